@@ -0,0 +1 @@
+../../../src/PublishQueueBatch.cpp
\ No newline at end of file
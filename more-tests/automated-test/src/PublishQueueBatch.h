@@ -0,0 +1 @@
+../../../src/PublishQueueBatch.h
\ No newline at end of file
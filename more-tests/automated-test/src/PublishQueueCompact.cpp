@@ -0,0 +1 @@
+../../../src/PublishQueueCompact.cpp
\ No newline at end of file
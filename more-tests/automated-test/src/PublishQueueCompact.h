@@ -0,0 +1 @@
+../../../src/PublishQueueCompact.h
\ No newline at end of file
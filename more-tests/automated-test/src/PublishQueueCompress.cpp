@@ -0,0 +1 @@
+../../../src/PublishQueueCompress.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../../src/PublishQueueCompress.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../src/PublishQueueEventPool.cpp
\ No newline at end of file
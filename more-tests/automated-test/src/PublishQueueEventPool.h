@@ -0,0 +1 @@
+../../../src/PublishQueueEventPool.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../src/PublishQueueFileQueue.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../../src/PublishQueueFileQueue.h
\ No newline at end of file
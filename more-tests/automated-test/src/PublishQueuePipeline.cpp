@@ -0,0 +1 @@
+../../../src/PublishQueuePipeline.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../../src/PublishQueuePipeline.h
\ No newline at end of file
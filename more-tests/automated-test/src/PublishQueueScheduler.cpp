@@ -0,0 +1 @@
+../../../src/PublishQueueScheduler.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../../src/PublishQueueScheduler.h
\ No newline at end of file
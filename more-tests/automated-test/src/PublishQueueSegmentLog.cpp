@@ -0,0 +1 @@
+../../../src/PublishQueueSegmentLog.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../../src/PublishQueueSegmentLog.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../src/PublishQueueSpscRing.cpp
\ No newline at end of file
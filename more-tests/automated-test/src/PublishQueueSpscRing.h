@@ -0,0 +1 @@
+../../../src/PublishQueueSpscRing.h
\ No newline at end of file
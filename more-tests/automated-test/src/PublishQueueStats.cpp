@@ -0,0 +1 @@
+../../../src/PublishQueueStats.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../../src/PublishQueueStats.h
\ No newline at end of file
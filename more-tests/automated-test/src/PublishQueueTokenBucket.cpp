@@ -0,0 +1 @@
+../../../src/PublishQueueTokenBucket.cpp
\ No newline at end of file
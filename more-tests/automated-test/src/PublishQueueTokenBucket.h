@@ -0,0 +1 @@
+../../../src/PublishQueueTokenBucket.h
\ No newline at end of file
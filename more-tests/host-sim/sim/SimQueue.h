@@ -0,0 +1,122 @@
+#ifndef __SIMQUEUE_H
+#define __SIMQUEUE_H
+
+#include "PublishQueuePosixRK.h"
+#include "HostSim.h"
+
+#include <string>
+#include <vector>
+
+/**
+ * @brief PublishQueuePosix that can be created and destroyed by the simulator
+ *
+ * On a device the queue is a singleton that lives forever. The simulator needs to
+ * start from scratch for each run, and destroy and recreate the queue to simulate
+ * a reboot, so this subclass exposes the constructor, destructor and the internal
+ * methods that the benchmarks time individually.
+ */
+class SimQueue : public PublishQueuePosix {
+public:
+    SimQueue() { _instance = this; }
+    SimQueue(const char *name) : PublishQueuePosix(name) {}
+    virtual ~SimQueue() {
+        clearRamQueue();
+        if (_instance == this) {
+            _instance = nullptr;
+        }
+    }
+
+    using PublishQueuePosix::readQueueFile;
+    using PublishQueuePosix::fileQueue;
+    using PublishQueuePosix::segmentLog;
+    using PublishQueuePosix::deleteEvent;
+    using PublishQueuePosix::getFileCrc;
+
+    /**
+     * @brief Discard RAM queue events and events not yet written by the async writer, as a power loss would
+     */
+    void clearRamQueue() {
+        WITH_LOCK(*this) {
+            drainLockFreeQueue();
+            while(!writeQueue.empty()) {
+                PublishQueueEvent *event = writeQueue.front();
+                writeQueue.pop_front();
+                deleteEvent(event);
+            }
+            while(!ramQueue.empty()) {
+                PublishQueueEvent *event = ramQueue.front();
+                ramQueue.pop_front();
+                deleteEvent(event);
+            }
+        }
+    }
+};
+
+namespace SimUtil {
+
+/**
+ * @brief Other instances run along with the queue passed to run() and runUntilEmpty()
+ */
+inline std::vector<PublishQueuePosix *> &getOtherQueues() {
+    static std::vector<PublishQueuePosix *> queues;
+    return queues;
+}
+
+/**
+ * @brief Advance virtual time in steps, completing publishes and calling loop()
+ *
+ * @param queue The queue to run, along with getOtherQueues()
+ * @param ms How long to run for in virtual milliseconds
+ * @param stepMs Virtual time per loop() call
+ */
+inline void run(PublishQueuePosix &queue, unsigned long ms, unsigned long stepMs = 10) {
+    for(unsigned long elapsed = 0; elapsed < ms; elapsed += stepMs) {
+        HostSim::advanceMillis(stepMs);
+        HostSim::processCloud();
+        queue.loop();
+        for(PublishQueuePosix *other : getOtherQueues()) {
+            other->loop();
+        }
+    }
+}
+
+/**
+ * @brief Run until the queue and getOtherQueues() are empty and nothing is in flight, or the timeout expires
+ *
+ * @return The number of virtual milliseconds it took, or 0 if the timeout expired
+ */
+inline unsigned long runUntilEmpty(PublishQueuePosix &queue, unsigned long timeoutMs, unsigned long stepMs = 10) {
+    unsigned long start = millis();
+    while(millis() - start < timeoutMs) {
+        run(queue, stepMs, stepMs);
+        bool empty = (queue.getNumEvents() == 0 && queue.getCanSleep());
+        for(PublishQueuePosix *other : getOtherQueues()) {
+            empty = empty && other->getNumEvents() == 0 && other->getCanSleep();
+        }
+        if (empty && HostSim::getPublishesInFlight() == 0) {
+            return millis() - start;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Event data used by the simulator: a zero-padded counter, padded to size with letters
+ */
+inline std::string makeEventData(int counter, size_t size) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%05d", counter);
+    std::string result = buf;
+    char c = 'A';
+    while(result.length() < size) {
+        result += c;
+        if (++c > 'Z') {
+            c = 'A';
+        }
+    }
+    return result;
+}
+
+} // namespace SimUtil
+
+#endif /* __SIMQUEUE_H */
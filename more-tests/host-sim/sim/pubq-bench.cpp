@@ -0,0 +1,537 @@
+// Micro-benchmarks for PublishQueuePosix on a Linux host
+//
+// Times the enqueue, persist and drain paths of the real library code and writes
+// the results as JSON, so results can be compared across library versions:
+//
+// - publish_ram: publishCommon() when the event stays in the RAM queue
+// - publish_in_place: allocEvent(), building the data in the event, then publishEvent(), RAM queue only
+// - publish_file: publishCommon() with withRamQueueSize(0), so every event is written to flash
+// - publish_bulk: publishBulk() of --batch events while offline, so they are written to flash together
+// - write_queue_to_files: writeQueueToFiles() flushing a RAM queue of --batch events
+// - read_queue_file: readQueueFile() (or the segment log head) for each queued event
+// - publish_concurrent: publish() from one thread while another thread runs loop(), offline
+//   so loop() is writing files; shows how long a publishing thread stalls on the queue mutex
+// - scan_dir_N: the startup directory scan with N queued events
+//
+// Latencies are wall clock times on the host, so absolute numbers are much smaller
+// than on a device. The file system operation counts per operation are the same as
+// on a device and are usually the better indicator of a regression.
+
+#include "SimQueue.h"
+
+#include <algorithm>
+#include <chrono>
+#include <getopt.h>
+#include <memory>
+#include <thread>
+
+#ifndef PUBQ_LIBRARY_VERSION
+#define PUBQ_LIBRARY_VERSION "unknown"
+#endif
+
+struct BenchOptions {
+    int events = 1000;
+    size_t size = 64;
+    size_t batch = 20;
+    size_t segmentSize = 0;
+    size_t eventPoolDataSize = 0;
+    size_t lockFreeSize = 0;
+    long asyncWriterDelayMs = -1;
+    bool queueIndex = true;
+    bool compact = false;
+    std::vector<int> scanCounts = {100, 1000, 10000};
+    std::string dir = "/tmp/pubq-bench";
+    std::string output;
+};
+
+/**
+ * @brief Results of one benchmark
+ */
+struct BenchResult {
+    std::string name;
+    unsigned long ops = 0;          //!< Number of timed operations
+    unsigned long eventsPerOp = 1;  //!< Events handled by each operation
+    std::vector<uint64_t> latencyNs;
+    HostSim::FlashOps flashOps;
+    unsigned long heapAllocs = 0;   //!< Heap allocations during the timed operations
+};
+
+static int benchErrors = 0; //!< Sanity check failures, makes the exit code non-zero
+
+static uint64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static SimQueue *createQueue(const BenchOptions &opts, size_t ramQueueSize, size_t fileQueueSize, bool erase = true) {
+    if (erase) {
+        HostSim::removeTree(opts.dir.c_str());
+    }
+    SimQueue *queue = new SimQueue();
+    queue->withDirPath(opts.dir.c_str())
+        .withRamQueueSize(ramQueueSize)
+        .withFileQueueSize(fileQueueSize)
+        .withSegmentSize(opts.segmentSize);
+    if (opts.eventPoolDataSize) {
+        queue->withEventPool(opts.eventPoolDataSize);
+    }
+    if (opts.lockFreeSize) {
+        queue->withLockFreeQueue(opts.lockFreeSize);
+    }
+    if (opts.asyncWriterDelayMs >= 0) {
+        queue->withAsyncWriter(opts.asyncWriterDelayMs);
+    }
+    queue->withCompactEncoding(opts.compact);
+    queue->withQueueIndex(opts.queueIndex);
+    queue->setup();
+    return queue;
+}
+
+/**
+ * @brief Fill the file queue with count events
+ */
+static void fillFileQueue(SimQueue &queue, const BenchOptions &opts, int count) {
+    queue.withRamQueueSize(0);
+    for(int ii = 0; ii < count; ii++) {
+        queue.publish("testEvent", SimUtil::makeEventData(ii, opts.size).c_str(), PRIVATE | WITH_ACK);
+    }
+    // Events in the lock-free queue are only written by loop() or here
+    queue.writeQueueToFiles();
+}
+
+static BenchResult benchPublishRam(const BenchOptions &opts) {
+    BenchResult result;
+    result.name = "publish_ram";
+
+    HostSim::setConnected(true);
+    std::unique_ptr<SimQueue> queue(createQueue(opts, opts.events + 1, opts.events + 1));
+
+    std::vector<std::string> data;
+    for(int ii = 0; ii < opts.events; ii++) {
+        data.push_back(SimUtil::makeEventData(ii, opts.size));
+    }
+
+    HostSim::resetCounters();
+    for(int ii = 0; ii < opts.events; ii++) {
+        unsigned long allocs = HostSim::getHeapAllocs();
+        uint64_t start = nowNs();
+        queue->publish("testEvent", data[ii].c_str(), PRIVATE | WITH_ACK);
+        uint64_t elapsed = nowNs() - start;
+        result.heapAllocs += HostSim::getHeapAllocs() - allocs;
+        result.latencyNs.push_back(elapsed);
+    }
+    result.flashOps = HostSim::getFlashOps();
+    result.ops = opts.events;
+    return result;
+}
+
+static BenchResult benchPublishInPlace(const BenchOptions &opts) {
+    BenchResult result;
+    result.name = "publish_in_place";
+
+    HostSim::setConnected(true);
+    std::unique_ptr<SimQueue> queue(createQueue(opts, opts.events + 1, opts.events + 1));
+
+    std::vector<std::string> data;
+    for(int ii = 0; ii < opts.events; ii++) {
+        data.push_back(SimUtil::makeEventData(ii, opts.size));
+    }
+
+    HostSim::resetCounters();
+    for(int ii = 0; ii < opts.events; ii++) {
+        unsigned long allocs = HostSim::getHeapAllocs();
+        uint64_t start = nowNs();
+        // The copy stands in for building the data in place, such as with JSONBufferWriter
+        PublishQueueEvent *event = queue->allocEvent("testEvent", data[ii].length());
+        if (event) {
+            memcpy(event->eventData, data[ii].c_str(), data[ii].length() + 1);
+        }
+        bool queued = queue->publishEvent(event, 0, PRIVATE | WITH_ACK);
+        uint64_t elapsed = nowNs() - start;
+        result.heapAllocs += HostSim::getHeapAllocs() - allocs;
+        result.latencyNs.push_back(elapsed);
+
+        if (!queued) {
+            fprintf(stderr, "publishEvent failed for event %d\n", ii);
+            benchErrors++;
+        }
+    }
+    result.flashOps = HostSim::getFlashOps();
+    result.ops = opts.events;
+    return result;
+}
+
+static BenchResult benchPublishFile(const BenchOptions &opts) {
+    BenchResult result;
+    result.name = "publish_file";
+
+    HostSim::setConnected(true);
+    std::unique_ptr<SimQueue> queue(createQueue(opts, 0, opts.events + 1));
+
+    std::vector<std::string> data;
+    for(int ii = 0; ii < opts.events; ii++) {
+        data.push_back(SimUtil::makeEventData(ii, opts.size));
+    }
+
+    HostSim::resetCounters();
+    for(int ii = 0; ii < opts.events; ii++) {
+        unsigned long allocs = HostSim::getHeapAllocs();
+        uint64_t start = nowNs();
+        queue->publish("testEvent", data[ii].c_str(), PRIVATE | WITH_ACK);
+        uint64_t elapsed = nowNs() - start;
+        result.heapAllocs += HostSim::getHeapAllocs() - allocs;
+        result.latencyNs.push_back(elapsed);
+    }
+    // Include the writes made by the async writer thread
+    queue->flush();
+    result.flashOps = HostSim::getFlashOps();
+    result.ops = opts.events;
+    return result;
+}
+
+static BenchResult benchPublishBulk(const BenchOptions &opts) {
+    BenchResult result;
+    result.name = "publish_bulk";
+    result.eventsPerOp = opts.batch;
+
+    int iterations = std::max(1, opts.events / (int)opts.batch);
+
+    HostSim::setConnected(false);
+    std::unique_ptr<SimQueue> queue(createQueue(opts, opts.batch, iterations * opts.batch + 1));
+
+    std::vector<std::string> data;
+    std::vector<PublishQueueBulkEvent> events;
+    for(size_t ii = 0; ii < opts.batch; ii++) {
+        data.push_back(SimUtil::makeEventData(ii, opts.size));
+    }
+    for(const auto &eventData : data) {
+        events.push_back({"testEvent", eventData.c_str(), PRIVATE | WITH_ACK, 0, false});
+    }
+
+    HostSim::resetCounters();
+    for(int iter = 0; iter < iterations; iter++) {
+        unsigned long allocs = HostSim::getHeapAllocs();
+        uint64_t start = nowNs();
+        size_t numQueued = queue->publishBulk(events.data(), events.size());
+        uint64_t elapsed = nowNs() - start;
+        result.heapAllocs += HostSim::getHeapAllocs() - allocs;
+        result.latencyNs.push_back(elapsed);
+
+        if (numQueued != opts.batch) {
+            fprintf(stderr, "publishBulk queued %u events, expected %u\n", (unsigned) numQueued, (unsigned) opts.batch);
+            benchErrors++;
+        }
+    }
+    // Include the writes made by the async writer thread
+    queue->flush();
+    result.flashOps = HostSim::getFlashOps();
+    result.ops = iterations;
+    HostSim::setConnected(true);
+    return result;
+}
+
+static BenchResult benchWriteQueueToFiles(const BenchOptions &opts) {
+    BenchResult result;
+    result.name = "write_queue_to_files";
+    result.eventsPerOp = opts.batch;
+
+    int iterations = std::max(1, opts.events / (int)opts.batch);
+
+    HostSim::setConnected(true);
+    std::unique_ptr<SimQueue> queue(createQueue(opts, opts.batch, iterations * opts.batch + 1));
+
+    HostSim::FlashOps total;
+    for(int iter = 0; iter < iterations; iter++) {
+        for(size_t ii = 0; ii < opts.batch; ii++) {
+            queue->publish("testEvent", SimUtil::makeEventData(iter * opts.batch + ii, opts.size).c_str(), PRIVATE | WITH_ACK);
+        }
+
+        HostSim::resetCounters();
+        unsigned long allocs = HostSim::getHeapAllocs();
+        uint64_t start = nowNs();
+        queue->writeQueueToFiles();
+        uint64_t elapsed = nowNs() - start;
+        result.heapAllocs += HostSim::getHeapAllocs() - allocs;
+        result.latencyNs.push_back(elapsed);
+
+        const HostSim::FlashOps &ops = HostSim::getFlashOps();
+        total.opens += ops.opens;
+        total.closes += ops.closes;
+        total.reads += ops.reads;
+        total.writes += ops.writes;
+        total.bytesRead += ops.bytesRead;
+        total.bytesWritten += ops.bytesWritten;
+        total.seeks += ops.seeks;
+        total.stats += ops.stats;
+        total.unlinks += ops.unlinks;
+        total.renames += ops.renames;
+        total.fsyncs += ops.fsyncs;
+        total.truncates += ops.truncates;
+        total.dirScans += ops.dirScans;
+    }
+    result.flashOps = total;
+    result.ops = iterations;
+    return result;
+}
+
+static BenchResult benchReadQueueFile(const BenchOptions &opts) {
+    BenchResult result;
+    result.name = "read_queue_file";
+
+    HostSim::setConnected(true);
+    std::unique_ptr<SimQueue> queue(createQueue(opts, 0, opts.events + 1));
+    fillFileQueue(*queue, opts, opts.events);
+
+    HostSim::resetCounters();
+    WITH_LOCK(*queue) {
+        while(true) {
+            unsigned long allocs = HostSim::getHeapAllocs();
+            uint64_t start = nowNs();
+            PublishQueueEvent *event = NULL;
+
+            int fileNum = queue->fileQueue.getFileFromQueue(true);
+            if (fileNum) {
+                event = queue->readQueueFile(fileNum);
+            }
+            else {
+                uint32_t seq;
+                event = queue->segmentLog.readHead(seq);
+                if (event) {
+                    // Reading the head without consuming it would read the same event again
+                    queue->segmentLog.removeHead(seq);
+                }
+            }
+            uint64_t elapsed = nowNs() - start;
+            result.heapAllocs += HostSim::getHeapAllocs() - allocs;
+
+            if (!event) {
+                break;
+            }
+            queue->deleteEvent(event);
+            result.latencyNs.push_back(elapsed);
+        }
+    }
+    result.flashOps = HostSim::getFlashOps();
+    result.ops = result.latencyNs.size();
+    if (result.ops != (unsigned long)opts.events) {
+        fprintf(stderr, "read %lu events, expected %d\n", result.ops, opts.events);
+        benchErrors++;
+    }
+    return result;
+}
+
+static BenchResult benchPublishConcurrent(const BenchOptions &opts) {
+    BenchResult result;
+    result.name = "publish_concurrent";
+
+    // Offline, so events are written to files, either by publish() or by loop(). The queue must
+    // exist first, as the disconnect event is handled by the queue instance.
+    std::unique_ptr<SimQueue> queue(createQueue(opts, 2, opts.events + 1));
+    HostSim::setConnected(false);
+
+    std::vector<std::string> data;
+    for(int ii = 0; ii < opts.events; ii++) {
+        data.push_back(SimUtil::makeEventData(ii, opts.size));
+    }
+
+    std::atomic<bool> done(false);
+    std::thread loopThread([&]() {
+        while(!done) {
+            queue->loop();
+            std::this_thread::yield();
+        }
+    });
+
+    HostSim::resetCounters();
+    for(int ii = 0; ii < opts.events; ii++) {
+        uint64_t start = nowNs();
+        queue->publish("testEvent", data[ii].c_str(), PRIVATE | WITH_ACK);
+        result.latencyNs.push_back(nowNs() - start);
+
+        // Publish at a high but not unlimited rate
+        std::this_thread::sleep_for(std::chrono::microseconds(20));
+    }
+    done = true;
+    loopThread.join();
+    queue->loop();
+    queue->flush();
+
+    result.flashOps = HostSim::getFlashOps();
+    result.ops = opts.events;
+    HostSim::setConnected(true);
+    return result;
+}
+
+static BenchResult benchScanDir(const BenchOptions &opts, int count) {
+    BenchResult result;
+    result.name = "scan_dir_" + std::to_string(count);
+    result.eventsPerOp = count;
+
+    {
+        std::unique_ptr<SimQueue> queue(createQueue(opts, 0, count + 1));
+        HostSim::setConnected(false);
+        fillFileQueue(*queue, opts, count);
+    }
+
+    const int iterations = 5;
+    HostSim::resetCounters();
+    for(int iter = 0; iter < iterations; iter++) {
+        // The time for setup() is the startup cost, which is mostly the directory scan
+        unsigned long allocs = HostSim::getHeapAllocs();
+        uint64_t start = nowNs();
+        std::unique_ptr<SimQueue> queue(createQueue(opts, 0, count + 1, false));
+        uint64_t elapsed = nowNs() - start;
+        result.heapAllocs += HostSim::getHeapAllocs() - allocs;
+        result.latencyNs.push_back(elapsed);
+
+        if (queue->getNumEvents() != (size_t)count) {
+            fprintf(stderr, "scan found %u events, expected %d\n", (unsigned) queue->getNumEvents(), count);
+            benchErrors++;
+        }
+    }
+    result.flashOps = HostSim::getFlashOps();
+    result.ops = iterations;
+    HostSim::setConnected(true);
+    return result;
+}
+
+static uint64_t percentile(const std::vector<uint64_t> &sorted, double pct) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = (size_t)(pct / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+static void writeResult(FILE *fp, const BenchResult &result, bool last) {
+    std::vector<uint64_t> sorted = result.latencyNs;
+    std::sort(sorted.begin(), sorted.end());
+
+    uint64_t total = 0;
+    for(uint64_t ns : sorted) {
+        total += ns;
+    }
+    double mean = sorted.empty() ? 0 : (double)total / sorted.size();
+    double eventsPerSec = total ? (double)(result.ops * result.eventsPerOp) * 1e9 / total : 0;
+    double ops = result.ops ? result.ops : 1;
+    const HostSim::FlashOps &f = result.flashOps;
+
+    fprintf(fp, "    {\n");
+    fprintf(fp, "      \"name\": \"%s\",\n", result.name.c_str());
+    fprintf(fp, "      \"ops\": %lu,\n", result.ops);
+    fprintf(fp, "      \"eventsPerOp\": %lu,\n", result.eventsPerOp);
+    fprintf(fp, "      \"eventsPerSec\": %.1f,\n", eventsPerSec);
+    fprintf(fp, "      \"heapAllocsPerOp\": %.2f,\n", result.heapAllocs / ops);
+    fprintf(fp, "      \"latencyNs\": {\"mean\": %.0f, \"p50\": %lu, \"p90\": %lu, \"p99\": %lu, \"max\": %lu},\n",
+        mean, (unsigned long)percentile(sorted, 50), (unsigned long)percentile(sorted, 90), (unsigned long)percentile(sorted, 99), (unsigned long)percentile(sorted, 100));
+    fprintf(fp, "      \"flashOpsPerOp\": {\"opens\": %.2f, \"closes\": %.2f, \"reads\": %.2f, \"writes\": %.2f, \"bytesRead\": %.1f, \"bytesWritten\": %.1f, "
+        "\"seeks\": %.2f, \"stats\": %.2f, \"unlinks\": %.2f, \"renames\": %.2f, \"fsyncs\": %.2f, \"truncates\": %.2f, \"dirScans\": %.2f}\n",
+        f.opens / ops, f.closes / ops, f.reads / ops, f.writes / ops, f.bytesRead / ops, f.bytesWritten / ops,
+        f.seeks / ops, f.stats / ops, f.unlinks / ops, f.renames / ops, f.fsyncs / ops, f.truncates / ops, f.dirScans / ops);
+    fprintf(fp, "    }%s\n", last ? "" : ",");
+}
+
+static void usage() {
+    fprintf(stderr,
+        "usage: pubq-bench [options]\n"
+        "  --events N          events per benchmark (default 1000)\n"
+        "  --size N            event data size in bytes (default 64)\n"
+        "  --batch N           events per publishBulk() and writeQueueToFiles() call (default 20)\n"
+        "  --segment-size N    withSegmentSize, 0 for one file per event (default 0)\n"
+        "  --event-pool N      withEventPool with N bytes of data per event, 0 to use the heap (default 0)\n"
+        "  --lock-free N       withLockFreeQueue with N events, 0 to not use it (default 0)\n"
+        "  --async-writer MS   withAsyncWriter with a maximum delay of MS (default not used)\n"
+        "  --no-queue-index    withQueueIndex(false), so setup() always scans the directory\n"
+        "  --compact           withCompactEncoding() for events stored on flash\n"
+        "  --scan-counts LIST  comma-separated queue lengths for the startup scan (default 100,1000,10000)\n"
+        "  --dir PATH          queue directory (default /tmp/pubq-bench, erased first)\n"
+        "  --output FILE       write JSON to FILE instead of stdout\n");
+}
+
+int main(int argc, char **argv) {
+    BenchOptions opts;
+
+    static const struct option longOptions[] = {
+        {"events", required_argument, 0, 'n'},
+        {"size", required_argument, 0, 's'},
+        {"batch", required_argument, 0, 'b'},
+        {"segment-size", required_argument, 0, 'g'},
+        {"event-pool", required_argument, 0, 'e'},
+        {"lock-free", required_argument, 0, 'L'},
+        {"async-writer", required_argument, 0, 'w'},
+        {"no-queue-index", no_argument, 0, 'I'},
+        {"compact", no_argument, 0, 'C'},
+        {"scan-counts", required_argument, 0, 'c'},
+        {"dir", required_argument, 0, 'd'},
+        {"output", required_argument, 0, 'o'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    while((opt = getopt_long(argc, argv, "", longOptions, NULL)) != -1) {
+        switch(opt) {
+        case 'n': opts.events = atoi(optarg); break;
+        case 's': opts.size = strtoul(optarg, NULL, 10); break;
+        case 'b': opts.batch = std::max(1UL, strtoul(optarg, NULL, 10)); break;
+        case 'g': opts.segmentSize = strtoul(optarg, NULL, 10); break;
+        case 'e': opts.eventPoolDataSize = strtoul(optarg, NULL, 10); break;
+        case 'L': opts.lockFreeSize = strtoul(optarg, NULL, 10); break;
+        case 'w': opts.asyncWriterDelayMs = atol(optarg); break;
+        case 'I': opts.queueIndex = false; break;
+        case 'C': opts.compact = true; break;
+        case 'c': {
+            opts.scanCounts.clear();
+            for(char *cp = strtok(optarg, ","); cp; cp = strtok(NULL, ",")) {
+                opts.scanCounts.push_back(atoi(cp));
+            }
+            break;
+        }
+        case 'd': opts.dir = optarg; break;
+        case 'o': opts.output = optarg; break;
+        default: usage(); return 2;
+        }
+    }
+
+    HostSim::CloudConfig cloud;
+    HostSim::setCloudConfig(cloud);
+    HostSim::setMillis(10000);
+
+    std::vector<BenchResult> results;
+    results.push_back(benchPublishRam(opts));
+    results.push_back(benchPublishInPlace(opts));
+    results.push_back(benchPublishFile(opts));
+    results.push_back(benchPublishBulk(opts));
+    results.push_back(benchWriteQueueToFiles(opts));
+    results.push_back(benchReadQueueFile(opts));
+    results.push_back(benchPublishConcurrent(opts));
+    for(int count : opts.scanCounts) {
+        results.push_back(benchScanDir(opts, count));
+    }
+    HostSim::removeTree(opts.dir.c_str());
+
+    FILE *fp = stdout;
+    if (!opts.output.empty()) {
+        fp = fopen(opts.output.c_str(), "w");
+        if (!fp) {
+            fprintf(stderr, "cannot open %s\n", opts.output.c_str());
+            return 1;
+        }
+    }
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"library\": \"PublishQueuePosixRK\",\n");
+    fprintf(fp, "  \"version\": \"%s\",\n", PUBQ_LIBRARY_VERSION);
+    fprintf(fp, "  \"config\": {\"events\": %d, \"size\": %u, \"batch\": %u, \"segmentSize\": %u, \"eventPool\": %u, \"lockFree\": %u, \"asyncWriter\": %ld, \"queueIndex\": %s},\n",
+        opts.events, (unsigned) opts.size, (unsigned) opts.batch, (unsigned) opts.segmentSize, (unsigned) opts.eventPoolDataSize, (unsigned) opts.lockFreeSize, opts.asyncWriterDelayMs, opts.queueIndex ? "true" : "false");
+    fprintf(fp, "  \"benchmarks\": [\n");
+    for(size_t ii = 0; ii < results.size(); ii++) {
+        writeResult(fp, results[ii], ii == results.size() - 1);
+    }
+    fprintf(fp, "  ]\n");
+    fprintf(fp, "}\n");
+
+    if (fp != stdout) {
+        fclose(fp);
+    }
+    return benchErrors ? 1 : 0;
+}
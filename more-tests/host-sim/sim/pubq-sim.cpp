@@ -0,0 +1,1102 @@
+// Simulator for PublishQueuePosix on a Linux host
+//
+// Runs the real PublishQueuePosix state machine against a temporary queue
+// directory and a simulated cloud with configurable latency and failure rate,
+// then reports what was delivered, how long it took (in virtual time) and how
+// many file system operations were made.
+//
+// With --check the exit code is non-zero if events were lost, duplicated or
+// delivered out of order, which is how the CTest scenarios use it.
+
+#include "SimQueue.h"
+
+#include <dirent.h>
+#include <getopt.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <set>
+
+struct SimOptions {
+    int events = 10;
+    size_t size = 0;
+    size_t ramQueueSize = 2;
+    size_t fileQueueSize = 100;
+    size_t segmentSize = 0;
+    size_t batchEvents = 0;
+    size_t eventPoolDataSize = 0;
+    size_t lockFreeSize = 0;
+    long asyncWriterDelayMs = -1;
+    bool queueIndex = true;
+    size_t pipelineSize = 0;
+    size_t publishBurst = 0;
+    unsigned long backoffMinMs = 0;
+    unsigned long backoffMaxMs = 0;
+    unsigned backoffJitterPercent = 0;
+    int priorityEvery = 0;
+    int coalesceKeys = 0;
+    bool compress = false;
+    bool compressCloud = false;
+    bool v1Files = false;
+    bool v2Files = false;
+    int corruptEvery = 0;
+    int ttl = 0;
+    bool stats = false;
+    size_t ramQueueBytes = 0;
+    size_t fileQueueBytes = 0;
+    size_t minFreeSpace = 0;
+    size_t flashCapacity = 0;
+    unsigned long sleepBudgetMs = 0;
+    unsigned schedulerWeight = 0;
+    unsigned sharedWeight = 0;
+    bool secondQueue = false;
+    size_t bulkEvents = 0;
+    bool inPlace = false;
+    bool deferred = false;
+    bool compact = false;
+    unsigned long periodMs = 0;
+    bool offline = false;
+    bool reboot = false;
+    size_t crashAfter = 0;
+    bool check = false;
+    unsigned long timeoutMs = 3600000;
+    std::string dir = "/tmp/pubq-sim";
+    HostSim::CloudConfig cloud;
+};
+
+static void usage() {
+    fprintf(stderr,
+        "usage: pubq-sim [options]\n"
+        "  --events N          number of events to publish (default 10)\n"
+        "  --size N            event data size in bytes (default 5)\n"
+        "  --period MS         milliseconds between publishes (default 0, burst)\n"
+        "  --ram-queue N       withRamQueueSize (default 2)\n"
+        "  --file-queue N      withFileQueueSize (default 100)\n"
+        "  --segment-size N    withSegmentSize, 0 for one file per event (default 0)\n"
+        "  --batch N           withBatchPublish with up to N events per batch (default 0, no batching)\n"
+        "  --event-pool N      withEventPool with N bytes of data per event (default 0, use the heap)\n"
+        "  --lock-free N       withLockFreeQueue with N events (default 0, not used)\n"
+        "  --async-writer MS   withAsyncWriter with a maximum delay of MS (default not used)\n"
+        "  --no-queue-index    withQueueIndex(false), so setup() always scans the directory\n"
+        "  --pipeline N        withPipelining with up to N publishes in progress (default 0, not used)\n"
+        "  --burst N           withPublishRate(1000, N) (default not used)\n"
+        "  --backoff MIN,MAX,PCT  withFailureBackoff(MIN, MAX, PCT) (default not used)\n"
+        "  --priority-every N  publish every Nth event as \"alarm\" using priority lane 1 (default 0, not used)\n"
+        "  --coalesce N        publish events using publishCoalesced with N keys, one per counter %% N (default 0, not used)\n"
+        "  --compress          withCompression() for events stored on flash\n"
+        "  --compress-cloud    withCompression(NULL, true), also compressing data sent to the cloud\n"
+        "  --v1-files          with --reboot, rewrite the queued event files in the version 1 format before rebooting\n"
+        "  --v2-files          with --reboot, rewrite the queued event files in the version 2 format before rebooting\n"
+        "  --corrupt-every N   with --reboot, damage every Nth queued event file before rebooting (default 0)\n"
+        "  --ttl S             withEventExpiry() and publish events with a ttl of S seconds (default 0, not used)\n"
+        "  --stats             print getStats() before connecting and after draining\n"
+        "  --ram-queue-bytes N   withRamQueueMaxBytes (default 0, no limit)\n"
+        "  --file-queue-bytes N  withFileQueueMaxBytes (default 0, no limit)\n"
+        "  --compact           withCompactEncoding() for events stored on flash\n"
+        "  --deferred          publish using publishDeferred, formatting the data when it's sent\n"
+        "  --in-place          publish alternately using allocEvent/publishEvent and publishWithLength\n"
+        "  --bulk N            publish N events at a time using publishBulk (default 0, publish each event)\n"
+        "  --scheduler W1,W2   withScheduler(W1), and a second instance named \"diag\" using withScheduler(W2)\n"
+        "                      that publishes the same number of \"diag\" events (default not used)\n"
+        "  --second-queue      the \"diag\" instance without withScheduler(), so both share BackgroundPublishRK\n"
+        "                      without taking turns\n"
+        "  --sleep-budget MS   after connecting, drainForSleep(MS), then lose the RAM queue and sleep for a minute\n"
+        "  --free-space-guard MIN,CAPACITY  withMinFreeSpace(MIN) on a file system of CAPACITY bytes that\n"
+        "                      only contains the queue directory (default not used)\n"
+        "  --latency MS        cloud round trip time (default 300)\n"
+        "  --jitter MS         random additional latency (default 0)\n"
+        "  --failure-rate P    probability a publish fails, 0 to 1 (default 0)\n"
+        "  --cloud-rate-limit N  cloud fails publishes over one per second with a burst of N (default 0, no limit)\n"
+        "  --seed N            random seed (default 1)\n"
+        "  --offline           publish while disconnected, then connect\n"
+        "  --reboot            publish while disconnected, then simulate a reboot\n"
+        "  --crash-after N     with --reboot, write the queue to files, connect until N events are delivered,\n"
+        "                      then reboot without the reset system event, as a brownout or watchdog would\n"
+        "  --dir PATH          queue directory (default /tmp/pubq-sim, erased first)\n"
+        "  --timeout MS        virtual time limit to drain the queue (default 3600000)\n"
+        "  --check             exit with an error if events are lost, duplicated or out of order\n"
+        "                      (with --pipeline, order is only checked if no publishes failed;\n"
+        "                      with --priority-every, order is checked for each event name and\n"
+        "                      with --offline or --reboot, priority events must be sent first;\n"
+        "                      with --coalesce, only the last event for each key must be delivered,\n"
+        "                      and order is checked for each key;\n"
+        "                      with --corrupt-every, damaged events may be missing but must not be delivered;\n"
+        "                      with --ttl, events must be delivered before they expire or not at all;\n"
+        "                      with --stats, the statistics must match what was published and delivered;\n"
+        "                      with --scheduler, \"diag\" events are checked the same way, and while both\n"
+        "                      instances have events and no publish fails, publishes must be shared by weight;\n"
+        "                      with --second-queue, \"diag\" events are checked the same way;\n"
+        "                      with --sleep-budget, getCanSleep() must be true within the budget;\n"
+        "                      with byte limits, the limits must be kept and only events counted as\n"
+        "                      discarded by the limit may be missing)\n"
+        "  --trace             show library trace logging\n");
+}
+
+static bool parseOptions(int argc, char **argv, SimOptions &opts) {
+    static const struct option longOptions[] = {
+        {"events", required_argument, 0, 'n'},
+        {"size", required_argument, 0, 's'},
+        {"period", required_argument, 0, 'p'},
+        {"ram-queue", required_argument, 0, 'r'},
+        {"file-queue", required_argument, 0, 'f'},
+        {"segment-size", required_argument, 0, 'g'},
+        {"batch", required_argument, 0, 'b'},
+        {"event-pool", required_argument, 0, 'e'},
+        {"lock-free", required_argument, 0, 'L'},
+        {"async-writer", required_argument, 0, 'w'},
+        {"no-queue-index", no_argument, 0, 'I'},
+        {"pipeline", required_argument, 0, 'P'},
+        {"burst", required_argument, 0, 'B'},
+        {"backoff", required_argument, 0, 'k'},
+        {"priority-every", required_argument, 0, 'Y'},
+        {"coalesce", required_argument, 0, 'K'},
+        {"compress", no_argument, 0, 'z'},
+        {"compress-cloud", no_argument, 0, 'Z'},
+        {"v1-files", no_argument, 0, '1'},
+        {"v2-files", no_argument, 0, '2'},
+        {"corrupt-every", required_argument, 0, 'X'},
+        {"ttl", required_argument, 0, 'E'},
+        {"stats", no_argument, 0, 'A'},
+        {"ram-queue-bytes", required_argument, 0, 'M'},
+        {"file-queue-bytes", required_argument, 0, 'F'},
+        {"free-space-guard", required_argument, 0, 'G'},
+        {"sleep-budget", required_argument, 0, 'D'},
+        {"scheduler", required_argument, 0, 'W'},
+        {"second-queue", no_argument, 0, 'Q'},
+        {"bulk", required_argument, 0, 'U'},
+        {"in-place", no_argument, 0, 'H'},
+        {"deferred", no_argument, 0, 'J'},
+        {"compact", no_argument, 0, 'N'},
+        {"cloud-rate-limit", required_argument, 0, 'C'},
+        {"latency", required_argument, 0, 'l'},
+        {"jitter", required_argument, 0, 'j'},
+        {"failure-rate", required_argument, 0, 'x'},
+        {"seed", required_argument, 0, 'S'},
+        {"offline", no_argument, 0, 'o'},
+        {"reboot", no_argument, 0, 'R'},
+        {"crash-after", required_argument, 0, 'O'},
+        {"dir", required_argument, 0, 'd'},
+        {"timeout", required_argument, 0, 't'},
+        {"check", no_argument, 0, 'c'},
+        {"trace", no_argument, 0, 'T'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    while((opt = getopt_long(argc, argv, "", longOptions, NULL)) != -1) {
+        switch(opt) {
+        case 'n': opts.events = atoi(optarg); break;
+        case 's': opts.size = strtoul(optarg, NULL, 10); break;
+        case 'p': opts.periodMs = strtoul(optarg, NULL, 10); break;
+        case 'r': opts.ramQueueSize = strtoul(optarg, NULL, 10); break;
+        case 'f': opts.fileQueueSize = strtoul(optarg, NULL, 10); break;
+        case 'g': opts.segmentSize = strtoul(optarg, NULL, 10); break;
+        case 'b': opts.batchEvents = strtoul(optarg, NULL, 10); break;
+        case 'e': opts.eventPoolDataSize = strtoul(optarg, NULL, 10); break;
+        case 'L': opts.lockFreeSize = strtoul(optarg, NULL, 10); break;
+        case 'w': opts.asyncWriterDelayMs = atol(optarg); break;
+        case 'I': opts.queueIndex = false; break;
+        case 'P': opts.pipelineSize = strtoul(optarg, NULL, 10); break;
+        case 'B': opts.publishBurst = strtoul(optarg, NULL, 10); break;
+        case 'k':
+            if (sscanf(optarg, "%lu,%lu,%u", &opts.backoffMinMs, &opts.backoffMaxMs, &opts.backoffJitterPercent) != 3) {
+                usage();
+                return false;
+            }
+            break;
+        case 'Y': opts.priorityEvery = atoi(optarg); break;
+        case 'K': opts.coalesceKeys = atoi(optarg); break;
+        case 'z': opts.compress = true; break;
+        case 'Z': opts.compressCloud = true; break;
+        case '1': opts.v1Files = true; break;
+        case '2': opts.v2Files = true; break;
+        case 'X': opts.corruptEvery = atoi(optarg); break;
+        case 'E': opts.ttl = atoi(optarg); break;
+        case 'A': opts.stats = true; break;
+        case 'M': opts.ramQueueBytes = strtoul(optarg, NULL, 10); break;
+        case 'F': opts.fileQueueBytes = strtoul(optarg, NULL, 10); break;
+        case 'D': opts.sleepBudgetMs = strtoul(optarg, NULL, 10); break;
+        case 'U': opts.bulkEvents = strtoul(optarg, NULL, 10); break;
+        case 'H': opts.inPlace = true; break;
+        case 'J': opts.deferred = true; break;
+        case 'N': opts.compact = true; break;
+        case 'W':
+            if (sscanf(optarg, "%u,%u", &opts.schedulerWeight, &opts.sharedWeight) != 2 || opts.schedulerWeight == 0 || opts.sharedWeight == 0) {
+                usage();
+                return false;
+            }
+            opts.secondQueue = true;
+            break;
+        case 'Q': opts.secondQueue = true; break;
+        case 'G':
+            if (sscanf(optarg, "%zu,%zu", &opts.minFreeSpace, &opts.flashCapacity) != 2 || opts.minFreeSpace == 0) {
+                usage();
+                return false;
+            }
+            break;
+        case 'C': opts.cloud.rateLimitBurst = strtoul(optarg, NULL, 10); break;
+        case 'l': opts.cloud.latencyMs = strtoul(optarg, NULL, 10); break;
+        case 'j': opts.cloud.latencyJitterMs = strtoul(optarg, NULL, 10); break;
+        case 'x': opts.cloud.failureRate = atof(optarg); break;
+        case 'S': opts.cloud.seed = strtoul(optarg, NULL, 10); break;
+        case 'o': opts.offline = true; break;
+        case 'R': opts.reboot = true; break;
+        case 'O': opts.crashAfter = strtoul(optarg, NULL, 10); break;
+        case 'd': opts.dir = optarg; break;
+        case 't': opts.timeoutMs = strtoul(optarg, NULL, 10); break;
+        case 'c': opts.check = true; break;
+        case 'T': Logger::level = LOG_LEVEL_TRACE; break;
+        default: usage(); return false;
+        }
+    }
+    return true;
+}
+
+static const char * const BATCH_EVENT_NAME = "pqBatch";
+static const char * const EVENT_NAME = "testEvent";
+static const char * const PRIORITY_EVENT_NAME = "alarm";
+static const char * const SHARED_EVENT_NAME = "diag";
+static const char * const SHARED_QUEUE_NAME = "diag";
+
+static bool isPriorityEvent(const SimOptions &opts, int counter) {
+    return opts.priorityEvery > 0 && (counter % opts.priorityEvery) == (opts.priorityEvery - 1);
+}
+
+/**
+ * @brief Coalescing key for a counter, or an empty string if not coalesced
+ */
+static std::string getCoalesceKey(const SimOptions &opts, int counter) {
+    if (opts.coalesceKeys <= 0 || isPriorityEvent(opts, counter)) {
+        return "";
+    }
+    return "k" + std::to_string(counter % opts.coalesceKeys);
+}
+
+/**
+ * @brief Record published using publishDeferred() for --deferred
+ */
+struct SimRecord {
+    int32_t counter;
+    uint16_t size;
+};
+
+/**
+ * @brief Format used with withFormatter() for --deferred
+ */
+static const uint8_t SIM_FORMAT_ID = 1;
+
+/**
+ * @brief Formatter for --deferred, producing the same data as publish() would have
+ */
+static size_t formatSimRecord(const void *record, size_t recordLen, char *buf, size_t bufSize) {
+    SimRecord simRecord;
+    if (recordLen != sizeof(simRecord)) {
+        return 0;
+    }
+    memcpy(&simRecord, record, sizeof(simRecord));
+    std::string data = SimUtil::makeEventData(simRecord.counter, simRecord.size);
+    strncpy(buf, data.c_str(), bufSize);
+    return data.length();
+}
+
+/**
+ * @brief Publish an event for --in-place without publish()
+ *
+ * Even counters build the data in an event from allocEvent(), odd counters use publishWithLength()
+ * with a buffer that is not null terminated.
+ */
+static bool publishInPlace(SimQueue &queue, const SimOptions &opts, int counter, const std::string &data) {
+    if ((counter % 2) == 0) {
+        PublishQueueEvent *event = queue.allocEvent(EVENT_NAME, data.length());
+        if (!event) {
+            return false;
+        }
+        memcpy(event->eventData, data.c_str(), data.length() + 1);
+        return queue.publishEvent(event, opts.ttl, PRIVATE | WITH_ACK);
+    }
+    else {
+        std::vector<char> buf(data.begin(), data.end());
+        buf.push_back('x');
+        return queue.publishWithLength(EVENT_NAME, buf.data(), data.length(), opts.ttl, PRIVATE | WITH_ACK);
+    }
+}
+
+/**
+ * @brief Publish the events waiting for --bulk using one publishBulk() call
+ *
+ * @param counters The counters of the events to publish, cleared after publishing
+ *
+ * @param deadlineMs Updated with the deadline of each event when using --ttl
+ */
+static void publishBulk(SimQueue &queue, const SimOptions &opts, std::vector<int> &counters, std::vector<unsigned long> &deadlineMs) {
+    std::vector<std::string> data;
+    for(int counter : counters) {
+        data.push_back(SimUtil::makeEventData(counter, opts.size));
+    }
+
+    std::vector<PublishQueueBulkEvent> events;
+    for(const auto &eventData : data) {
+        events.push_back({EVENT_NAME, eventData.c_str(), PRIVATE | WITH_ACK, opts.ttl, false});
+    }
+
+    size_t numQueued = queue.publishBulk(events.data(), events.size());
+    if (numQueued != events.size()) {
+        printf("publishBulk queued %u of %u events\n", (unsigned) numQueued, (unsigned) events.size());
+    }
+    if (opts.ttl) {
+        for(int counter : counters) {
+            deadlineMs[counter] = (millis() / 1000 + opts.ttl) * 1000;
+        }
+    }
+    counters.clear();
+}
+
+/**
+ * @brief Returns true if a later event has the same coalescing key, so this one can be replaced
+ */
+static bool isSuperseded(const SimOptions &opts, int counter) {
+    std::string key = getCoalesceKey(opts, counter);
+    if (key.empty()) {
+        return false;
+    }
+    for(int later = counter + 1; later < opts.events; later++) {
+        if (getCoalesceKey(opts, later) == key) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Total size of the files in the queue directory and its priority lane subdirectories
+ */
+static size_t getDirBytes(const std::string &path) {
+    size_t result = 0;
+    DIR *dir = opendir(path.c_str());
+    while(struct dirent *ent = dir ? readdir(dir) : NULL) {
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+        std::string child = path + "/" + ent->d_name;
+        struct stat sb;
+        if (::stat(child.c_str(), &sb) == 0) {
+            result += S_ISDIR(sb.st_mode) ? getDirBytes(child) : sb.st_size;
+        }
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    return result;
+}
+
+/**
+ * @brief Free space on the simulated file system for --free-space-guard
+ */
+static size_t getFreeSpace(const SimOptions &opts) {
+    size_t used = getDirBytes(opts.dir);
+    return (used < opts.flashCapacity) ? opts.flashCapacity - used : 0;
+}
+
+/**
+ * @brief Publish complete callbacks whose data was not the uncompressed event data
+ */
+static int callbackErrors = 0;
+
+/**
+ * @brief Create and set up a queue
+ *
+ * @param name NULL for the default instance, or the name of the second instance for --scheduler,
+ * which uses a directory next to the default one
+ */
+static SimQueue *createQueue(const SimOptions &opts, const char *name = NULL) {
+    SimQueue *queue = name ? new SimQueue(name) : new SimQueue();
+    std::string dir = name ? opts.dir + "-" + name : opts.dir;
+    queue->withDirPath(dir.c_str())
+        .withRamQueueSize(opts.ramQueueSize)
+        .withFileQueueSize(opts.fileQueueSize)
+        .withSegmentSize(opts.segmentSize);
+    if (opts.batchEvents) {
+        queue->withBatchPublish(BATCH_EVENT_NAME, opts.batchEvents);
+    }
+    if (opts.eventPoolDataSize) {
+        queue->withEventPool(opts.eventPoolDataSize);
+    }
+    if (opts.lockFreeSize) {
+        queue->withLockFreeQueue(opts.lockFreeSize);
+    }
+    if (opts.asyncWriterDelayMs >= 0) {
+        queue->withAsyncWriter(opts.asyncWriterDelayMs);
+    }
+    if (opts.pipelineSize) {
+        queue->withPipelining(opts.pipelineSize);
+    }
+    if (opts.publishBurst) {
+        queue->withPublishRate(1000, opts.publishBurst);
+    }
+    if (opts.backoffMinMs) {
+        queue->withFailureBackoff(opts.backoffMinMs, opts.backoffMaxMs, opts.backoffJitterPercent);
+    }
+    if (opts.compress || opts.compressCloud) {
+        queue->withCompression(NULL, opts.compressCloud);
+        queue->withPublishCompleteUserCallback([](bool succeeded, const char *eventName, const char *eventData) {
+            if (strncmp(eventData, PublishQueueCompress::CLOUD_PREFIX, strlen(PublishQueueCompress::CLOUD_PREFIX)) == 0) {
+                callbackErrors++;
+            }
+        });
+    }
+    if (opts.compact) {
+        queue->withCompactEncoding();
+    }
+    if (opts.priorityEvery) {
+        queue->withPriorityLane(1, 2, opts.fileQueueSize);
+    }
+    if (opts.ttl) {
+        queue->withEventExpiry();
+    }
+    if (opts.ramQueueBytes) {
+        queue->withRamQueueMaxBytes(opts.ramQueueBytes);
+    }
+    if (opts.fileQueueBytes) {
+        queue->withFileQueueMaxBytes(opts.fileQueueBytes);
+    }
+    if (opts.minFreeSpace) {
+        queue->withMinFreeSpace(opts.minFreeSpace, [&opts]() {
+            return getFreeSpace(opts);
+        });
+    }
+    if (opts.schedulerWeight) {
+        PublishQueueScheduler::instance().withPublishRate(1000, opts.publishBurst ? opts.publishBurst : 1);
+        queue->withScheduler(name ? opts.sharedWeight : opts.schedulerWeight);
+    }
+    if (opts.deferred) {
+        queue->withFormatter(SIM_FORMAT_ID, formatSimRecord);
+    }
+    queue->withQueueIndex(opts.queueIndex);
+    queue->setup();
+    return queue;
+}
+
+/**
+ * @brief Cloud events with compressed data decoded and batches unpacked into the events they contain
+ */
+static std::vector<HostSim::CloudEvent> getDeliveredEvents(int &errors) {
+    std::vector<HostSim::CloudEvent> result;
+    PublishQueueCompress decompressor;
+    for(auto ev : HostSim::getCloudEvents()) {
+        if (ev.data.compare(0, strlen(PublishQueueCompress::CLOUD_PREFIX), PublishQueueCompress::CLOUD_PREFIX) == 0) {
+            char buf[particle::protocol::MAX_EVENT_DATA_LENGTH + 1];
+            if (!decompressor.decodeCloud(ev.data.c_str(), buf, sizeof(buf))) {
+                fprintf(stderr, "check failed: invalid compressed data %s\n", ev.data.c_str());
+                errors++;
+                continue;
+            }
+            ev.data = buf;
+        }
+        if (ev.name != BATCH_EVENT_NAME) {
+            result.push_back(ev);
+            continue;
+        }
+        bool valid = PublishQueueBatch::decode(ev.data.c_str(), [&](const char *eventName, const char *eventData) {
+            HostSim::CloudEvent unpacked = ev;
+            unpacked.name = eventName;
+            unpacked.data = eventData;
+            result.push_back(unpacked);
+        });
+        if (!valid) {
+            fprintf(stderr, "check failed: invalid batch %s\n", ev.data.c_str());
+            errors++;
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Counter of the event in the payload of an event file, or -1 if it can't be decoded
+ */
+static int getFileCounter(const PublishQueueFileHeader &hdr, const std::string &payload, const PublishQueueCompact &names) {
+    std::string event = payload;
+    if (hdr.encoding == PublishQueueCompress::ENCODING_COMPACT) {
+        event.resize(names.getDecodedSize((const uint8_t *)payload.data(), payload.size()));
+        if (event.size() < PublishQueueEvent::getSize(0) || !names.decodeEvent((const uint8_t *)payload.data(), payload.size(), (PublishQueueEvent *)&event[0], event.size())) {
+            return -1;
+        }
+    }
+    else
+    if (hdr.encoding == PublishQueueCompress::ENCODING_LZSS) {
+        PublishQueueCompress decompressor;
+        event.resize(PublishQueueCompress::getDecodedSize((const uint8_t *)payload.data(), payload.size()));
+        if (event.size() < PublishQueueEvent::getSize(0) || !decompressor.decompress((const uint8_t *)payload.data(), payload.size(), &event[0], event.size())) {
+            return -1;
+        }
+    }
+    return atoi(event.c_str() + offsetof(PublishQueueEvent, eventData));
+}
+
+/**
+ * @brief Path of the temporary file an event is written to before it's renamed into the queue
+ */
+static std::string getTempFilePath(const SimOptions &opts) {
+    return opts.dir + "/pqwrite.tmp";
+}
+
+/**
+ * @brief Before the simulated reboot, rewrite queued event files as version 1 and damage every Nth one
+ *
+ * Damaged files are alternately truncated, like a write interrupted by a reset, and have a byte of
+ * the event data changed, which only the version 2 CRC can detect. A partial temporary file is also
+ * left behind, as if the reset happened while an event was being written, and with --compact a
+ * partial name at the end of the name table.
+ *
+ * @return Counters of the damaged events, which may not be delivered
+ */
+static std::set<int> damageQueueFiles(const SimOptions &opts) {
+    std::set<int> result;
+
+    std::vector<std::string> names;
+    DIR *dir = opendir(opts.dir.c_str());
+    while(struct dirent *ent = dir ? readdir(dir) : NULL) {
+        if (strlen(ent->d_name) == 8 && strspn(ent->d_name, "0123456789") == 8) {
+            names.push_back(ent->d_name);
+        }
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    std::sort(names.begin(), names.end());
+
+    // Events stored using withCompactEncoding() refer to the name table
+    PublishQueueCompact nameTable;
+    nameTable.withDirPath(opts.dir.c_str()).load(false);
+
+    int index = 0;
+    for(const auto &name : names) {
+        std::string path = opts.dir + "/" + name;
+        std::ifstream in(path, std::ios::binary);
+        std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        in.close();
+
+        PublishQueueFileHeader hdr;
+        if (contents.size() < sizeof(hdr)) {
+            continue;
+        }
+        memcpy(&hdr, contents.data(), sizeof(hdr));
+        std::string payload = contents.substr(sizeof(hdr));
+
+        if (opts.v1Files && hdr.encoding == PublishQueueCompress::ENCODING_NONE) {
+            hdr.version = PublishQueuePosix::FILE_VERSION_1;
+            hdr.headerSize = PublishQueuePosix::FILE_V1_HEADER_SIZE;
+            // Version 1 events do not have the expires and timestamp fields
+            contents = std::string((const char *)&hdr, PublishQueuePosix::FILE_V1_HEADER_SIZE) + payload.substr(offsetof(PublishQueueEvent, flags));
+        }
+        else
+        if (opts.v2Files && hdr.encoding != PublishQueueCompress::ENCODING_COMPACT) {
+            // Version 2 events do not have the expires, timestamp and formatId fields. Compressed
+            // events are compressed again without them.
+            std::string event = payload;
+            PublishQueueCompress compressor;
+            if (hdr.encoding == PublishQueueCompress::ENCODING_LZSS) {
+                event.resize(PublishQueueCompress::getDecodedSize((const uint8_t *)payload.data(), payload.size()));
+                if (event.size() < PublishQueueEvent::getSize(0) || !compressor.decompress((const uint8_t *)payload.data(), payload.size(), &event[0], event.size())) {
+                    continue;
+                }
+            }
+            event = event.substr(offsetof(PublishQueueEvent, flags));
+            if (hdr.encoding == PublishQueueCompress::ENCODING_LZSS) {
+                uint8_t buf[PublishQueueCompress::MAX_STORED_SIZE];
+                size_t len = compressor.init() ? compressor.compress(event.data(), event.size(), buf, sizeof(buf)) : 0;
+                if (!len) {
+                    continue;
+                }
+                event = std::string((const char *)buf, len);
+            }
+            hdr.version = PublishQueuePosix::FILE_VERSION_2;
+            hdr.payloadLen = (uint16_t) event.size();
+            hdr.crc = SimQueue::getFileCrc(hdr, event.data());
+            contents = std::string((const char *)&hdr, sizeof(hdr)) + event;
+        }
+
+        if (opts.corruptEvery > 0 && (index++ % opts.corruptEvery) == (opts.corruptEvery - 1)) {
+            result.insert(getFileCounter(hdr, payload, nameTable));
+            if (opts.v1Files || (result.size() % 2) == 1) {
+                contents.resize(contents.size() - 1);
+            }
+            else {
+                contents[contents.size() - 2] ^= 0x01;
+            }
+        }
+
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(contents.data(), contents.size());
+    }
+
+    if (opts.corruptEvery > 0) {
+        // A reset while an event was being written leaves a partial temporary file, which setup removes
+        std::ofstream out(getTempFilePath(opts), std::ios::binary | std::ios::trunc);
+        out.write("PQ", 2);
+
+        // and a name being added to the name table, which setup removes from the end of it
+        if (nameTable.getNumNames() != 0) {
+            std::ofstream names(opts.dir + "/" + PublishQueueCompact::NAME_TABLE_NAME, std::ios::binary | std::ios::app);
+            names.write("\x05ala", 4);
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Verify every event was delivered exactly once, in order for each event name
+ *
+ * @param damaged Counters of events in files damaged by damageQueueFiles(), which may be missing
+ *
+ * @param deadlineMs For each counter, the millis() value at which the event expires, or 0
+ *
+ * @param missing Set to the number of events not delivered that may have been discarded by a byte limit
+ */
+static int checkDelivery(const SimOptions &opts, const std::set<int> &damaged, const std::vector<unsigned long> &deadlineMs, size_t &missing) {
+    int errors = 0;
+
+    // Byte limits discard the oldest events instead of losing them, checked using the stats
+    bool limited = opts.fileQueueBytes || opts.minFreeSpace;
+    missing = 0;
+
+    // With pipelining, events sent after one that failed can be delivered before it is sent again
+    bool checkOrder = !(opts.pipelineSize > 1 && HostSim::getPublishFailures() != 0);
+
+    // Events queued while offline are sent after connecting, priority events first
+    bool checkPriority = checkOrder && (opts.offline || opts.reboot);
+    bool defaultDelivered = false;
+
+    std::vector<int> received(opts.events, 0);
+    std::map<std::string, int> lastCounter;
+    for(const auto &ev : getDeliveredEvents(errors)) {
+        if (ev.name == SHARED_EVENT_NAME) {
+            // Checked by checkShared()
+            continue;
+        }
+        int counter = atoi(ev.data.c_str());
+        if (counter < 0 || counter >= opts.events || ev.data != SimUtil::makeEventData(counter, opts.size)) {
+            fprintf(stderr, "check failed: unexpected data %s\n", ev.data.c_str());
+            errors++;
+            continue;
+        }
+        bool priority = isPriorityEvent(opts, counter);
+        if (ev.name != (priority ? PRIORITY_EVENT_NAME : EVENT_NAME)) {
+            fprintf(stderr, "check failed: counter %d delivered as %s\n", counter, ev.name.c_str());
+            errors++;
+        }
+        received[counter]++;
+
+        // The last attempt to send it started before it expired
+        if (deadlineMs[counter] && ev.receivedMs >= deadlineMs[counter] + opts.cloud.latencyMs + opts.cloud.latencyJitterMs) {
+            fprintf(stderr, "check failed: counter %d delivered at %lu after it expired at %lu\n", counter, ev.receivedMs, deadlineMs[counter]);
+            errors++;
+        }
+
+        // A coalesced event takes the place of the one it replaces, so order is only kept for each key
+        std::string group = ev.name + getCoalesceKey(opts, counter);
+        auto it = lastCounter.find(group);
+        if (checkOrder && it != lastCounter.end() && counter <= it->second) {
+            fprintf(stderr, "check failed: %s counter %d delivered after %d\n", group.c_str(), counter, it->second);
+            errors++;
+        }
+        lastCounter[group] = counter;
+
+        if (priority && checkPriority && defaultDelivered) {
+            fprintf(stderr, "check failed: priority counter %d delivered after other events\n", counter);
+            errors++;
+        }
+        if (!priority) {
+            defaultDelivered = true;
+        }
+    }
+    for(int counter = 0; counter < opts.events; counter++) {
+        bool expired = deadlineMs[counter] && millis() >= deadlineMs[counter];
+        if (received[counter] == 0 && limited && !isSuperseded(opts, counter) && !damaged.count(counter) && !expired) {
+            missing++;
+            continue;
+        }
+        if (received[counter] > 1 || (received[counter] == 0 && !isSuperseded(opts, counter) && !damaged.count(counter) && !expired)) {
+            fprintf(stderr, "check failed: counter %d delivered %d times\n", counter, received[counter]);
+            errors++;
+        }
+    }
+    return errors;
+}
+
+/**
+ * @brief With --scheduler or --second-queue, verify the second instance's events, and with --scheduler
+ * that publishes were shared by weight
+ *
+ * Publishes are counted until the first instance to run out of events sent its last one, as
+ * after that the other one gets all of the publishes. The share is not checked if a publish
+ * failed, as an instance waiting to retry gives up its turns to the other one.
+ */
+static int checkShared(const SimOptions &opts) {
+    int errors = 0;
+
+    bool checkOrder = !(opts.pipelineSize > 1 && HostSim::getPublishFailures() != 0);
+    std::vector<int> received(opts.events, 0);
+    int lastCounter = -1;
+    for(const auto &ev : getDeliveredEvents(errors)) {
+        if (ev.name != SHARED_EVENT_NAME) {
+            continue;
+        }
+        int counter = atoi(ev.data.c_str());
+        if (counter < 0 || counter >= opts.events || ev.data != SimUtil::makeEventData(counter, opts.size)) {
+            fprintf(stderr, "check failed: unexpected %s data %s\n", SHARED_EVENT_NAME, ev.data.c_str());
+            errors++;
+            continue;
+        }
+        received[counter]++;
+        if (checkOrder && counter <= lastCounter) {
+            fprintf(stderr, "check failed: %s counter %d delivered after %d\n", SHARED_EVENT_NAME, counter, lastCounter);
+            errors++;
+        }
+        lastCounter = counter;
+    }
+    for(int counter = 0; counter < opts.events; counter++) {
+        if (received[counter] != 1) {
+            fprintf(stderr, "check failed: %s counter %d delivered %d times\n", SHARED_EVENT_NAME, counter, received[counter]);
+            errors++;
+        }
+    }
+
+    if (!opts.schedulerWeight) {
+        return errors;
+    }
+
+    const auto &cloudEvents = HostSim::getCloudEvents();
+    size_t lastDefault = 0;
+    size_t lastShared = 0;
+    for(size_t ii = 0; ii < cloudEvents.size(); ii++) {
+        if (cloudEvents[ii].name == SHARED_EVENT_NAME) {
+            lastShared = ii;
+        }
+        else {
+            lastDefault = ii;
+        }
+    }
+    size_t end = std::min(lastDefault, lastShared);
+    size_t numDefault = 0;
+    for(size_t ii = 0; ii <= end && ii < cloudEvents.size(); ii++) {
+        if (cloudEvents[ii].name != SHARED_EVENT_NAME) {
+            numDefault++;
+        }
+    }
+    double share = (end != 0) ? (double) numDefault / (end + 1) : 0;
+    double expected = (double) opts.schedulerWeight / (opts.schedulerWeight + opts.sharedWeight);
+    printf("schedulerShare=%.2f expected=%.2f publishes=%u\n", share, expected, (unsigned) (end + 1));
+    if (HostSim::getPublishFailures() == 0 && (share < expected - 0.1 || share > expected + 0.1)) {
+        fprintf(stderr, "check failed: default instance had %.2f of the publishes, expected %.2f\n", share, expected);
+        errors++;
+    }
+    return errors;
+}
+
+static void printHistogram(const char *name, const PublishQueueHistogram &histogram) {
+    printf("%s count=%lu p50=%lu p90=%lu max=%lu\n", name, (unsigned long) histogram.getCount(),
+        (unsigned long) histogram.getPercentile(50), (unsigned long) histogram.getPercentile(90), (unsigned long) histogram.max);
+}
+
+static void printStats(const char *label, const PublishQueueStats &stats) {
+    printf("%s enqueued=%lu rejected=%lu coalesced=%lu published=%lu failed=%lu discardedLimit=%lu discardedCorrupt=%lu discardedExpired=%lu spilled=%lu writeFailures=%lu\n",
+        label, (unsigned long) stats.enqueued, (unsigned long) stats.rejected, (unsigned long) stats.coalesced, (unsigned long) stats.published, (unsigned long) stats.failed,
+        (unsigned long) stats.discardedLimit, (unsigned long) stats.discardedCorrupt, (unsigned long) stats.discardedExpired, (unsigned long) stats.spilled, (unsigned long) stats.writeFailures);
+    printf("%s ramQueueLen=%u fileQueueLen=%u flashBytes=%u\n", label, (unsigned) stats.ramQueueLen, (unsigned) stats.fileQueueLen, (unsigned) stats.flashBytes);
+    printHistogram("  queueLatencySec", stats.queueLatency);
+    printHistogram("  publishRoundTripMs", stats.publishRoundTrip);
+    printHistogram("  writeDurationMs", stats.writeDuration);
+}
+
+/**
+ * @brief Verify the statistics after the queue drained against what the simulated cloud saw
+ *
+ * With --reboot, the counters are from the queue created after the reboot, which sends all
+ * of the events but did not publish them.
+ */
+static int checkStats(const SimOptions &opts, const PublishQueueStats &stats, const std::set<int> &damaged, size_t delivered) {
+    int errors = 0;
+    auto expect = [&errors](const char *name, unsigned long value, unsigned long expected) {
+        if (value != expected) {
+            fprintf(stderr, "check failed: stats %s=%lu expected %lu\n", name, value, expected);
+            errors++;
+        }
+    };
+
+    if (!opts.reboot) {
+        expect("enqueued", stats.enqueued, opts.events);
+        expect("rejected", stats.rejected, 0);
+    }
+    expect("published", stats.published, delivered);
+    expect("failed", stats.failed, HostSim::getPublishFailures());
+    expect("publishRoundTrip count", stats.publishRoundTrip.getCount(), HostSim::getPublishAttempts());
+    expect("discardedCorrupt", stats.discardedCorrupt, damaged.size());
+    expect("ramQueueLen", stats.ramQueueLen, 0);
+    expect("fileQueueLen", stats.fileQueueLen, 0);
+    if (opts.segmentSize == 0) {
+        expect("flashBytes", stats.flashBytes, 0);
+    }
+    // Version 1 and 2 files do not have the time the event was published
+    if (stats.published != 0 && stats.queueLatency.getCount() == 0 && !opts.v1Files && !opts.v2Files) {
+        fprintf(stderr, "check failed: stats queueLatency is empty\n");
+        errors++;
+    }
+    if (stats.spilled != 0 && stats.writeDuration.getCount() == 0) {
+        fprintf(stderr, "check failed: stats writeDuration is empty\n");
+        errors++;
+    }
+    return errors;
+}
+
+/**
+ * @brief Virtual time from connectMs until the last priority event was received, 0 if none
+ */
+static unsigned long getPriorityDrainMs(unsigned long connectMs) {
+    unsigned long result = 0;
+    for(const auto &ev : HostSim::getCloudEvents()) {
+        if (ev.name == PRIORITY_EVENT_NAME && ev.receivedMs >= connectMs && ev.receivedMs - connectMs > result) {
+            result = ev.receivedMs - connectMs;
+        }
+    }
+    return result;
+}
+
+int main(int argc, char **argv) {
+    SimOptions opts;
+    if (!parseOptions(argc, argv, opts)) {
+        return 2;
+    }
+
+    HostSim::removeTree(opts.dir.c_str());
+    HostSim::setCloudConfig(opts.cloud);
+    HostSim::setConnected(!(opts.offline || opts.reboot));
+    HostSim::setMillis(10000);
+
+    std::unique_ptr<SimQueue> queue(createQueue(opts));
+    std::unique_ptr<SimQueue> shared;
+    if (opts.secondQueue) {
+        HostSim::removeTree((opts.dir + "-" + SHARED_QUEUE_NAME).c_str());
+        shared.reset(createQueue(opts, SHARED_QUEUE_NAME));
+        SimUtil::getOtherQueues().push_back(shared.get());
+    }
+    if (opts.crashAfter) {
+        // The queue goes idle while connected, saving its index, before the device goes offline
+        HostSim::setConnected(true);
+        SimUtil::run(*queue, 5000, 10);
+        HostSim::setConnected(false);
+    }
+    HostSim::resetCounters();
+
+    // Time.now() is in whole seconds, so an event expires at the start of a second
+    std::vector<unsigned long> deadlineMs(opts.events, 0);
+
+    // Largest queue sizes and smallest free space, checked after each publish
+    size_t maxRamBytes = 0;
+    size_t maxFileBytes = 0;
+    size_t minFreeSpace = opts.flashCapacity;
+
+    // Counters of the events waiting to be published with --bulk
+    std::vector<int> bulkCounters;
+
+    unsigned long startMs = millis();
+    for(int ii = 0; ii < opts.events; ii++) {
+        std::string data = SimUtil::makeEventData(ii, opts.size);
+        if (opts.ttl) {
+            // With --bulk, publishBulk() sets it again when the events are published
+            deadlineMs[ii] = (millis() / 1000 + opts.ttl) * 1000;
+        }
+        if (isPriorityEvent(opts, ii)) {
+            queue->publishWithPriority(1, PRIORITY_EVENT_NAME, data.c_str(), opts.ttl, PRIVATE, WITH_ACK);
+        }
+        else
+        if (opts.coalesceKeys) {
+            queue->publishCoalesced(getCoalesceKey(opts, ii).c_str(), EVENT_NAME, data.c_str(), opts.ttl, PRIVATE, WITH_ACK);
+        }
+        else
+        if (opts.bulkEvents) {
+            bulkCounters.push_back(ii);
+            if (bulkCounters.size() >= opts.bulkEvents) {
+                publishBulk(*queue, opts, bulkCounters, deadlineMs);
+            }
+        }
+        else {
+            if (opts.inPlace) {
+                publishInPlace(*queue, opts, ii, data);
+            }
+            else
+            if (opts.deferred) {
+                SimRecord record = { ii, (uint16_t) opts.size };
+                queue->publishDeferred(SIM_FORMAT_ID, EVENT_NAME, &record, sizeof(record), opts.ttl, PRIVATE | WITH_ACK);
+            }
+            else {
+                queue->publish(EVENT_NAME, data.c_str(), opts.ttl, PRIVATE | WITH_ACK);
+            }
+        }
+        if (shared) {
+            shared->publish(SHARED_EVENT_NAME, data.c_str(), PRIVATE | WITH_ACK);
+        }
+        SimUtil::run(*queue, opts.periodMs ? opts.periodMs : 1, opts.periodMs ? 10 : 1);
+
+        maxRamBytes = std::max(maxRamBytes, queue->getRamQueueBytes());
+        maxFileBytes = std::max(maxFileBytes, queue->getFileQueueBytes());
+        if (opts.minFreeSpace) {
+            minFreeSpace = std::min(minFreeSpace, getFreeSpace(opts));
+        }
+    }
+    if (!bulkCounters.empty()) {
+        publishBulk(*queue, opts, bulkCounters, deadlineMs);
+    }
+
+    std::set<int> damaged;
+    uint32_t discardedBeforeReboot = 0;
+    if (opts.reboot) {
+        if (opts.crashAfter) {
+            // Unplanned reset: the queue was written to files, as before sleep, and some were sent.
+            // Nothing is saved before the reset, which happens between publishes while connected.
+            queue->writeQueueToFiles();
+            HostSim::setConnected(true);
+            unsigned long crashStartMs = millis();
+            while((HostSim::getCloudEvents().size() < opts.crashAfter || HostSim::getPublishesInFlight() != 0) && millis() - crashStartMs < opts.timeoutMs) {
+                SimUtil::run(*queue, 10, 10);
+            }
+        }
+        else {
+            // Graceful reset: Device OS sends the reset system event first
+            HostSim::fireResetEvent();
+        }
+        discardedBeforeReboot = queue->getStats().discardedLimit;
+        queue.reset();
+        if (shared) {
+            SimUtil::getOtherQueues().clear();
+            shared.reset();
+        }
+        damaged = damageQueueFiles(opts);
+        queue.reset(createQueue(opts));
+        if (opts.secondQueue) {
+            shared.reset(createQueue(opts, SHARED_QUEUE_NAME));
+            SimUtil::getOtherQueues().push_back(shared.get());
+        }
+    }
+    if (opts.stats) {
+        printStats("statsBeforeConnect", queue->getStats());
+    }
+    if (opts.offline || opts.reboot) {
+        HostSim::setConnected(true);
+    }
+
+    unsigned long connectMs = millis();
+
+    // Time from drainForSleep() until getCanSleep(), 0 if it did not within the budget
+    unsigned long sleepReadyMs = 0;
+    if (opts.sleepBudgetMs) {
+        unsigned long estimateMs = queue->drainForSleep(opts.sleepBudgetMs);
+        while(millis() - connectMs < opts.sleepBudgetMs) {
+            SimUtil::run(*queue, 10, 10);
+            if (queue->getCanSleep()) {
+                sleepReadyMs = millis() - connectMs;
+                break;
+            }
+        }
+        printf("sleepEstimateMs=%lu sleepReadyMs=%lu sentBeforeSleep=%u queuedAtSleep=%u\n", estimateMs, sleepReadyMs,
+            (unsigned) HostSim::getCloudEvents().size(), (unsigned) queue->getNumEvents());
+
+        // Sleep modes that do not retain RAM lose the RAM queue. Nothing is published while asleep.
+        queue->clearRamQueue();
+        HostSim::advanceMillis(60000);
+    }
+
+    unsigned long drainMs = SimUtil::runUntilEmpty(*queue, opts.timeoutMs);
+    unsigned long totalMs = millis() - startMs;
+
+    const HostSim::FlashOps &ops = HostSim::getFlashOps();
+    int batchErrors = 0;
+    printf("delivered=%u cloudEvents=%u attempts=%lu failures=%lu rateLimited=%lu remaining=%u\n",
+        (unsigned) getDeliveredEvents(batchErrors).size(), (unsigned) HostSim::getCloudEvents().size(), HostSim::getPublishAttempts(), HostSim::getPublishFailures(), HostSim::getRateLimited(), (unsigned) queue->getNumEvents());
+    printf("drainMs=%lu totalMs=%lu timedOut=%d\n", drainMs, totalMs, (drainMs == 0 && opts.events != 0));
+    if (opts.compressCloud) {
+        size_t cloudBytes = 0;
+        for(const auto &ev : HostSim::getCloudEvents()) {
+            cloudBytes += ev.data.length();
+        }
+        printf("cloudBytes=%u\n", (unsigned) cloudBytes);
+    }
+    if (opts.corruptEvery) {
+        printf("damaged=%u\n", (unsigned) damaged.size());
+    }
+    if (opts.ttl) {
+        printf("expired=%lu\n", (unsigned long) queue->getExpiredCount());
+    }
+    if (opts.priorityEvery) {
+        printf("priorityDrainMs=%lu\n", getPriorityDrainMs(connectMs));
+    }
+    if (opts.ramQueueBytes || opts.fileQueueBytes || opts.minFreeSpace || opts.compact) {
+        printf("maxRamBytes=%u maxFileBytes=%u minFreeSpace=%u\n", (unsigned) maxRamBytes, (unsigned) maxFileBytes, (unsigned) minFreeSpace);
+    }
+    PublishQueueStats stats = queue->getStats();
+    if (opts.stats) {
+        printStats("stats", stats);
+    }
+    printf("flash opens=%lu closes=%lu reads=%lu writes=%lu bytesRead=%lu bytesWritten=%lu seeks=%lu stats=%lu unlinks=%lu renames=%lu fsyncs=%lu dirScans=%lu\n",
+        ops.opens, ops.closes, ops.reads, ops.writes, ops.bytesRead, ops.bytesWritten, ops.seeks, ops.stats, ops.unlinks, ops.renames, ops.fsyncs, ops.dirScans);
+
+    if (opts.check) {
+        size_t missing = 0;
+        int errors = checkDelivery(opts, damaged, deadlineMs, missing);
+        if (drainMs == 0 && opts.events != 0) {
+            fprintf(stderr, "check failed: queue did not drain within %lu ms\n", opts.timeoutMs);
+            errors++;
+        }
+        struct stat sb;
+        if (opts.corruptEvery && ::stat(getTempFilePath(opts).c_str(), &sb) == 0) {
+            fprintf(stderr, "check failed: partial event file was not removed\n");
+            errors++;
+        }
+        if (opts.secondQueue) {
+            errors += checkShared(opts);
+        }
+        if (opts.sleepBudgetMs && sleepReadyMs == 0) {
+            fprintf(stderr, "check failed: getCanSleep() was not true within the sleep budget\n");
+            errors++;
+        }
+        // An event being sent when it's discarded can still be delivered, so fewer may be missing
+        if (missing > discardedBeforeReboot + stats.discardedLimit) {
+            fprintf(stderr, "check failed: %u events missing but %lu discarded by the limits\n", (unsigned) missing, (unsigned long) (discardedBeforeReboot + stats.discardedLimit));
+            errors++;
+        }
+        if (opts.ramQueueBytes && maxRamBytes > opts.ramQueueBytes) {
+            fprintf(stderr, "check failed: RAM queue was %u bytes, limit %u\n", (unsigned) maxRamBytes, (unsigned) opts.ramQueueBytes);
+            errors++;
+        }
+        if (opts.fileQueueBytes && maxFileBytes > opts.fileQueueBytes) {
+            fprintf(stderr, "check failed: file queue was %u bytes, limit %u\n", (unsigned) maxFileBytes, (unsigned) opts.fileQueueBytes);
+            errors++;
+        }
+        if (opts.minFreeSpace && minFreeSpace < opts.minFreeSpace) {
+            fprintf(stderr, "check failed: free space was %u bytes, minimum %u\n", (unsigned) minFreeSpace, (unsigned) opts.minFreeSpace);
+            errors++;
+        }
+        if (opts.stats) {
+            int statsErrors = 0;
+            errors += checkStats(opts, stats, damaged, getDeliveredEvents(statsErrors).size());
+        }
+        if (callbackErrors != 0) {
+            fprintf(stderr, "check failed: %d publish complete callbacks got compressed data\n", callbackErrors);
+            errors++;
+        }
+        if (HostSim::getRateLimited() != 0) {
+            fprintf(stderr, "check failed: %lu publishes went over the cloud rate limit\n", HostSim::getRateLimited());
+            errors++;
+        }
+        if (errors) {
+            return 1;
+        }
+        printf("check passed\n");
+    }
+    return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef __BACKGROUNDPUBLISHRK_H
+#define __BACKGROUNDPUBLISHRK_H
+
+// Host stand-in for BackgroundPublishRK. Like the real library, only one publish
+// can be in progress at a time; publish() returns false if one is already running.
+// Publishes are completed by HostSim::processCloud() after the configured latency.
+
+#include "Particle.h"
+
+#include <functional>
+
+class BackgroundPublishRK {
+public:
+    typedef std::function<void(bool succeeded, const char *event_name, const char *event_data, const void *event_context)> publish_completed_cb_t;
+
+    static BackgroundPublishRK &instance();
+
+    void start();
+    void stop();
+
+    bool publish(const char *name, const char *data, PublishFlags flags, publish_completed_cb_t cb = nullptr, const void *context = nullptr);
+
+protected:
+    BackgroundPublishRK() {}
+
+    static BackgroundPublishRK *_instance;
+};
+
+#endif /* __BACKGROUNDPUBLISHRK_H */
@@ -0,0 +1,540 @@
+// Implementation of the host stand-ins for Particle.h and BackgroundPublishRK,
+// and the control interface in HostSim.h.
+
+#include "Particle.h"
+#include "BackgroundPublishRK.h"
+#include "HostSim.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <dirent.h>
+#include <fcntl.h>
+#include <new>
+#include <random>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+namespace {
+
+struct PendingPublish {
+    unsigned long completeAtMs;
+    bool succeeded;
+    std::string name;
+    std::string data;
+    PublishFlags flags;
+    BackgroundPublishRK::publish_completed_cb_t cb;
+    const void *context;
+};
+
+std::atomic<unsigned long> simMillis(0);
+std::atomic<bool> cloudConnected(true);
+
+std::mutex cloudMutex;
+HostSim::CloudConfig cloudConfig;
+std::mt19937 rng(1);
+std::vector<PendingPublish> pending;
+std::vector<HostSim::CloudEvent> cloudEvents;
+unsigned long publishAttempts = 0;
+unsigned long publishFailures = 0;
+unsigned long rateLimited = 0;
+unsigned cloudTokens = 0;
+unsigned long cloudTokenTime = 0;
+
+HostSim::FlashOps flashOps;
+std::mutex flashOpsMutex;
+
+std::atomic<unsigned long> heapAllocs(0);
+
+system_event_handler_t *systemEventHandler = nullptr;
+system_event_t systemEventMask = 0;
+
+void fireSystemEvent(system_event_t event, int param) {
+    if (systemEventHandler && (systemEventMask & event) != 0) {
+        systemEventHandler(event, param);
+    }
+}
+
+bool startPublish(const char *name, const char *data, PublishFlags flags, BackgroundPublishRK::publish_completed_cb_t cb, const void *context) {
+    std::lock_guard<std::mutex> lock(cloudMutex);
+
+    PendingPublish pub;
+    unsigned long latency = cloudConfig.latencyMs;
+    if (cloudConfig.latencyJitterMs) {
+        latency += rng() % (cloudConfig.latencyJitterMs + 1);
+    }
+    pub.completeAtMs = simMillis + latency;
+    pub.succeeded = cloudConnected && (std::uniform_real_distribution<double>(0.0, 1.0)(rng) >= cloudConfig.failureRate);
+    if (cloudConfig.rateLimitBurst) {
+        // Token bucket, one token per second
+        unsigned long earned = (simMillis - cloudTokenTime) / 1000;
+        if (publishAttempts == 0 || cloudTokens + earned >= cloudConfig.rateLimitBurst) {
+            cloudTokens = cloudConfig.rateLimitBurst;
+            cloudTokenTime = simMillis;
+        }
+        else {
+            cloudTokens += earned;
+            cloudTokenTime += earned * 1000;
+        }
+        if (cloudTokens == 0) {
+            pub.succeeded = false;
+            rateLimited++;
+        }
+        else {
+            cloudTokens--;
+        }
+    }
+    pub.name = name;
+    pub.data = data ? data : "";
+    pub.flags = flags;
+    pub.cb = cb;
+    pub.context = context;
+    pending.push_back(pub);
+
+    publishAttempts++;
+    return true;
+}
+
+} // namespace
+
+//
+// Particle.h
+//
+LogLevel Logger::level = LOG_LEVEL_NONE;
+Logger Log("app");
+SystemClass System;
+CloudClass Particle;
+
+String String::format(const char *fmt, ...) {
+    char buf[512];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    return String(buf);
+}
+
+void Logger::log(LogLevel msgLevel, const char *fmt, va_list ap) const {
+    if (msgLevel < level) {
+        return;
+    }
+    const char *levelName = (msgLevel >= LOG_LEVEL_ERROR) ? "ERROR" : (msgLevel >= LOG_LEVEL_WARN) ? "WARN" : (msgLevel >= LOG_LEVEL_INFO) ? "INFO" : "TRACE";
+    fprintf(stderr, "%010lu [%s] %s: ", millis(), name, levelName);
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+}
+
+#define LOGGER_METHOD(method, msgLevel) \
+    void Logger::method(const char *fmt, ...) const { va_list ap; va_start(ap, fmt); log(msgLevel, fmt, ap); va_end(ap); }
+
+LOGGER_METHOD(trace, LOG_LEVEL_TRACE)
+LOGGER_METHOD(info, LOG_LEVEL_INFO)
+LOGGER_METHOD(warn, LOG_LEVEL_WARN)
+LOGGER_METHOD(error, LOG_LEVEL_ERROR)
+
+unsigned long millis() {
+    return simMillis;
+}
+
+void delay(unsigned long ms) {
+    simMillis += ms;
+}
+
+TimeClass Time;
+
+bool TimeClass::isValid() {
+    return true;
+}
+
+time_t TimeClass::now() {
+    // 2026-09-21, so timestamps look realistic
+    return 1790000000 + simMillis / 1000;
+}
+
+int os_mutex_recursive_create(os_mutex_recursive_t *mutex) {
+    *mutex = new std::recursive_mutex();
+    return 0;
+}
+
+int os_mutex_recursive_destroy(os_mutex_recursive_t mutex) {
+    delete mutex;
+    return 0;
+}
+
+void os_mutex_recursive_lock(os_mutex_recursive_t mutex) {
+    mutex->lock();
+}
+
+bool os_mutex_recursive_trylock(os_mutex_recursive_t mutex) {
+    return mutex->try_lock();
+}
+
+void os_mutex_recursive_unlock(os_mutex_recursive_t mutex) {
+    mutex->unlock();
+}
+
+struct HostThread {
+    std::thread thread;
+};
+
+int os_thread_create(os_thread_t *thread, const char *, os_thread_prio_t, os_thread_fn_t fun, void *thread_param, size_t) {
+    *thread = new HostThread();
+    (*thread)->thread = std::thread(fun, thread_param);
+    return 0;
+}
+
+int os_thread_join(os_thread_t thread) {
+    thread->thread.join();
+    delete thread;
+    return 0;
+}
+
+int os_thread_exit(os_thread_t) {
+    // The thread function returns right after this, which ends the std::thread
+    return 0;
+}
+
+struct HostSemaphore {
+    std::mutex mutex;
+    std::condition_variable cond;
+    unsigned count;
+    unsigned max;
+};
+
+int os_semaphore_create(os_semaphore_t *semaphore, unsigned max, unsigned initial) {
+    *semaphore = new HostSemaphore();
+    (*semaphore)->count = initial;
+    (*semaphore)->max = max;
+    return 0;
+}
+
+int os_semaphore_destroy(os_semaphore_t semaphore) {
+    delete semaphore;
+    return 0;
+}
+
+int os_semaphore_take(os_semaphore_t semaphore, system_tick_t timeout, bool) {
+    std::unique_lock<std::mutex> lock(semaphore->mutex);
+    auto available = [semaphore]() { return semaphore->count != 0; };
+    if (timeout == CONCURRENT_WAIT_FOREVER) {
+        semaphore->cond.wait(lock, available);
+    }
+    else
+    if (!semaphore->cond.wait_for(lock, std::chrono::milliseconds(timeout), available)) {
+        return 1;
+    }
+    semaphore->count--;
+    return 0;
+}
+
+int os_semaphore_give(os_semaphore_t semaphore, bool) {
+    std::lock_guard<std::mutex> lock(semaphore->mutex);
+    if (semaphore->count >= semaphore->max) {
+        return 1;
+    }
+    semaphore->count++;
+    semaphore->cond.notify_one();
+    return 0;
+}
+
+spark::feature::State system_thread_get_state(void *) {
+    return spark::feature::ENABLED;
+}
+
+bool SystemClass::on(system_event_t events, system_event_handler_t *handler) {
+    systemEventMask = events;
+    systemEventHandler = handler;
+    return true;
+}
+
+particle::Future<bool> CloudClass::publish(const char *name, const char *data, PublishFlags flags1, PublishFlags flags2) {
+    particle::Future<bool> future;
+    startPublish(name, data, flags1 | flags2, [future](bool succeeded, const char *, const char *, const void *) mutable {
+        future.complete(succeeded, succeeded);
+    }, nullptr);
+    return future;
+}
+
+bool CloudClass::connected() {
+    return cloudConnected;
+}
+
+void CloudClass::connect() {
+    HostSim::setConnected(true);
+}
+
+void CloudClass::disconnect() {
+    HostSim::setConnected(false);
+}
+
+//
+// BackgroundPublishRK.h
+//
+BackgroundPublishRK *BackgroundPublishRK::_instance;
+
+BackgroundPublishRK &BackgroundPublishRK::instance() {
+    if (!_instance) {
+        _instance = new BackgroundPublishRK();
+    }
+    return *_instance;
+}
+
+void BackgroundPublishRK::start() {
+}
+
+void BackgroundPublishRK::stop() {
+}
+
+bool BackgroundPublishRK::publish(const char *name, const char *data, PublishFlags flags, publish_completed_cb_t cb, const void *context) {
+    if (HostSim::getPublishesInFlight() != 0) {
+        // Only one publish at a time, like the real library
+        return false;
+    }
+    return startPublish(name, data, flags, cb, context);
+}
+
+//
+// HostSim.h
+//
+void HostSim::setMillis(unsigned long ms) {
+    simMillis = ms;
+}
+
+void HostSim::advanceMillis(unsigned long ms) {
+    simMillis += ms;
+}
+
+void HostSim::setCloudConfig(const CloudConfig &config) {
+    std::lock_guard<std::mutex> lock(cloudMutex);
+    cloudConfig = config;
+    rng.seed(config.seed);
+}
+
+const HostSim::CloudConfig &HostSim::getCloudConfig() {
+    return cloudConfig;
+}
+
+void HostSim::setConnected(bool connected) {
+    if (cloudConnected == connected) {
+        return;
+    }
+    if (!connected) {
+        fireSystemEvent(cloud_status, cloud_status_disconnecting);
+
+        std::lock_guard<std::mutex> lock(cloudMutex);
+        for(auto &pub : pending) {
+            pub.succeeded = false;
+        }
+    }
+    cloudConnected = connected;
+    if (connected) {
+        fireSystemEvent(cloud_status, cloud_status_connected);
+    }
+}
+
+bool HostSim::isConnected() {
+    return cloudConnected;
+}
+
+void HostSim::fireResetEvent() {
+    fireSystemEvent(reset, 0);
+}
+
+void HostSim::processCloud() {
+    std::vector<PendingPublish> completed;
+    {
+        std::lock_guard<std::mutex> lock(cloudMutex);
+        for(auto it = pending.begin(); it != pending.end(); ) {
+            if ((long)(simMillis - it->completeAtMs) >= 0 || !cloudConnected) {
+                if (it->succeeded) {
+                    cloudEvents.push_back(CloudEvent{it->name, it->data, it->flags.value(), simMillis});
+                }
+                else {
+                    publishFailures++;
+                }
+                completed.push_back(*it);
+                it = pending.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+    for(auto &pub : completed) {
+        if (pub.cb) {
+            pub.cb(pub.succeeded, pub.name.c_str(), pub.data.c_str(), pub.context);
+        }
+    }
+}
+
+size_t HostSim::getPublishesInFlight() {
+    std::lock_guard<std::mutex> lock(cloudMutex);
+    return pending.size();
+}
+
+std::vector<HostSim::CloudEvent> &HostSim::getCloudEvents() {
+    return cloudEvents;
+}
+
+unsigned long HostSim::getPublishAttempts() {
+    return publishAttempts;
+}
+
+unsigned long HostSim::getPublishFailures() {
+    return publishFailures;
+}
+
+unsigned long HostSim::getRateLimited() {
+    return rateLimited;
+}
+
+HostSim::FlashOps &HostSim::getFlashOps() {
+    return flashOps;
+}
+
+unsigned long HostSim::getHeapAllocs() {
+    return heapAllocs;
+}
+
+void HostSim::resetCounters() {
+    std::lock_guard<std::mutex> lock(cloudMutex);
+    cloudEvents.clear();
+    publishAttempts = 0;
+    publishFailures = 0;
+    rateLimited = 0;
+    flashOps = FlashOps();
+}
+
+void HostSim::removeTree(const char *path) {
+    DIR *dir = ::opendir(path);
+    if (dir) {
+        while(struct dirent *ent = ::readdir(dir)) {
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+                continue;
+            }
+            std::string child = std::string(path) + "/" + ent->d_name;
+            if (ent->d_type == DT_DIR) {
+                removeTree(child.c_str());
+            }
+            else {
+                ::unlink(child.c_str());
+            }
+        }
+        ::closedir(dir);
+        ::rmdir(path);
+    }
+}
+
+//
+// File system call counters. The library is linked with -Wl,--wrap=<function>
+// so calls from the library and the SequentialFile stand-in come here first.
+//
+#define COUNT_FLASH_OP(field) { std::lock_guard<std::mutex> lock(flashOpsMutex); flashOps.field++; }
+
+extern "C" {
+
+int __real_open(const char *path, int flags, ...);
+int __real_close(int fd);
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+off_t __real_lseek(int fd, off_t offset, int whence);
+int __real_fstat(int fd, struct stat *sb);
+int __real_stat(const char *path, struct stat *sb);
+int __real_unlink(const char *path);
+int __real_rename(const char *oldPath, const char *newPath);
+int __real_fsync(int fd);
+int __real_ftruncate(int fd, off_t length);
+DIR *__real_opendir(const char *path);
+
+int __wrap_open(const char *path, int flags, ...) {
+    COUNT_FLASH_OP(opens);
+    // The Device OS file system ignores the mode, so callers don't always pass
+    // one. Use a fixed mode so files are always readable on the host.
+    return __real_open(path, flags, 0666);
+}
+
+int __wrap_close(int fd) {
+    COUNT_FLASH_OP(closes);
+    return __real_close(fd);
+}
+
+ssize_t __wrap_read(int fd, void *buf, size_t count) {
+    ssize_t result = __real_read(fd, buf, count);
+    std::lock_guard<std::mutex> lock(flashOpsMutex);
+    flashOps.reads++;
+    if (result > 0) {
+        flashOps.bytesRead += result;
+    }
+    return result;
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t count) {
+    ssize_t result = __real_write(fd, buf, count);
+    std::lock_guard<std::mutex> lock(flashOpsMutex);
+    flashOps.writes++;
+    if (result > 0) {
+        flashOps.bytesWritten += result;
+    }
+    return result;
+}
+
+off_t __wrap_lseek(int fd, off_t offset, int whence) {
+    COUNT_FLASH_OP(seeks);
+    return __real_lseek(fd, offset, whence);
+}
+
+int __wrap_fstat(int fd, struct stat *sb) {
+    COUNT_FLASH_OP(stats);
+    return __real_fstat(fd, sb);
+}
+
+int __wrap_stat(const char *path, struct stat *sb) {
+    COUNT_FLASH_OP(stats);
+    return __real_stat(path, sb);
+}
+
+int __wrap_unlink(const char *path) {
+    COUNT_FLASH_OP(unlinks);
+    return __real_unlink(path);
+}
+
+int __wrap_rename(const char *oldPath, const char *newPath) {
+    COUNT_FLASH_OP(renames);
+    return __real_rename(oldPath, newPath);
+}
+
+int __wrap_fsync(int fd) {
+    COUNT_FLASH_OP(fsyncs);
+    return __real_fsync(fd);
+}
+
+int __wrap_ftruncate(int fd, off_t length) {
+    COUNT_FLASH_OP(truncates);
+    return __real_ftruncate(fd, length);
+}
+
+DIR *__wrap_opendir(const char *path) {
+    COUNT_FLASH_OP(dirScans);
+    return __real_opendir(path);
+}
+
+} // extern "C"
+
+// Count heap allocations. operator new[] and the nothrow variants call this by default.
+void *operator new(size_t size) {
+    heapAllocs++;
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
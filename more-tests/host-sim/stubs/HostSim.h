@@ -0,0 +1,116 @@
+#ifndef __HOSTSIM_H
+#define __HOSTSIM_H
+
+// Control interface for the host stand-ins in this directory. The simulator and
+// benchmark programs use this to drive virtual time, the simulated cloud
+// connection and to read back what was published and how many file system
+// operations were made.
+
+#include "Particle.h"
+
+#include <string>
+#include <vector>
+
+namespace HostSim {
+
+/**
+ * @brief An event as received by the simulated cloud
+ */
+struct CloudEvent {
+    std::string name;
+    std::string data;
+    uint8_t flags;
+    unsigned long receivedMs;
+};
+
+/**
+ * @brief Behavior of the simulated cloud
+ */
+struct CloudConfig {
+    unsigned long latencyMs = 300;      //!< Publish round trip time
+    unsigned long latencyJitterMs = 0;  //!< Random 0..jitter added to latencyMs
+    double failureRate = 0.0;           //!< Probability [0, 1] that a publish fails
+    uint32_t seed = 1;                  //!< Random seed, so runs are repeatable
+    unsigned rateLimitBurst = 0;        //!< If non-zero, publishes over one per second with this burst fail
+};
+
+/**
+ * @brief Counters of file system calls made through the wrapped POSIX functions
+ */
+struct FlashOps {
+    unsigned long opens = 0;
+    unsigned long closes = 0;
+    unsigned long reads = 0;
+    unsigned long writes = 0;
+    unsigned long bytesRead = 0;
+    unsigned long bytesWritten = 0;
+    unsigned long seeks = 0;
+    unsigned long stats = 0;
+    unsigned long unlinks = 0;
+    unsigned long renames = 0;
+    unsigned long fsyncs = 0;
+    unsigned long truncates = 0;
+    unsigned long dirScans = 0;
+};
+
+void setMillis(unsigned long ms);
+void advanceMillis(unsigned long ms);
+
+void setCloudConfig(const CloudConfig &config);
+const CloudConfig &getCloudConfig();
+
+/**
+ * @brief Connect or disconnect the simulated cloud
+ *
+ * Disconnecting fires the cloud_status_disconnecting system event and fails
+ * any publish in progress, like Device OS does.
+ */
+void setConnected(bool connected);
+bool isConnected();
+
+/**
+ * @brief Fire the reset system event, as before a System.reset()
+ */
+void fireResetEvent();
+
+/**
+ * @brief Complete any simulated publishes whose round trip time has elapsed
+ *
+ * Called by the simulator after each advanceMillis(). Completion callbacks
+ * run on the calling thread.
+ */
+void processCloud();
+
+/**
+ * @brief Number of publishes that have been started but not completed
+ */
+size_t getPublishesInFlight();
+
+std::vector<CloudEvent> &getCloudEvents();
+unsigned long getPublishAttempts();
+unsigned long getPublishFailures();
+
+/**
+ * @brief Number of publishes that failed because of CloudConfig::rateLimitBurst
+ */
+unsigned long getRateLimited();
+
+FlashOps &getFlashOps();
+
+/**
+ * @brief Number of calls to operator new (including new[]) since the program started
+ *
+ * Not reset by resetCounters(); take the difference around the code being measured.
+ */
+unsigned long getHeapAllocs();
+
+void resetCounters();
+
+/**
+ * @brief Remove a directory and everything in it (used to prepare temp directories)
+ */
+void removeTree(const char *path);
+
+} // namespace HostSim
+
+#endif /* __HOSTSIM_H */
@@ -0,0 +1,307 @@
+#ifndef __PARTICLE_HOST_STUB_H
+#define __PARTICLE_HOST_STUB_H
+
+// Minimal host (Linux) stand-in for the parts of the Particle Device OS API that
+// PublishQueuePosixRK uses. This is not a general purpose emulator; it only
+// implements what the library and the simulator harness in this directory need.
+//
+// Time is virtual: millis() only advances when the simulator calls
+// HostSim::advanceMillis(), which makes runs deterministic and lets a simulated
+// 30 second backoff complete instantly.
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+
+namespace particle {
+namespace protocol {
+    const size_t MAX_EVENT_NAME_LENGTH = 64;
+    const size_t MAX_EVENT_DATA_LENGTH = 1024;
+}
+}
+
+//
+// PublishFlags
+//
+enum PublishFlag : uint8_t {
+    PUBLIC = 0x00,
+    PRIVATE = 0x01,
+    NO_ACK = 0x02,
+    WITH_ACK = 0x08
+};
+
+class PublishFlags {
+public:
+    typedef uint8_t ValueType;
+
+    PublishFlags() : val(0) {}
+    PublishFlags(PublishFlag flag) : val(flag) {}
+
+    static PublishFlags fromUnderlying(ValueType value) { PublishFlags f; f.val = value; return f; }
+    ValueType value() const { return val; }
+
+    PublishFlags operator|(PublishFlags other) const { return fromUnderlying(val | other.val); }
+    PublishFlags operator&(PublishFlags other) const { return fromUnderlying(val & other.val); }
+    bool operator==(PublishFlags other) const { return val == other.val; }
+    bool operator!=(PublishFlags other) const { return val != other.val; }
+    explicit operator bool() const { return val != 0; }
+
+private:
+    ValueType val;
+};
+
+inline PublishFlags operator|(PublishFlag a, PublishFlag b) { return PublishFlags(a) | PublishFlags(b); }
+
+//
+// String (only the subset used by SequentialFile and the library)
+//
+class String {
+public:
+    String() {}
+    String(const char *s) : str(s ? s : "") {}
+    String(const std::string &s) : str(s) {}
+
+    const char *c_str() const { return str.c_str(); }
+    operator const char *() const { return str.c_str(); }
+    unsigned int length() const { return (unsigned int) str.length(); }
+
+    String &operator+=(const char *s) { str += s; return *this; }
+    String &operator+=(const String &s) { str += s.str; return *this; }
+    String operator+(const char *s) const { return String(str + s); }
+    String operator+(const String &s) const { return String(str + s.str); }
+    bool operator==(const char *s) const { return str == s; }
+
+    bool endsWith(const char *s) const { size_t n = strlen(s); return str.length() >= n && str.compare(str.length() - n, n, s) == 0; }
+    void remove(unsigned int index) { str.erase(index); }
+    char charAt(unsigned int index) const { return index < str.length() ? str[index] : 0; }
+
+    static String format(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+private:
+    std::string str;
+};
+
+//
+// Future (only what Particle.publish() returns)
+//
+namespace particle {
+
+class Error {
+public:
+    enum Type {
+        NONE = 0,
+        UNKNOWN = -100
+    };
+
+    Error(Type type = UNKNOWN) : t(type) {}
+    Type type() const { return t; }
+
+private:
+    Type t;
+};
+
+template<typename T>
+class Future {
+public:
+    typedef std::function<void(const T &)> OnSuccessCallback;
+    typedef std::function<void(Error)> OnErrorCallback;
+
+    Future() : state(std::make_shared<State>()) {}
+
+    bool isDone() const { std::lock_guard<std::mutex> lock(state->mutex); return state->done; }
+    bool isSucceeded() const { std::lock_guard<std::mutex> lock(state->mutex); return state->done && state->succeeded; }
+    bool isFailed() const { std::lock_guard<std::mutex> lock(state->mutex); return state->done && !state->succeeded; }
+
+    // Called immediately if already complete, like the Device OS implementation
+    Future &onSuccess(OnSuccessCallback cb) {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        if (!state->done) {
+            state->onSuccess = cb;
+        }
+        else if (state->succeeded) {
+            lock.unlock();
+            cb(state->value);
+        }
+        return *this;
+    }
+    Future &onError(OnErrorCallback cb) {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        if (!state->done) {
+            state->onError = cb;
+        }
+        else if (!state->succeeded) {
+            lock.unlock();
+            cb(Error());
+        }
+        return *this;
+    }
+
+    // Host only: complete the operation, calling the callbacks
+    void complete(bool succeeded, const T &value) {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->done = true;
+        state->succeeded = succeeded;
+        state->value = value;
+        OnSuccessCallback successCb = state->onSuccess;
+        OnErrorCallback errorCb = state->onError;
+        lock.unlock();
+        if (succeeded && successCb) {
+            successCb(value);
+        }
+        if (!succeeded && errorCb) {
+            errorCb(Error());
+        }
+    }
+
+private:
+    struct State {
+        std::mutex mutex;
+        bool done = false;
+        bool succeeded = false;
+        T value = T();
+        OnSuccessCallback onSuccess;
+        OnErrorCallback onError;
+    };
+    std::shared_ptr<State> state;
+};
+
+}
+
+//
+// Logging
+//
+typedef enum {
+    LOG_LEVEL_ALL = 1,
+    LOG_LEVEL_TRACE = 1,
+    LOG_LEVEL_INFO = 30,
+    LOG_LEVEL_WARN = 40,
+    LOG_LEVEL_ERROR = 50,
+    LOG_LEVEL_NONE = 70
+} LogLevel;
+
+class Logger {
+public:
+    explicit Logger(const char *name) : name(name) {}
+
+    void trace(const char *fmt, ...) const __attribute__((format(printf, 2, 3)));
+    void info(const char *fmt, ...) const __attribute__((format(printf, 2, 3)));
+    void warn(const char *fmt, ...) const __attribute__((format(printf, 2, 3)));
+    void error(const char *fmt, ...) const __attribute__((format(printf, 2, 3)));
+
+    void log(LogLevel level, const char *fmt, va_list ap) const;
+
+    static LogLevel level; //!< Messages below this level are discarded (default: LOG_LEVEL_NONE)
+
+private:
+    const char *name;
+};
+
+extern Logger Log;
+
+//
+// Timing
+//
+unsigned long millis();
+void delay(unsigned long ms);
+
+//
+// Time: always valid, a fixed date plus the virtual millis()
+//
+class TimeClass {
+public:
+    bool isValid();
+    time_t now();
+};
+extern TimeClass Time;
+
+//
+// Threads and mutexes
+//
+typedef std::recursive_mutex *os_mutex_recursive_t;
+typedef std::mutex *os_mutex_t;
+
+int os_mutex_recursive_create(os_mutex_recursive_t *mutex);
+int os_mutex_recursive_destroy(os_mutex_recursive_t mutex);
+void os_mutex_recursive_lock(os_mutex_recursive_t mutex);
+bool os_mutex_recursive_trylock(os_mutex_recursive_t mutex);
+void os_mutex_recursive_unlock(os_mutex_recursive_t mutex);
+
+typedef uint32_t system_tick_t;
+const system_tick_t CONCURRENT_WAIT_FOREVER = (system_tick_t)-1;
+
+struct HostThread;
+typedef HostThread *os_thread_t;
+typedef void (*os_thread_fn_t)(void *param);
+typedef uint8_t os_thread_prio_t;
+const os_thread_prio_t OS_THREAD_PRIORITY_DEFAULT = 2;
+
+int os_thread_create(os_thread_t *thread, const char *name, os_thread_prio_t priority, os_thread_fn_t fun, void *thread_param, size_t stack_size);
+int os_thread_join(os_thread_t thread);
+int os_thread_exit(os_thread_t thread);
+
+// Timeouts are real (wall clock) milliseconds, not virtual time
+struct HostSemaphore;
+typedef HostSemaphore *os_semaphore_t;
+
+int os_semaphore_create(os_semaphore_t *semaphore, unsigned max, unsigned initial);
+int os_semaphore_destroy(os_semaphore_t semaphore);
+int os_semaphore_take(os_semaphore_t semaphore, system_tick_t timeout, bool reserved);
+int os_semaphore_give(os_semaphore_t semaphore, bool reserved);
+
+#define WITH_LOCK(lock) for (std::unique_lock<typename std::remove_reference<decltype(lock)>::type> __withLock(lock); __withLock; __withLock.unlock())
+
+//
+// System
+//
+typedef uint64_t system_event_t;
+typedef void (system_event_handler_t)(system_event_t event, int param);
+
+const system_event_t reset = 0x0200;
+const system_event_t cloud_status = 0x0080;
+
+enum {
+    cloud_status_disconnected = 0,
+    cloud_status_connecting = 1,
+    cloud_status_connected = 8,
+    cloud_status_disconnecting = 9
+};
+
+namespace spark {
+namespace feature {
+    enum State {
+        DISABLED,
+        ENABLED
+    };
+}
+}
+
+spark::feature::State system_thread_get_state(void *reserved);
+
+class SystemClass {
+public:
+    bool on(system_event_t events, system_event_handler_t *handler);
+};
+extern SystemClass System;
+
+class CloudClass {
+public:
+    // Any number of publishes can be in progress; completed by HostSim::processCloud()
+    particle::Future<bool> publish(const char *name, const char *data, PublishFlags flags1, PublishFlags flags2 = PublishFlags());
+
+    bool connected();
+    void connect();
+    void disconnect();
+};
+extern CloudClass Particle;
+
+#endif /* __PARTICLE_HOST_STUB_H */
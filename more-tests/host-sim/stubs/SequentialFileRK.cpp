@@ -0,0 +1,142 @@
+#include "SequentialFileRK.h"
+
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static Logger _log("app.seqfile");
+
+SequentialFile::SequentialFile() {
+}
+
+SequentialFile::~SequentialFile() {
+}
+
+SequentialFile &SequentialFile::withDirPath(const char *dirPath) {
+    this->dirPath = dirPath;
+    if (this->dirPath.length() > 1 && this->dirPath.endsWith("/")) {
+        this->dirPath.remove(this->dirPath.length() - 1);
+    }
+    return *this;
+}
+
+SequentialFile &SequentialFile::withFilenameExtension(const char *ext) {
+    filenameExtension = ext;
+    return *this;
+}
+
+bool SequentialFile::scanDir(void) {
+    if (!createDirIfNecessary(dirPath)) {
+        return false;
+    }
+
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    queue.clear();
+    lastFileNum = 0;
+
+    DIR *dir = opendir(dirPath);
+    if (!dir) {
+        return false;
+    }
+    while(struct dirent *ent = readdir(dir)) {
+        if (ent->d_type != DT_REG) {
+            continue;
+        }
+        int fileNum;
+        char ext[32];
+        int count = sscanf(ent->d_name, "%08d.%31s", &fileNum, ext);
+        if (count < 1 || fileNum <= 0 || strlen(ent->d_name) < 8) {
+            continue;
+        }
+        if (filenameExtension.length() == 0 ? (count != 1 || strlen(ent->d_name) != 8) : (count != 2 || strcmp(ext, filenameExtension) != 0)) {
+            continue;
+        }
+        if (fileNum > lastFileNum) {
+            lastFileNum = fileNum;
+        }
+        queue.push_back(fileNum);
+    }
+    closedir(dir);
+
+    std::sort(queue.begin(), queue.end());
+    _log.trace("scanDir lastFileNum=%d queueLen=%u", lastFileNum, (unsigned) queue.size());
+    return true;
+}
+
+int SequentialFile::reserveFile(void) {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    return ++lastFileNum;
+}
+
+void SequentialFile::addFileToQueue(int fileNum) {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    queue.push_back(fileNum);
+}
+
+int SequentialFile::getFileFromQueue(bool remove) {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    if (queue.empty()) {
+        return 0;
+    }
+    int fileNum = queue.front();
+    if (remove) {
+        queue.pop_front();
+    }
+    return fileNum;
+}
+
+int SequentialFile::getQueueLen() const {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    return (int) queue.size();
+}
+
+String SequentialFile::getNameForFileNum(int fileNum, const char *overrideExt) {
+    const char *ext = overrideExt ? overrideExt : filenameExtension.c_str();
+    if (ext[0]) {
+        return String::format("%08d.%s", fileNum, ext);
+    }
+    else {
+        return String::format("%08d", fileNum);
+    }
+}
+
+String SequentialFile::getPathForFileNum(int fileNum, const char *overrideExt) {
+    return dirPath + "/" + getNameForFileNum(fileNum, overrideExt);
+}
+
+void SequentialFile::removeFileNum(int fileNum, bool allExtensions) {
+    unlink(getPathForFileNum(fileNum));
+}
+
+void SequentialFile::removeAll(bool removeDir, const char *excludeName) {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+
+    DIR *dir = opendir(dirPath);
+    if (dir) {
+        while(struct dirent *ent = readdir(dir)) {
+            if (ent->d_type != DT_REG) {
+                continue;
+            }
+            if (excludeName && strcmp(ent->d_name, excludeName) == 0) {
+                continue;
+            }
+            String path = dirPath + "/" + ent->d_name;
+            unlink(path);
+        }
+        closedir(dir);
+    }
+    if (removeDir) {
+        rmdir(dirPath);
+    }
+    queue.clear();
+}
+
+bool SequentialFile::createDirIfNecessary(const char *path) {
+    struct stat sb;
+    if (stat(path, &sb) == 0) {
+        return S_ISDIR(sb.st_mode);
+    }
+    return mkdir(path, 0777) == 0;
+}
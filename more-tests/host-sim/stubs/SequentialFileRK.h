@@ -0,0 +1,45 @@
+#ifndef __SEQUENTIALFILERK_H
+#define __SEQUENTIALFILERK_H
+
+// Host stand-in for SequentialFileRK. Implements the subset of the API that
+// PublishQueuePosixRK uses, on top of the host POSIX file system, with the same
+// naming (8-digit zero-padded file numbers) and queue semantics.
+
+#include "Particle.h"
+
+#include <deque>
+
+class SequentialFile {
+public:
+    SequentialFile();
+    virtual ~SequentialFile();
+
+    SequentialFile &withDirPath(const char *dirPath);
+    const char *getDirPath() const { return dirPath.c_str(); };
+
+    SequentialFile &withFilenameExtension(const char *ext);
+
+    bool scanDir(void);
+
+    int reserveFile(void);
+    void addFileToQueue(int fileNum);
+    int getFileFromQueue(bool remove = true);
+    int getQueueLen() const;
+
+    String getNameForFileNum(int fileNum, const char *overrideExt = NULL);
+    String getPathForFileNum(int fileNum, const char *overrideExt = NULL);
+
+    void removeFileNum(int fileNum, bool allExtensions);
+    void removeAll(bool removeDir, const char *excludeName = NULL);
+
+    bool createDirIfNecessary(const char *path);
+
+protected:
+    String dirPath;
+    String filenameExtension;
+    int lastFileNum = 0;
+    std::deque<int> queue;
+    mutable std::recursive_mutex mutex;
+};
+
+#endif /* __SEQUENTIALFILERK_H */
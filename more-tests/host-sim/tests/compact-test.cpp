@@ -0,0 +1,309 @@
+// Tests of PublishQueueCompact on a Linux host
+//
+// Covers the varints, the name table and the compact event encoding,
+// including the edge cases that the simulator does not reach: empty and
+// maximum size events, deferred records containing null bytes, a full name
+// table, and invalid or truncated input, such as a name index past the end
+// of the name table, which must be rejected without reading past it.
+//
+// The exit code is non-zero if any check failed, which is how CTest uses it.
+
+#include "PublishQueueCompact.h"
+#include "PublishQueuePosixRK.h"
+#include "HostSim.h"
+
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+
+static int errors = 0;
+
+#define CHECK(cond) do { if (!(cond)) { fprintf(stderr, "check failed: %s line %d: %s\n", __func__, __LINE__, #cond); errors++; } } while(0)
+
+static const char * const TEST_DIR = "/tmp/pubq-compact-test";
+
+/**
+ * @brief PublishQueueCompact with the internal methods exposed
+ */
+class TestCompact : public PublishQueueCompact {
+public:
+    using PublishQueueCompact::Fields;
+    using PublishQueueCompact::parse;
+    using PublishQueueCompact::internName;
+    using PublishQueueCompact::putVarint;
+    using PublishQueueCompact::getVarint;
+};
+
+/**
+ * @brief Make an event in a buffer of exactly its size, so reading past it is caught by the address sanitizer
+ *
+ * @param data The event data. If formatId is not 0, the record length byte followed by the record.
+ */
+static std::vector<uint8_t> makeEvent(const char *name, const std::string &data, uint8_t formatId = 0, uint32_t timestamp = 0, uint32_t expires = 0) {
+    std::vector<uint8_t> buf(PublishQueueEvent::getSize(data.size()));
+    PublishQueueEvent *event = (PublishQueueEvent *) buf.data();
+    event->expires = expires;
+    event->timestamp = timestamp;
+    event->formatId = formatId;
+    event->flags = PRIVATE | WITH_ACK;
+    strcpy(event->eventName, name);
+    memcpy(event->eventData, data.data(), data.size());
+    event->eventData[data.size()] = 0;
+    return buf;
+}
+
+/**
+ * @brief Encode an event and decode it again, returning the encoded size, or 0 if it failed
+ */
+static size_t roundTrip(TestCompact &compact, const std::vector<uint8_t> &buf) {
+    const PublishQueueEvent *event = (const PublishQueueEvent *) buf.data();
+    size_t storedSize;
+    const uint8_t *encoded = compact.encodeEvent(event, storedSize);
+    if (!encoded) {
+        return 0;
+    }
+    std::vector<uint8_t> stored(encoded, encoded + storedSize);
+
+    size_t eventSize = compact.getDecodedSize(stored.data(), stored.size());
+    if (eventSize != buf.size()) {
+        return 0;
+    }
+    std::vector<uint8_t> decodedBuf(eventSize);
+    PublishQueueEvent *decoded = (PublishQueueEvent *) decodedBuf.data();
+    if (!compact.decodeEvent(stored.data(), stored.size(), decoded, eventSize)) {
+        return 0;
+    }
+    if (decoded->expires != event->expires || decoded->timestamp != event->timestamp || decoded->formatId != event->formatId ||
+        decoded->flags != event->flags || strcmp(decoded->eventName, event->eventName) != 0 ||
+        decoded->getDataLen() != event->getDataLen() || memcmp(decoded->eventData, event->eventData, event->getDataLen() + 1) != 0) {
+        return 0;
+    }
+    return storedSize;
+}
+
+/**
+ * @brief Start with an empty name table in TEST_DIR
+ */
+static void resetDir(TestCompact &compact) {
+    HostSim::removeTree(TEST_DIR);
+    mkdir(TEST_DIR, 0777);
+    compact.withDirPath(TEST_DIR).withEnabled(true).load(true);
+}
+
+static void testVarint() {
+    const uint32_t values[] = { 0, 1, 127, 128, 16383, 16384, 2097151, 2097152, 268435455, 268435456, 0xffffffff };
+    const size_t lengths[] = { 1, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5 };
+    for(size_t ii = 0; ii < sizeof(values) / sizeof(values[0]); ii++) {
+        uint8_t buf[5];
+        size_t len = TestCompact::putVarint(buf, values[ii]);
+        CHECK(len == lengths[ii]);
+
+        size_t offset = 0;
+        uint32_t value;
+        CHECK(TestCompact::getVarint(buf, len, offset, value) && value == values[ii] && offset == len);
+
+        // Truncated
+        for(size_t truncated = 0; truncated < len; truncated++) {
+            offset = 0;
+            CHECK(!TestCompact::getVarint(buf, truncated, offset, value));
+        }
+    }
+
+    // Starting at an offset, which is updated to the byte after it
+    const uint8_t twoValues[] = { 0x05, 0x80, 0x01 };
+    size_t offset = 0;
+    uint32_t value;
+    CHECK(TestCompact::getVarint(twoValues, sizeof(twoValues), offset, value) && value == 5 && offset == 1);
+    CHECK(TestCompact::getVarint(twoValues, sizeof(twoValues), offset, value) && value == 128 && offset == 3);
+    CHECK(!TestCompact::getVarint(twoValues, sizeof(twoValues), offset, value));
+
+    // More than 32 bits, either in the 5th byte or with a 6th byte
+    const uint8_t over[] = { 0xff, 0xff, 0xff, 0xff, 0x1f };
+    offset = 0;
+    CHECK(!TestCompact::getVarint(over, sizeof(over), offset, value));
+    const uint8_t six[] = { 0x80, 0x80, 0x80, 0x80, 0x80, 0x00 };
+    offset = 0;
+    CHECK(!TestCompact::getVarint(six, sizeof(six), offset, value));
+}
+
+static void testNameTable() {
+    TestCompact compact;
+    resetDir(compact);
+
+    CHECK(compact.internName("temp", 4) == 0);
+    CHECK(compact.internName("hum", 3) == 1);
+    CHECK(compact.internName("temp", 4) == 0);
+
+    // A prefix of a name, or a name that has it as a prefix, is a different name
+    CHECK(compact.internName("te", 2) == 2);
+    CHECK(compact.internName("temps", 5) == 3);
+
+    // Only nameLen bytes of the name are used
+    CHECK(compact.internName("humidity", 3) == 1);
+
+    std::string longName(particle::protocol::MAX_EVENT_NAME_LENGTH, 'n');
+    CHECK(compact.internName(longName.c_str(), longName.size()) == 4);
+    CHECK(compact.getNumNames() == 5);
+
+    // The names are read back in the same order
+    TestCompact loaded;
+    loaded.withDirPath(TEST_DIR).withEnabled(true).load(false);
+    CHECK(loaded.getNumNames() == 5);
+    CHECK(loaded.internName("temps", 5) == 3);
+    CHECK(loaded.internName(longName.c_str(), longName.size()) == 4);
+
+    // Until it's full
+    for(size_t ii = compact.getNumNames(); ii < PublishQueueCompact::MAX_NAMES; ii++) {
+        std::string name = "name" + std::to_string(ii);
+        CHECK(compact.internName(name.c_str(), name.size()) == (int) ii);
+    }
+    CHECK(compact.internName("another", 7) == -1);
+    CHECK(compact.internName("temp", 4) == 0);
+
+    // A partially appended name is removed when the table is read
+    {
+        FILE *fp = fopen((std::string(TEST_DIR) + "/" + PublishQueueCompact::NAME_TABLE_NAME).c_str(), "ab");
+        fwrite("\x05ala", 1, 4, fp);
+        fclose(fp);
+    }
+    loaded.load(false);
+    CHECK(loaded.getNumNames() == PublishQueueCompact::MAX_NAMES);
+
+    // Names can't be written, so they're stored in each event instead
+    TestCompact noDir;
+    noDir.withDirPath("/tmp/pubq-compact-test-missing/queue").withEnabled(true);
+    CHECK(noDir.internName("temp", 4) == -1);
+    CHECK(noDir.getNumNames() == 0);
+}
+
+static void testEncode() {
+    TestCompact compact;
+    resetDir(compact);
+
+    // Not enabled
+    TestCompact disabled;
+    std::vector<uint8_t> simple = makeEvent("temp", "21.5");
+    size_t storedSize = 0;
+    CHECK(disabled.encodeEvent((const PublishQueueEvent *) simple.data(), storedSize) == NULL);
+
+    // The flags byte, the name index and the data
+    CHECK(roundTrip(compact, simple) == 1 + 1 + 4);
+
+    // Empty data
+    CHECK(roundTrip(compact, makeEvent("temp", "")) == 1 + 1);
+
+    // The largest name and data
+    std::string longName(particle::protocol::MAX_EVENT_NAME_LENGTH, 'n');
+    std::string maxData(particle::protocol::MAX_EVENT_DATA_LENGTH, 'd');
+    CHECK(roundTrip(compact, makeEvent(longName.c_str(), maxData)) != 0);
+
+    // With a timestamp and expiry
+    CHECK(roundTrip(compact, makeEvent("temp", "21.5", 0, 1700000000, 1700000060)) == 1 + 4 + 1 + 1 + 4);
+    CHECK(roundTrip(compact, makeEvent("temp", "21.5", 0, 0, 0xffffffff)) != 0);
+
+    // An expiry before the timestamp can't be stored
+    std::vector<uint8_t> expired = makeEvent("temp", "21.5", 0, 1700000000, 1600000000);
+    CHECK(compact.encodeEvent((const PublishQueueEvent *) expired.data(), storedSize) == NULL);
+
+    // A deferred record, which can contain null bytes, including an empty record
+    std::string record("\x00\x01\x00\xff\x00", 5);
+    CHECK(roundTrip(compact, makeEvent("reading", std::string(1, (char) record.size()) + record, 7)) == 1 + 1 + 1 + 1 + record.size());
+    CHECK(roundTrip(compact, makeEvent("reading", std::string(1, 0), 7)) != 0);
+    std::string maxRecord(PublishQueuePosix::MAX_RECORD_SIZE, '\0');
+    CHECK(roundTrip(compact, makeEvent("reading", std::string(1, (char) maxRecord.size()) + maxRecord, 255)) != 0);
+
+    // With the names stored in the events
+    TestCompact noDir;
+    noDir.withDirPath("/tmp/pubq-compact-test-missing/queue").withEnabled(true);
+    CHECK(roundTrip(noDir, simple) == 1 + 1 + 4 + 4);
+    CHECK(roundTrip(noDir, makeEvent(longName.c_str(), maxData, 0, 1700000000, 0xffffffff)) == PublishQueueCompact::MAX_STORED_SIZE - 1);
+}
+
+static void testDecode() {
+    TestCompact compact;
+    resetDir(compact);
+    TestCompact::Fields fields;
+
+    // Valid encoded events, checked against the fields
+    std::vector<uint8_t> event = makeEvent("temp", "21.5", 0, 1700000000, 1700000060);
+    size_t storedSize;
+    const uint8_t *encoded = compact.encodeEvent((const PublishQueueEvent *) event.data(), storedSize);
+    CHECK(encoded != NULL);
+    std::vector<uint8_t> stored(encoded, encoded + storedSize);
+    CHECK(compact.parse(stored.data(), stored.size(), fields));
+    CHECK(fields.timestamp == 1700000000 && fields.expires == 1700000060 && fields.formatId == 0);
+    CHECK(fields.nameLen == 4 && memcmp(fields.name, "temp", 4) == 0 && fields.dataLen == 4 && memcmp(fields.data, "21.5", 4) == 0);
+
+    // Truncated anywhere before the data
+    for(size_t len = 0; len < stored.size() - 4; len++) {
+        std::vector<uint8_t> truncated(stored.begin(), stored.begin() + len);
+        CHECK(!compact.parse(truncated.data(), truncated.size(), fields));
+        CHECK(compact.getDecodedSize(truncated.data(), truncated.size()) == 0);
+    }
+
+    // A name index past the end of the name table, which a different table would have
+    const uint8_t pastTable[] = { PublishQueueCompact::FLAG_NAME_INDEX, 0x01, 'x' };
+    CHECK(!compact.parse(pastTable, sizeof(pastTable), fields));
+    const uint8_t farPastTable[] = { PublishQueueCompact::FLAG_NAME_INDEX, 0xff, 0xff, 0xff, 0xff, 0x0f, 'x' };
+    CHECK(!compact.parse(farPastTable, sizeof(farPastTable), fields));
+    TestCompact emptyTable;
+    CHECK(!emptyTable.parse(stored.data(), stored.size(), fields));
+
+    // A name stored in the event that is empty, too long, past the end, or contains a null
+    const uint8_t validName[] = { 0x00, 0x02, 'a', 'b', 'x' };
+    CHECK(compact.parse(validName, sizeof(validName), fields) && fields.nameLen == 2 && fields.dataLen == 1);
+    const uint8_t emptyName[] = { 0x00, 0x00, 'x' };
+    CHECK(!compact.parse(emptyName, sizeof(emptyName), fields));
+    std::vector<uint8_t> longName = { 0x00, (uint8_t) (particle::protocol::MAX_EVENT_NAME_LENGTH + 1) };
+    longName.resize(longName.size() + particle::protocol::MAX_EVENT_NAME_LENGTH + 1, 'n');
+    CHECK(!compact.parse(longName.data(), longName.size(), fields));
+    const uint8_t pastEnd[] = { 0x00, 0x05, 'a', 'b' };
+    CHECK(!compact.parse(pastEnd, sizeof(pastEnd), fields));
+    const uint8_t nullName[] = { 0x00, 0x02, 'a', 0x00, 'x' };
+    CHECK(!compact.parse(nullName, sizeof(nullName), fields));
+
+    // A null byte in the data, and a format of 0
+    const uint8_t nullData[] = { 0x00, 0x01, 'a', 'x', 0x00 };
+    CHECK(!compact.parse(nullData, sizeof(nullData), fields));
+    const uint8_t formatZero[] = { PublishQueueCompact::FLAG_FORMAT, 0x00, 0x01, 'a', 0x00 };
+    CHECK(!compact.parse(formatZero, sizeof(formatZero), fields));
+
+    // A deferred record whose length byte does not match, or without a length byte
+    const uint8_t record[] = { PublishQueueCompact::FLAG_FORMAT, 0x07, 0x01, 'a', 0x02, 0x00, 0x00 };
+    CHECK(compact.parse(record, sizeof(record), fields) && fields.formatId == 7 && fields.dataLen == 3);
+    const uint8_t shortRecord[] = { PublishQueueCompact::FLAG_FORMAT, 0x07, 0x01, 'a', 0x03, 0x00, 0x00 };
+    CHECK(!compact.parse(shortRecord, sizeof(shortRecord), fields));
+    const uint8_t longRecord[] = { PublishQueueCompact::FLAG_FORMAT, 0x07, 0x01, 'a', 0x01, 0x00, 0x00 };
+    CHECK(!compact.parse(longRecord, sizeof(longRecord), fields));
+    const uint8_t noRecord[] = { PublishQueueCompact::FLAG_FORMAT, 0x07, 0x01, 'a' };
+    CHECK(!compact.parse(noRecord, sizeof(noRecord), fields));
+
+    // Data longer than an event can have
+    std::vector<uint8_t> tooLong = { 0x00, 0x01, 'a' };
+    tooLong.resize(tooLong.size() + particle::protocol::MAX_EVENT_DATA_LENGTH + 1, 'd');
+    CHECK(!compact.parse(tooLong.data(), tooLong.size(), fields));
+
+    // decodeEvent() only fills in an event of the size from getDecodedSize()
+    size_t eventSize = compact.getDecodedSize(stored.data(), stored.size());
+    CHECK(eventSize == event.size());
+    std::vector<uint8_t> decoded(eventSize + 1);
+    CHECK(!compact.decodeEvent(stored.data(), stored.size(), (PublishQueueEvent *) decoded.data(), eventSize + 1));
+    CHECK(!compact.decodeEvent(stored.data(), stored.size(), (PublishQueueEvent *) decoded.data(), eventSize - 1));
+}
+
+int main(int argc, char **argv) {
+    testVarint();
+    testNameTable();
+    testEncode();
+    testDecode();
+
+    HostSim::removeTree(TEST_DIR);
+
+    if (errors) {
+        fprintf(stderr, "%d checks failed\n", errors);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,244 @@
+// Tests of PublishQueueCompress on a Linux host
+//
+// Covers the LZSS stream, the Z85 encoding and the cloud encoding built from
+// them, including the edge cases that the simulator does not reach: empty
+// and maximum size input, overlapping matches, a different dictionary, and
+// invalid or truncated input, which must be rejected without reading past it.
+//
+// The exit code is non-zero if any check failed, which is how CTest uses it.
+
+#include "PublishQueueCompress.h"
+#include "PublishQueuePosixRK.h"
+
+#include <string>
+#include <vector>
+
+static int errors = 0;
+
+#define CHECK(cond) do { if (!(cond)) { fprintf(stderr, "check failed: %s line %d: %s\n", __func__, __LINE__, #cond); errors++; } } while(0)
+
+/**
+ * @brief Compress data and decompress it again, returning the compressed size, or 0 if it failed
+ */
+static size_t roundTrip(PublishQueueCompress &compressor, const std::string &data) {
+    std::vector<uint8_t> stream(PublishQueueCompress::STREAM_HEADER_SIZE + data.size() + data.size() / 8 + 1);
+    size_t len = compressor.compress(data.data(), data.size(), stream.data(), stream.size());
+    if (len < PublishQueueCompress::STREAM_HEADER_SIZE || PublishQueueCompress::getDecodedSize(stream.data(), len) != data.size()) {
+        return 0;
+    }
+
+    // Exactly the decoded size, so reading or writing past it is caught by the address sanitizer
+    std::vector<uint8_t> decoded(data.size());
+    if (!compressor.decompress(stream.data(), len, decoded.data(), decoded.size()) || (data.size() && memcmp(decoded.data(), data.data(), data.size()) != 0)) {
+        return 0;
+    }
+    return len;
+}
+
+static void testCompress() {
+    PublishQueueCompress compressor;
+    uint8_t buf[64];
+
+    // Not enabled until init()
+    CHECK(compressor.compress("abcabcabc", 9, buf, sizeof(buf)) == 0);
+    CHECK(compressor.init());
+
+    // Empty input is just the stream header
+    CHECK(roundTrip(compressor, "") == PublishQueueCompress::STREAM_HEADER_SIZE);
+    CHECK(roundTrip(compressor, "a") != 0);
+    CHECK(roundTrip(compressor, "ab") != 0);
+
+    // A run is a match that overlaps the bytes it produces
+    std::string run(200, 'x');
+    size_t len = roundTrip(compressor, run);
+    CHECK(len != 0 && len < 40);
+
+    std::string pattern;
+    for(int ii = 0; ii < 100; ii++) {
+        pattern += "abc";
+    }
+    CHECK(roundTrip(compressor, pattern) != 0);
+
+    // Bytes that do not repeat, including null bytes, are stored as literals
+    std::string bytes;
+    for(int ii = 0; ii < 256; ii++) {
+        bytes += (char) ii;
+    }
+    CHECK(roundTrip(compressor, bytes) != 0);
+
+    // Matches up to MAX_OFFSET back
+    std::string far = "0123456789abcdefghij" + std::string(4070, '-') + "0123456789abcdefghij";
+    CHECK(roundTrip(compressor, far) != 0);
+
+    // The largest event
+    std::string maxData;
+    for(size_t ii = 0; ii < particle::protocol::MAX_EVENT_DATA_LENGTH; ii++) {
+        maxData += (char) ('a' + (ii * 7) % 26);
+    }
+    CHECK(roundTrip(compressor, maxData) != 0);
+
+    // 0 if the stream does not fit, so incompressible data is stored as is
+    CHECK(compressor.compress(bytes.data(), bytes.size(), buf, sizeof(buf)) == 0);
+    CHECK(compressor.compress("abc", 3, buf, PublishQueueCompress::STREAM_HEADER_SIZE - 1) == 0);
+}
+
+static void testDecompress() {
+    PublishQueueCompress compressor;
+    CHECK(compressor.init());
+    uint8_t out[64];
+
+    // A literal 'a', then a match of 18 bytes at offset 1, which overlaps the bytes being written
+    const uint8_t overlap[] = { 19, 0, 0, 0, 0x02, 'a', 0x00, 0x0f };
+    CHECK(compressor.decompress(overlap, sizeof(overlap), out, 19));
+    CHECK(memcmp(out, "aaaaaaaaaaaaaaaaaaa", 19) == 0);
+
+    // The decoded size must match
+    CHECK(!compressor.decompress(overlap, sizeof(overlap), out, 18));
+
+    // Truncated streams, including the header, are rejected without reading past the end
+    for(size_t len = 0; len < sizeof(overlap); len++) {
+        std::vector<uint8_t> truncated(overlap, overlap + len);
+        CHECK(!compressor.decompress(truncated.data(), truncated.size(), out, 19));
+        CHECK(!compressor.decompress(truncated.data(), truncated.size(), out, 0));
+    }
+
+    // A match before the start of the data
+    const uint8_t before[] = { 4, 0, 0, 0, 0x02, 'a', 0x00, 0x10 };
+    CHECK(!compressor.decompress(before, sizeof(before), out, 4));
+
+    // A match past the end of the data
+    const uint8_t past[] = { 4, 0, 0, 0, 0x02, 'a', 0x00, 0x0f };
+    CHECK(!compressor.decompress(past, sizeof(past), out, 4));
+
+    // A stream compressed with a dictionary only decodes with the same dictionary
+    PublishQueueCompress withDict;
+    CHECK(withDict.init("{\"temperature\":,\"humidity\":}"));
+    const char *data = "{\"temperature\":21.5,\"humidity\":40}";
+    uint8_t stream[64];
+    size_t len = withDict.compress(data, strlen(data), stream, sizeof(stream));
+    CHECK(len != 0 && len < strlen(data));
+    CHECK(withDict.decompress(stream, len, out, strlen(data)) && memcmp(out, data, strlen(data)) == 0);
+    CHECK(!compressor.decompress(stream, len, out, strlen(data)));
+
+    // An event must be at least the fixed part and end with the null terminator of its data
+    std::vector<uint8_t> event(PublishQueueEvent::getSize(0));
+    CHECK(!compressor.decompressEvent(overlap, sizeof(overlap), (PublishQueueEvent *) event.data(), 19));
+    CHECK(!compressor.decompressEvent(overlap, sizeof(overlap), (PublishQueueEvent *) event.data(), event.size()));
+}
+
+static void testZ85() {
+    char text[32];
+    uint8_t bytes[32];
+
+    // The example from the Z85 specification
+    const uint8_t hello[] = { 0x86, 0x4f, 0xd2, 0x6f, 0xb5, 0x59, 0xf7, 0x5b };
+    CHECK(PublishQueueCompress::z85Encode(hello, sizeof(hello), text, sizeof(text)) == 10);
+    CHECK(strcmp(text, "HelloWorld") == 0);
+    CHECK(PublishQueueCompress::z85Decode("HelloWorld", 10, bytes, sizeof(bytes)) == 8);
+    CHECK(memcmp(bytes, hello, sizeof(hello)) == 0);
+
+    // Empty input
+    text[0] = 'x';
+    CHECK(PublishQueueCompress::z85Encode(hello, 0, text, sizeof(text)) == 0);
+    CHECK(text[0] == 0);
+    CHECK(PublishQueueCompress::z85Decode("", 0, bytes, sizeof(bytes)) == 0);
+
+    // Every value of a byte, and the largest 32 bit value
+    uint8_t all[256];
+    for(int ii = 0; ii < 256; ii++) {
+        all[ii] = (uint8_t) ii;
+    }
+    char allText[321];
+    uint8_t allBytes[256];
+    CHECK(PublishQueueCompress::z85Encode(all, sizeof(all), allText, sizeof(allText)) == 320);
+    CHECK(PublishQueueCompress::z85Decode(allText, 320, allBytes, sizeof(allBytes)) == 256);
+    CHECK(memcmp(all, allBytes, sizeof(all)) == 0);
+
+    const uint8_t ones[] = { 0xff, 0xff, 0xff, 0xff };
+    CHECK(PublishQueueCompress::z85Encode(ones, sizeof(ones), text, sizeof(text)) == 5);
+    CHECK(strcmp(text, "%nSc0") == 0);
+
+    // Lengths that are not a multiple of 4 or 5, or do not fit, including the null terminator
+    CHECK(PublishQueueCompress::z85Encode(hello, 3, text, sizeof(text)) == 0);
+    CHECK(PublishQueueCompress::z85Encode(hello, 8, text, 10) == 0);
+    CHECK(PublishQueueCompress::z85Decode("Hello", 4, bytes, sizeof(bytes)) == 0);
+    CHECK(PublishQueueCompress::z85Decode("HelloWorld", 10, bytes, 7) == 0);
+
+    // Characters that are not in the alphabet, including a null, and a value over 32 bits
+    CHECK(PublishQueueCompress::z85Decode("Hel\"o", 5, bytes, sizeof(bytes)) == 0);
+    CHECK(PublishQueueCompress::z85Decode("Hel o", 5, bytes, sizeof(bytes)) == 0);
+    CHECK(PublishQueueCompress::z85Decode("Hel\0o", 5, bytes, sizeof(bytes)) == 0);
+    CHECK(PublishQueueCompress::z85Decode("%nSc1", 5, bytes, sizeof(bytes)) == 0);
+    CHECK(PublishQueueCompress::z85Decode("#####", 5, bytes, sizeof(bytes)) == 0);
+}
+
+static void testCloud() {
+    PublishQueueCompress compressor;
+    char buf[particle::protocol::MAX_EVENT_DATA_LENGTH + 1];
+
+    // Not enabled until init()
+    CHECK(compressor.encodeCloud("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa") == NULL);
+    CHECK(compressor.init());
+
+    // Data that would not be shorter is sent as is
+    CHECK(compressor.encodeCloud("") == NULL);
+    CHECK(compressor.encodeCloud("abc") == NULL);
+    CHECK(compressor.encodeCloud("{\"a\":1,\"b\":2}") == NULL);
+
+    std::string data;
+    for(int ii = 0; ii < 40; ii++) {
+        data += "{\"temp\":21.5,\"hum\":40},";
+    }
+    const char *encoded = compressor.encodeCloud(data.c_str());
+    CHECK(encoded != NULL);
+    if (encoded) {
+        std::string copy = encoded;
+        CHECK(copy.compare(0, 2, PublishQueueCompress::CLOUD_PREFIX) == 0);
+        CHECK(copy.size() < data.size());
+        CHECK(compressor.decodeCloud(copy.c_str(), buf, sizeof(buf)) && data == buf);
+
+        // The decoded data must fit with its null terminator
+        CHECK(!compressor.decodeCloud(copy.c_str(), buf, data.size()));
+
+        // Truncated, or with a character that is not in the alphabet
+        for(size_t len = 2; len < copy.size(); len++) {
+            CHECK(!compressor.decodeCloud(copy.substr(0, len).c_str(), buf, sizeof(buf)));
+        }
+        std::string invalid = copy;
+        invalid[7] = '"';
+        CHECK(!compressor.decodeCloud(invalid.c_str(), buf, sizeof(buf)));
+    }
+
+    // The largest event data
+    std::string maxData;
+    for(size_t ii = 0; ii < particle::protocol::MAX_EVENT_DATA_LENGTH; ii++) {
+        maxData += (char) ('a' + (ii / 16) % 8);
+    }
+    encoded = compressor.encodeCloud(maxData.c_str());
+    CHECK(encoded != NULL && strlen(encoded) <= particle::protocol::MAX_EVENT_DATA_LENGTH);
+    if (encoded) {
+        std::string copy = encoded;
+        CHECK(compressor.decodeCloud(copy.c_str(), buf, sizeof(buf)) && maxData == buf);
+    }
+    CHECK(compressor.encodeCloud((maxData + "a").c_str()) == NULL);
+
+    // Data without the prefix, only the prefix, or invalid Z85 after it
+    CHECK(!compressor.decodeCloud("abcde", buf, sizeof(buf)));
+    CHECK(!compressor.decodeCloud("~Z", buf, sizeof(buf)));
+    CHECK(!compressor.decodeCloud("~Z\"\"\"\"\"", buf, sizeof(buf)));
+    CHECK(!compressor.decodeCloud("~Z0000", buf, sizeof(buf)));
+}
+
+int main(int argc, char **argv) {
+    testCompress();
+    testDecompress();
+    testZ85();
+    testCloud();
+
+    if (errors) {
+        fprintf(stderr, "%d checks failed\n", errors);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
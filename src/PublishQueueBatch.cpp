@@ -0,0 +1,162 @@
+#include "PublishQueueBatch.h"
+#include "PublishQueuePosixRK.h"
+
+/**
+ * @brief Parse a decimal length followed by a colon, advancing cp past the colon
+ */
+static bool parseLength(const char *&cp, const char *end, size_t &value) {
+    const char *start = cp;
+
+    value = 0;
+    while(cp < end && *cp >= '0' && *cp <= '9') {
+        value = value * 10 + (*cp++ - '0');
+        if (value > particle::protocol::MAX_EVENT_DATA_LENGTH) {
+            return false;
+        }
+    }
+    if (cp == start || cp >= end || *cp != ':') {
+        return false;
+    }
+    cp++;
+    return true;
+}
+
+PublishQueueBatch::PublishQueueBatch(size_t maxDataSize, PublishQueueEventPool *eventPool) : maxDataSize(maxDataSize), eventPool(eventPool) {
+}
+
+PublishQueueBatch::~PublishQueueBatch() {
+    if (eventPool) {
+        eventPool->free(batchEvent);
+    }
+    else {
+        delete[] (char *)batchEvent;
+    }
+}
+
+bool PublishQueueBatch::add(const PublishQueueEvent *event, const char *eventData) {
+    if (!eventData) {
+        eventData = event->eventData;
+    }
+    size_t nameLen = strlen(event->eventName);
+    size_t dataLen = strlen(eventData);
+
+    bool sameName = (lastName && nameLen == lastNameLen && memcmp(lastName, event->eventName, nameLen) == 0);
+
+    char nameHdr[12], dataHdr[12];
+    size_t nameHdrLen = snprintf(nameHdr, sizeof(nameHdr), "%u:", (unsigned) (sameName ? 0 : nameLen));
+    size_t dataHdrLen = snprintf(dataHdr, sizeof(dataHdr), "%u:", (unsigned) dataLen);
+
+    if (!buf) {
+        if (maxDataSize < 2) {
+            return false;
+        }
+        size_t eventSize = sizeof(PublishQueueEvent) + maxDataSize;
+        batchEvent = eventPool ? eventPool->alloc(eventSize) : (PublishQueueEvent *) new char[eventSize];
+        if (!batchEvent) {
+            return false;
+        }
+        buf = batchEvent->eventData;
+        buf[len++] = FORMAT_VERSION;
+        buf[len++] = ';';
+        buf[len] = 0;
+    }
+
+    if (len + nameHdrLen + (sameName ? 0 : nameLen) + dataHdrLen + dataLen > maxDataSize) {
+        return false;
+    }
+
+    memcpy(&buf[len], nameHdr, nameHdrLen);
+    len += nameHdrLen;
+    if (!sameName) {
+        lastName = &buf[len];
+        lastNameLen = nameLen;
+        memcpy(&buf[len], event->eventName, nameLen);
+        len += nameLen;
+    }
+    memcpy(&buf[len], dataHdr, dataHdrLen);
+    len += dataHdrLen;
+    memcpy(&buf[len], eventData, dataLen);
+    len += dataLen;
+    buf[len] = 0;
+
+    numEvents++;
+
+    // The batch is only discarded once all of its events have expired
+    if (numEvents == 1 || (expires != 0 && (event->expires == 0 || event->expires > expires))) {
+        expires = event->expires;
+    }
+    if (numEvents == 1 || (event->timestamp != 0 && (timestamp == 0 || event->timestamp < timestamp))) {
+        timestamp = event->timestamp;
+    }
+    return true;
+}
+
+PublishQueueEvent *PublishQueueBatch::releaseEvent(const char *eventName, PublishFlags flags) {
+    PublishQueueEvent *result = batchEvent;
+    if (result) {
+        result->expires = expires;
+        result->timestamp = timestamp;
+        result->formatId = 0;
+        result->flags = flags;
+        strncpy(result->eventName, eventName, sizeof(PublishQueueEvent::eventName) - 1);
+        result->eventName[sizeof(PublishQueueEvent::eventName) - 1] = 0;
+
+        batchEvent = 0;
+        buf = 0;
+        len = 0;
+        numEvents = 0;
+        expires = 0;
+        timestamp = 0;
+        lastName = 0;
+    }
+    return result;
+}
+
+// static
+bool PublishQueueBatch::decode(const char *data, std::function<void(const char *eventName, const char *eventData)> callback) {
+    if (!data || data[0] != FORMAT_VERSION || data[1] != ';') {
+        return false;
+    }
+    const char *cp = &data[2];
+    const char *end = cp + strlen(cp);
+
+    char eventName[particle::protocol::MAX_EVENT_NAME_LENGTH + 1];
+    eventName[0] = 0;
+
+    while(cp < end) {
+        size_t nameLen, dataLen;
+
+        if (!parseLength(cp, end, nameLen)) {
+            return false;
+        }
+        if (nameLen == 0) {
+            if (eventName[0] == 0) {
+                // Same name as the previous event, but this is the first event
+                return false;
+            }
+        }
+        else {
+            if (nameLen > particle::protocol::MAX_EVENT_NAME_LENGTH || nameLen > (size_t)(end - cp)) {
+                return false;
+            }
+            memcpy(eventName, cp, nameLen);
+            eventName[nameLen] = 0;
+            cp += nameLen;
+        }
+
+        if (!parseLength(cp, end, dataLen) || dataLen > (size_t)(end - cp)) {
+            return false;
+        }
+        char *eventData = new char[dataLen + 1];
+        if (!eventData) {
+            return false;
+        }
+        memcpy(eventData, cp, dataLen);
+        eventData[dataLen] = 0;
+        cp += dataLen;
+
+        callback(eventName, eventData);
+        delete[] eventData;
+    }
+    return true;
+}
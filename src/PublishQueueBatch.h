@@ -0,0 +1,135 @@
+#ifndef __PUBLISHQUEUEBATCH_H
+#define __PUBLISHQUEUEBATCH_H
+
+// Github: https://github.com/rickkas7/PublishQueuePosixRK
+// License: MIT
+
+#include "Particle.h"
+
+#include "PublishQueueEventPool.h"
+
+#include <functional>
+
+struct PublishQueueEvent;
+
+/**
+ * @brief Packs several queued events into the data of one cloud event
+ *
+ * Used by PublishQueuePosix when withBatchPublish() is set. The format is text so
+ * it can be sent as event data and forwarded by webhooks unchanged:
+ *
+ * ```
+ * 1;<nameLen>:<name><dataLen>:<data><nameLen>:<name><dataLen>:<data>...
+ * ```
+ *
+ * - The data starts with the format version (1) and a semicolon.
+ * - Each event is its name and data, each prefixed by its length in bytes as a decimal
+ *   number and a colon. The data is not escaped.
+ * - A name length of 0 means the same event name as the previous event in the batch.
+ *
+ * For example, two events named "temp" with data "21.5" and "21.6":
+ *
+ * ```
+ * 1;4:temp4:21.50:4:21.6
+ * ```
+ *
+ * decode() unpacks a batch. There is also a decoder for node.js servers in tools/batch-decoder.
+ */
+class PublishQueueBatch {
+public:
+    /**
+     * @brief Constructor
+     *
+     * @param maxDataSize Maximum size of the batch data in bytes, not including the null terminator
+     *
+     * @param eventPool Pool to allocate the batch event from, or NULL to use the heap
+     */
+    PublishQueueBatch(size_t maxDataSize = particle::protocol::MAX_EVENT_DATA_LENGTH, PublishQueueEventPool *eventPool = NULL);
+
+    /**
+     * @brief Destructor
+     */
+    virtual ~PublishQueueBatch();
+
+    /**
+     * @brief Add an event to the batch
+     *
+     * @param event The event to add. Only the name and data are stored; the caller
+     * is responsible for only batching events with the same flags.
+     *
+     * @param eventData The data to store instead of the event's data, such as the formatted
+     * data of an event published using PublishQueuePosix::publishDeferred(), or NULL to use the
+     * event's data
+     *
+     * @return true if the event was added, false if it does not fit or out of memory
+     */
+    bool add(const PublishQueueEvent *event, const char *eventData = NULL);
+
+    /**
+     * @brief Gets the batch data as a c-string
+     */
+    const char *getData() const { return buf ? buf : ""; };
+
+    /**
+     * @brief Gets the batch as an event ready to publish, and transfers ownership of it to the caller
+     *
+     * @param eventName Name of the batch event (63 character maximum)
+     *
+     * @param flags Flags of the batch event, normally the flags of the events in the batch
+     *
+     * @return The event, or NULL if no events have been added. You must free the result from this
+     * method using the event pool passed to the constructor (or delete it, if none) when you are
+     * done using it.
+     *
+     * The event is allocated when the first event is added, so this does not allocate memory.
+     * It expires when all of the events in the batch have expired, and its timestamp is that of the
+     * oldest event.
+     */
+    PublishQueueEvent *releaseEvent(const char *eventName, PublishFlags flags);
+
+    /**
+     * @brief Gets the number of events added to the batch
+     */
+    size_t getNumEvents() const { return numEvents; };
+
+    /**
+     * @brief Unpack the events in a batch
+     *
+     * @param data The batch data (event data of the batch event)
+     *
+     * @param callback Called for each event in the batch, in order
+     *
+     * @return true if the batch was valid. If false, the callback may already have been
+     * called for the events before the invalid part.
+     */
+    static bool decode(const char *data, std::function<void(const char *eventName, const char *eventData)> callback);
+
+    /**
+     * @brief Version of the batch format, the first character of the batch data
+     */
+    static const char FORMAT_VERSION = '1';
+
+protected:
+    /**
+     * @brief This class is not copyable
+     */
+    PublishQueueBatch(const PublishQueueBatch&) = delete;
+
+    /**
+     * @brief This class is not copyable
+     */
+    PublishQueueBatch& operator=(const PublishQueueBatch&) = delete;
+
+    size_t maxDataSize; //!< Maximum size of the batch data
+    PublishQueueEventPool *eventPool; //!< Pool to allocate the batch event from, or NULL
+    PublishQueueEvent *batchEvent = 0; //!< Event containing the batch, allocated when the first event is added
+    char *buf = 0; //!< Batch data (batchEvent->eventData)
+    size_t len = 0; //!< Length of the batch data
+    size_t numEvents = 0; //!< Number of events in the batch
+    uint32_t expires = 0; //!< Latest expires of the events in the batch, 0 if any does not expire
+    uint32_t timestamp = 0; //!< Oldest timestamp of the events in the batch, 0 if none has one
+    const char *lastName = 0; //!< Name of the last event added (points into buf)
+    size_t lastNameLen = 0; //!< Length of lastName
+};
+
+#endif /* __PUBLISHQUEUEBATCH_H */
@@ -0,0 +1,299 @@
+#include "PublishQueueCompact.h"
+#include "PublishQueuePosixRK.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+static Logger _log("app.pubq");
+
+const char * const PublishQueueCompact::NAME_TABLE_NAME = "pqnames";
+
+PublishQueueCompact::PublishQueueCompact() {
+}
+
+PublishQueueCompact::~PublishQueueCompact() {
+    delete[] buffer;
+}
+
+void PublishQueueCompact::load(bool reset) {
+    clear();
+
+    if (reset) {
+        unlink(getPath());
+        return;
+    }
+
+    int fd = open(getPath(), O_RDWR);
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat sb;
+    uint32_t magic = 0;
+    size_t validSize = 0;
+    if (fstat(fd, &sb) == 0 && read(fd, &magic, sizeof(magic)) == sizeof(magic) && magic == NAME_TABLE_MAGIC) {
+        validSize = sizeof(magic);
+        char name[particle::protocol::MAX_EVENT_NAME_LENGTH + 1];
+        uint8_t nameLen;
+        while(nameOffsets.size() < MAX_NAMES && read(fd, &nameLen, 1) == 1) {
+            if (nameLen == 0 || nameLen > particle::protocol::MAX_EVENT_NAME_LENGTH || read(fd, name, nameLen) != nameLen) {
+                break;
+            }
+            nameOffsets.push_back((uint16_t) names.size());
+            names.insert(names.end(), name, name + nameLen);
+            names.push_back(0);
+            validSize += 1 + nameLen;
+        }
+    }
+
+    if (validSize == 0) {
+        // Not a name table, so no events can refer to it
+        close(fd);
+        unlink(getPath());
+        return;
+    }
+    if (sb.st_size > (off_t)validSize) {
+        // A name was being appended when the device reset. No event refers to it yet.
+        _log.info("truncating name table from %ld to %u", (long) sb.st_size, (unsigned) validSize);
+        ftruncate(fd, validSize);
+    }
+    close(fd);
+
+    _log.trace("name table names=%u", (unsigned) nameOffsets.size());
+}
+
+void PublishQueueCompact::clear() {
+    names.clear();
+    nameOffsets.clear();
+    appendFailed = false;
+}
+
+const uint8_t *PublishQueueCompact::encodeEvent(const PublishQueueEvent *event, size_t &storedSize) {
+    size_t nameLen = strnlen(event->eventName, sizeof(PublishQueueEvent::eventName));
+    size_t dataLen = event->getDataLen();
+    uint8_t publishFlags = (uint8_t) event->flags.value();
+
+    if (!enabled || nameLen == 0 || nameLen > particle::protocol::MAX_EVENT_NAME_LENGTH || dataLen > particle::protocol::MAX_EVENT_DATA_LENGTH ||
+        (publishFlags & ~FLAG_PUBLISH_MASK) != 0 || (event->expires != 0 && event->expires < event->timestamp)) {
+        return NULL;
+    }
+    uint8_t *buf = getBuffer();
+    if (!buf) {
+        return NULL;
+    }
+
+    // The name is added to the name table before the buffer is filled in
+    int nameIndex = internName(event->eventName, nameLen);
+
+    size_t out = 1;
+    buf[0] = publishFlags;
+    if (event->timestamp != 0) {
+        buf[0] |= FLAG_TIMESTAMP;
+        memcpy(&buf[out], &event->timestamp, sizeof(uint32_t));
+        out += sizeof(uint32_t);
+    }
+    if (event->expires != 0) {
+        buf[0] |= FLAG_EXPIRES;
+        out += putVarint(&buf[out], event->expires - event->timestamp);
+    }
+    if (event->formatId != 0) {
+        buf[0] |= FLAG_FORMAT;
+        buf[out++] = event->formatId;
+    }
+    if (nameIndex >= 0) {
+        buf[0] |= FLAG_NAME_INDEX;
+        out += putVarint(&buf[out], (uint32_t) nameIndex);
+    }
+    else {
+        out += putVarint(&buf[out], (uint32_t) nameLen);
+        memcpy(&buf[out], event->eventName, nameLen);
+        out += nameLen;
+    }
+    memcpy(&buf[out], event->eventData, dataLen);
+    out += dataLen;
+
+    storedSize = out;
+    return buf;
+}
+
+size_t PublishQueueCompact::getDecodedSize(const uint8_t *stored, size_t storedSize) const {
+    Fields fields;
+    if (!parse(stored, storedSize, fields)) {
+        return 0;
+    }
+    return PublishQueueEvent::getSize(fields.dataLen);
+}
+
+bool PublishQueueCompact::decodeEvent(const uint8_t *stored, size_t storedSize, PublishQueueEvent *event, size_t eventSize) const {
+    Fields fields;
+    if (!parse(stored, storedSize, fields) || eventSize != PublishQueueEvent::getSize(fields.dataLen)) {
+        return false;
+    }
+
+    event->expires = fields.expires;
+    event->timestamp = fields.timestamp;
+    event->formatId = fields.formatId;
+    event->flags = PublishFlags::fromUnderlying(fields.flags & FLAG_PUBLISH_MASK);
+    memcpy(event->eventName, fields.name, fields.nameLen);
+    event->eventName[fields.nameLen] = 0;
+    memcpy(event->eventData, fields.data, fields.dataLen);
+    event->eventData[fields.dataLen] = 0;
+    return true;
+}
+
+uint8_t *PublishQueueCompact::getBuffer() {
+    if (!buffer) {
+        buffer = new uint8_t[MAX_STORED_SIZE];
+    }
+    return buffer;
+}
+
+bool PublishQueueCompact::parse(const uint8_t *stored, size_t storedSize, Fields &fields) const {
+    if (storedSize < MIN_STORED_SIZE || storedSize > MAX_STORED_SIZE) {
+        return false;
+    }
+
+    size_t in = 0;
+    fields.flags = stored[in++];
+    if ((fields.flags & ~(FLAG_PUBLISH_MASK | FLAG_TIMESTAMP | FLAG_EXPIRES | FLAG_NAME_INDEX | FLAG_FORMAT)) != 0) {
+        return false;
+    }
+
+    fields.timestamp = 0;
+    if (fields.flags & FLAG_TIMESTAMP) {
+        if (in + sizeof(uint32_t) > storedSize) {
+            return false;
+        }
+        memcpy(&fields.timestamp, &stored[in], sizeof(uint32_t));
+        in += sizeof(uint32_t);
+    }
+
+    fields.expires = 0;
+    if (fields.flags & FLAG_EXPIRES) {
+        uint32_t ttl;
+        if (!getVarint(stored, storedSize, in, ttl)) {
+            return false;
+        }
+        fields.expires = fields.timestamp + ttl;
+    }
+
+    fields.formatId = 0;
+    if (fields.flags & FLAG_FORMAT) {
+        if (in >= storedSize || stored[in] == 0) {
+            return false;
+        }
+        fields.formatId = stored[in++];
+    }
+
+    uint32_t value;
+    if (!getVarint(stored, storedSize, in, value)) {
+        return false;
+    }
+    if (fields.flags & FLAG_NAME_INDEX) {
+        if (value >= nameOffsets.size()) {
+            // The name table does not match this event
+            return false;
+        }
+        fields.name = &names[nameOffsets[value]];
+        fields.nameLen = strlen(fields.name);
+    }
+    else {
+        if (value == 0 || value > particle::protocol::MAX_EVENT_NAME_LENGTH || in + value > storedSize ||
+            memchr(&stored[in], 0, value) != NULL) {
+            return false;
+        }
+        fields.name = (const char *) &stored[in];
+        fields.nameLen = value;
+        in += value;
+    }
+
+    fields.data = &stored[in];
+    fields.dataLen = storedSize - in;
+    if (fields.dataLen > particle::protocol::MAX_EVENT_DATA_LENGTH) {
+        return false;
+    }
+    if (fields.formatId != 0) {
+        // A length byte, then the record, which can contain null bytes
+        return fields.dataLen >= 1 && fields.dataLen == 1 + (size_t) fields.data[0];
+    }
+    return memchr(fields.data, 0, fields.dataLen) == NULL;
+}
+
+int PublishQueueCompact::internName(const char *name, size_t nameLen) {
+    for(size_t ii = 0; ii < nameOffsets.size(); ii++) {
+        const char *cur = &names[nameOffsets[ii]];
+        if (strncmp(cur, name, nameLen) == 0 && cur[nameLen] == 0) {
+            return (int) ii;
+        }
+    }
+    if (nameOffsets.size() >= MAX_NAMES || appendFailed) {
+        return -1;
+    }
+
+    // The name is appended to the file before any event refers to it
+    bool written = false;
+    int fd = open(getPath(), O_WRONLY | O_APPEND | O_CREAT);
+    if (fd >= 0) {
+        struct stat sb;
+        uint8_t nameLenByte = (uint8_t) nameLen;
+        written = fstat(fd, &sb) == 0;
+        if (written && sb.st_size == 0) {
+            uint32_t magic = NAME_TABLE_MAGIC;
+            written = write(fd, &magic, sizeof(magic)) == sizeof(magic);
+        }
+        written = written &&
+            write(fd, &nameLenByte, 1) == 1 &&
+            write(fd, name, nameLen) == (ssize_t)nameLen;
+        if (close(fd) != 0) {
+            written = false;
+        }
+    }
+    if (!written) {
+        // A partially written name is removed by load() after a reset, and the file is not
+        // appended to again until then, so later names do not follow it
+        _log.error("name table write failed errno=%d", errno);
+        appendFailed = true;
+        return -1;
+    }
+
+    nameOffsets.push_back((uint16_t) names.size());
+    names.insert(names.end(), name, name + nameLen);
+    names.push_back(0);
+    return (int)(nameOffsets.size() - 1);
+}
+
+String PublishQueueCompact::getPath() const {
+    return String::format("%s/%s", dirPath.c_str(), NAME_TABLE_NAME);
+}
+
+// static
+size_t PublishQueueCompact::putVarint(uint8_t *buf, uint32_t value) {
+    size_t len = 0;
+    while(value >= 0x80) {
+        buf[len++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    buf[len++] = (uint8_t) value;
+    return len;
+}
+
+// static
+bool PublishQueueCompact::getVarint(const uint8_t *buf, size_t len, size_t &offset, uint32_t &value) {
+    value = 0;
+    for(size_t shift = 0; shift < 35; shift += 7) {
+        if (offset >= len) {
+            return false;
+        }
+        uint8_t b = buf[offset++];
+        if (shift == 28 && (b & 0x70) != 0) {
+            // Only the low 4 bits of the 5th byte fit in 32 bits
+            return false;
+        }
+        value |= (uint32_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
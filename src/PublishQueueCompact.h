@@ -0,0 +1,257 @@
+#ifndef __PUBLISHQUEUECOMPACT_H
+#define __PUBLISHQUEUECOMPACT_H
+
+// Github: https://github.com/rickkas7/PublishQueuePosixRK
+// License: MIT
+
+#include "Particle.h"
+
+#include <vector>
+
+struct PublishQueueEvent;
+
+/**
+ * @brief Compact binary encoding for events stored on the flash file system
+ *
+ * Used by PublishQueuePosix when withCompactEncoding() is set. A PublishQueueEvent always
+ * stores the event name in a 65 byte array, so a small event is mostly zeros on flash. The
+ * compact encoding stores only the bytes that are used:
+ *
+ * - A flags byte. The low 4 bits are the PublishFlags value, the high bits are FLAG_TIMESTAMP,
+ *   FLAG_EXPIRES, FLAG_NAME_INDEX and FLAG_FORMAT.
+ * - The timestamp (uint32_t, little endian), if FLAG_TIMESTAMP is set
+ * - The expires time minus the timestamp as a varint, if FLAG_EXPIRES is set
+ * - The formatId byte of an event from PublishQueuePosix::publishDeferred(), if FLAG_FORMAT is set
+ * - If FLAG_NAME_INDEX is set, the index of the event name in the name table as a varint.
+ *   Otherwise, the length of the event name as a varint, followed by the name.
+ * - The event data, without a null terminator, up to the end of the stored event. If FLAG_FORMAT
+ *   is set, this is the record length byte followed by the record.
+ *
+ * A varint is 7 bits per byte, low bits first, with the high bit set in all but the last byte.
+ *
+ * The name table interns the event names, so an event whose name has been seen before stores it
+ * in 1 byte (2 bytes after the first 128 names). It's kept in the queue directory in the file
+ * NAME_TABLE_NAME, which is a uint32_t NAME_TABLE_MAGIC followed by the names, each a length byte
+ * followed by the name. Names are only appended, and are appended before an event that uses them
+ * is written, so the table is valid for every event on the flash file system. It's removed when
+ * the queue is empty at startup. After MAX_NAMES names, new names are stored in each event.
+ *
+ * This class is not thread-safe; PublishQueuePosix calls it with its mutex locked.
+ */
+class PublishQueueCompact {
+public:
+    /**
+     * @brief Constructor
+     */
+    PublishQueueCompact();
+
+    /**
+     * @brief Destructor
+     */
+    virtual ~PublishQueueCompact();
+
+    /**
+     * @brief Sets the directory the name table is stored in
+     *
+     * @param dirPath the pathname, Unix-style with / as the directory separator, not ending with a slash.
+     */
+    PublishQueueCompact &withDirPath(const char *dirPath) { this->dirPath = dirPath; return *this; };
+
+    /**
+     * @brief Enable the compact encoding in encodeEvent(). Events can be decoded even if it's not enabled.
+     */
+    PublishQueueCompact &withEnabled(bool enabled) { this->enabled = enabled; return *this; };
+
+    /**
+     * @brief Returns true if withEnabled() has been called with true
+     */
+    bool isEnabled() const { return enabled; };
+
+    /**
+     * @brief Read the name table from the file system
+     *
+     * @param reset Remove the name table instead. Only do this when there are no stored events.
+     *
+     * A name that was only partially appended when the device reset is removed from the file.
+     */
+    void load(bool reset);
+
+    /**
+     * @brief Forget the names in RAM, after the name table file has been removed with the rest of the queue
+     */
+    void clear();
+
+    /**
+     * @brief Gets the number of names in the name table
+     */
+    size_t getNumNames() const { return nameOffsets.size(); };
+
+    /**
+     * @brief Encode an event as stored on the flash file system
+     *
+     * @param event The event
+     *
+     * @param storedSize Filled in with the size of the encoded event. Not changed if NULL is returned.
+     *
+     * @return The encoded event in an internal buffer, valid until the next call, or NULL if not
+     * enabled or the event can't be encoded
+     *
+     * If the event name is not in the name table, it's added first. If that fails, the name is
+     * stored in the event.
+     */
+    const uint8_t *encodeEvent(const PublishQueueEvent *event, size_t &storedSize);
+
+    /**
+     * @brief Gets the size of the PublishQueueEvent for an event encoded using encodeEvent()
+     *
+     * @return The size, or 0 if the encoded event is not valid
+     */
+    size_t getDecodedSize(const uint8_t *stored, size_t storedSize) const;
+
+    /**
+     * @brief Decode an event encoded using encodeEvent()
+     *
+     * @param stored The encoded event
+     *
+     * @param storedSize Size of stored in bytes
+     *
+     * @param event Buffer for the event, allocated by the caller with getDecodedSize() bytes
+     *
+     * @param eventSize The size from getDecodedSize()
+     *
+     * @return true if valid
+     */
+    bool decodeEvent(const uint8_t *stored, size_t storedSize, PublishQueueEvent *event, size_t eventSize) const;
+
+    /**
+     * @brief Gets the internal buffer of MAX_STORED_SIZE bytes, used to read encoded events
+     *
+     * @return The buffer, or NULL if out of memory
+     */
+    uint8_t *getBuffer();
+
+    /**
+     * @brief Bits of the flags byte that are the PublishFlags value
+     */
+    static const uint8_t FLAG_PUBLISH_MASK = 0x0f;
+
+    /**
+     * @brief The timestamp is stored
+     */
+    static const uint8_t FLAG_TIMESTAMP = 0x10;
+
+    /**
+     * @brief The expires time is stored
+     */
+    static const uint8_t FLAG_EXPIRES = 0x20;
+
+    /**
+     * @brief The event name is an index in the name table
+     */
+    static const uint8_t FLAG_NAME_INDEX = 0x40;
+
+    /**
+     * @brief The formatId is stored
+     */
+    static const uint8_t FLAG_FORMAT = 0x80;
+
+    /**
+     * @brief Maximum number of names in the name table
+     */
+    static const size_t MAX_NAMES = 256;
+
+    /**
+     * @brief Smallest encoded event: the flags byte and a name index
+     */
+    static const size_t MIN_STORED_SIZE = 2;
+
+    /**
+     * @brief Maximum size of an encoded event, which is always smaller than the PublishQueueEvent
+     */
+    static const size_t MAX_STORED_SIZE = 1 + 4 + 5 + 1 + 1 + particle::protocol::MAX_EVENT_NAME_LENGTH + particle::protocol::MAX_EVENT_DATA_LENGTH;
+
+    /**
+     * @brief Value at the beginning of the name table file
+     */
+    static const uint32_t NAME_TABLE_MAGIC = 0x5e9a3c19;
+
+    /**
+     * @brief Filename of the name table in the queue directory
+     */
+    static const char * const NAME_TABLE_NAME;
+
+protected:
+    /**
+     * @brief This class is not copyable
+     */
+    PublishQueueCompact(const PublishQueueCompact&) = delete;
+
+    /**
+     * @brief This class is not copyable
+     */
+    PublishQueueCompact& operator=(const PublishQueueCompact&) = delete;
+
+    /**
+     * @brief Fields of an encoded event, from parse()
+     */
+    struct Fields {
+        uint8_t flags;          //!< The flags byte
+        uint32_t timestamp;     //!< Timestamp, 0 if not stored
+        uint32_t expires;       //!< Expires time, 0 if not stored
+        uint8_t formatId;       //!< formatId, 0 if not stored
+        const char *name;       //!< Event name, not null terminated
+        size_t nameLen;         //!< Length of name
+        const uint8_t *data;    //!< Event data, not null terminated
+        size_t dataLen;         //!< Length of data
+    };
+
+    /**
+     * @brief Split an encoded event into its fields
+     *
+     * @return false if the encoded event is not valid, or refers to a name not in the name table
+     */
+    bool parse(const uint8_t *stored, size_t storedSize, Fields &fields) const;
+
+    /**
+     * @brief Gets the index of a name in the name table, adding it if necessary
+     *
+     * @return The index, or -1 if the table is full or names can't be written to the file system
+     */
+    int internName(const char *name, size_t nameLen);
+
+    /**
+     * @brief Gets the pathname of the name table file
+     */
+    String getPath() const;
+
+    /**
+     * @brief Write a varint
+     *
+     * @return The number of bytes written, 1 to 5
+     */
+    static size_t putVarint(uint8_t *buf, uint32_t value);
+
+    /**
+     * @brief Read a varint
+     *
+     * @param buf The encoded event
+     *
+     * @param len Size of buf in bytes
+     *
+     * @param offset Offset of the varint in buf. Updated to the byte after it.
+     *
+     * @param value Filled in with the value
+     *
+     * @return false if the varint goes past the end of buf or is more than 32 bits
+     */
+    static bool getVarint(const uint8_t *buf, size_t len, size_t &offset, uint32_t &value);
+
+    String dirPath; //!< Directory containing the name table file
+    bool enabled = false; //!< encodeEvent() is enabled, set using withEnabled()
+    std::vector<char> names; //!< Names in the name table, each null terminated
+    std::vector<uint16_t> nameOffsets; //!< Offset in names of each name, by index
+    bool appendFailed = false; //!< A name could not be appended to the file, so no more are added until load()
+    uint8_t *buffer = 0; //!< MAX_STORED_SIZE bytes, from getBuffer()
+};
+
+#endif /* __PUBLISHQUEUECOMPACT_H */
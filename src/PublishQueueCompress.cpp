@@ -0,0 +1,315 @@
+#include "PublishQueueCompress.h"
+#include "PublishQueuePosixRK.h"
+#include "PublishQueueSegmentLog.h"
+
+const char * const PublishQueueCompress::CLOUD_PREFIX = "~Z";
+
+static const char * const Z85_CHARS = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ.-:+=^!/*?&<>()[]{}@%$#";
+
+// Hash of the 3 bytes at a position, HASH_BITS bits
+static inline uint32_t hash3(uint8_t b0, uint8_t b1, uint8_t b2, size_t hashBits) {
+    uint32_t value = (((uint32_t)b0 << 16) | ((uint32_t)b1 << 8) | b2) * (uint32_t)2654435761UL;
+    return value >> (32 - hashBits);
+}
+
+PublishQueueCompress::PublishQueueCompress() {
+}
+
+PublishQueueCompress::~PublishQueueCompress() {
+    delete[] dict;
+    delete[] hashTable;
+    delete[] buffer;
+    delete[] cloudBuf;
+}
+
+bool PublishQueueCompress::init(const char *dictionary) {
+    size_t len = dictionary ? strlen(dictionary) : 0;
+    if (len > MAX_DICTIONARY_SIZE) {
+        return false;
+    }
+    if (!hashTable) {
+        hashTable = new uint16_t[1 << HASH_BITS];
+        if (!hashTable) {
+            return false;
+        }
+    }
+    delete[] dict;
+    dict = 0;
+    dictLen = 0;
+    dictId = 0;
+    if (len) {
+        dict = new char[len];
+        if (!dict) {
+            return false;
+        }
+        memcpy(dict, dictionary, len);
+        dictLen = len;
+        dictId = (uint16_t) PublishQueueSegmentLog::crc32(dict, len);
+        if (dictId == 0) {
+            // 0 means no dictionary
+            dictId = 1;
+        }
+    }
+    return true;
+}
+
+size_t PublishQueueCompress::compress(const void *srcVoid, size_t srcLen, uint8_t *dst, size_t dstSize) {
+    const uint8_t *src = (const uint8_t *)srcVoid;
+    const uint8_t *dictBytes = (const uint8_t *)dict;
+    size_t total = dictLen + srcLen;
+
+    if (!hashTable || srcLen > 0xffff || total >= 0xffff || dstSize < STREAM_HEADER_SIZE) {
+        return 0;
+    }
+
+    // Bytes are addressed as the dictionary followed by the data
+    auto at = [&](size_t pos) {
+        return (pos < dictLen) ? dictBytes[pos] : src[pos - dictLen];
+    };
+    auto hashAt = [&](size_t pos) {
+        return hash3(at(pos), at(pos + 1), at(pos + 2), HASH_BITS);
+    };
+
+    memset(hashTable, 0, sizeof(uint16_t) << HASH_BITS);
+    for(size_t pos = 0; pos < dictLen && pos + 2 < total; pos++) {
+        hashTable[hashAt(pos)] = (uint16_t)(pos + 1);
+    }
+
+    dst[0] = (uint8_t) srcLen;
+    dst[1] = (uint8_t)(srcLen >> 8);
+    dst[2] = (uint8_t) dictId;
+    dst[3] = (uint8_t)(dictId >> 8);
+
+    size_t out = STREAM_HEADER_SIZE;
+    size_t flagPos = 0;
+    size_t item = 0;
+    size_t pos = dictLen;
+    while(pos < total) {
+        if (item == 0) {
+            if (out >= dstSize) {
+                return 0;
+            }
+            flagPos = out++;
+            dst[flagPos] = 0;
+        }
+
+        size_t matchLen = 0;
+        size_t matchOffset = 0;
+        if (pos + MIN_MATCH <= total) {
+            uint32_t hash = hashAt(pos);
+            size_t candidate = hashTable[hash];
+            hashTable[hash] = (uint16_t)(pos + 1);
+            if (candidate && pos - (candidate - 1) <= MAX_OFFSET) {
+                candidate--;
+                size_t maxLen = total - pos;
+                if (maxLen > MAX_MATCH) {
+                    maxLen = MAX_MATCH;
+                }
+                size_t len = 0;
+                while(len < maxLen && at(candidate + len) == at(pos + len)) {
+                    len++;
+                }
+                if (len >= MIN_MATCH) {
+                    matchLen = len;
+                    matchOffset = pos - candidate;
+                }
+            }
+        }
+
+        if (matchLen) {
+            if (out + 2 > dstSize) {
+                return 0;
+            }
+            dst[flagPos] |= (uint8_t)(1 << item);
+            size_t offset = matchOffset - 1;
+            dst[out++] = (uint8_t)(offset >> 4);
+            dst[out++] = (uint8_t)(((offset & 0x0f) << 4) | (matchLen - MIN_MATCH));
+
+            // Positions inside the match are candidates for later matches too
+            for(size_t ii = 1; ii < matchLen && pos + ii + 2 < total; ii++) {
+                hashTable[hashAt(pos + ii)] = (uint16_t)(pos + ii + 1);
+            }
+            pos += matchLen;
+        }
+        else {
+            if (out >= dstSize) {
+                return 0;
+            }
+            dst[out++] = at(pos++);
+        }
+        item = (item + 1) % 8;
+    }
+    return out;
+}
+
+bool PublishQueueCompress::decompress(const uint8_t *src, size_t srcLen, void *dstVoid, size_t dstSize) const {
+    uint8_t *dst = (uint8_t *)dstVoid;
+    const uint8_t *dictBytes = (const uint8_t *)dict;
+
+    if (srcLen < STREAM_HEADER_SIZE || getDecodedSize(src, srcLen) != dstSize || (src[2] | (src[3] << 8)) != dictId) {
+        return false;
+    }
+
+    size_t in = STREAM_HEADER_SIZE;
+    size_t out = 0;
+    while(out < dstSize) {
+        if (in >= srcLen) {
+            return false;
+        }
+        uint8_t flags = src[in++];
+        for(size_t item = 0; item < 8 && out < dstSize; item++) {
+            if (flags & (1 << item)) {
+                if (in + 2 > srcLen) {
+                    return false;
+                }
+                size_t offset = (((size_t)src[in] << 4) | (src[in + 1] >> 4)) + 1;
+                size_t len = (src[in + 1] & 0x0f) + MIN_MATCH;
+                in += 2;
+                if (offset > dictLen + out || out + len > dstSize) {
+                    return false;
+                }
+                // Copy a byte at a time, as the match can overlap the bytes being written
+                size_t from = dictLen + out - offset;
+                for(size_t ii = 0; ii < len; ii++, from++) {
+                    dst[out++] = (from < dictLen) ? dictBytes[from] : dst[from - dictLen];
+                }
+            }
+            else {
+                if (in >= srcLen) {
+                    return false;
+                }
+                dst[out++] = src[in++];
+            }
+        }
+    }
+    return true;
+}
+
+// static
+size_t PublishQueueCompress::getDecodedSize(const uint8_t *src, size_t srcLen) {
+    if (srcLen < STREAM_HEADER_SIZE) {
+        return 0;
+    }
+    return src[0] | (src[1] << 8);
+}
+
+const uint8_t *PublishQueueCompress::compressEvent(const PublishQueueEvent *event, size_t &storedSize) {
+    size_t size = PublishQueueEvent::getSize(event->getDataLen());
+    uint8_t *buf = getBuffer();
+
+    if (!isEnabled() || !buf || size > MAX_STORED_SIZE) {
+        return NULL;
+    }
+
+    // Only store compressed if it's smaller
+    size_t len = compress(event, size, buf, size - 1);
+    if (!len) {
+        return NULL;
+    }
+    storedSize = len;
+    return buf;
+}
+
+bool PublishQueueCompress::decompressEvent(const uint8_t *stored, size_t storedSize, PublishQueueEvent *event, size_t eventSize) const {
+    if (eventSize < PublishQueueEvent::getSize(0) || !decompress(stored, storedSize, event, eventSize)) {
+        return false;
+    }
+    return ((const char *)event)[eventSize - 1] == 0;
+}
+
+uint8_t *PublishQueueCompress::getBuffer() {
+    if (!buffer) {
+        buffer = new uint8_t[MAX_STORED_SIZE];
+    }
+    return buffer;
+}
+
+const char *PublishQueueCompress::encodeCloud(const char *data) {
+    size_t dataLen = strlen(data);
+    size_t prefixLen = strlen(CLOUD_PREFIX);
+    uint8_t *buf = getBuffer();
+
+    if (!isEnabled() || !buf || dataLen > particle::protocol::MAX_EVENT_DATA_LENGTH || dataLen <= prefixLen + 5) {
+        return NULL;
+    }
+    if (!cloudBuf) {
+        cloudBuf = new char[particle::protocol::MAX_EVENT_DATA_LENGTH + 1];
+        if (!cloudBuf) {
+            return NULL;
+        }
+    }
+
+    // Z85 is 5 characters for every 4 bytes, and the result must be shorter than the original.
+    // maxLen is a multiple of 4 so padding never goes past it.
+    size_t maxLen = ((dataLen - prefixLen - 1) / 5) * 4;
+    size_t len = compress(data, dataLen, buf, maxLen);
+    if (!len) {
+        return NULL;
+    }
+    while(len % 4) {
+        buf[len++] = 0;
+    }
+
+    strcpy(cloudBuf, CLOUD_PREFIX);
+    z85Encode(buf, len, &cloudBuf[prefixLen], particle::protocol::MAX_EVENT_DATA_LENGTH + 1 - prefixLen);
+    return cloudBuf;
+}
+
+bool PublishQueueCompress::decodeCloud(const char *data, char *buf, size_t bufSize) {
+    size_t prefixLen = strlen(CLOUD_PREFIX);
+    uint8_t *stream = getBuffer();
+
+    if (!stream || strncmp(data, CLOUD_PREFIX, prefixLen) != 0) {
+        return false;
+    }
+    size_t streamLen = z85Decode(&data[prefixLen], strlen(&data[prefixLen]), stream, MAX_STORED_SIZE);
+    size_t decodedLen = getDecodedSize(stream, streamLen);
+    if (decodedLen >= bufSize || !decompress(stream, streamLen, buf, decodedLen)) {
+        return false;
+    }
+    buf[decodedLen] = 0;
+    return true;
+}
+
+// static
+size_t PublishQueueCompress::z85Encode(const uint8_t *src, size_t srcLen, char *dst, size_t dstSize) {
+    size_t dstLen = srcLen / 4 * 5;
+    if ((srcLen % 4) != 0 || dstLen >= dstSize) {
+        return 0;
+    }
+    for(size_t in = 0, out = 0; in < srcLen; in += 4, out += 5) {
+        uint32_t value = ((uint32_t)src[in] << 24) | ((uint32_t)src[in + 1] << 16) | ((uint32_t)src[in + 2] << 8) | src[in + 3];
+        for(int ii = 4; ii >= 0; ii--) {
+            dst[out + ii] = Z85_CHARS[value % 85];
+            value /= 85;
+        }
+    }
+    dst[dstLen] = 0;
+    return dstLen;
+}
+
+// static
+size_t PublishQueueCompress::z85Decode(const char *src, size_t srcLen, uint8_t *dst, size_t dstSize) {
+    size_t dstLen = srcLen / 5 * 4;
+    if ((srcLen % 5) != 0 || dstLen > dstSize) {
+        return 0;
+    }
+    for(size_t in = 0, out = 0; in < srcLen; in += 5, out += 4) {
+        uint64_t value = 0;
+        for(size_t ii = 0; ii < 5; ii++) {
+            const char *cp = (src[in + ii] != 0) ? strchr(Z85_CHARS, src[in + ii]) : NULL;
+            if (!cp) {
+                return 0;
+            }
+            value = value * 85 + (cp - Z85_CHARS);
+        }
+        if (value > 0xffffffffULL) {
+            return 0;
+        }
+        dst[out] = (uint8_t)(value >> 24);
+        dst[out + 1] = (uint8_t)(value >> 16);
+        dst[out + 2] = (uint8_t)(value >> 8);
+        dst[out + 3] = (uint8_t) value;
+    }
+    return dstLen;
+}
@@ -0,0 +1,244 @@
+#ifndef __PUBLISHQUEUECOMPRESS_H
+#define __PUBLISHQUEUECOMPRESS_H
+
+// Github: https://github.com/rickkas7/PublishQueuePosixRK
+// License: MIT
+
+#include "Particle.h"
+
+struct PublishQueueEvent;
+
+/**
+ * @brief Small LZSS compressor for events stored on flash and, optionally, sent to the cloud
+ *
+ * Used by PublishQueuePosix when withCompression() is set. The codec is a byte-oriented LZSS
+ * with a 4 KB window, so decoding needs no memory other than the output, and encoding uses a
+ * 2 KB hash table allocated once. An optional preset dictionary, such as the JSON keys that
+ * most events contain, is placed in the window before the data so even short events compress.
+ *
+ * A compressed stream is:
+ *
+ * - The decoded size in bytes (uint16_t, little endian)
+ * - The dictionary id (uint16_t, little endian), 0 if no dictionary was used
+ * - Groups of a flag byte followed by up to 8 items. Bit 0 of the flag byte is the first item.
+ *   A 0 bit is a literal byte. A 1 bit is a match of 2 bytes: a 12-bit offset minus 1 (the
+ *   high 8 bits, then the low 4 bits in the high nibble of the second byte), and the length
+ *   minus 3 in the low nibble. The offset counts back from the current position in the
+ *   dictionary followed by the decoded data.
+ *
+ * Bytes after the end of the decoded data are ignored.
+ *
+ * Cloud data is CLOUD_PREFIX ("~Z") followed by the compressed stream, padded with zero bytes
+ * to a multiple of 4 bytes, encoded using Z85 (the ZeroMQ variant of Base85, which has no
+ * quotes or backslashes, so it can be used in JSON unchanged). There is a decoder for node.js
+ * servers in tools/compression-decoder.
+ */
+class PublishQueueCompress {
+public:
+    /**
+     * @brief Constructor
+     */
+    PublishQueueCompress();
+
+    /**
+     * @brief Destructor
+     */
+    virtual ~PublishQueueCompress();
+
+    /**
+     * @brief Enable compression
+     *
+     * @param dictionary Preset dictionary (MAX_DICTIONARY_SIZE bytes maximum), or NULL. It's copied.
+     * Data compressed with a dictionary can only be decoded with the same dictionary.
+     *
+     * @return false if the dictionary is too long or out of memory
+     */
+    bool init(const char *dictionary = NULL);
+
+    /**
+     * @brief Returns true if init() has been called successfully
+     */
+    bool isEnabled() const { return hashTable != 0; };
+
+    /**
+     * @brief Gets the id of the dictionary, stored in the compressed stream, or 0 if none
+     */
+    uint16_t getDictionaryId() const { return dictId; };
+
+    /**
+     * @brief Compress data
+     *
+     * @param src Data to compress
+     *
+     * @param srcLen Length of src in bytes
+     *
+     * @param dst Buffer for the compressed stream
+     *
+     * @param dstSize Size of dst. If the compressed stream is larger than this, 0 is returned, so
+     * pass less than srcLen to only compress when it makes the data smaller.
+     *
+     * @return Size of the compressed stream, or 0 if it does not fit or not enabled
+     */
+    size_t compress(const void *src, size_t srcLen, uint8_t *dst, size_t dstSize);
+
+    /**
+     * @brief Decompress a stream
+     *
+     * @param src The compressed stream
+     *
+     * @param srcLen Length of src in bytes
+     *
+     * @param dst Buffer for the decoded data
+     *
+     * @param dstSize Must be the decoded size from getDecodedSize()
+     *
+     * @return true if the stream was valid and used the same dictionary as this object
+     */
+    bool decompress(const uint8_t *src, size_t srcLen, void *dst, size_t dstSize) const;
+
+    /**
+     * @brief Gets the decoded size of a stream, or 0 if too short
+     */
+    static size_t getDecodedSize(const uint8_t *src, size_t srcLen);
+
+    /**
+     * @brief Compress an event as stored on the flash file system
+     *
+     * @param event The event. The whole structure is compressed, including the event name and the
+     * null terminator of the data.
+     *
+     * @param storedSize Filled in with the size of the compressed event. Not changed if NULL is returned.
+     *
+     * @return The compressed event in an internal buffer, valid until the next call, or NULL if not
+     * enabled or compressing would not make it smaller
+     */
+    const uint8_t *compressEvent(const PublishQueueEvent *event, size_t &storedSize);
+
+    /**
+     * @brief Decompress an event compressed using compressEvent()
+     *
+     * @param stored The compressed event
+     *
+     * @param storedSize Size of stored in bytes
+     *
+     * @param event Buffer for the event, allocated by the caller with getDecodedSize() bytes
+     *
+     * @param eventSize The size from getDecodedSize()
+     *
+     * @return true if valid. The caller must still check the event name.
+     */
+    bool decompressEvent(const uint8_t *stored, size_t storedSize, PublishQueueEvent *event, size_t eventSize) const;
+
+    /**
+     * @brief Gets the internal buffer of MAX_STORED_SIZE bytes, used to read compressed events
+     *
+     * @return The buffer, or NULL if out of memory. It's allocated the first time this is called,
+     * so events compressed earlier can be read even if compression is no longer enabled.
+     */
+    uint8_t *getBuffer();
+
+    /**
+     * @brief Encode event data for the cloud
+     *
+     * @param data The event data
+     *
+     * @return The encoded data in an internal buffer, valid until the next call, or NULL if not enabled
+     * or encoding would not make it shorter, in which case the data should be sent unchanged
+     */
+    const char *encodeCloud(const char *data);
+
+    /**
+     * @brief Decode event data encoded using encodeCloud()
+     *
+     * @param data The event data received by the cloud
+     *
+     * @param buf Buffer for the decoded data, which is null terminated
+     *
+     * @param bufSize Size of buf in bytes
+     *
+     * @return false if data is not valid encoded data or does not fit in buf
+     */
+    bool decodeCloud(const char *data, char *buf, size_t bufSize);
+
+    /**
+     * @brief Encode bytes using Z85
+     *
+     * @param src The bytes to encode. srcLen must be a multiple of 4.
+     *
+     * @param dst Buffer for the characters, which are null terminated. Must be srcLen * 5 / 4 + 1 bytes.
+     *
+     * @return The number of characters, or 0 if srcLen is not a multiple of 4 or dst is too small
+     */
+    static size_t z85Encode(const uint8_t *src, size_t srcLen, char *dst, size_t dstSize);
+
+    /**
+     * @brief Decode Z85 characters
+     *
+     * @param src The characters. srcLen must be a multiple of 5.
+     *
+     * @param dst Buffer for the bytes, srcLen * 4 / 5 bytes
+     *
+     * @return The number of bytes, or 0 if not valid Z85 or dst is too small
+     */
+    static size_t z85Decode(const char *src, size_t srcLen, uint8_t *dst, size_t dstSize);
+
+    /**
+     * @brief Stored without compression
+     */
+    static const uint8_t ENCODING_NONE = 0;
+
+    /**
+     * @brief Stored using compressEvent()
+     */
+    static const uint8_t ENCODING_LZSS = 1;
+
+    /**
+     * @brief Stored using PublishQueueCompact::encodeEvent()
+     */
+    static const uint8_t ENCODING_COMPACT = 2;
+
+    /**
+     * @brief Maximum size of the preset dictionary in bytes
+     */
+    static const size_t MAX_DICTIONARY_SIZE = 2048;
+
+    /**
+     * @brief Size of the decoded size and dictionary id at the beginning of a stream
+     */
+    static const size_t STREAM_HEADER_SIZE = 4;
+
+    /**
+     * @brief Maximum size of a compressed event, which is always smaller than the event
+     */
+    static const size_t MAX_STORED_SIZE = STREAM_HEADER_SIZE + particle::protocol::MAX_EVENT_NAME_LENGTH + particle::protocol::MAX_EVENT_DATA_LENGTH + 16;
+
+    /**
+     * @brief Prefix of event data encoded using encodeCloud()
+     */
+    static const char * const CLOUD_PREFIX;
+
+protected:
+    /**
+     * @brief This class is not copyable
+     */
+    PublishQueueCompress(const PublishQueueCompress&) = delete;
+
+    /**
+     * @brief This class is not copyable
+     */
+    PublishQueueCompress& operator=(const PublishQueueCompress&) = delete;
+
+    static const size_t MIN_MATCH = 3; //!< Shortest match, encoded as length 0
+    static const size_t MAX_MATCH = 18; //!< Longest match, encoded as length 15
+    static const size_t MAX_OFFSET = 4096; //!< Farthest match, encoded as offset 4095
+    static const size_t HASH_BITS = 10; //!< Size of hashTable is 1 << HASH_BITS entries
+
+    char *dict = 0; //!< Copy of the preset dictionary, or NULL
+    size_t dictLen = 0; //!< Length of dict
+    uint16_t dictId = 0; //!< Id of dict, 0 if none
+    uint16_t *hashTable = 0; //!< Most recent position + 1 of each hash of 3 bytes, used when compressing
+    uint8_t *buffer = 0; //!< MAX_STORED_SIZE bytes, from getBuffer()
+    char *cloudBuf = 0; //!< Encoded cloud data, from encodeCloud()
+};
+
+#endif /* __PUBLISHQUEUECOMPRESS_H */
@@ -0,0 +1,155 @@
+#include "PublishQueueEventPool.h"
+#include "PublishQueuePosixRK.h"
+
+static Logger _log("app.pubq");
+
+PublishQueueEventPool::PublishQueueEventPool() {
+}
+
+PublishQueueEventPool::~PublishQueueEventPool() {
+    delete[] buf;
+    if (mutex) {
+        os_mutex_recursive_destroy(mutex);
+    }
+}
+
+bool PublishQueueEventPool::init(size_t numEvents, size_t maxDataSize) {
+    if (buf || numEvents == 0) {
+        return false;
+    }
+
+    // Round up so each buffer is aligned for the FreeBlock pointer
+    size_t size = sizeof(PublishQueueEvent) + maxDataSize;
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    buf = new char[numEvents * size];
+    if (!buf) {
+        _log.error("event pool out of memory (%u bytes)", numEvents * size);
+        return false;
+    }
+    os_mutex_recursive_create(&mutex);
+
+    blockSize = size;
+    this->maxDataSize = maxDataSize;
+    this->numEvents = numEvents;
+
+    for(size_t ii = numEvents; ii-- > 0; ) {
+        FreeBlock *block = (FreeBlock *)&buf[ii * blockSize];
+        block->next = freeList;
+        freeList = block;
+    }
+    numFree = numEvents;
+
+    _log.trace("event pool %u events, %u bytes", numEvents, numEvents * blockSize);
+    return true;
+}
+
+PublishQueueEvent *PublishQueueEventPool::alloc(size_t eventSize, bool allowHeap) {
+    if (buf && eventSize <= blockSize) {
+        FreeBlock *block = NULL;
+
+        os_mutex_recursive_lock(mutex);
+        if (freeList) {
+            block = freeList;
+            freeList = block->next;
+            numFree--;
+        }
+        os_mutex_recursive_unlock(mutex);
+
+        if (block) {
+            return (PublishQueueEvent *)block;
+        }
+        if (!allowHeap) {
+            return NULL;
+        }
+    }
+    return (PublishQueueEvent *) new char[eventSize];
+}
+
+void PublishQueueEventPool::free(PublishQueueEvent *event) {
+    char *p = (char *)event;
+
+    if (buf && p >= buf && p < &buf[numEvents * blockSize]) {
+        FreeBlock *block = (FreeBlock *)p;
+
+        os_mutex_recursive_lock(mutex);
+        block->next = freeList;
+        freeList = block;
+        numFree++;
+        os_mutex_recursive_unlock(mutex);
+    }
+    else {
+        delete[] p;
+    }
+}
+
+
+// Size of an event in RAM, not including unused space in its buffer
+static size_t getEventBytes(const PublishQueueEvent *event) {
+    return PublishQueueEvent::getSize(event->getDataLen());
+}
+
+PublishQueueEventRing::PublishQueueEventRing() {
+}
+
+PublishQueueEventRing::~PublishQueueEventRing() {
+    delete[] events;
+}
+
+bool PublishQueueEventRing::reserve(size_t newCapacity) {
+    if (newCapacity <= capacity) {
+        return true;
+    }
+
+    PublishQueueEvent **newEvents = new PublishQueueEvent*[newCapacity];
+    if (!newEvents) {
+        return false;
+    }
+    for(size_t ii = 0; ii < count; ii++) {
+        newEvents[ii] = (*this)[ii];
+    }
+    delete[] events;
+
+    events = newEvents;
+    capacity = newCapacity;
+    head = 0;
+    return true;
+}
+
+bool PublishQueueEventRing::push_back(PublishQueueEvent *event) {
+    if (count == capacity && !reserve(capacity ? (capacity * 2) : 4)) {
+        return false;
+    }
+    events[(head + count) % capacity] = event;
+    count++;
+    bytes += getEventBytes(event);
+    return true;
+}
+
+bool PublishQueueEventRing::push_front(PublishQueueEvent *event) {
+    if (count == capacity && !reserve(capacity ? (capacity * 2) : 4)) {
+        return false;
+    }
+    head = (head + capacity - 1) % capacity;
+    events[head] = event;
+    count++;
+    bytes += getEventBytes(event);
+    return true;
+}
+
+void PublishQueueEventRing::pop_front() {
+    bytes -= getEventBytes(front());
+    head = (head + 1) % capacity;
+    count--;
+}
+
+void PublishQueueEventRing::pop_back() {
+    bytes -= getEventBytes(back());
+    count--;
+}
+
+void PublishQueueEventRing::set(size_t index, PublishQueueEvent *event) {
+    PublishQueueEvent *&slot = events[(head + index) % capacity];
+    bytes = bytes - getEventBytes(slot) + getEventBytes(event);
+    slot = event;
+}
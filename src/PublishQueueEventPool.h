@@ -0,0 +1,218 @@
+#ifndef __PUBLISHQUEUEEVENTPOOL_H
+#define __PUBLISHQUEUEEVENTPOOL_H
+
+// Github: https://github.com/rickkas7/PublishQueuePosixRK
+// License: MIT
+
+#include "Particle.h"
+
+struct PublishQueueEvent;
+
+/**
+ * @brief Fixed-capacity pool of preallocated event buffers
+ *
+ * All of the buffers are allocated in one block by init(), each large enough for a
+ * PublishQueueEvent with maxDataSize bytes of data. After that, alloc() and free()
+ * take a buffer from and return it to a free list without using the heap.
+ *
+ * Until init() is called, or if it's called with 0 events, alloc() and free() use
+ * the heap. Events that are too large for a buffer, and events allocated when the
+ * pool is empty if allowHeap is true, also use the heap. free() works with both.
+ *
+ * This class is thread-safe once init() has been called.
+ */
+class PublishQueueEventPool {
+public:
+    /**
+     * @brief Constructor
+     */
+    PublishQueueEventPool();
+
+    /**
+     * @brief Destructor
+     */
+    virtual ~PublishQueueEventPool();
+
+    /**
+     * @brief Allocate the buffers. Can only be called once.
+     *
+     * @param numEvents Number of buffers
+     *
+     * @param maxDataSize Size of the largest event data that fits in a buffer, not including the null terminator
+     *
+     * @return true if the buffers were allocated, false if out of memory or already initialized
+     */
+    bool init(size_t numEvents, size_t maxDataSize);
+
+    /**
+     * @brief Allocate an event
+     *
+     * @param eventSize Size of the PublishQueueEvent, including the eventData and its null terminator
+     *
+     * @param allowHeap If the pool is empty, allocate from the heap instead of returning NULL
+     *
+     * @return The event, with unspecified contents, or NULL if none is available. Use free() to release it.
+     */
+    PublishQueueEvent *alloc(size_t eventSize, bool allowHeap = true);
+
+    /**
+     * @brief Release an event allocated by alloc(). NULL is ignored.
+     */
+    void free(PublishQueueEvent *event);
+
+    /**
+     * @brief Returns true if init() allocated buffers
+     */
+    bool isEnabled() const { return numEvents != 0; };
+
+    /**
+     * @brief Gets the number of buffers in the pool
+     */
+    size_t getNumEvents() const { return numEvents; };
+
+    /**
+     * @brief Gets the number of buffers not in use
+     */
+    size_t getNumFree() const { return numFree; };
+
+    /**
+     * @brief Gets the largest event data size that fits in a buffer
+     */
+    size_t getMaxDataSize() const { return maxDataSize; };
+
+protected:
+    /**
+     * @brief This class is not copyable
+     */
+    PublishQueueEventPool(const PublishQueueEventPool&) = delete;
+
+    /**
+     * @brief This class is not copyable
+     */
+    PublishQueueEventPool& operator=(const PublishQueueEventPool&) = delete;
+
+    /**
+     * @brief Header of a buffer that is not in use, stored in the buffer itself
+     */
+    struct FreeBlock {
+        FreeBlock *next; //!< Next free buffer, or NULL
+    };
+
+    char *buf = 0; //!< All of the buffers, numEvents * blockSize bytes
+    size_t blockSize = 0; //!< Size of each buffer in bytes
+    size_t numEvents = 0; //!< Number of buffers
+    size_t maxDataSize = 0; //!< Largest event data that fits in a buffer
+    size_t numFree = 0; //!< Number of buffers in freeList
+    FreeBlock *freeList = 0; //!< Buffers not in use
+    os_mutex_recursive_t mutex = 0; //!< Protects freeList, created by init()
+};
+
+/**
+ * @brief Double-ended queue of events in a circular buffer
+ *
+ * Used instead of std::deque for the RAM queue so adding and removing events does not
+ * allocate memory once reserve() has been called. If more events than the reserved
+ * capacity are added, the buffer is grown.
+ *
+ * This class is not thread-safe; PublishQueuePosix uses it with its mutex locked.
+ */
+class PublishQueueEventRing {
+public:
+    /**
+     * @brief Constructor
+     */
+    PublishQueueEventRing();
+
+    /**
+     * @brief Destructor. Does not free the events in the queue.
+     */
+    virtual ~PublishQueueEventRing();
+
+    /**
+     * @brief Make sure there is room for capacity events without allocating memory
+     *
+     * @return false if out of memory
+     */
+    bool reserve(size_t capacity);
+
+    /**
+     * @brief Add an event to the end. Returns false if out of memory.
+     */
+    bool push_back(PublishQueueEvent *event);
+
+    /**
+     * @brief Add an event to the beginning. Returns false if out of memory.
+     */
+    bool push_front(PublishQueueEvent *event);
+
+    /**
+     * @brief Remove the first event. Must not be empty.
+     */
+    void pop_front();
+
+    /**
+     * @brief Remove the last event. Must not be empty.
+     */
+    void pop_back();
+
+    /**
+     * @brief Gets the first event. Must not be empty.
+     */
+    PublishQueueEvent *front() const { return events[head]; };
+
+    /**
+     * @brief Gets the last event. Must not be empty.
+     */
+    PublishQueueEvent *back() const { return events[(head + count - 1) % capacity]; };
+
+    /**
+     * @brief Gets the event at index, 0 = first. index must be less than size().
+     */
+    PublishQueueEvent *operator[](size_t index) const { return events[(head + index) % capacity]; };
+
+    /**
+     * @brief Replaces the event at index, 0 = first. index must be less than size().
+     */
+    void set(size_t index, PublishQueueEvent *event);
+
+    /**
+     * @brief Gets the number of events
+     */
+    size_t size() const { return count; };
+
+    /**
+     * @brief Returns true if there are no events
+     */
+    bool empty() const { return count == 0; };
+
+    /**
+     * @brief Gets the total size of the events in bytes, as returned by PublishQueueEvent::getSize()
+     *
+     * This is updated as events are added and removed, so it does not need to check each event.
+     */
+    size_t getBytes() const { return bytes; };
+
+    /**
+     * @brief Remove all events without freeing them
+     */
+    void clear() { head = count = bytes = 0; };
+
+protected:
+    /**
+     * @brief This class is not copyable
+     */
+    PublishQueueEventRing(const PublishQueueEventRing&) = delete;
+
+    /**
+     * @brief This class is not copyable
+     */
+    PublishQueueEventRing& operator=(const PublishQueueEventRing&) = delete;
+
+    PublishQueueEvent **events = 0; //!< Circular buffer of capacity events
+    size_t capacity = 0; //!< Size of events
+    size_t head = 0; //!< Index of the first event
+    size_t count = 0; //!< Number of events
+    size_t bytes = 0; //!< Total size of the events, from getBytes()
+};
+
+#endif /* __PUBLISHQUEUEEVENTPOOL_H */
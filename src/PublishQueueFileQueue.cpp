@@ -0,0 +1,235 @@
+#include "PublishQueueFileQueue.h"
+#include "PublishQueueSegmentLog.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+static Logger _log("app.pubq");
+
+static const char * const INDEX_NAME = "pqindex";
+static const char * const TEMP_NAME = "pqwrite.tmp";
+
+PublishQueueFileQueue::PublishQueueFileQueue() {
+}
+
+PublishQueueFileQueue::~PublishQueueFileQueue() {
+}
+
+bool PublishQueueFileQueue::loadIndex() {
+    PublishQueueIndexData data;
+    bool valid = false;
+
+    int fd = open(getIndexPath(), O_RDONLY);
+    if (fd >= 0) {
+        valid = (read(fd, &data, sizeof(data)) == sizeof(data) &&
+            data.magic == INDEX_MAGIC &&
+            data.version == INDEX_VERSION &&
+            data.crc == PublishQueueSegmentLog::crc32(&data, offsetof(PublishQueueIndexData, crc)) &&
+            data.lastFileNum >= 0 &&
+            data.headFileNum >= 0 && data.headFileNum <= data.tailFileNum && data.tailFileNum <= data.lastFileNum);
+        close(fd);
+    }
+    if (!valid) {
+        _log.trace("queue index missing or invalid");
+        return false;
+    }
+
+    // Files sent since the index was saved have been removed from the beginning of the queue
+    int head = data.headFileNum;
+    int tail = data.tailFileNum;
+    int probes = 0;
+    while(head != 0 && head <= tail && !fileNumExists(head)) {
+        head++;
+        if (++probes > MAX_INDEX_PROBES) {
+            _log.trace("queue index too old");
+            return false;
+        }
+    }
+    if (head == 0 || head > tail) {
+        // Empty when saved, or every file in it was sent since. There's no file left to find
+        // later files from, so scan the directory, which is fast when the queue is nearly empty.
+        _log.trace("queue index empty");
+        return false;
+    }
+
+    // Files written since the index was saved are after the end
+    while(fileNumExists(tail + 1)) {
+        tail++;
+        if (++probes > MAX_INDEX_PROBES) {
+            _log.trace("queue index too old");
+            return false;
+        }
+    }
+    if (head < tail && !fileNumExists(tail)) {
+        // The last file was removed, which doesn't happen when files are only removed from the beginning
+        _log.trace("queue index inconsistent");
+        return false;
+    }
+
+    queue.clear();
+    for(int fileNum = head; fileNum <= tail; fileNum++) {
+        queue.push_back(fileNum);
+    }
+    lastFileNum = (tail > data.lastFileNum) ? tail : data.lastFileNum;
+
+    saved = data;
+    savedValid = (head == data.headFileNum && tail == data.tailFileNum);
+
+    _log.trace("queue index generation=%lu lastFileNum=%d queueLen=%u", (unsigned long) data.generation, lastFileNum, (unsigned) queue.size());
+    return true;
+}
+
+bool PublishQueueFileQueue::saveIndex(int oldestFileNum) {
+    PublishQueueIndexData data;
+    data.magic = INDEX_MAGIC;
+    data.version = INDEX_VERSION;
+    data.reserved1 = 0;
+    data.reserved2 = 0;
+    data.headFileNum = queue.empty() ? 0 : queue.front();
+    data.tailFileNum = queue.empty() ? 0 : queue.back();
+    data.lastFileNum = lastFileNum;
+    if (oldestFileNum != 0 && (data.headFileNum == 0 || oldestFileNum < data.headFileNum)) {
+        // Files being sent are between oldestFileNum and the head of the queue. Any that are
+        // deleted before the next boot are skipped or discarded by loadIndex().
+        data.headFileNum = oldestFileNum;
+        if (data.tailFileNum == 0) {
+            data.tailFileNum = lastFileNum;
+        }
+    }
+
+    if (savedValid && data.headFileNum == saved.headFileNum && data.tailFileNum == saved.tailFileNum && data.lastFileNum == saved.lastFileNum) {
+        return true;
+    }
+    data.generation = saved.generation + 1;
+    data.crc = PublishQueueSegmentLog::crc32(&data, offsetof(PublishQueueIndexData, crc));
+
+    // A partial write is detected by the CRC, and the next boot scans the directory instead
+    int fd = open(getIndexPath(), O_WRONLY | O_CREAT | O_TRUNC);
+    if (fd < 0) {
+        _log.error("cannot open queue index errno=%d", errno);
+        savedValid = false;
+        return false;
+    }
+    bool result = (write(fd, &data, sizeof(data)) == sizeof(data));
+    close(fd);
+
+    saved = data;
+    savedValid = result;
+    return result;
+}
+
+void PublishQueueFileQueue::removeIndex() {
+    unlink(getIndexPath());
+    savedValid = false;
+}
+
+String PublishQueueFileQueue::getIndexPath() const {
+    return String::format("%s/%s", getDirPath(), INDEX_NAME);
+}
+
+bool PublishQueueFileQueue::commitTempFile(int fileNum) {
+    if (rename(getTempPath(), getPathForFileNum(fileNum)) != 0) {
+        _log.error("cannot rename to fileNum=%d errno=%d", fileNum, errno);
+        unlink(getTempPath());
+        return false;
+    }
+    return true;
+}
+
+bool PublishQueueFileQueue::removeTempFile() {
+    if (unlink(getTempPath()) != 0) {
+        return false;
+    }
+    _log.info("removed incomplete event file");
+    return true;
+}
+
+String PublishQueueFileQueue::getTempPath() const {
+    return String::format("%s/%s", getDirPath(), TEMP_NAME);
+}
+
+size_t PublishQueueFileQueue::getFileBytes(int oldestFileNum) {
+    size_t result = 0;
+
+    int first = getFileFromQueue(false);
+    if (oldestFileNum != 0 && (first == 0 || oldestFileNum < first)) {
+        first = oldestFileNum;
+    }
+    if (first == 0) {
+        return 0;
+    }
+
+    // Files being sent may have been deleted out of order, so missing files are skipped
+    for(int fileNum = first; fileNum <= lastFileNum; fileNum++) {
+        struct stat sb;
+        if (stat(getPathForFileNum(fileNum), &sb) == 0) {
+            result += sb.st_size;
+        }
+    }
+    return result;
+}
+
+void PublishQueueFileQueue::setFileSize(int fileNum, size_t size) {
+    if (fileSizes.empty()) {
+        fileSizesFirst = fileNum;
+    }
+    else
+    if (fileNum < fileSizesFirst) {
+        // Only happens if files are added out of order, which the queue does not do
+        return;
+    }
+    while(fileNum >= fileSizesFirst + (int)fileSizes.size()) {
+        fileSizes.push_back(0);
+    }
+    uint32_t &entry = fileSizes[fileNum - fileSizesFirst];
+    queueBytes = queueBytes - entry + size;
+    entry = (uint32_t) size;
+}
+
+void PublishQueueFileQueue::loadFileSizes(int oldestFileNum) {
+    fileSizes.clear();
+    queueBytes = 0;
+
+    int first = getFileFromQueue(false);
+    if (oldestFileNum != 0 && (first == 0 || oldestFileNum < first)) {
+        first = oldestFileNum;
+    }
+    if (first == 0) {
+        return;
+    }
+    for(int fileNum = first; fileNum <= lastFileNum; fileNum++) {
+        struct stat sb;
+        if (stat(getPathForFileNum(fileNum), &sb) == 0) {
+            setFileSize(fileNum, sb.st_size);
+        }
+    }
+}
+
+void PublishQueueFileQueue::removeFileNum(int fileNum, bool allExtensions) {
+    SequentialFile::removeFileNum(fileNum, allExtensions);
+
+    if (fileNum >= fileSizesFirst && fileNum < fileSizesFirst + (int)fileSizes.size()) {
+        queueBytes -= fileSizes[fileNum - fileSizesFirst];
+        fileSizes[fileNum - fileSizesFirst] = 0;
+
+        // Files being sent can be removed out of order, so only the beginning is trimmed
+        while(!fileSizes.empty() && fileSizes.front() == 0) {
+            fileSizes.pop_front();
+            fileSizesFirst++;
+        }
+    }
+}
+
+void PublishQueueFileQueue::removeAll(bool removeDir, const char *excludeName) {
+    SequentialFile::removeAll(removeDir, excludeName);
+
+    fileSizes.clear();
+    queueBytes = 0;
+}
+
+bool PublishQueueFileQueue::fileNumExists(int fileNum) {
+    struct stat sb;
+    return stat(getPathForFileNum(fileNum), &sb) == 0;
+}
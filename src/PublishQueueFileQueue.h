@@ -0,0 +1,195 @@
+#ifndef __PUBLISHQUEUEFILEQUEUE_H
+#define __PUBLISHQUEUEFILEQUEUE_H
+
+// Github: https://github.com/rickkas7/PublishQueuePosixRK
+// License: MIT
+
+#include "Particle.h"
+#include "SequentialFileRK.h"
+
+#include <deque>
+
+/**
+ * @brief Structure stored in the queue index file
+ *
+ * The file queue is always a contiguous range of file numbers, as files are only added at
+ * the end and removed from the beginning, so this is enough to rebuild it.
+ */
+struct PublishQueueIndexData {
+    uint32_t magic;         //!< PublishQueueFileQueue::INDEX_MAGIC = 0x5e9a3c19
+    uint8_t version;        //!< PublishQueueFileQueue::INDEX_VERSION = 1
+    uint8_t reserved1;      //!< Reserved, currently 0
+    uint16_t reserved2;     //!< Reserved, currently 0
+    uint32_t generation;    //!< Incremented each time the index is saved
+    int32_t headFileNum;    //!< Oldest file in the queue, 0 if empty
+    int32_t tailFileNum;    //!< Newest file in the queue, 0 if empty
+    int32_t lastFileNum;    //!< Last file number reserved
+    uint32_t crc;           //!< CRC-32 of the previous fields
+};
+
+/**
+ * @brief SequentialFile with a persisted index so the queue directory does not need to be scanned at boot
+ *
+ * SequentialFile::scanDir() reads every entry in the queue directory and sorts the file numbers,
+ * which takes a while when a large number of events are queued. saveIndex() stores the first
+ * and last file numbers in a small file, and loadIndex() rebuilds the queue from it.
+ *
+ * PublishQueuePosix saves it after each pass that writes events to files, so files only need to
+ * be found past the end if the device reset during the pass. Files sent after it was saved are
+ * found by loadIndex() checking whether the files at the beginning still exist. If the index is
+ * missing, corrupted, empty, or too many files changed, loadIndex() returns false and scanDir()
+ * must be used instead.
+ *
+ * This class is used by PublishQueuePosix, which calls it with its mutex locked.
+ */
+class PublishQueueFileQueue : public SequentialFile {
+public:
+    /**
+     * @brief Constructor
+     */
+    PublishQueueFileQueue();
+
+    /**
+     * @brief Destructor
+     */
+    virtual ~PublishQueueFileQueue();
+
+    /**
+     * @brief Rebuild the queue from the index file instead of scanning the directory
+     *
+     * @return true if the queue was rebuilt, false if scanDir() needs to be called instead
+     */
+    bool loadIndex();
+
+    /**
+     * @brief Save the index file, if the queue has changed since it was last saved
+     *
+     * @param oldestFileNum The oldest file that has been removed from the queue to send but not
+     * deleted yet, or 0 if none. The index includes it so it's sent again after a reset.
+     *
+     * @return true if the index is up to date
+     */
+    bool saveIndex(int oldestFileNum = 0);
+
+    /**
+     * @brief Delete the index file, so the next boot scans the directory
+     */
+    void removeIndex();
+
+    /**
+     * @brief Gets the last file number reserved, which is the newest file unless it was not written
+     */
+    int getLastFileNum() const { return lastFileNum; };
+
+    /**
+     * @brief Gets the total size of the queued files in bytes
+     *
+     * @param oldestFileNum The oldest file that has been removed from the queue to send but not
+     * deleted yet, or 0 if none. Files from it to the head of the queue are also counted.
+     *
+     * This checks the size of each file on the file system, so it's not intended to be called
+     * frequently.
+     */
+    size_t getFileBytes(int oldestFileNum = 0);
+
+    /**
+     * @brief Record the size of the file for fileNum after writing it
+     *
+     * This is called each time a file is written, including when an event is rewritten, so
+     * getQueueBytes() does not need to access the file system.
+     */
+    void setFileSize(int fileNum, size_t size);
+
+    /**
+     * @brief Set the size of each file from oldestFileNum or the head of the queue through the last
+     * file number by checking the file system
+     *
+     * @param oldestFileNum The oldest file that has been removed from the queue to send but not
+     * deleted yet, or 0 if none.
+     *
+     * Files in the queue at boot were not written by setFileSize(), so this is done once when a byte
+     * limit is used.
+     */
+    void loadFileSizes(int oldestFileNum = 0);
+
+    /**
+     * @brief Gets the total size of the files written using setFileSize() that have not been removed
+     *
+     * This includes files being sent that have not been deleted yet. It's tracked as files are
+     * written and removed, so it's fast and does not access the file system.
+     */
+    size_t getQueueBytes() const { return queueBytes; };
+
+    /**
+     * @brief Remove the file for fileNum. Hides SequentialFile::removeFileNum() to also forget its size.
+     */
+    void removeFileNum(int fileNum, bool allExtensions);
+
+    /**
+     * @brief Remove all files. Hides SequentialFile::removeAll() to also forget their sizes.
+     */
+    void removeAll(bool removeDir, const char *excludeName = NULL);
+
+    /**
+     * @brief Get the pathname of the index file
+     */
+    String getIndexPath() const;
+
+    /**
+     * @brief Move the file at getTempPath() to the file for fileNum, replacing it if it exists
+     *
+     * Events are written to the temporary file first, so a reset while writing never leaves a
+     * partial event file in the queue. Rename is atomic, so the file for fileNum is either the
+     * complete new file or unchanged.
+     *
+     * @return true if renamed. If not, the temporary file is removed.
+     */
+    bool commitTempFile(int fileNum);
+
+    /**
+     * @brief Remove a temporary file left by a reset while writing an event
+     *
+     * @return true if there was one
+     */
+    bool removeTempFile();
+
+    /**
+     * @brief Get the pathname of the temporary file events are written to before commitTempFile()
+     *
+     * It's not a file number, so scanDir() skips it.
+     */
+    String getTempPath() const;
+
+    /**
+     * @brief Magic bytes at the beginning of the index file
+     */
+    static const uint32_t INDEX_MAGIC = 0x5e9a3c19;
+
+    /**
+     * @brief Version of the index file format
+     */
+    static const uint8_t INDEX_VERSION = 1;
+
+    /**
+     * @brief Maximum number of files loadIndex() checks before falling back to scanning
+     */
+    static const int MAX_INDEX_PROBES = 64;
+
+    /**
+     * @brief Returns true if the file for fileNum exists
+     *
+     * After loadIndex(), the queue can include numbers of files that were sent out of order
+     * by pipelining before the device reset. Use this to tell them from corrupted files.
+     */
+    bool fileNumExists(int fileNum);
+
+protected:
+
+    PublishQueueIndexData saved = {}; //!< Contents of the index file when last loaded or saved
+    bool savedValid = false; //!< true if saved matches the index file
+    std::deque<uint32_t> fileSizes; //!< Size of each file from fileSizesFirst, 0 if removed or not known
+    int fileSizesFirst = 0; //!< File number of the first entry in fileSizes
+    size_t queueBytes = 0; //!< Sum of fileSizes
+};
+
+#endif /* __PUBLISHQUEUEFILEQUEUE_H */
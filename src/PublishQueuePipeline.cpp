@@ -0,0 +1,108 @@
+#include "PublishQueuePipeline.h"
+
+PublishQueuePipeline::PublishQueuePipeline() {
+}
+
+PublishQueuePipeline::~PublishQueuePipeline() {
+    delete[] slots;
+}
+
+bool PublishQueuePipeline::init(size_t capacity) {
+    if (slots || capacity == 0) {
+        return false;
+    }
+    slots = new PublishQueueInFlight[capacity];
+    if (!slots) {
+        return false;
+    }
+    this->capacity = capacity;
+    return true;
+}
+
+PublishQueueInFlight *PublishQueuePipeline::add(PublishQueueEvent *event, uint8_t source, uint8_t priority, int fileNum, uint32_t segmentSeq) {
+    if (full()) {
+        return NULL;
+    }
+    PublishQueueInFlight &entry = slots[(head + count) % capacity];
+    entry.id = nextId++;
+    entry.event = event;
+    entry.source = source;
+    entry.priority = priority;
+    entry.fileNum = fileNum;
+    entry.segmentSeq = segmentSeq;
+    entry.sendTime = 0;
+    entry.state = STATE_SENDING;
+    count++;
+    return &entry;
+}
+
+void PublishQueuePipeline::removeFront() {
+    if (count) {
+        slots[head].event = NULL;
+        head = (head + 1) % capacity;
+        count--;
+    }
+}
+
+// static
+void PublishQueuePipeline::complete(PublishQueueInFlight *entry, uint32_t id, bool succeeded) {
+    // The id only changes once the entry is no longer STATE_SENDING, so this is just a sanity check
+    if (entry->id == id && entry->state == STATE_SENDING) {
+        entry->state = succeeded ? STATE_SUCCEEDED : STATE_FAILED;
+    }
+}
+
+size_t PublishQueuePipeline::countState(uint8_t state) const {
+    size_t result = 0;
+    for(size_t ii = 0; ii < count; ii++) {
+        if (slots[(head + ii) % capacity].state == state) {
+            result++;
+        }
+    }
+    return result;
+}
+
+size_t PublishQueuePipeline::countSource(uint8_t source) const {
+    size_t result = 0;
+    for(size_t ii = 0; ii < count; ii++) {
+        const PublishQueueInFlight &entry = slots[(head + ii) % capacity];
+        if (entry.source == source && entry.event) {
+            result++;
+        }
+    }
+    return result;
+}
+
+size_t PublishQueuePipeline::getNumFiles(uint8_t priority) const {
+    size_t result = 0;
+    for(size_t ii = 0; ii < count; ii++) {
+        const PublishQueueInFlight &entry = slots[(head + ii) % capacity];
+        if (entry.fileNum != 0 && entry.priority == priority) {
+            result++;
+        }
+    }
+    return result;
+}
+
+int PublishQueuePipeline::getOldestFileNum(uint8_t priority) const {
+    int result = 0;
+    for(size_t ii = 0; ii < count; ii++) {
+        const PublishQueueInFlight &entry = slots[(head + ii) % capacity];
+        int fileNum = entry.fileNum;
+        if (fileNum != 0 && entry.priority == priority && (result == 0 || fileNum < result)) {
+            result = fileNum;
+        }
+    }
+    return result;
+}
+
+uint32_t PublishQueuePipeline::getLastSegmentSeq() const {
+    uint32_t result = 0;
+    for(size_t ii = 0; ii < count; ii++) {
+        uint32_t seq = slots[(head + ii) % capacity].segmentSeq;
+        if (seq > result) {
+            result = seq;
+        }
+    }
+    return result;
+}
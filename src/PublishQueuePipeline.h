@@ -0,0 +1,195 @@
+#ifndef __PUBLISHQUEUEPIPELINE_H
+#define __PUBLISHQUEUEPIPELINE_H
+
+// Github: https://github.com/rickkas7/PublishQueuePosixRK
+// License: MIT
+
+#include "Particle.h"
+
+#include <atomic>
+
+struct PublishQueueEvent;
+
+/**
+ * @brief An event that has been sent and not yet removed from the queue
+ */
+struct PublishQueueInFlight {
+    uint32_t id;                    //!< Sequence id, assigned in the order events were first sent
+    PublishQueueEvent *event;       //!< The event, or NULL once it has been sent successfully
+    uint8_t source;                 //!< PublishQueuePipeline::SOURCE_RAM, SOURCE_FILE or SOURCE_SEGMENT
+    uint8_t priority;               //!< Priority lane the event came from, 0 for the default queue
+    int fileNum;                    //!< File the event was read from (no longer in the file queue), or 0
+    uint32_t segmentSeq;            //!< Sequence number in the segment log, or 0
+    unsigned long sendTime;         //!< millis() value when the event was last sent
+    std::atomic<uint8_t> state;     //!< PublishQueuePipeline::STATE_SENDING, etc. Set from the completion callback.
+};
+
+/**
+ * @brief Fixed size window of events being published at the same time
+ *
+ * Used by PublishQueuePosix when withPipelining() is set. Entries are kept in the order they
+ * were first sent. Publishes can complete in any order; the completion callback finds its entry
+ * by id and only sets its state, and PublishQueuePosix removes the events from the queue from
+ * loop(). Entries are removed from this window from the beginning only, so events from the
+ * segment log, which can only be removed from the head, are removed in order.
+ */
+class PublishQueuePipeline {
+public:
+    /**
+     * @brief Constructor
+     */
+    PublishQueuePipeline();
+
+    /**
+     * @brief Destructor. Does not free the events in the window.
+     */
+    virtual ~PublishQueuePipeline();
+
+    /**
+     * @brief Allocate the window. Can only be called once.
+     *
+     * @param capacity Maximum number of events being published at the same time
+     *
+     * @return false if out of memory, or already initialized
+     */
+    bool init(size_t capacity);
+
+    /**
+     * @brief Add an event to the end of the window, in STATE_SENDING
+     *
+     * @return The entry, or NULL if the window is full
+     */
+    PublishQueueInFlight *add(PublishQueueEvent *event, uint8_t source, uint8_t priority, int fileNum, uint32_t segmentSeq);
+
+    /**
+     * @brief Remove the entry at the beginning of the window. Does not free its event.
+     */
+    void removeFront();
+
+    /**
+     * @brief Gets an entry
+     *
+     * @param index 0 is the oldest entry, must be less than size()
+     */
+    PublishQueueInFlight &at(size_t index) { return slots[(head + index) % capacity]; };
+
+    /**
+     * @brief Mark an entry as complete. Called from the publish completion callback.
+     *
+     * @param entry The entry passed to the callback
+     *
+     * @param id The id of the entry when the publish was started
+     *
+     * @param succeeded true if the publish succeeded
+     */
+    static void complete(PublishQueueInFlight *entry, uint32_t id, bool succeeded);
+
+    /**
+     * @brief Gets the number of entries in the window
+     */
+    size_t size() const { return count; };
+
+    /**
+     * @brief Returns true if the window is empty
+     */
+    bool empty() const { return count == 0; };
+
+    /**
+     * @brief Returns true if the window is full
+     */
+    bool full() const { return count >= capacity; };
+
+    /**
+     * @brief Returns true if init() has been called
+     */
+    bool isEnabled() const { return capacity != 0; };
+
+    /**
+     * @brief Gets the maximum number of entries
+     */
+    size_t getCapacity() const { return capacity; };
+
+    /**
+     * @brief Gets the number of entries in a state
+     */
+    size_t countState(uint8_t state) const;
+
+    /**
+     * @brief Gets the number of entries with an event from a source that have not been sent successfully
+     */
+    size_t countSource(uint8_t source) const;
+
+    /**
+     * @brief Gets the number of entries from a priority whose file has not been deleted yet
+     */
+    size_t getNumFiles(uint8_t priority) const;
+
+    /**
+     * @brief Gets the smallest file number of the entries from a priority, or 0 if none
+     */
+    int getOldestFileNum(uint8_t priority) const;
+
+    /**
+     * @brief Gets the largest segment log sequence number of the entries, or 0 if none
+     */
+    uint32_t getLastSegmentSeq() const;
+
+    /**
+     * @brief The publish is in progress
+     */
+    static const uint8_t STATE_SENDING = 0;
+
+    /**
+     * @brief The publish succeeded, set by the completion callback
+     */
+    static const uint8_t STATE_SUCCEEDED = 1;
+
+    /**
+     * @brief The publish failed, set by the completion callback
+     */
+    static const uint8_t STATE_FAILED = 2;
+
+    /**
+     * @brief The publish failed and the event needs to be sent again
+     */
+    static const uint8_t STATE_WAITING = 3;
+
+    /**
+     * @brief The event was sent and removed from the queue, except for the segment log
+     */
+    static const uint8_t STATE_DONE = 4;
+
+    /**
+     * @brief The event came from the RAM queue
+     */
+    static const uint8_t SOURCE_RAM = 0;
+
+    /**
+     * @brief The event came from a file
+     */
+    static const uint8_t SOURCE_FILE = 1;
+
+    /**
+     * @brief The event came from the segment log
+     */
+    static const uint8_t SOURCE_SEGMENT = 2;
+
+protected:
+    /**
+     * @brief This class is not copyable
+     */
+    PublishQueuePipeline(const PublishQueuePipeline&) = delete;
+
+    /**
+     * @brief This class is not copyable
+     */
+    PublishQueuePipeline& operator=(const PublishQueuePipeline&) = delete;
+
+    PublishQueueInFlight *slots = 0; //!< Array of capacity entries
+    size_t capacity = 0; //!< Size of slots
+    size_t head = 0; //!< Index in slots of the oldest entry
+    size_t count = 0; //!< Number of entries in use
+    uint32_t nextId = 1; //!< id of the next entry added
+};
+
+#endif /* __PUBLISHQUEUEPIPELINE_H */
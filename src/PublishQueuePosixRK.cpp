@@ -3,10 +3,13 @@
 #include "BackgroundPublishRK.h"
 
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <sys/stat.h>
 
 PublishQueuePosix *PublishQueuePosix::_instance;
+std::vector<PublishQueuePosix *> PublishQueuePosix::_instances;
 
 static Logger _log("app.pubq");
 
@@ -18,6 +21,18 @@ PublishQueuePosix &PublishQueuePosix::instance() {
     return *_instance;
 }
 
+PublishQueuePosix &PublishQueuePosix::instance(const char *name) {
+    if (!name || !*name) {
+        return instance();
+    }
+    for(PublishQueuePosix *queue : _instances) {
+        if (queue->name == name) {
+            return *queue;
+        }
+    }
+    return *new PublishQueuePosix(name);
+}
+
 PublishQueuePosix &PublishQueuePosix::withRamQueueSize(size_t size) { 
     ramQueueSize = size;
 
@@ -39,6 +54,168 @@ PublishQueuePosix &PublishQueuePosix::withFileQueueSize(size_t size) {
     return *this; 
 }
 
+PublishQueuePosix &PublishQueuePosix::withRamQueueMaxBytes(size_t bytes) {
+    ramQueueMaxBytes = bytes;
+
+    if (stateHandler) {
+        _log.trace("withRamQueueMaxBytes(%u)", ramQueueMaxBytes);
+        checkQueueLimits();
+    }
+    return *this;
+}
+
+PublishQueuePosix &PublishQueuePosix::withFileQueueMaxBytes(size_t bytes) {
+    fileQueueMaxBytes = bytes;
+
+    if (stateHandler) {
+        _log.trace("withFileQueueMaxBytes(%u)", fileQueueMaxBytes);
+        checkQueueLimits();
+    }
+    return *this;
+}
+
+PublishQueuePosix &PublishQueuePosix::withMinFreeSpace(size_t bytes, std::function<size_t()> freeSpaceFunction) {
+    minFreeSpace = bytes;
+    this->freeSpaceFunction = freeSpaceFunction;
+
+    if (stateHandler) {
+        _log.trace("withMinFreeSpace(%u)", minFreeSpace);
+        checkQueueLimits();
+    }
+    return *this;
+}
+
+PublishQueuePosix &PublishQueuePosix::withScheduler(unsigned weight) {
+    schedulerWeight = weight;
+    if (weight) {
+        PublishQueueScheduler::instance().add(this, weight);
+    }
+    else {
+        PublishQueueScheduler::instance().remove(this);
+    }
+    return *this;
+}
+
+PublishQueuePosix &PublishQueuePosix::withBatchPublish(const char *eventName, size_t maxEvents, size_t maxDataSize) {
+    if (eventName && strlen(eventName) > particle::protocol::MAX_EVENT_NAME_LENGTH) {
+        _log.error("batch event name too long, not batching");
+        eventName = NULL;
+    }
+    batchEventName = eventName ? eventName : "";
+    batchMaxEvents = maxEvents;
+    batchMaxDataSize = maxDataSize;
+    return *this;
+}
+
+PublishQueuePosix &PublishQueuePosix::withPublishRate(unsigned long msPerEvent, size_t burst) {
+    publishRate.setRate(msPerEvent, burst);
+    return *this;
+}
+
+PublishQueuePosix &PublishQueuePosix::withFailureBackoff(unsigned long minMs, unsigned long maxMs, unsigned jitterPercent) {
+    waitAfterFailure = minMs;
+    maxWaitAfterFailure = (maxMs > minMs) ? maxMs : minMs;
+    failureJitterPercent = (jitterPercent < 100) ? jitterPercent : 100;
+    return *this;
+}
+
+PublishQueuePosix &PublishQueuePosix::withEventPool(size_t maxDataSize) {
+    if (stateHandler) {
+        _log.error("withEventPool must be called before setup");
+        return *this;
+    }
+    eventPoolMaxDataSize = maxDataSize;
+    return *this;
+}
+
+PublishQueuePosix &PublishQueuePosix::withLockFreeQueue(size_t size) {
+    if (stateHandler) {
+        _log.error("withLockFreeQueue must be called before setup");
+        return *this;
+    }
+    lockFreeQueueSize = size;
+    return *this;
+}
+
+PublishQueuePosix &PublishQueuePosix::withPipelining(size_t maxInFlight) {
+    if (stateHandler) {
+        _log.error("withPipelining must be called before setup");
+        return *this;
+    }
+    pipelineSize = (maxInFlight > 1) ? maxInFlight : 0;
+    return *this;
+}
+
+PublishQueuePosix &PublishQueuePosix::withCompression(const char *dictionary, bool cloud) {
+    if (stateHandler) {
+        _log.error("withCompression must be called before setup");
+        return *this;
+    }
+    if (!compressor.init(dictionary)) {
+        _log.error("withCompression dictionary too long or out of memory");
+        return *this;
+    }
+    compressCloud = cloud;
+    return *this;
+}
+
+PublishQueuePosix &PublishQueuePosix::withCompactEncoding(bool enable) {
+    if (stateHandler) {
+        _log.error("withCompactEncoding must be called before setup");
+        return *this;
+    }
+    compact.withEnabled(enable);
+    return *this;
+}
+
+PublishQueuePosix &PublishQueuePosix::withFormatter(uint8_t formatId, std::function<size_t(const void *record, size_t recordLen, char *buf, size_t bufSize)> formatter) {
+    if (stateHandler) {
+        _log.error("withFormatter must be called before setup");
+        return *this;
+    }
+    if (formatId == 0) {
+        _log.error("withFormatter format must be between 1 and 255");
+        return *this;
+    }
+    for(auto &it : formatters) {
+        if (it.first == formatId) {
+            it.second = formatter;
+            return *this;
+        }
+    }
+    formatters.push_back(std::make_pair(formatId, formatter));
+    return *this;
+}
+
+PublishQueuePosix &PublishQueuePosix::withPriorityLane(uint8_t priority, size_t ramQueueSize, size_t fileQueueSize) {
+    if (stateHandler) {
+        _log.error("withPriorityLane must be called before setup");
+        return *this;
+    }
+    if (priority < 1 || priority > MAX_PRIORITY) {
+        _log.error("priority %u is not between 1 and %u", priority, MAX_PRIORITY);
+        return *this;
+    }
+    PublishQueueLane *lane = getLane(priority);
+    if (!lane) {
+        lane = lanes[priority - 1] = new PublishQueueLane();
+    }
+    lane->ramQueueSize = ramQueueSize;
+    lane->fileQueueSize = fileQueueSize;
+    return *this;
+}
+
+PublishQueuePosix &PublishQueuePosix::withAsyncWriter(unsigned long maxDelayMs, size_t maxGroupSize) {
+    if (stateHandler) {
+        _log.error("withAsyncWriter must be called before setup");
+        return *this;
+    }
+    asyncWriter = true;
+    asyncWriterMaxDelay = maxDelayMs;
+    asyncWriterMaxGroupSize = (maxGroupSize != 0) ? maxGroupSize : 1;
+    return *this;
+}
+
 void PublishQueuePosix::setup() {
     if (system_thread_get_state(nullptr) != spark::feature::ENABLED) {
         _log.error("SYSTEM_THREAD(ENABLED) is required");
@@ -47,20 +224,120 @@ void PublishQueuePosix::setup() {
 
     os_mutex_recursive_create(&mutex);
 
-    // Register a system reset handler
-    System.on(reset | cloud_status, systemEventHandler);
+    if (lockFreeQueueSize != 0) {
+        lockFreeQueue.init(lockFreeQueueSize);
+    }
+    if (pipelineSize != 0) {
+        if (batchEventName.length() != 0) {
+            _log.error("withPipelining cannot be used with withBatchPublish, sending one at a time");
+        }
+        else {
+            pipeline.init(pipelineSize);
+        }
+    }
+    if (eventPoolMaxDataSize != 0) {
+        // RAM queue, one more event before it's written to files, the event being published,
+        // and one for reading from files. Batching also needs the batch and one for reading.
+        // Events in the lock-free queue and the other events being published also need buffers.
+        // Priority lanes each have their own RAM queue, plus one before it's written to files.
+        size_t numSending = pipeline.isEnabled() ? pipeline.getCapacity() : 1;
+        size_t numLaneEvents = 0;
+        for(uint8_t priority = 1; priority <= MAX_PRIORITY; priority++) {
+            if (PublishQueueLane *lane = getLane(priority)) {
+                numLaneEvents += lane->ramQueueSize + 1;
+            }
+        }
+        eventPool.init(ramQueueSize + 2 + numSending + (batchEventName.length() ? 2 : 0) + lockFreeQueue.getCapacity() + numLaneEvents, eventPoolMaxDataSize);
+    }
+    ramQueue.reserve(ramQueueSize + 2 + lockFreeQueue.getCapacity());
+    batchRamEvents.reserve(batchMaxEvents);
+    batchFileNums.reserve(batchMaxEvents);
+
+    // Register a system reset handler, once for all instances
+    static bool systemEventRegistered = false;
+    if (!systemEventRegistered) {
+        System.on(reset | cloud_status, systemEventHandler);
+        systemEventRegistered = true;
+    }
 
     // Start the background publish thread
     BackgroundPublishRK::instance().start();
 
-    fileQueue.scanDir();
+    loadFileQueue(fileQueue);
+    loadSequence(fileQueue);
+
+    // Segments are also checked when not using the segment log so events left over
+    // from using it previously are still sent
+    segmentLog.withDirPath(fileQueue.getDirPath()).withEventPool(&eventPool).withCompressor(&compressor).withCompact(&compact).withStats(&stats);
+    segmentLog.scan();
+
+    // Priority lanes are in subdirectories, which are skipped when scanning the queue directory
+    for(uint8_t priority = 1; priority <= MAX_PRIORITY; priority++) {
+        if (PublishQueueLane *lane = getLane(priority)) {
+            lane->fileQueue.withDirPath(String::format("%s/p%u", fileQueue.getDirPath(), priority));
+            loadFileQueue(lane->fileQueue);
+            loadSequence(lane->fileQueue);
+            lane->ramQueue.reserve(lane->ramQueueSize + 2);
+        }
+    }
+
+    // The name table is read even if not using the compact encoding now, for events written
+    // using it earlier. When nothing is stored, no event refers to it, so it starts over.
+    bool stored = (fileQueue.getQueueLen() != 0 || segmentLog.getQueueLen() != 0);
+    for(uint8_t priority = 1; priority <= MAX_PRIORITY; priority++) {
+        if (PublishQueueLane *lane = getLane(priority)) {
+            stored = stored || (lane->fileQueue.getQueueLen() != 0);
+        }
+    }
+    compact.withDirPath(fileQueue.getDirPath()).load(!stored);
 
     checkQueueLimits();
 
+    if (asyncWriter) {
+        writeQueue.reserve(ramQueueSize + 2 + asyncWriterMaxGroupSize);
+        os_semaphore_create(&writerSemaphore, 1, 0);
+        os_semaphore_create(&persistedSemaphore, 1, 0);
+        if (os_thread_create(&writerThread, "pubqWriter", OS_THREAD_PRIORITY_DEFAULT, asyncWriterThreadFunctionStatic, this, ASYNC_WRITER_STACK_SIZE) != 0) {
+            _log.error("could not start writer thread, writing synchronously");
+            writerThread = 0;
+        }
+    }
+
     stateHandler = &PublishQueuePosix::stateConnectWait;
 }
 
+void PublishQueuePosix::loadFileQueue(PublishQueueFileQueue &queue) {
+    // An event being written when the device reset is not in the queue
+    queue.removeTempFile();
+
+    if (!useQueueIndex || !queue.loadIndex()) {
+        queue.scanDir();
+    }
+    if (useQueueIndex) {
+        // Save now so the next boot can use the index even if no events are written before then
+        queue.saveIndex();
+    }
+    else {
+        // A stale index would not be valid if it's enabled again later
+        queue.removeIndex();
+    }
+}
+
 void PublishQueuePosix::loop() {
+    if (lockFreeQueue.size() != 0) {
+        // Move events published using the lock-free queue into the RAM queue
+        bool connected = Particle.connected();
+        WITH_LOCK(*this) {
+            drainLockFreeQueue();
+            checkRamQueue(connected);
+        }
+    }
+
+    if (expirySweepInterval && stateHandler && millis() - lastExpirySweep >= expirySweepInterval) {
+        lastExpirySweep = millis();
+        discardExpiredEvents();
+    }
+
     if (stateHandler) {
         stateHandler(*this);
     }
@@ -68,216 +345,1486 @@ void PublishQueuePosix::loop() {
 
 bool PublishQueuePosix::publishCommon(const char *eventName, const char *eventData, int ttl, PublishFlags flags1, PublishFlags flags2) {
 
-    PublishQueueEvent *event = newRamEvent(eventName, eventData, flags1 | flags2);
+    PublishQueueEvent *event = allocRamEvent(eventName, eventData, flags1 | flags2, getTtlExpires(ttl));
     if (!event) {
         return false;
     }
     _log.trace("publishCommon eventName=%s eventData=%s", eventName, eventData ? eventData : "");
 
-    WITH_LOCK(*this) {
-        ramQueue.push_back(event);
-
-        _log.trace("fileQueueLen=%u ramQueueLen=%u connected=%d", fileQueue.getQueueLen(), ramQueue.size(), Particle.connected());
+    queueRamEvent(event);
+    return true;
+}
 
-        if (fileQueue.getQueueLen() == 0 && (ramQueue.size() <= ramQueueSize) && Particle.connected()) {
-            // No files in the disk-based queue, RAM-based queue is not full, and we are cloud connected
-            // Leave the event in the RAM queue and return true
-            _log.trace("queued to ramQueue");
-        }
-        else {
-            // We need to move the queue to the file system
-            writeQueueToFiles();
-        }
-        checkQueueLimits();
+bool PublishQueuePosix::publishWithLength(const char *eventName, const char *eventData, size_t dataLen, int ttl, PublishFlags flags1, PublishFlags flags2) {
+    if (!eventData) {
+        dataLen = 0;
     }
+    PublishQueueEvent *event = allocRamEvent(eventName, eventData, dataLen, flags1 | flags2, getTtlExpires(ttl));
+    if (!event) {
+        return false;
+    }
+    _log.trace("publishWithLength eventName=%s eventData=%s", eventName, event->eventData);
 
-
+    queueRamEvent(event);
     return true;
 }
 
-PublishQueueEvent *PublishQueuePosix::newRamEvent(const char *eventName, const char *eventData, PublishFlags flags) {
+PublishQueueEvent *PublishQueuePosix::allocEvent(const char *eventName, size_t maxDataLen) {
+    // The flags and expiry time are set by publishEvent()
+    return allocRamEvent(eventName, NULL, maxDataLen, PublishFlags());
+}
 
-    if (!eventData) {
-        eventData = "";
-    }
-    if (strlen(eventName) > particle::protocol::MAX_EVENT_NAME_LENGTH) {
-        return NULL;
-    }
-    if (strlen(eventData) > particle::protocol::MAX_EVENT_DATA_LENGTH) {
-        return NULL;
+bool PublishQueuePosix::publishEvent(PublishQueueEvent *event, int ttl, PublishFlags flags1, PublishFlags flags2) {
+    if (!event) {
+        return false;
     }
+    event->expires = getTtlExpires(ttl);
+    event->timestamp = Time.isValid() ? (uint32_t) Time.now() : 0;
+    event->flags = flags1 | flags2;
+    _log.trace("publishEvent eventName=%s eventData=%s", event->eventName, event->eventData);
 
-    PublishQueueEvent *event;
+    queueRamEvent(event);
+    return true;
+}
 
-    event = (PublishQueueEvent *) new char[sizeof(PublishQueueEvent) + strlen(eventData)];
-    if (event) {
-        event->flags = flags;
-        strcpy(event->eventName, eventName);
-        strcpy(event->eventData, eventData);
+uint32_t PublishQueuePosix::getTtlExpires(int ttl) const {
+    if (enforceTtl && ttl > 0 && Time.isValid()) {
+        return (uint32_t) Time.now() + ttl;
     }
-    return event;
+    return 0;
 }
 
-void PublishQueuePosix::writeQueueToFiles() {
+bool PublishQueuePosix::publishWithDeadline(time_t deadline, const char *eventName, const char *eventData, PublishFlags flags1, PublishFlags flags2) {
+    PublishQueueEvent *event = allocRamEvent(eventName, eventData, flags1 | flags2, (uint32_t) deadline);
+    if (!event) {
+        return false;
+    }
+    _log.trace("publishWithDeadline deadline=%lu eventName=%s eventData=%s", (unsigned long) deadline, eventName, eventData ? eventData : "");
 
-    WITH_LOCK(*this) {
-        while(!ramQueue.empty()) {
-            PublishQueueEvent *event = ramQueue.front();
-            ramQueue.pop_front();
+    queueRamEvent(event);
+    return true;
+}
+
+bool PublishQueuePosix::publishDeferred(uint8_t formatId, const char *eventName, const void *record, size_t recordLen, int ttl, PublishFlags flags1, PublishFlags flags2) {
+    if (formatId == 0 || recordLen > MAX_RECORD_SIZE || (!record && recordLen != 0)) {
+        _log.info("publishDeferred invalid format %u or record length %u", formatId, (unsigned) recordLen);
+        stats.increment(PublishQueueStatsCollector::REJECTED);
+        return false;
+    }
+
+    // The record length, then the record as is
+    PublishQueueEvent *event = allocRamEvent(eventName, NULL, 1 + recordLen, flags1 | flags2, getTtlExpires(ttl));
+    if (!event) {
+        return false;
+    }
+    event->formatId = formatId;
+    event->eventData[0] = (char) recordLen;
+    if (recordLen) {
+        memcpy(&event->eventData[1], record, recordLen);
+    }
+    event->eventData[1 + recordLen] = 0;
+    _log.trace("publishDeferred formatId=%u eventName=%s recordLen=%u", formatId, eventName, (unsigned) recordLen);
 
-            int fileNum = fileQueue.reserveFile();
+    queueRamEvent(event);
+    return true;
+}
 
-            int fd = open(fileQueue.getPathForFileNum(fileNum), O_RDWR | O_CREAT);
-            if (fd) {
-                PublishQueueFileHeader hdr;
-                hdr.magic = FILE_MAGIC;
-                hdr.version = FILE_VERSION;
-                hdr.headerSize = sizeof(PublishQueueFileHeader);
-                hdr.nameLen = sizeof(PublishQueueEvent::eventName);
-                write(fd, &hdr, sizeof(hdr));
+size_t PublishQueuePosix::publishBulk(PublishQueueBulkEvent *events, size_t numEvents) {
+    size_t numQueued = 0;
 
-                write(fd, event, sizeof(PublishQueueEvent) + strlen(event->eventData));
-                close(fd);
+    // Checked once for all of the events, before locking, the same as queueRamEvent()
+    bool connected = Particle.connected();
 
-                // This message is monitored by the automated test tool. If you edit this, change that too.
-                _log.trace("writeQueueToFiles fileNum=%d", fileNum);
+    WITH_LOCK(*this) {
+        // Events still in the lock-free queue are older than these
+        drainLockFreeQueue();
+
+        for(size_t ii = 0; ii < numEvents; ii++) {
+            PublishQueueBulkEvent &bulkEvent = events[ii];
+
+            // If all of the preallocated events are in use, this writes the RAM queue to files,
+            // including the events from this call that were already queued
+            PublishQueueEvent *event = allocRamEvent(bulkEvent.eventName, bulkEvent.eventData, bulkEvent.flags, getTtlExpires(bulkEvent.ttl));
+            bulkEvent.queued = (event != NULL);
+            if (event) {
+                ramQueue.push_back(event);
+                numQueued++;
             }
-            fileQueue.addFileToQueue(fileNum);
+        }
+        _log.trace("publishBulk numEvents=%u numQueued=%u", (unsigned) numEvents, (unsigned) numQueued);
 
-            delete event;
+        if (numQueued) {
+            checkRamQueue(connected);
         }
     }
+    return numQueued;
 }
 
+void PublishQueuePosix::queueRamEvent(PublishQueueEvent *event) {
+    if (lockFreeQueue.push(event)) {
+        // Moved into the RAM queue from loop()
+        return;
+    }
 
-PublishQueueEvent *PublishQueuePosix::readQueueFile(int fileNum) {
-    PublishQueueEvent *result = NULL;
+    // Not using the lock-free queue, or it's full. Check this before locking because
+    // Particle.connected() can take a while when the system thread is busy.
+    bool connected = Particle.connected();
 
-    int fd = open(fileQueue.getPathForFileNum(fileNum), O_RDONLY);
-    if (fd) {
-        struct stat sb;
-        fstat(fd, &sb);
+    WITH_LOCK(*this) {
+        // Events still in the lock-free queue are older than this one
+        drainLockFreeQueue();
+        ramQueue.push_back(event);
+        checkRamQueue(connected);
+    }
+}
 
-        _log.trace("fileNum=%d size=%ld", fileNum, sb.st_size);
+bool PublishQueuePosix::publishWithPriority(uint8_t priority, const char *eventName, const char *eventData, int ttl, PublishFlags flags1, PublishFlags flags2) {
+    PublishQueueLane *lane = getLane(priority);
+    if (!lane) {
+        return publishCommon(eventName, eventData, ttl, flags1, flags2);
+    }
 
-        PublishQueueFileHeader hdr;
-        
-        lseek(fd, 0, SEEK_SET);
-        read(fd, &hdr, sizeof(PublishQueueFileHeader));
-        if (sb.st_size >= (off_t)(sizeof(PublishQueueFileHeader) + sizeof(PublishQueueEvent)) &&
-            hdr.magic == FILE_MAGIC && 
-            hdr.version == FILE_VERSION &&
-            hdr.headerSize == sizeof(PublishQueueFileHeader) &&
-            hdr.nameLen == sizeof(PublishQueueEvent::eventName)) {
-
-            size_t eventSize = sb.st_size - sizeof(PublishQueueFileHeader);
-
-            result = (PublishQueueEvent *)new char[eventSize];
-            if (result) {
-                read(fd, result, eventSize);
+    PublishQueueEvent *event = allocRamEvent(eventName, eventData, flags1 | flags2, getTtlExpires(ttl));
+    if (!event) {
+        return false;
+    }
+    _log.trace("publishWithPriority priority=%u eventName=%s eventData=%s", priority, eventName, eventData ? eventData : "");
 
-                if (((char *)result)[eventSize - 1] == 0 && strlen(result->eventName) < (sizeof(PublishQueueEvent::eventName) - 1)) {
-                    _log.trace("readQueueFile %d event=%s data=%s", fileNum, result->eventName, result->eventData);
-                }
-                else {
-                    _log.trace("readQueueFile %d corrupted event name or data", fileNum);
-                    delete result;
-                    result = NULL;
-                }
+    bool connected = Particle.connected();
 
-            }
-        } else {
-            _log.trace("readQueueFile %d bad magic=%08lx version=%u headerSize=%u nameLen=%u", fileNum, hdr.magic, hdr.version, hdr.headerSize, hdr.nameLen);
-        }
+    WITH_LOCK(*this) {
+        lane->ramQueue.push_back(event);
 
-        close(fd);
+        if (lane->fileQueue.getQueueLen() != 0 || pipeline.getNumFiles(priority) != 0 || lane->ramQueue.size() > lane->ramQueueSize || !connected) {
+            // Same as checkRamQueue(), events of this priority already in files must be sent first
+            writeLaneToFiles(priority);
+        }
+        checkQueueLimits();
     }
-    return result;
+    return true;
 }
 
-void PublishQueuePosix::clearQueues() {
-    WITH_LOCK(*this) {
-        while(!ramQueue.empty()) {
-            PublishQueueEvent *event = ramQueue.front();
-            ramQueue.pop_front();
-
-            delete event;
-        }
+bool PublishQueuePosix::publishCoalesced(const char *key, const char *eventName, const char *eventData, int ttl, PublishFlags flags1, PublishFlags flags2) {
+    if (!key || !key[0]) {
+        return publishCommon(eventName, eventData, ttl, flags1, flags2);
+    }
+    if (strlen(key) >= sizeof(PublishQueueCoalesceEntry::key)) {
+        _log.info("coalescing key too long %s", key);
+        return false;
+    }
 
-        fileQueue.removeAll(true);
+    PublishQueueEvent *event = allocRamEvent(eventName, eventData, flags1 | flags2, getTtlExpires(ttl));
+    if (!event) {
+        return false;
     }
+    _log.trace("publishCoalesced key=%s eventName=%s eventData=%s", key, eventName, eventData ? eventData : "");
 
-    _log.trace("clearQueues");
-}
+    bool connected = Particle.connected();
 
-void PublishQueuePosix::setPausePublishing(bool value) { 
-    pausePublishing = value; 
+    WITH_LOCK(*this) {
+        // Events still in the lock-free queue are older than this one, and may have the same key
+        drainLockFreeQueue();
 
-    if (!value) {
-        // When resuming publishing, update the canSleep flag
-        if (getNumEvents() != 0) {
-            canSleep = false;
+        if (replaceCoalesced(key, event)) {
+            stats.increment(PublishQueueStatsCollector::COALESCED);
+            return true;
         }
+
+        PublishQueueCoalesceEntry entry;
+        strcpy(entry.key, key);
+        entry.event = event;
+        entry.fileNum = 0;
+        coalesceEntries.push_back(entry);
+
+        // If the RAM queue is written to files, the entry is updated with the file number
+        ramQueue.push_back(event);
+        checkRamQueue(connected);
     }
+    return true;
 }
 
+bool PublishQueuePosix::replaceCoalesced(const char *key, PublishQueueEvent *event) {
+    for(auto it = coalesceEntries.begin(); it != coalesceEntries.end(); ) {
+        if (!it->event && !isFileQueued(it->fileNum)) {
+            // The file has been sent or discarded since
+            it = coalesceEntries.erase(it);
+            continue;
+        }
+        if (strcmp(it->key, key) != 0) {
+            ++it;
+            continue;
+        }
 
+        if (!it->event) {
+            // Rewrite the file in place, so the queue does not grow
+            if (writeEventToFile(fileQueue, event, it->fileNum) == 0) {
+                // The file still has the old event, so queue this one after it
+                coalesceEntries.erase(it);
+                return false;
+            }
+            deleteEvent(event);
+            _log.trace("coalesced key=%s fileNum=%d", key, it->fileNum);
+            return true;
+        }
 
-void PublishQueuePosix::checkQueueLimits() {
-    WITH_LOCK(*this) {
-        if (ramQueue.size() > ramQueueSize) {
-            // RAM queue is too large, move all to files
-            writeQueueToFiles();
+        PublishQueueEventRing *queues[2] = { &ramQueue, &writeQueue };
+        for(PublishQueueEventRing *queue : queues) {
+            for(size_t ii = 0; ii < queue->size(); ii++) {
+                if ((*queue)[ii] == it->event) {
+                    queue->set(ii, event);
+                    deleteEvent(it->event);
+                    it->event = event;
+                    _log.trace("coalesced key=%s in RAM", key);
+                    return true;
+                }
+            }
         }
 
-        while(fileQueue.getQueueLen() > (int)fileQueueSize) {
-            int fileNum = fileQueue.getFileFromQueue(true);
+        // Not expected, as entries are updated when events leave the RAM queue
+        coalesceEntries.erase(it);
+        break;
+    }
+    return false;
+}
+
+void PublishQueuePosix::updateCoalesceEntry(const PublishQueueEvent *event, int fileNum) {
+    for(auto it = coalesceEntries.begin(); it != coalesceEntries.end(); ++it) {
+        if (it->event == event) {
             if (fileNum) {
-                fileQueue.removeFileNum(fileNum, false);
-                _log.info("discarded event %d", fileNum);
+                it->event = NULL;
+                it->fileNum = fileNum;
             }
+            else {
+                coalesceEntries.erase(it);
+            }
+            break;
         }
     }
 }
 
-size_t PublishQueuePosix::getNumEvents() {
-    size_t result = 0;
+bool PublishQueuePosix::isFileQueued(int fileNum) {
+    // Files are only removed from the head of fileQueue, and the head is not removed while it's being sent
+    int headFileNum = fileQueue.getFileFromQueue(false);
+    if (headFileNum == 0 || fileNum < headFileNum) {
+        return false;
+    }
+    return !(curEvent && curPriority == 0 && curFileNum == fileNum);
+}
 
+void PublishQueuePosix::checkRamQueue(bool connected) {
     WITH_LOCK(*this) {
-        result = ramQueue.size();
-        if (result == 0) {
-            result = fileQueue.getQueueLen();
+        _log.trace("fileQueueLen=%u ramQueueLen=%u connected=%d", getFileQueueLen(), ramQueue.size(), connected);
 
-            if (curEvent && curFileNum == 0) {
-                // This happens when we are sending an event from the RAM queue
-                // It's not in the RAM queue, but we want to count it, because
-                // otherwise getNumEvents would return 1 for the event sent from
-                // a file (because the file is not deleted until sent) and
-                // this makes the behavior consistent.
-                result++;
-            }
+        if (getFileQueueLen() == 0 && writeQueue.empty() && !isRamQueueFull() && connected) {
+            // No files in the disk-based queue, RAM-based queue is not full, and we are cloud connected
+            // Leave the event in the RAM queue and return true
+            _log.trace("queued to ramQueue");
+        }
+        else {
+            // We need to move the queue to the file system
+            spillRamQueue();
         }
+        checkQueueLimits();
     }
-    return result;
 }
 
-void PublishQueuePosix::publishCompleteCallback(bool succeeded, const char *eventName, const char *eventData) {
-    publishComplete = true;
-    publishSuccess = succeeded;
+void PublishQueuePosix::drainLockFreeQueue() {
+    WITH_LOCK(*this) {
+        while(PublishQueueEvent *event = lockFreeQueue.pop()) {
+            ramQueue.push_back(event);
+        }
+    }
+}
 
-    if (publishCompleteUserCallback) {
-        publishCompleteUserCallback(succeeded, eventName, eventData);
+PublishQueueEvent *PublishQueuePosix::allocRamEvent(const char *eventName, const char *eventData, size_t dataLen, PublishFlags flags, uint32_t expires) {
+    PublishQueueEvent *event = newRamEvent(eventName, eventData, dataLen, flags, expires);
+    if (!event && eventPool.isEnabled() && eventPool.getNumFree() == 0) {
+        // All of the preallocated events are in use. Moving the RAM queue to files frees them.
+        writeQueueToFiles();
+        event = newRamEvent(eventName, eventData, dataLen, flags, expires);
+        if (!event) {
+            _log.info("queue full, no free events");
+        }
     }
+    stats.increment(event ? PublishQueueStatsCollector::ENQUEUED : PublishQueueStatsCollector::REJECTED);
+    return event;
 }
 
+PublishQueueEvent *PublishQueuePosix::newRamEvent(const char *eventName, const char *eventData, size_t dataLen, PublishFlags flags, uint32_t expires) {
+
+    // Each length is only found once, and the name and data are copied with memcpy
+    size_t nameLen = strnlen(eventName, particle::protocol::MAX_EVENT_NAME_LENGTH + 1);
+    if (nameLen > particle::protocol::MAX_EVENT_NAME_LENGTH) {
+        return NULL;
+    }
+    if (dataLen > particle::protocol::MAX_EVENT_DATA_LENGTH) {
+        return NULL;
+    }
+
+    // When using preallocated events, returns NULL instead of using the heap if they are all in use
+    PublishQueueEvent *event = eventPool.alloc(PublishQueueEvent::getSize(dataLen), false);
+    if (event) {
+        event->expires = expires;
+        event->timestamp = Time.isValid() ? (uint32_t) Time.now() : 0;
+        event->formatId = 0;
+        event->flags = flags;
+        memcpy(event->eventName, eventName, nameLen);
+        event->eventName[nameLen] = 0;
+        if (eventData) {
+            memcpy(event->eventData, eventData, dataLen);
+            event->eventData[dataLen] = 0;
+        }
+        else {
+            event->eventData[0] = 0;
+        }
+    }
+    return event;
+}
+
+void PublishQueuePosix::writeQueueToFiles() {
+    bool persisted = false;
+
+    WITH_LOCK(*this) {
+        unsigned long start = millis();
+        uint32_t spilled = stats.get(PublishQueueStatsCollector::SPILLED);
+
+        drainLockFreeQueue();
+
+        // Events waiting for the writer thread are older than the RAM queue
+        while(!writeQueue.empty()) {
+            PublishQueueEvent *event = writeQueue.front();
+            writeQueue.pop_front();
+
+            writeEvent(event);
+            deleteEvent(event);
+            persistedCount++;
+            persisted = true;
+        }
+
+        while(!ramQueue.empty()) {
+            PublishQueueEvent *event = ramQueue.front();
+            ramQueue.pop_front();
+
+            writeEvent(event);
+            deleteEvent(event);
+        }
+
+        for(uint8_t priority = 1; priority <= MAX_PRIORITY; priority++) {
+            writeLaneToFiles(priority);
+        }
+
+        // Commit the events appended to the segment log with a single close
+        segmentLog.flush();
+
+        saveQueueIndex();
+
+        if (stats.get(PublishQueueStatsCollector::SPILLED) != spilled) {
+            stats.record(PublishQueueStatsCollector::WRITE_DURATION, millis() - start);
+        }
+    }
+
+    if (persisted && persistedSemaphore) {
+        os_semaphore_give(persistedSemaphore, false);
+    }
+}
+
+void PublishQueuePosix::writeEvent(const PublishQueueEvent *event) {
+    WITH_LOCK(*this) {
+        // Make room first, so the limits are not exceeded even briefly. Compression and the segment
+        // log both make the event smaller than this.
+        size_t size = sizeof(PublishQueueFileHeader) + PublishQueueEvent::getSize(event->getDataLen());
+        while(isFlashFull(size)) {
+            if (!discardOldestFileEvent()) {
+                break;
+            }
+        }
+
+        if (segmentLog.getSegmentSize() != 0 || segmentLog.getQueueLen() != 0) {
+            // Append to the segment log. This is also done if not using the segment log but it still
+            // contains events, otherwise these newer events would be sent before the events in segments.
+            bool appended = segmentLog.append(event);
+            stats.increment(appended ? PublishQueueStatsCollector::SPILLED : PublishQueueStatsCollector::WRITE_FAILURES);
+            updateCoalesceEntry(event, 0);
+            return;
+        }
+
+        int fileNum = writeEventToFile(fileQueue, event);
+        if (fileNum) {
+            stats.increment(PublishQueueStatsCollector::SPILLED);
+        }
+        updateCoalesceEntry(event, fileNum);
+    }
+}
+
+int PublishQueuePosix::writeEventToFile(PublishQueueFileQueue &queue, const PublishQueueEvent *event, int fileNum) {
+    WITH_LOCK(*this) {
+        bool newFile = (fileNum == 0);
+        if (newFile) {
+            fileNum = queue.reserveFile();
+        }
+
+        // Written to a temporary file and renamed into the queue when complete, so after a reset the
+        // file for fileNum is either complete or does not exist. This also replaces it when rewriting.
+        bool written = false;
+        int fd = open(queue.getTempPath(), O_WRONLY | O_CREAT | O_TRUNC);
+        if (fd >= 0) {
+            PublishQueueFileHeader hdr;
+            memset(&hdr, 0, sizeof(hdr));
+            hdr.magic = FILE_MAGIC;
+            hdr.version = FILE_VERSION;
+            hdr.headerSize = sizeof(PublishQueueFileHeader);
+            hdr.nameLen = sizeof(PublishQueueEvent::eventName);
+            hdr.encoding = PublishQueueCompress::ENCODING_NONE;
+
+            const void *stored = event;
+            size_t storedSize = PublishQueueEvent::getSize(event->getDataLen());
+            if (const uint8_t *compressed = compressor.compressEvent(event, storedSize)) {
+                hdr.encoding = PublishQueueCompress::ENCODING_LZSS;
+                stored = compressed;
+            }
+            // If both are enabled, whichever is smaller is used
+            size_t compactSize;
+            if (const uint8_t *encoded = compact.encodeEvent(event, compactSize)) {
+                if (compactSize < storedSize) {
+                    hdr.encoding = PublishQueueCompress::ENCODING_COMPACT;
+                    stored = encoded;
+                    storedSize = compactSize;
+                }
+            }
+            hdr.payloadLen = (uint16_t) storedSize;
+            hdr.timestamp = Time.isValid() ? (uint32_t) Time.now() : 0;
+            hdr.sequence = nextSequence++;
+            hdr.crc = getFileCrc(hdr, stored);
+
+            written = write(fd, &hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr) &&
+                write(fd, stored, storedSize) == (ssize_t)storedSize;
+
+            // The data is committed to flash by close
+            if (close(fd) != 0) {
+                written = false;
+            }
+            if (written) {
+                written = queue.commitTempFile(fileNum);
+            }
+            if (written) {
+                queue.setFileSize(fileNum, sizeof(hdr) + storedSize);
+            }
+            else {
+                unlink(queue.getTempPath());
+            }
+        }
+        if (!written) {
+            // The event is lost, but the queue does not contain a partial file
+            _log.error("writeEventToFile fileNum=%d failed errno=%d", fileNum, errno);
+            stats.increment(PublishQueueStatsCollector::WRITE_FAILURES);
+            return 0;
+        }
+
+        if (newFile) {
+            // This message is monitored by the automated test tool. If you edit this, change that too.
+            _log.trace("writeQueueToFiles fileNum=%d", fileNum);
+            queue.addFileToQueue(fileNum);
+        }
+    }
+    return fileNum;
+}
+
+void PublishQueuePosix::writeLaneToFiles(uint8_t priority) {
+    PublishQueueLane *lane = getLane(priority);
+    if (!lane || lane->ramQueue.empty()) {
+        return;
+    }
+
+    WITH_LOCK(*this) {
+        while(!lane->ramQueue.empty()) {
+            PublishQueueEvent *event = lane->ramQueue.front();
+            lane->ramQueue.pop_front();
+
+            if (writeEventToFile(lane->fileQueue, event)) {
+                stats.increment(PublishQueueStatsCollector::SPILLED);
+            }
+            deleteEvent(event);
+        }
+        saveQueueIndex();
+    }
+}
+
+PublishQueueFileQueue &PublishQueuePosix::getFileQueue(uint8_t priority) {
+    PublishQueueLane *lane = getLane(priority);
+    return lane ? lane->fileQueue : fileQueue;
+}
+
+uint8_t PublishQueuePosix::getHighestQueuedPriority() {
+    WITH_LOCK(*this) {
+        for(uint8_t priority = MAX_PRIORITY; priority >= 1; priority--) {
+            PublishQueueLane *lane = getLane(priority);
+            if (lane && (lane->fileQueue.getQueueLen() != 0 || !lane->ramQueue.empty())) {
+                return priority;
+            }
+        }
+    }
+    return 0;
+}
+
+PublishQueueEvent *PublishQueuePosix::readPriorityEvent(uint8_t &priority, int &fileNum, bool removeFile) {
+    PublishQueueEvent *event = NULL;
+
+    priority = 0;
+    fileNum = 0;
+
+    WITH_LOCK(*this) {
+        for(uint8_t pri = MAX_PRIORITY; pri >= 1 && !event; pri--) {
+            PublishQueueLane *lane = getLane(pri);
+            if (!lane) {
+                continue;
+            }
+
+            // Files are older than the lane's RAM queue
+            while(!event && (fileNum = lane->fileQueue.getFileFromQueue(false)) != 0) {
+                event = readQueueFile(lane->fileQueue, fileNum);
+                if (!event) {
+                    // Corrupted, or already sent before a reset. Discard.
+                    countCorruptFile(lane->fileQueue, fileNum, pri);
+                    lane->fileQueue.getFileFromQueue(true);
+                    lane->fileQueue.removeFileNum(fileNum, false);
+                }
+                else
+                if (removeFile) {
+                    lane->fileQueue.getFileFromQueue(true);
+                }
+            }
+            if (!event && !lane->ramQueue.empty()) {
+                event = lane->ramQueue.front();
+                lane->ramQueue.pop_front();
+            }
+            if (event) {
+                priority = pri;
+            }
+        }
+    }
+    return event;
+}
+
+void PublishQueuePosix::saveQueueIndex() {
+    if (useQueueIndex && stateHandler) {
+        fileQueue.saveIndex(getOldestSendingFileNum());
+
+        for(uint8_t priority = 1; priority <= MAX_PRIORITY; priority++) {
+            if (PublishQueueLane *lane = getLane(priority)) {
+                lane->fileQueue.saveIndex(pipeline.getOldestFileNum(priority));
+            }
+        }
+    }
+}
+
+int PublishQueuePosix::getOldestSendingFileNum() const {
+    int result = pipeline.getOldestFileNum(0);
+    for(int fileNum : batchFileNums) {
+        if (result == 0 || fileNum < result) {
+            result = fileNum;
+        }
+    }
+    return result;
+}
+
+void PublishQueuePosix::spillRamQueue() {
+    if (!writerThread) {
+        writeQueueToFiles();
+        return;
+    }
+
+    WITH_LOCK(*this) {
+        drainLockFreeQueue();
+
+        bool wasEmpty = writeQueue.empty();
+        while(!ramQueue.empty()) {
+            writeQueue.push_back(ramQueue.front());
+            ramQueue.pop_front();
+            spilledCount++;
+        }
+
+        // The writer thread only needs to be woken for the first event of a group, and when the group is full
+        if (!writeQueue.empty() && (wasEmpty || writeQueue.size() >= asyncWriterMaxGroupSize)) {
+            os_semaphore_give(writerSemaphore, false);
+        }
+    }
+}
+
+void PublishQueuePosix::requeueRamEvent(PublishQueueEvent *event, uint8_t priority) {
+    WITH_LOCK(*this) {
+        if (PublishQueueLane *lane = getLane(priority)) {
+            lane->ramQueue.push_front(event);
+        }
+        else
+        if (!writeQueue.empty()) {
+            writeQueue.push_front(event);
+            spilledCount++;
+        }
+        else {
+            ramQueue.push_front(event);
+        }
+    }
+}
+
+bool PublishQueuePosix::flush(system_tick_t timeoutMs) {
+    if (!writerThread) {
+        writeQueueToFiles();
+        return true;
+    }
+    spillRamQueue();
+    return waitForPersisted(timeoutMs);
+}
+
+bool PublishQueuePosix::waitForPersisted(system_tick_t timeoutMs) {
+    if (!writerThread) {
+        return true;
+    }
+
+    uint32_t target;
+    WITH_LOCK(*this) {
+        target = spilledCount;
+    }
+
+    unsigned long start = millis();
+    while(true) {
+        uint32_t persisted;
+        WITH_LOCK(*this) {
+            persisted = persistedCount;
+        }
+        if ((int32_t)(persisted - target) >= 0) {
+            // Another thread may also be waiting
+            os_semaphore_give(persistedSemaphore, false);
+            return true;
+        }
+
+        system_tick_t waitMs = CONCURRENT_WAIT_FOREVER;
+        if (timeoutMs != CONCURRENT_WAIT_FOREVER) {
+            unsigned long elapsed = millis() - start;
+            if (elapsed >= timeoutMs) {
+                return false;
+            }
+            waitMs = timeoutMs - elapsed;
+        }
+
+        writerFlush = true;
+        os_semaphore_give(writerSemaphore, false);
+
+        if (os_semaphore_take(persistedSemaphore, waitMs, false) != 0) {
+            // Timed out, but check once more in case the events were written at the same time
+            timeoutMs = 0;
+        }
+    }
+}
+
+void PublishQueuePosix::writePendingEvents() {
+    bool done = false;
+    bool persisted = false;
+    unsigned long start = millis();
+
+    while(!done) {
+        WITH_LOCK(*this) {
+            size_t maxCount = (segmentLog.getSegmentSize() != 0 || segmentLog.getQueueLen() != 0) ? asyncWriterMaxGroupSize : 1;
+
+            for(size_t count = 0; count < maxCount && !writeQueue.empty(); count++) {
+                PublishQueueEvent *event = writeQueue.front();
+                writeQueue.pop_front();
+
+                writeEvent(event);
+                deleteEvent(event);
+                persistedCount++;
+                persisted = true;
+            }
+            segmentLog.flush();
+
+            done = writeQueue.empty();
+        }
+    }
+
+    WITH_LOCK(*this) {
+        saveQueueIndex();
+    }
+
+    if (persisted) {
+        stats.record(PublishQueueStatsCollector::WRITE_DURATION, millis() - start);
+        WITH_LOCK(*this) {
+            checkQueueLimits();
+        }
+        os_semaphore_give(persistedSemaphore, false);
+    }
+}
+
+void PublishQueuePosix::asyncWriterThreadFunction() {
+    while(!writerStop) {
+        // Wait for events to write
+        os_semaphore_take(writerSemaphore, CONCURRENT_WAIT_FOREVER, false);
+
+        // Wait for more events so they can be written together, until the group is full or
+        // the oldest event has waited long enough
+        unsigned long start = millis();
+        while(!writerStop && !writerFlush) {
+            size_t numEvents;
+            WITH_LOCK(*this) {
+                numEvents = writeQueue.size();
+            }
+            unsigned long elapsed = millis() - start;
+            if (numEvents == 0 || numEvents >= asyncWriterMaxGroupSize || elapsed >= asyncWriterMaxDelay) {
+                break;
+            }
+            if (os_semaphore_take(writerSemaphore, asyncWriterMaxDelay - elapsed, false) != 0) {
+                // Timed out
+                break;
+            }
+        }
+        writerFlush = false;
+
+        writePendingEvents();
+    }
+}
+
+// static
+void PublishQueuePosix::asyncWriterThreadFunctionStatic(void *param) {
+    ((PublishQueuePosix *)param)->asyncWriterThreadFunction();
+    os_thread_exit(nullptr);
+}
+
+
+PublishQueueEvent *PublishQueuePosix::readQueueFile(PublishQueueFileQueue &queue, int fileNum) {
+    PublishQueueEvent *result = NULL;
+
+    int fd = open(queue.getPathForFileNum(fileNum), O_RDONLY);
+    if (fd >= 0) {
+        struct stat sb;
+        fstat(fd, &sb);
+
+        _log.trace("fileNum=%d size=%ld", fileNum, sb.st_size);
+
+        // A file that was not completely written is detected here, before allocating the event
+        PublishQueueFileHeader hdr;
+        bool valid = readFileHeader(fd, sb.st_size, hdr);
+        size_t storedSize = hdr.payloadLen;
+
+        // Version 1 and 2 events do not have the expires, timestamp and formatId fields, which are first
+        size_t offset = (hdr.version != FILE_VERSION) ? offsetof(PublishQueueEvent, flags) : 0;
+
+        if (valid && hdr.encoding == PublishQueueCompress::ENCODING_NONE && offset + storedSize >= PublishQueueEvent::getSize(0)) {
+            size_t eventSize = offset + storedSize;
+
+            result = eventPool.alloc(eventSize);
+            if (result) {
+                result->expires = 0;
+                result->timestamp = 0;
+                result->formatId = 0;
+                valid = read(fd, &((uint8_t *)result)[offset], storedSize) == (ssize_t)storedSize && ((char *)result)[eventSize - 1] == 0;
+                if (valid && hdr.version == FILE_VERSION_1) {
+                    // No CRC, so check that the event name is terminated
+                    valid = strlen(result->eventName) < (sizeof(PublishQueueEvent::eventName) - 1);
+                }
+                else
+                if (valid) {
+                    valid = getFileCrc(hdr, &((uint8_t *)result)[offset]) == hdr.crc;
+                }
+
+                if (valid) {
+                    _log.trace("readQueueFile %d event=%s data=%s", fileNum, result->eventName, result->eventData);
+                }
+                else {
+                    _log.trace("readQueueFile %d corrupted event name or data", fileNum);
+                    deleteEvent(result);
+                    result = NULL;
+                }
+
+            }
+        }
+        else
+        if (valid && hdr.encoding == PublishQueueCompress::ENCODING_LZSS && storedSize <= PublishQueueCompress::MAX_STORED_SIZE) {
+            // Decoding works even if compression is not enabled now, as long as there was no dictionary.
+            // The compressor buffer is shared with writers, which hold the lock.
+            WITH_LOCK(*this) {
+                uint8_t *stored = compressor.getBuffer();
+                if (stored && read(fd, stored, storedSize) == (ssize_t)storedSize && getFileCrc(hdr, stored) == hdr.crc) {
+                    size_t eventSize = offset + PublishQueueCompress::getDecodedSize(stored, storedSize);
+                    if (eventSize >= PublishQueueEvent::getSize(0) && eventSize <= PublishQueueCompress::MAX_STORED_SIZE) {
+                        result = eventPool.alloc(eventSize);
+                    }
+                    if (result) {
+                        bool decoded;
+                        if (offset) {
+                            result->expires = 0;
+                            result->timestamp = 0;
+                            result->formatId = 0;
+                            decoded = compressor.decompress(stored, storedSize, &((uint8_t *)result)[offset], eventSize - offset) && ((char *)result)[eventSize - 1] == 0;
+                        }
+                        else {
+                            decoded = compressor.decompressEvent(stored, storedSize, result, eventSize);
+                        }
+                        if (decoded && strlen(result->eventName) < (sizeof(PublishQueueEvent::eventName) - 1)) {
+                            _log.trace("readQueueFile %d compressed=%u event=%s data=%s", fileNum, (unsigned)storedSize, result->eventName, result->eventData);
+                        }
+                        else {
+                            _log.trace("readQueueFile %d different dictionary", fileNum);
+                            deleteEvent(result);
+                            result = NULL;
+                        }
+                    }
+                }
+                else {
+                    _log.trace("readQueueFile %d corrupted compressed event", fileNum);
+                }
+            }
+        }
+        else
+        if (valid && hdr.encoding == PublishQueueCompress::ENCODING_COMPACT && storedSize <= PublishQueueCompact::MAX_STORED_SIZE) {
+            // The buffer is shared with writers, which hold the lock, and so is the name table
+            WITH_LOCK(*this) {
+                uint8_t *stored = compact.getBuffer();
+                if (stored && read(fd, stored, storedSize) == (ssize_t)storedSize && getFileCrc(hdr, stored) == hdr.crc) {
+                    size_t eventSize = compact.getDecodedSize(stored, storedSize);
+                    if (eventSize) {
+                        result = eventPool.alloc(eventSize);
+                    }
+                    else {
+                        _log.trace("readQueueFile %d invalid compact event or name not in name table", fileNum);
+                    }
+                    if (result) {
+                        if (compact.decodeEvent(stored, storedSize, result, eventSize)) {
+                            _log.trace("readQueueFile %d compact=%u event=%s data=%s", fileNum, (unsigned)storedSize, result->eventName, result->eventData);
+                        }
+                        else {
+                            deleteEvent(result);
+                            result = NULL;
+                        }
+                    }
+                }
+                else {
+                    _log.trace("readQueueFile %d corrupted compact event", fileNum);
+                }
+            }
+        }
+        else {
+            _log.trace("readQueueFile %d bad magic=%08lx version=%u headerSize=%u nameLen=%u encoding=%u payloadLen=%u", fileNum, hdr.magic, hdr.version, hdr.headerSize, hdr.nameLen, hdr.encoding, hdr.payloadLen);
+        }
+
+        close(fd);
+    }
+    return result;
+}
+
+void PublishQueuePosix::countCorruptFile(PublishQueueFileQueue &queue, int fileNum, uint8_t priority) {
+    if (!queue.fileNumExists(fileNum)) {
+        _log.trace("skipping missing file %d priority %u", fileNum, priority);
+        return;
+    }
+    _log.info("discarding corrupted file %d priority %u", fileNum, priority);
+    stats.increment(PublishQueueStatsCollector::DISCARDED_CORRUPT);
+}
+
+bool PublishQueuePosix::readFileHeader(int fd, off_t fileSize, PublishQueueFileHeader &hdr) {
+    memset(&hdr, 0, sizeof(hdr));
+
+    if (read(fd, &hdr, FILE_V1_HEADER_SIZE) != FILE_V1_HEADER_SIZE || hdr.magic != FILE_MAGIC || hdr.nameLen != sizeof(PublishQueueEvent::eventName)) {
+        return false;
+    }
+
+    if (hdr.version == FILE_VERSION_1 && hdr.headerSize == FILE_V1_HEADER_SIZE) {
+        // The event size comes from the file size
+        if (fileSize <= (off_t)FILE_V1_HEADER_SIZE || fileSize - FILE_V1_HEADER_SIZE > 0xffff) {
+            return false;
+        }
+        hdr.encoding = PublishQueueCompress::ENCODING_NONE;
+        hdr.payloadLen = (uint16_t)(fileSize - FILE_V1_HEADER_SIZE);
+        return true;
+    }
+
+    if ((hdr.version == FILE_VERSION || hdr.version == FILE_VERSION_2) && hdr.headerSize == sizeof(PublishQueueFileHeader)) {
+        size_t extraSize = sizeof(PublishQueueFileHeader) - FILE_V1_HEADER_SIZE;
+        return read(fd, &((uint8_t *)&hdr)[FILE_V1_HEADER_SIZE], extraSize) == (ssize_t)extraSize &&
+            fileSize == (off_t)(sizeof(PublishQueueFileHeader) + hdr.payloadLen);
+    }
+
+    return false;
+}
+
+// static
+uint32_t PublishQueuePosix::getFileCrc(const PublishQueueFileHeader &hdr, const void *payload) {
+    uint32_t crc = PublishQueueSegmentLog::crc32(&hdr, offsetof(PublishQueueFileHeader, crc));
+    return PublishQueueSegmentLog::crc32(payload, hdr.payloadLen, crc);
+}
+
+void PublishQueuePosix::loadSequence(PublishQueueFileQueue &queue) {
+    int fileNum = queue.getLastFileNum();
+    if (queue.getQueueLen() == 0 || fileNum == 0) {
+        return;
+    }
+
+    int fd = open(queue.getPathForFileNum(fileNum), O_RDONLY);
+    if (fd >= 0) {
+        struct stat sb;
+        PublishQueueFileHeader hdr;
+        if (fstat(fd, &sb) == 0 && readFileHeader(fd, sb.st_size, hdr) && hdr.version != FILE_VERSION_1 && hdr.sequence >= nextSequence) {
+            nextSequence = hdr.sequence + 1;
+        }
+        close(fd);
+    }
+}
+
+void PublishQueuePosix::clearQueues() {
+    WITH_LOCK(*this) {
+        drainLockFreeQueue();
+
+        while(!writeQueue.empty()) {
+            PublishQueueEvent *event = writeQueue.front();
+            writeQueue.pop_front();
+            deleteEvent(event);
+        }
+        // Nothing left for waitForPersisted() to wait for
+        persistedCount = spilledCount;
+
+        while(!ramQueue.empty()) {
+            PublishQueueEvent *event = ramQueue.front();
+            ramQueue.pop_front();
+
+            deleteEvent(event);
+        }
+
+        // Files in the batch being sent are not in fileQueue
+        for(int fileNum : batchFileNums) {
+            fileQueue.removeFileNum(fileNum, false);
+        }
+        batchFileNums.clear();
+
+        // Same for events being sent using pipelining. The events themselves are still sent.
+        for(size_t ii = 0; ii < pipeline.size(); ii++) {
+            PublishQueueInFlight &entry = pipeline.at(ii);
+            if (entry.fileNum) {
+                getFileQueue(entry.priority).removeFileNum(entry.fileNum, false);
+                entry.fileNum = 0;
+            }
+        }
+
+        for(uint8_t priority = 1; priority <= MAX_PRIORITY; priority++) {
+            if (PublishQueueLane *lane = getLane(priority)) {
+                while(!lane->ramQueue.empty()) {
+                    PublishQueueEvent *event = lane->ramQueue.front();
+                    lane->ramQueue.pop_front();
+                    deleteEvent(event);
+                }
+                // The lane directories are left in place, so the queue directory is too
+                lane->fileQueue.removeAll(false);
+            }
+        }
+
+        coalesceEntries.clear();
+
+        segmentLog.removeAll();
+        fileQueue.removeAll(true);
+
+        // The name table file was removed with the other files
+        compact.clear();
+    }
+
+    _log.trace("clearQueues");
+}
+
+void PublishQueuePosix::setPausePublishing(bool value) { 
+    pausePublishing = value; 
+
+    if (!value) {
+        // When resuming publishing, update the canSleep flag
+        if (getNumEvents() != 0) {
+            canSleep = false;
+        }
+    }
+}
+
+
+
+void PublishQueuePosix::checkQueueLimits() {
+    WITH_LOCK(*this) {
+        if (isRamQueueFull()) {
+            // RAM queue is too large, move all to files
+            spillRamQueue();
+        }
+
+        while(getFileQueueLen() > fileQueueSize || isFlashFull(0)) {
+            if (!discardOldestFileEvent()) {
+                break;
+            }
+        }
+
+        // Each priority lane has its own limits, so lower priority events never cause
+        // higher priority events to be discarded
+        for(uint8_t priority = 1; priority <= MAX_PRIORITY; priority++) {
+            PublishQueueLane *lane = getLane(priority);
+            if (!lane) {
+                continue;
+            }
+            if (lane->ramQueue.size() > lane->ramQueueSize) {
+                writeLaneToFiles(priority);
+            }
+            while(lane->fileQueue.getQueueLen() + pipeline.getNumFiles(priority) > lane->fileQueueSize) {
+                int fileNum = lane->fileQueue.getFileFromQueue(true);
+                if (!fileNum) {
+                    break;
+                }
+                lane->fileQueue.removeFileNum(fileNum, false);
+                _log.info("discarded event %d priority %u", fileNum, priority);
+                stats.increment(PublishQueueStatsCollector::DISCARDED_LIMIT);
+            }
+        }
+    }
+}
+
+bool PublishQueuePosix::isFlashFull(size_t extraBytes) {
+    bool checkFreeSpace = (minFreeSpace != 0 && freeSpaceFunction);
+    if (fileQueueMaxBytes == 0 && !checkFreeSpace) {
+        return false;
+    }
+
+    loadFileSizes();
+
+    if (fileQueueMaxBytes != 0 && getFlashBytes() + extraBytes > fileQueueMaxBytes) {
+        return true;
+    }
+    return checkFreeSpace && freeSpaceFunction() < minFreeSpace + extraBytes;
+}
+
+void PublishQueuePosix::loadFileSizes() {
+    if (!fileSizesLoaded) {
+        // Files queued at boot were not written by this instance
+        fileQueue.loadFileSizes(getOldestSendingFileNum());
+
+        for(uint8_t priority = 1; priority <= MAX_PRIORITY; priority++) {
+            if (PublishQueueLane *lane = getLane(priority)) {
+                lane->fileQueue.loadFileSizes(pipeline.getOldestFileNum(priority));
+            }
+        }
+        fileSizesLoaded = true;
+    }
+}
+
+size_t PublishQueuePosix::getFlashBytes() const {
+    size_t result = fileQueue.getQueueBytes() + segmentLog.getFileBytes();
+
+    for(uint8_t priority = 1; priority <= MAX_PRIORITY; priority++) {
+        if (const PublishQueueLane *lane = getLane(priority)) {
+            result += lane->fileQueue.getQueueBytes();
+        }
+    }
+    return result;
+}
+
+bool PublishQueuePosix::discardOldestFileEvent() {
+    WITH_LOCK(*this) {
+        // Files are always older than events in the segment log
+        int fileNum = fileQueue.getFileFromQueue(true);
+        if (fileNum) {
+            fileQueue.removeFileNum(fileNum, false);
+            _log.info("discarded event %d", fileNum);
+        }
+        else
+        if (segmentLog.removeHead()) {
+            _log.info("discarded segment log event");
+        }
+        else {
+            return false;
+        }
+        stats.increment(PublishQueueStatsCollector::DISCARDED_LIMIT);
+    }
+    return true;
+}
+
+size_t PublishQueuePosix::getRamQueueBytes() {
+    size_t result = 0;
+
+    WITH_LOCK(*this) {
+        result = ramQueue.getBytes();
+    }
+    return result;
+}
+
+size_t PublishQueuePosix::getFileQueueBytes() {
+    size_t result = 0;
+
+    WITH_LOCK(*this) {
+        result = fileQueue.getQueueBytes() + segmentLog.getFileBytes();
+    }
+    return result;
+}
+
+size_t PublishQueuePosix::discardExpiredEvents() {
+    size_t count = 0;
+
+    if (!Time.isValid()) {
+        return 0;
+    }
+
+    WITH_LOCK(*this) {
+        drainLockFreeQueue();
+
+        count += discardExpired(ramQueue);
+        count += discardExpiredFiles(fileQueue, 0);
+
+        // Events being sent from the segment log are removed from its head once sent
+        if (curSegmentSeq == 0 && pipeline.getLastSegmentSeq() == 0) {
+            while(segmentLog.getQueueLen() != 0) {
+                uint32_t seq;
+                PublishQueueEvent *event = segmentLog.readHead(seq);
+                if (!event) {
+                    break;
+                }
+                bool expired = isExpired(event);
+                deleteEvent(event);
+                if (!expired || !segmentLog.removeHead(seq)) {
+                    break;
+                }
+                count++;
+            }
+        }
+
+        for(uint8_t priority = 1; priority <= MAX_PRIORITY; priority++) {
+            if (PublishQueueLane *lane = getLane(priority)) {
+                count += discardExpired(lane->ramQueue);
+                count += discardExpiredFiles(lane->fileQueue, priority);
+            }
+        }
+
+        if (count) {
+            stats.increment(PublishQueueStatsCollector::DISCARDED_EXPIRED, count);
+            saveQueueIndex();
+            _log.info("discarded %u expired events", (unsigned) count);
+        }
+    }
+    return count;
+}
+
+size_t PublishQueuePosix::discardExpired(PublishQueueEventRing &queue) {
+    size_t count = 0;
+
+    // Each event is moved to the back unless it has expired, so the order is the same afterwards
+    for(size_t remaining = queue.size(); remaining > 0; remaining--) {
+        PublishQueueEvent *event = queue.front();
+        queue.pop_front();
+
+        if (isExpired(event)) {
+            updateCoalesceEntry(event, 0);
+            deleteEvent(event);
+            count++;
+        }
+        else {
+            queue.push_back(event);
+        }
+    }
+    return count;
+}
+
+size_t PublishQueuePosix::discardExpiredFiles(PublishQueueFileQueue &queue, uint8_t priority) {
+    size_t count = 0;
+
+    int fileNum;
+    while((fileNum = queue.getFileFromQueue(false)) != 0) {
+        if (curEvent && curPriority == priority && curFileNum == fileNum) {
+            // Being sent, or kept to send again, which checks whether it has expired
+            break;
+        }
+
+        // Corrupted files are discarded when they're about to be sent
+        PublishQueueEvent *event = readQueueFile(queue, fileNum);
+        if (!event) {
+            break;
+        }
+        bool expired = isExpired(event);
+        deleteEvent(event);
+        if (!expired) {
+            break;
+        }
+
+        queue.getFileFromQueue(true);
+        queue.removeFileNum(fileNum, false);
+        _log.trace("discarded expired file %d", fileNum);
+        count++;
+    }
+    return count;
+}
+
+bool PublishQueuePosix::isExpired(const PublishQueueEvent *event) const {
+    return event->expires != 0 && Time.isValid() && (uint32_t) Time.now() >= event->expires;
+}
+
+size_t PublishQueuePosix::getNumPriorityEvents(uint8_t priority) {
+    size_t result = 0;
+
+    WITH_LOCK(*this) {
+        PublishQueueLane *lane = getLane(priority);
+        if (lane) {
+            result = lane->ramQueue.size() + lane->fileQueue.getQueueLen() + pipeline.getNumFiles(priority);
+
+            if (curEvent && curPriority == priority && curFileNum == 0) {
+                // Sending an event from the lane's RAM queue
+                result++;
+            }
+            for(size_t ii = 0; ii < pipeline.size(); ii++) {
+                const PublishQueueInFlight &entry = pipeline.at(ii);
+                if (entry.priority == priority && entry.event && entry.source == PublishQueuePipeline::SOURCE_RAM) {
+                    result++;
+                }
+            }
+        }
+    }
+    return result;
+}
+
+PublishQueueStats PublishQueuePosix::getStats() {
+    PublishQueueStats result;
+    stats.snapshot(result);
+
+    WITH_LOCK(*this) {
+        result.ramQueueLen = ramQueue.size() + lockFreeQueue.size() + writeQueue.size();
+        result.fileQueueLen = getFileQueueLen();
+        loadFileSizes();
+        result.flashBytes = getFlashBytes();
+
+        for(uint8_t priority = 1; priority <= MAX_PRIORITY; priority++) {
+            if (PublishQueueLane *lane = getLane(priority)) {
+                result.ramQueueLen += lane->ramQueue.size();
+                result.fileQueueLen += lane->fileQueue.getQueueLen() + pipeline.getNumFiles(priority);
+            }
+        }
+    }
+    return result;
+}
+
+size_t PublishQueuePosix::getNumEvents() {
+    size_t result = 0;
+
+    WITH_LOCK(*this) {
+        result = ramQueue.size() + lockFreeQueue.size() + writeQueue.size();
+        if (result == 0) {
+            result = getFileQueueLen();
+
+            if (curEvent && curFileNum == 0 && curSegmentSeq == 0 && batchFileNums.empty()) {
+                // This happens when we are sending an event from the RAM queue
+                // It's not in the RAM queue, but we want to count it, because
+                // otherwise getNumEvents would return 1 for the event sent from
+                // a file (because the file is not deleted until sent) and
+                // this makes the behavior consistent.
+                result += batchRamEvents.empty() ? 1 : batchRamEvents.size();
+            }
+            result += pipeline.countSource(PublishQueuePipeline::SOURCE_RAM);
+        }
+
+        for(uint8_t priority = 1; priority <= MAX_PRIORITY; priority++) {
+            if (PublishQueueLane *lane = getLane(priority)) {
+                result += lane->ramQueue.size() + lane->fileQueue.getQueueLen() + pipeline.getNumFiles(priority);
+            }
+        }
+    }
+    return result;
+}
+
+PublishQueueEvent *PublishQueuePosix::readBatch() {
+    PublishQueueBatch batch(batchMaxDataSize, &eventPool);
+    PublishQueueEvent *first = NULL;
+
+    // Returns true if event is part of the batch. The first event is always used, even if it's
+    // too large to add to the batch, in which case it's sent by itself.
+    auto addEvent = [&](PublishQueueEvent *event) {
+        if (!first) {
+            first = event;
+            batch.add(event, getEventData(event));
+            return true;
+        }
+        if (batch.getNumEvents() == 0 || batch.getNumEvents() >= batchMaxEvents || event->flags.value() != first->flags.value()) {
+            return false;
+        }
+        if (isExpired(first) || isExpired(event)) {
+            // An expired event is sent by itself, so stateWait discards it instead
+            return false;
+        }
+        return batch.add(event, getEventData(event));
+    };
+
+    WITH_LOCK(*this) {
+        if (fileQueue.getQueueLen() != 0) {
+            // Files are removed from fileQueue as they are added to the batch, because only the
+            // head of fileQueue can be read. The files are deleted once the batch has been sent.
+            while(batchFileNums.size() < batchMaxEvents) {
+                int fileNum = fileQueue.getFileFromQueue(false);
+                if (!fileNum) {
+                    break;
+                }
+                PublishQueueEvent *event = readQueueFile(fileNum);
+                if (!event) {
+                    // Corrupted, or already sent before a reset. Discard.
+                    countCorruptFile(fileQueue, fileNum);
+                    fileQueue.getFileFromQueue(true);
+                    fileQueue.removeFileNum(fileNum, false);
+                    continue;
+                }
+                if (!addEvent(event)) {
+                    deleteEvent(event);
+                    break;
+                }
+                fileQueue.getFileFromQueue(true);
+                batchFileNums.push_back(fileNum);
+                if (event != first) {
+                    deleteEvent(event);
+                }
+            }
+            curBatchCount = batchFileNums.size();
+        }
+        else
+        if (segmentLog.getQueueLen() != 0) {
+            uint32_t seq;
+            PublishQueueEvent *event = segmentLog.readHead(seq);
+            while(event) {
+                if (!addEvent(event)) {
+                    deleteEvent(event);
+                    break;
+                }
+                curSegmentSeq = seq;
+                curBatchCount++;
+                if (event != first) {
+                    deleteEvent(event);
+                }
+                event = (curBatchCount < batchMaxEvents) ? segmentLog.readNext(seq) : NULL;
+            }
+        }
+        else
+        if (writeQueue.empty()) {
+            // Events waiting for the writer thread are sent once they're written
+            while(!ramQueue.empty() && addEvent(ramQueue.front())) {
+                batchRamEvents.push_back(ramQueue.front());
+                updateCoalesceEntry(ramQueue.front(), 0);
+                ramQueue.pop_front();
+            }
+            if (batchRamEvents.size() == 1) {
+                // Only one event, send it the same way as without batching
+                batchRamEvents.clear();
+            }
+            else {
+                curBatchCount = batchRamEvents.size();
+            }
+        }
+    }
+
+    if (curBatchCount <= 1) {
+        return first;
+    }
+
+    PublishFlags flags = first->flags;
+    if (batchRamEvents.empty()) {
+        // first is a copy from a file or the segment log
+        deleteEvent(first);
+    }
+    _log.trace("batch of %u events", curBatchCount);
+    return batch.releaseEvent(batchEventName, flags);
+}
+
+void PublishQueuePosix::publishCompleteCallback(bool succeeded, const char *eventName, const char *eventData) {
+    if (compressCloud && curEvent) {
+        // eventData is what was sent, which may be compressed. This can run on another thread, so
+        // it uses the data from when the event was sent instead of formatting it again. curEvent
+        // and curEventData are not changed until publishComplete is set below.
+        eventName = curEvent->eventName;
+        eventData = curEventData;
+    }
+
+    if (publishCompleteUserCallback) {
+        if (curBatchCount > 1) {
+            PublishQueueBatch::decode(eventData, [this, succeeded](const char *eventName, const char *eventData) {
+                publishCompleteUserCallback(succeeded, eventName, eventData);
+            });
+        }
+        else {
+            publishCompleteUserCallback(succeeded, eventName, eventData);
+        }
+    }
+
+    publishSuccess = succeeded;
+    publishComplete = true;
+}
+
+bool PublishQueuePosix::refillPublishTokens() {
+    if (schedulerWeight) {
+        // With nothing to send, there's nothing to arbitrate, and the caller finds there's no event
+        if (!hasEventsToSend()) {
+            return true;
+        }
+        return PublishQueueScheduler::instance().canPublish(this, !pipeline.isEnabled());
+    }
+    return publishRate.refill();
+}
+
+unsigned long PublishQueuePosix::getFailureWait() const {
+    unsigned long waitMs = waitAfterFailure;
+    for(unsigned ii = 1; ii < consecutiveFailures && waitMs < maxWaitAfterFailure; ii++) {
+        waitMs *= 2;
+    }
+    if (waitMs > maxWaitAfterFailure) {
+        waitMs = maxWaitAfterFailure;
+    }
+
+    if (failureJitterPercent) {
+        unsigned long jitter = (unsigned long)((uint64_t)waitMs * failureJitterPercent / 100);
+        if (jitter) {
+            waitMs = waitMs - jitter + (unsigned long)((uint64_t)rand() % (2 * (uint64_t)jitter + 1));
+        }
+    }
+    return waitMs;
+}
+
+
+void PublishQueuePosix::usePublishToken() {
+    if (schedulerWeight) {
+        PublishQueueScheduler::instance().published(this, !pipeline.isEnabled());
+    }
+    else {
+        publishRate.use();
+    }
+}
+
+bool PublishQueuePosix::hasEventsToSend() {
+    if (curEvent) {
+        return true;
+    }
+
+    WITH_LOCK(*this) {
+        if (!ramQueue.empty() || lockFreeQueue.size() != 0 || fileQueue.getQueueLen() != 0 || segmentLog.getQueueLen() != 0) {
+            return true;
+        }
+        for(uint8_t priority = 1; priority <= MAX_PRIORITY; priority++) {
+            PublishQueueLane *lane = getLane(priority);
+            if (lane && (!lane->ramQueue.empty() || lane->fileQueue.getQueueLen() != 0)) {
+                return true;
+            }
+        }
+        for(size_t ii = 0; ii < pipeline.size(); ii++) {
+            if (pipeline.at(ii).state == PublishQueuePipeline::STATE_WAITING) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
 
 void PublishQueuePosix::stateConnectWait() {
     canSleep = (pausePublishing || getNumEvents() == 0);
 
+    if (checkSleepDrain(Particle.connected() && !pausePublishing)) {
+        canSleep = true;
+    }
+
     if (Particle.connected()) {
         stateTime = millis();
         durationMs = waitAfterConnect;
-        stateHandler = &PublishQueuePosix::stateWait;
+        consecutiveFailures = 0;
+        publishRate.fill();
+        if (pipeline.isEnabled()) {
+            stateHandler = &PublishQueuePosix::statePipeline;
+        }
+        else {
+            stateHandler = &PublishQueuePosix::stateWait;
+        }
     }
 }
 
@@ -288,55 +1835,145 @@ void PublishQueuePosix::stateWait() {
         return;
     }
 
+    if (checkSleepDrain(!pausePublishing)) {
+        canSleep = true;
+        return;
+    }
+
     if (pausePublishing) {
         canSleep = true;
         return;
     }
 
-    if (millis() - stateTime < durationMs) {
+    if (millis() - stateTime < durationMs || !refillPublishTokens()) {
         canSleep = (getNumEvents() == 0);
         return;
     }
     
-    curFileNum = fileQueue.getFileFromQueue(false);
-    if (curFileNum) {
-        curEvent = readQueueFile(curFileNum);
-        if (!curEvent) {
-            // Probably a corrupted file, discard
-            _log.info("discarding corrupted file %d", curFileNum);
-            fileQueue.getFileFromQueue(true);
-            fileQueue.removeFileNum(curFileNum, false);
+    if (curEvent) {
+        // An event kept after failing to send. Make sure it's still at the head of the queue, as
+        // clearQueues() or the queue limit may have discarded it since.
+        bool keep = false;
+        WITH_LOCK(*this) {
+            if (!batchFileNums.empty()) {
+                // A batch of files, which were removed from fileQueue when the batch was read
+                keep = true;
+            }
+            else
+            if (curFileNum) {
+                keep = (getFileQueue(curPriority).getFileFromQueue(false) == curFileNum);
+            }
+            else
+            if (curSegmentSeq) {
+                uint32_t firstSeq = curSegmentSeq + 1 - (curBatchCount ? curBatchCount : 1);
+                keep = (segmentLog.getQueueLen() != 0 && segmentLog.getHeadSeq() == firstSeq);
+            }
+            else {
+                // From a RAM queue, kept because BackgroundPublishRK was busy. It's only in curEvent.
+                keep = true;
+            }
         }
-    }
-    else {
-        if (!ramQueue.empty()) {
-            curEvent = ramQueue.front();
-            ramQueue.pop_front();
+        if (!keep) {
+            _log.trace("kept event is no longer queued");
+            deleteEvent(curEvent);
+            curEvent = NULL;
         }
-        else {
+        else
+        if ((curFileNum || curSegmentSeq) && getHighestQueuedPriority() > curPriority) {
+            // A higher priority event was queued while waiting to retry. The kept event is still
+            // stored in its queue, so it's read again after the higher priority events are sent.
+            _log.trace("kept event preempted by priority %u", getHighestQueuedPriority());
+            deleteEvent(curEvent);
             curEvent = NULL;
         }
     }
 
+    if (curEvent) {
+        // Retrying the kept event without reading it again
+    }
+    else
+    if ((curEvent = readPriorityEvent(curPriority, curFileNum, false)) != NULL) {
+        // Priority lanes are sent before the other queues, and are never batched
+        curSegmentSeq = 0;
+        curBatchCount = 0;
+    }
+    else
+    if (batchEventName.length() != 0) {
+        curFileNum = 0;
+        curSegmentSeq = 0;
+        curBatchCount = 0;
+        curEvent = readBatch();
+    }
+    else {
+        // Locked so the writer thread can't add a file between checking the file queue and the RAM queue
+        WITH_LOCK(*this) {
+            curSegmentSeq = 0;
+            curBatchCount = 0;
+            curFileNum = fileQueue.getFileFromQueue(false);
+            if (curFileNum) {
+                curEvent = readQueueFile(curFileNum);
+                if (!curEvent) {
+                    // Corrupted, or already sent before a reset. Discard.
+                    countCorruptFile(fileQueue, curFileNum);
+                    fileQueue.getFileFromQueue(true);
+                    fileQueue.removeFileNum(curFileNum, false);
+                }
+            }
+            else {
+                if (segmentLog.getQueueLen() != 0) {
+                    // Corrupted records are discarded by readHead
+                    curEvent = segmentLog.readHead(curSegmentSeq);
+                }
+                if (!curEvent && segmentLog.getQueueLen() == 0 && writeQueue.empty() && !ramQueue.empty()) {
+                    curEvent = ramQueue.front();
+                    ramQueue.pop_front();
+                    updateCoalesceEntry(curEvent, 0);
+                }
+            }
+        }
+    }
+
+    if (curEvent && isExpired(curEvent)) {
+        // Removed from its queue without sending. The next event is sent on the next call.
+        _log.info("discarding expired event %s", curEvent->eventName);
+        stats.increment(PublishQueueStatsCollector::DISCARDED_EXPIRED, curBatchCount ? curBatchCount : 1);
+        removeCurEvent();
+        return;
+    }
+
     if (curEvent) {
         stateTime = millis();
-        stateHandler = &PublishQueuePosix::statePublishWait;
         publishComplete = false;
         publishSuccess = false;
         canSleep = false;
 
+        // Formatted here, on the loop thread, and kept for publishCompleteCallback()
+        curEventData = getEventData(curEvent);
+
         // This message is monitored by the automated test tool. If you edit this, change that too.
-        _log.trace("publishing %s event=%s data=%s", (curFileNum ? "file" : "ram"), curEvent->eventName, curEvent->eventData);
+        _log.trace("publishing %s event=%s data=%s", ((curFileNum || curSegmentSeq || !batchFileNums.empty()) ? "file" : "ram"), curEvent->eventName, curEventData);
 
-        if (BackgroundPublishRK::instance().publish(curEvent->eventName, curEvent->eventData, curEvent->flags, 
+        if (BackgroundPublishRK::instance().publish(curEvent->eventName, getCloudData(curEventData), curEvent->flags, 
             [this](bool succeeded, const char *eventName, const char *eventData, const void *context) {
                 publishCompleteCallback(succeeded, eventName, eventData);
             })) {
             // Successfully started publish
+            stateHandler = &PublishQueuePosix::statePublishWait;
+            usePublishToken();
+        }
+        else {
+            // Another queue not using withScheduler() has a publish in progress. The token is not
+            // used, and curEvent is kept to try again.
+            _log.trace("background publish busy, retrying");
+            durationMs = PUBLISH_BUSY_RETRY_MS;
         }
     }
     else {
-        // No events, can sleep
+        // No events, can sleep. Save the index first so it's current if the device sleeps.
+        WITH_LOCK(*this) {
+            saveQueueIndex();
+            segmentLog.saveCursor();
+        }
         canSleep = true;
     }
 }
@@ -344,45 +1981,73 @@ void PublishQueuePosix::statePublishWait() {
     if (!publishComplete) {
         return;
     }
+    if (schedulerWeight) {
+        PublishQueueScheduler::instance().publishComplete(this);
+    }
+
+    recordPublishComplete(publishSuccess, curEvent, curBatchCount ? curBatchCount : 1, stateTime);
 
     if (publishSuccess) {
         // Remove from the queue
         _log.trace("publish success %d", curFileNum);
+        removeCurEvent();
+        consecutiveFailures = 0;
 
-        if (curFileNum) {
-            // Was from the file-based queue
-            int fileNum = fileQueue.getFileFromQueue(false);
-            if (fileNum == curFileNum) {
-                fileQueue.getFileFromQueue(true);
-                fileQueue.removeFileNum(fileNum, false);
-                _log.trace("removed file %d", fileNum);
-            }
-            curFileNum = 0;
-        }
-
-        delete curEvent;
-        curEvent = NULL;
-        durationMs = waitBetweenPublish;
+        // The token bucket paces successful publishes
+        durationMs = 0;
     }
     else {
         // Wait and retry
         // This message is monitored by the automated test tool. If you edit this, change that too.
         _log.trace("publish failed %d", curFileNum);
-        durationMs = waitAfterFailure;
+        consecutiveFailures++;
+        durationMs = getFailureWait();
 
-        if (curFileNum) {
-            // Was from the file-based queue
-            delete curEvent;
+        if (!batchFileNums.empty()) {
+            // Was a batch from the file-based queue. Keep curEvent to send again, as the files
+            // are no longer in fileQueue. They are still on the file system if reset.
+        }
+        else
+        if (curFileNum || curSegmentSeq) {
+            // Was from the file-based queue or segment log. Keep curEvent to send again so it
+            // does not need to be read again; stateWait checks that it's still queued.
+        }
+        else
+        if (curPriority) {
+            // Was in the RAM queue of a priority lane, put back and write the lane to files
+            WITH_LOCK(*this) {
+                requeueRamEvent(curEvent, curPriority);
+                writeLaneToFiles(curPriority);
+            }
             curEvent = NULL;
+            curPriority = 0;
+        }
+        else
+        if (!batchRamEvents.empty()) {
+            // Was a batch from the RAM-based queue, put the events back in the same order
+            WITH_LOCK(*this) {
+                while(!batchRamEvents.empty()) {
+                    requeueRamEvent(batchRamEvents.back());
+                    batchRamEvents.pop_back();
+                }
+            }
+            deleteEvent(curEvent);
+            curEvent = NULL;
+            curBatchCount = 0;
+
+            // Then write the entire queue to files
+            _log.trace("writing to files after publish failure");
+            spillRamQueue();
         }
         else {
             // Was in the RAM-based queue, put back
             WITH_LOCK(*this) {
-                ramQueue.push_front(curEvent);
+                requeueRamEvent(curEvent);
             }
+            curEvent = NULL;
             // Then write the entire queue to files
             _log.trace("writing to files after publish failure");
-            writeQueueToFiles();
+            spillRamQueue();
         }
     }
 
@@ -391,18 +2056,510 @@ void PublishQueuePosix::statePublishWait() {
 }
 
 
-PublishQueuePosix::PublishQueuePosix() {
+void PublishQueuePosix::removeCurEvent() {
+    if (!batchFileNums.empty()) {
+        // Was a batch from the file-based queue
+        for(int fileNum : batchFileNums) {
+            fileQueue.removeFileNum(fileNum, false);
+            _log.trace("removed file %d", fileNum);
+        }
+        batchFileNums.clear();
+    }
+    else
+    if (curFileNum) {
+        // Was from the file-based queue, or the file queue of a priority lane
+        WITH_LOCK(*this) {
+            PublishQueueFileQueue &queue = getFileQueue(curPriority);
+            int fileNum = queue.getFileFromQueue(false);
+            if (fileNum == curFileNum) {
+                queue.getFileFromQueue(true);
+                queue.removeFileNum(fileNum, false);
+                _log.trace("removed file %d", fileNum);
+            }
+        }
+        curFileNum = 0;
+    }
+    else
+    if (curSegmentSeq) {
+        // Was from the segment log
+        WITH_LOCK(*this) {
+            segmentLog.removeThrough(curSegmentSeq);
+        }
+        curSegmentSeq = 0;
+    }
+
+    while(!batchRamEvents.empty()) {
+        PublishQueueEvent *event = batchRamEvents.front();
+        batchRamEvents.pop_front();
+        deleteEvent(event);
+    }
+
+    deleteEvent(curEvent);
+    curEvent = NULL;
+    curBatchCount = 0;
+    curPriority = 0;
+}
+
+void PublishQueuePosix::deleteEvent(PublishQueueEvent *event) {
+    eventPool.free(event);
+}
+
+PublishQueuePosix::PublishQueuePosix() : writerFlush(false), writerStop(false) {
     fileQueue.withDirPath("/usr/pubqueue");
+    _instances.push_back(this);
+}
+
+PublishQueuePosix::PublishQueuePosix(const char *name) : writerFlush(false), writerStop(false), name(name) {
+    fileQueue.withDirPath(String::format("/usr/pubqueue-%s", name));
+    _instances.push_back(this);
 }
 
 PublishQueuePosix::~PublishQueuePosix() {
+    if (schedulerWeight) {
+        PublishQueueScheduler::instance().remove(this);
+    }
+    for(auto it = _instances.begin(); it != _instances.end(); ++it) {
+        if (*it == this) {
+            _instances.erase(it);
+            break;
+        }
+    }
+    if (writerThread) {
+        writerStop = true;
+        os_semaphore_give(writerSemaphore, false);
+        os_thread_join(writerThread);
+        writerThread = 0;
+    }
+    if (writerSemaphore) {
+        os_semaphore_destroy(writerSemaphore);
+    }
+    if (persistedSemaphore) {
+        os_semaphore_destroy(persistedSemaphore);
+    }
+    for(uint8_t priority = 1; priority <= MAX_PRIORITY; priority++) {
+        delete lanes[priority - 1];
+    }
+    delete[] formatBuf;
+
+}
+
+void PublishQueuePosix::statePipeline() {
+    bool connected = Particle.connected();
+
+    // Handle completed publishes, in any order
+    bool sending = false;
+    for(size_t ii = 0; ii < pipeline.size(); ii++) {
+        PublishQueueInFlight &entry = pipeline.at(ii);
+        uint8_t state = entry.state;
+
+        if (state == PublishQueuePipeline::STATE_SENDING) {
+            sending = true;
+        }
+        else
+        if (state == PublishQueuePipeline::STATE_SUCCEEDED) {
+            _log.trace("publish success id=%lu", (unsigned long) entry.id);
+            recordPublishComplete(true, entry.event, 1, entry.sendTime);
+            if (publishCompleteUserCallback) {
+                publishCompleteUserCallback(true, entry.event->eventName, getEventData(entry.event));
+            }
+            if (entry.fileNum) {
+                // Files can be deleted in any order, as they were removed from their file queue when read
+                WITH_LOCK(*this) {
+                    getFileQueue(entry.priority).removeFileNum(entry.fileNum, false);
+                }
+                _log.trace("removed file %d", entry.fileNum);
+                entry.fileNum = 0;
+            }
+            deleteEvent(entry.event);
+            entry.event = NULL;
+            entry.state = PublishQueuePipeline::STATE_DONE;
+            consecutiveFailures = 0;
+        }
+        else
+        if (state == PublishQueuePipeline::STATE_FAILED) {
+            // This message is monitored by the automated test tool. If you edit this, change that too.
+            _log.trace("publish failed id=%lu", (unsigned long) entry.id);
+            recordPublishComplete(false, entry.event, 1, entry.sendTime);
+            if (publishCompleteUserCallback) {
+                publishCompleteUserCallback(false, entry.event->eventName, getEventData(entry.event));
+            }
+            entry.state = PublishQueuePipeline::STATE_WAITING;
+            consecutiveFailures++;
+            stateTime = millis();
+            durationMs = getFailureWait();
+        }
+    }
 
+    // Remove events from the beginning of the window, in order, as the segment log can only be
+    // removed from the head
+    uint32_t segmentSeq = 0;
+    while(!pipeline.empty() && pipeline.at(0).state == PublishQueuePipeline::STATE_DONE) {
+        if (pipeline.at(0).segmentSeq) {
+            segmentSeq = pipeline.at(0).segmentSeq;
+        }
+        pipeline.removeFront();
+    }
+    if (segmentSeq) {
+        WITH_LOCK(*this) {
+            // Returns false if the events were discarded by clearQueues() or the queue limit
+            segmentLog.removeThrough(segmentSeq);
+        }
+    }
+
+    if (checkSleepDrain(connected && !pausePublishing)) {
+        // Publishes in progress complete, but new ones are not started until the drain ends
+        if (!connected && !sending) {
+            stateHandler = &PublishQueuePosix::stateConnectWait;
+        }
+        canSleep = !sending;
+        return;
+    }
+
+    if (!connected) {
+        if (!sending) {
+            // Events that failed stay in the window and are sent again after connecting
+            stateHandler = &PublishQueuePosix::stateConnectWait;
+        }
+        canSleep = false;
+        return;
+    }
+
+    if (pausePublishing || millis() - stateTime < durationMs) {
+        canSleep = pipeline.empty() && (pausePublishing || getNumEvents() == 0);
+        return;
+    }
+
+    // Send failed events again first, oldest first. New events are not sent until one succeeds.
+    bool waiting = false;
+    for(size_t ii = 0; ii < pipeline.size(); ii++) {
+        PublishQueueInFlight &entry = pipeline.at(ii);
+        if (entry.state == PublishQueuePipeline::STATE_WAITING) {
+            if (isExpired(entry.event)) {
+                discardPipelineEvent(&entry);
+                continue;
+            }
+            if (!refillPublishTokens()) {
+                waiting = true;
+                break;
+            }
+            sendPipelineEvent(&entry);
+        }
+    }
+
+    while(!waiting && consecutiveFailures == 0 && !pipeline.full() && refillPublishTokens()) {
+        uint8_t source;
+        uint8_t priority;
+        int fileNum;
+        PublishQueueEvent *event = readPipelineEvent(source, priority, fileNum, segmentSeq);
+        if (!event) {
+            break;
+        }
+        PublishQueueInFlight *entry = pipeline.add(event, source, priority, fileNum, segmentSeq);
+        if (isExpired(event)) {
+            // Added to the window so events from the segment log are still removed in order
+            discardPipelineEvent(entry);
+        }
+        else {
+            sendPipelineEvent(entry);
+        }
+    }
+
+    if (pipeline.empty()) {
+        // No events, can sleep. Save the index first so it's current if the device sleeps.
+        WITH_LOCK(*this) {
+            saveQueueIndex();
+            segmentLog.saveCursor();
+        }
+        canSleep = (getNumEvents() == 0);
+    }
+    else {
+        canSleep = false;
+    }
+}
+
+PublishQueueEvent *PublishQueuePosix::readPipelineEvent(uint8_t &source, uint8_t &priority, int &fileNum, uint32_t &segmentSeq) {
+    source = PublishQueuePipeline::SOURCE_RAM;
+    segmentSeq = 0;
+
+    PublishQueueEvent *event = readPriorityEvent(priority, fileNum, true);
+    if (event) {
+        if (fileNum) {
+            source = PublishQueuePipeline::SOURCE_FILE;
+        }
+        return event;
+    }
+
+    WITH_LOCK(*this) {
+        // Files are removed from fileQueue when read, because only the head of fileQueue can be read.
+        // They're deleted once sent.
+        while(!event && (fileNum = fileQueue.getFileFromQueue(true)) != 0) {
+            event = readQueueFile(fileNum);
+            if (!event) {
+                // Corrupted, or already sent before a reset. Discard.
+                countCorruptFile(fileQueue, fileNum);
+                fileQueue.removeFileNum(fileNum, false);
+            }
+        }
+        if (event) {
+            source = PublishQueuePipeline::SOURCE_FILE;
+            return event;
+        }
+
+        if (segmentLog.getQueueLen() != 0) {
+            uint32_t lastSeq = pipeline.getLastSegmentSeq();
+            if (lastSeq && lastSeq >= segmentLog.getHeadSeq()) {
+                // Events from the segment log are already being sent, read the one after them
+                if (lastSeq - segmentLog.getHeadSeq() + 1 < segmentLog.getQueueLen()) {
+                    // Returns NULL at the end of the head segment. The rest are read once it's removed.
+                    event = segmentLog.readNext(segmentSeq);
+                    if (event && segmentSeq != lastSeq + 1) {
+                        _log.error("segment log sequence %lu expected %lu", (unsigned long) segmentSeq, (unsigned long) (lastSeq + 1));
+                        deleteEvent(event);
+                        event = NULL;
+                    }
+                    if (event) {
+                        source = PublishQueuePipeline::SOURCE_SEGMENT;
+                    }
+                    return event;
+                }
+            }
+            else {
+                // Corrupted records are discarded by readHead
+                event = segmentLog.readHead(segmentSeq);
+                if (event) {
+                    source = PublishQueuePipeline::SOURCE_SEGMENT;
+                    return event;
+                }
+                if (segmentLog.getQueueLen() != 0) {
+                    // Out of memory, try again later
+                    return NULL;
+                }
+            }
+        }
+
+        // Events waiting for the writer thread are sent once they're written
+        if (writeQueue.empty() && !ramQueue.empty()) {
+            event = ramQueue.front();
+            ramQueue.pop_front();
+            updateCoalesceEntry(event, 0);
+        }
+    }
+    return event;
+}
+
+void PublishQueuePosix::sendPipelineEvent(PublishQueueInFlight *entry) {
+    PublishQueueEvent *event = entry->event;
+    uint32_t id = entry->id;
+
+    entry->state = PublishQueuePipeline::STATE_SENDING;
+    entry->sendTime = millis();
+    usePublishToken();
+    canSleep = false;
+
+    // This message is monitored by the automated test tool. If you edit this, change that too.
+    _log.trace("publishing %s event=%s data=%s id=%lu", ((entry->source != PublishQueuePipeline::SOURCE_RAM) ? "file" : "ram"), event->eventName, event->eventData, (unsigned long) id);
+
+    // Completion callbacks may be called from another thread, so they only set the state
+    Particle.publish(event->eventName, getCloudData(getEventData(event)), event->flags)
+        .onSuccess([entry, id](bool result) {
+            PublishQueuePipeline::complete(entry, id, result);
+        })
+        .onError([entry, id](particle::Error) {
+            PublishQueuePipeline::complete(entry, id, false);
+        });
+}
+
+void PublishQueuePosix::discardPipelineEvent(PublishQueueInFlight *entry) {
+    _log.info("discarding expired event %s id=%lu", entry->event->eventName, (unsigned long) entry->id);
+
+    if (entry->fileNum) {
+        // Removed from its file queue when it was read
+        WITH_LOCK(*this) {
+            getFileQueue(entry->priority).removeFileNum(entry->fileNum, false);
+        }
+        entry->fileNum = 0;
+    }
+    deleteEvent(entry->event);
+    entry->event = NULL;
+    entry->state = PublishQueuePipeline::STATE_DONE;
+    stats.increment(PublishQueueStatsCollector::DISCARDED_EXPIRED);
+}
+
+void PublishQueuePosix::recordPublishComplete(bool succeeded, const PublishQueueEvent *event, size_t numEvents, unsigned long sendTime) {
+    unsigned long elapsed = millis() - sendTime;
+    stats.record(PublishQueueStatsCollector::PUBLISH_ROUND_TRIP, elapsed);
+
+    // Moving average for drainForSleep(), so one slow publish does not change it much
+    if (elapsed == 0) {
+        elapsed = 1;
+    }
+    publishLatencyMs = publishLatencyMs ? (publishLatencyMs * 7 + elapsed) / 8 : elapsed;
+
+    if (!succeeded) {
+        stats.increment(PublishQueueStatsCollector::FAILED);
+        return;
+    }
+    stats.increment(PublishQueueStatsCollector::PUBLISHED, numEvents);
+
+    // A batch has the timestamp of its oldest event
+    if (event->timestamp != 0 && Time.isValid()) {
+        uint32_t now = (uint32_t) Time.now();
+        stats.record(PublishQueueStatsCollector::QUEUE_LATENCY, (now > event->timestamp) ? (now - event->timestamp) : 0);
+    }
+}
+
+unsigned long PublishQueuePosix::drainForSleep(unsigned long budgetMs) {
+    sleepDrainStart = millis();
+    sleepDrainBudget = budgetMs;
+    sleepDrainActive = true;
+    sleepDrainFlushed = false;
+    canSleep = false;
+
+    unsigned long result = getEstimatedDrainMs();
+    _log.trace("drainForSleep budgetMs=%lu estimatedDrainMs=%lu", budgetMs, result);
+    return result;
+}
+
+bool PublishQueuePosix::checkSleepDrain(bool connected) {
+    if (!sleepDrainActive) {
+        return false;
+    }
+
+    unsigned long elapsed = millis() - sleepDrainStart;
+    if (elapsed >= sleepDrainBudget) {
+        // The device did not sleep, or millis() advanced while it did
+        _log.trace("sleep drain ended");
+        sleepDrainActive = false;
+        return false;
+    }
+    if (!sleepDrainFlushed && connected && sleepDrainBudget - elapsed >= getPublishLatencyMs()) {
+        // Another publish is expected to complete before the device sleeps
+        return false;
+    }
+
+    bool ramEvents = false;
+    WITH_LOCK(*this) {
+        ramEvents = !ramQueue.empty() || lockFreeQueue.size() != 0 || !writeQueue.empty();
+        for(uint8_t priority = 1; priority <= MAX_PRIORITY; priority++) {
+            PublishQueueLane *lane = getLane(priority);
+            if (lane && !lane->ramQueue.empty()) {
+                ramEvents = true;
+            }
+        }
+    }
+    if (!sleepDrainFlushed || ramEvents) {
+        // Events published after the drain stopped publishing are written too
+        _log.trace("sleep drain writing %s", sleepDrainFlushed ? "new events" : "remaining events");
+        writeQueueToFiles();
+        WITH_LOCK(*this) {
+            saveQueueIndex();
+            segmentLog.saveCursor();
+        }
+        sleepDrainFlushed = true;
+    }
+    return true;
+}
+
+unsigned long PublishQueuePosix::getEstimatedDrainMs() {
+    size_t numPublishes = 0;
+
+    WITH_LOCK(*this) {
+        size_t numPriority = 0;
+        for(uint8_t priority = 1; priority <= MAX_PRIORITY; priority++) {
+            numPriority += getNumPriorityEvents(priority);
+        }
+
+        // Priority events are never batched
+        size_t numEvents = getNumEvents();
+        size_t numDefault = (numEvents > numPriority) ? numEvents - numPriority : 0;
+        if (batchEventName.length() != 0 && batchMaxEvents > 1) {
+            numDefault = (numDefault + batchMaxEvents - 1) / batchMaxEvents;
+        }
+        numPublishes = numPriority + numDefault;
+    }
+    if (numPublishes == 0) {
+        return 0;
+    }
+
+    // With pipelining, publishes overlap, but the last one still takes the full latency
+    unsigned long latency = getPublishLatencyMs();
+    unsigned long perPublish = pipeline.isEnabled() ? latency / pipeline.getCapacity() : latency;
+    unsigned long msPerEvent = schedulerWeight ? PublishQueueScheduler::instance().getWaitBetweenPublish() : publishRate.getMsPerToken();
+    if (perPublish < msPerEvent) {
+        perPublish = msPerEvent;
+    }
+    unsigned long result = (numPublishes - 1) * perPublish + latency;
+
+    unsigned long waited = millis() - stateTime;
+    if (waited < durationMs) {
+        // Waiting after connecting or after a failure
+        result += durationMs - waited;
+    }
+    return result;
+}
+
+const char *PublishQueuePosix::getEventData(const PublishQueueEvent *event) {
+    const char *data = event->eventData;
+    if (event->formatId == 0) {
+        return data;
+    }
+
+    if (!formatBuf) {
+        formatBuf = new char[particle::protocol::MAX_EVENT_DATA_LENGTH + 1];
+        if (!formatBuf) {
+            return "";
+        }
+    }
+    formatBuf[0] = 0;
+
+    // The record is copied so it's aligned for the formatter
+    uint8_t formatId = event->formatId;
+    size_t recordLen = (uint8_t) data[0];
+    uint32_t record[(MAX_RECORD_SIZE + 3) / 4];
+    if (recordLen > MAX_RECORD_SIZE) {
+        _log.error("deferred event %s has an invalid record", event->eventName);
+        return formatBuf;
+    }
+    memcpy(record, &data[1], recordLen);
+
+    for(auto &it : formatters) {
+        if (it.first == formatId) {
+            size_t len = it.second(record, recordLen, formatBuf, particle::protocol::MAX_EVENT_DATA_LENGTH + 1);
+            formatBuf[std::min(len, (size_t) particle::protocol::MAX_EVENT_DATA_LENGTH)] = 0;
+            return formatBuf;
+        }
+    }
+    _log.error("no formatter for format %u of event %s", formatId, event->eventName);
+    return formatBuf;
+}
+
+const char *PublishQueuePosix::getCloudData(const char *eventData) {
+    const char *result = eventData;
+    if (compressCloud) {
+        // The compressor buffer is shared with writers. The encoded data is only used from loop(),
+        // and both publish functions copy it before returning.
+        WITH_LOCK(*this) {
+            if (const char *encoded = compressor.encodeCloud(result)) {
+                _log.trace("compressed data from %u to %u bytes", (unsigned) strlen(result), (unsigned) strlen(encoded));
+                result = encoded;
+            }
+        }
+    }
+    return result;
 }
 
 void PublishQueuePosix::systemEventHandler(system_event_t event, int param) {
     if ((event == reset) || ((event == cloud_status) && (param == cloud_status_disconnecting))) {
         _log.trace("reset or disconnect event, save files to queue");
-        PublishQueuePosix::instance().writeQueueToFiles();
+        for(PublishQueuePosix *queue : _instances) {
+            if (queue->stateHandler) {
+                queue->writeQueueToFiles();
+                WITH_LOCK(*queue) {
+                    queue->saveQueueIndex();
+                    queue->segmentLog.saveCursor();
+                }
+            }
+        }
     }
 }
 
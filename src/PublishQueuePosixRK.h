@@ -6,21 +6,50 @@
 
 #include "Particle.h"
 #include "SequentialFileRK.h"
+#include "PublishQueueBatch.h"
+#include "PublishQueueCompact.h"
+#include "PublishQueueCompress.h"
+#include "PublishQueueEventPool.h"
+#include "PublishQueueFileQueue.h"
+#include "PublishQueuePipeline.h"
+#include "PublishQueueScheduler.h"
+#include "PublishQueueSegmentLog.h"
+#include "PublishQueueSpscRing.h"
+#include "PublishQueueStats.h"
+#include "PublishQueueTokenBucket.h"
 
-#include <deque>
+#include <atomic>
+#include <vector>
 
 /**
  * @brief Structure stored before the event data in files on the flash file system
  * 
  * Each file is sequentially numbered and has one event. The contents of the file
- * are this header (8 bytes) followed by the PublishQueueEvent structure, which
- * is variably sized based on the size of the event.    
+ * are this header (24 bytes) followed by the PublishQueueEvent structure, which
+ * is variably sized based on the size of the event. If the encoding is
+ * PublishQueueCompress::ENCODING_LZSS, the PublishQueueEvent is stored compressed
+ * using PublishQueueCompress::compressEvent(). If it's ENCODING_COMPACT, it's stored
+ * using PublishQueueCompact::encodeEvent().
+ * 
+ * The payload length and CRC let a file that was not completely written be
+ * detected from the file size and header alone, before allocating the event.
+ * 
+ * Version 1 files, written by earlier versions of the library, only have the
+ * first 4 fields (8 bytes) and are still read. Their payload is a PublishQueueEvent
+ * without the expires, timestamp and formatId fields. Version 2 files have this
+ * header, and the same payload as version 1 if it's not compact encoded.
  */
 struct PublishQueueFileHeader {
     uint32_t magic;         //!< PublishQueuePosix::FILE_MAGIC = 0x31b67663
-    uint8_t version;        //!< PublishQueuePosix::FILE_VERSION = 1
-    uint8_t headerSize;     //!< sizeof(PublishQueueFileHeader) = 8
-    uint16_t nameLen;       //!< sizeof(PublishQueueEvent::eventName) = 64
+    uint8_t version;        //!< PublishQueuePosix::FILE_VERSION = 3, or FILE_VERSION_2 or FILE_VERSION_1
+    uint8_t headerSize;     //!< sizeof(PublishQueueFileHeader) = 24, or FILE_V1_HEADER_SIZE = 8 for version 1
+    uint16_t nameLen;       //!< sizeof(PublishQueueEvent::eventName) = 65
+    uint8_t encoding;       //!< PublishQueueCompress::ENCODING_NONE, ENCODING_LZSS or ENCODING_COMPACT
+    uint8_t reserved;       //!< Reserved, currently 0
+    uint16_t payloadLen;    //!< Size of the payload after the header in bytes
+    uint32_t timestamp;     //!< Time.now() when the event was written, 0 if the time was not valid
+    uint32_t sequence;      //!< Sequence number, incremented for each event written
+    uint32_t crc;           //!< CRC-32 of the previous fields followed by the payload
 };
 
 /**
@@ -29,15 +58,66 @@ struct PublishQueueFileHeader {
  * In RAM, this structure is stored in the ramQueue. 
  * 
  * On the flash file system, each file contains one event and consists of the
- * PublishQueueFileHeader above (8 bytes) plus this structure.
+ * PublishQueueFileHeader above (24 bytes) plus this structure.
  * 
  * Note that the eventData is specified as 1 byte here, but it's actually
- * sized to fit the event data with a null terminator.
+ * sized to fit the event data with a null terminator. Use getSize() for the
+ * size, as sizeof() includes padding after eventData.
+ *
+ * For an event from publishDeferred(), eventData is not a string. It's the
+ * record length (1 byte), then the record, which can contain null bytes,
+ * followed by a null terminator. Use getDataLen() for its length.
  */
 struct PublishQueueEvent {
+    uint32_t expires; //!< Time.now() value at which the event is discarded instead of sent, 0 if it does not expire
+    uint32_t timestamp; //!< Time.now() value when the event was published, 0 if the time was not valid
+    uint8_t formatId; //!< Format from publishDeferred() used to format the record in eventData when it's sent, 0 to send eventData as is
     PublishFlags flags; //!< NO_ACK or WITH_ACK. Can use PRIVATE, but that's no longer needed.
     char eventName[particle::protocol::MAX_EVENT_NAME_LENGTH + 1]; //!< c-string event name (required)
     char eventData[1]; //!< Variable size event data
+
+    /**
+     * @brief Gets the size of an event with dataLen bytes of event data, not including the null terminator
+     */
+    static constexpr size_t getSize(size_t dataLen) { return offsetof(PublishQueueEvent, eventData) + dataLen + 1; };
+
+    /**
+     * @brief Gets the length of eventData, not including the null terminator
+     */
+    size_t getDataLen() const { return formatId ? (1 + (uint8_t) eventData[0]) : strlen(eventData); };
+};
+
+/**
+ * @brief Queues for one priority above the default, set up using PublishQueuePosix::withPriorityLane()
+ * 
+ * Events are kept in RAM while connected, and otherwise stored one per file in a subdirectory of
+ * the queue directory.
+ */
+struct PublishQueueLane {
+    PublishQueueEventRing ramQueue; //!< Events in RAM
+    PublishQueueFileQueue fileQueue; //!< Events on the flash file system
+    size_t ramQueueSize = 2; //!< Maximum events in ramQueue before they're written to files
+    size_t fileQueueSize = 20; //!< Maximum events in fileQueue, the oldest are discarded
+};
+
+/**
+ * @brief A coalescing key from PublishQueuePosix::publishCoalesced() and where its event is queued
+ */
+struct PublishQueueCoalesceEntry {
+    char key[32]; //!< Coalescing key (31 characters maximum)
+    PublishQueueEvent *event; //!< The event in ramQueue or writeQueue, or NULL if in a file
+    int fileNum; //!< The file in fileQueue, if event is NULL
+};
+
+/**
+ * @brief One event for PublishQueuePosix::publishBulk()
+ */
+struct PublishQueueBulkEvent {
+    const char *eventName; //!< c-string event name (63 character maximum)
+    const char *eventData; //!< c-string event data, or NULL for none
+    PublishFlags flags; //!< Normally PRIVATE. You can also use NO_ACK or WITH_ACK.
+    int ttl; //!< Time-to-live in seconds, the same as publish(). 0 does not expire.
+    bool queued; //!< Set by publishBulk(), true if the event was queued
 };
 
 /**
@@ -47,13 +127,32 @@ struct PublishQueueEvent {
 class PublishQueuePosix {
 public:
     /**
-     * @brief Gets the singleton instance of this class
+     * @brief Gets the default instance of this class
      * 
      * You cannot construct a PublishQueuePosix object as a global variable,
-     * stack variable, or with new. You can only request the singleton instance.
+     * stack variable, or with new. You can only request the default instance,
+     * or a named instance using instance(name).
      */
     static PublishQueuePosix &instance();
 
+    /**
+     * @brief Gets a named instance of this class, creating it if necessary
+     * 
+     * @param name The name of the instance. NULL or an empty string is the same as instance().
+     * 
+     * Each instance is a separate queue, with its own directory, limits, options, callbacks and
+     * state, so events with different needs, such as bulk telemetry and diagnostics, can be kept
+     * apart. The default directory is /usr/pubqueue-name, which should be changed using
+     * withDirPath() if it's not a valid name for a directory. Call setup() and loop() for each
+     * instance. Use withScheduler() to share the publish rate between them.
+     */
+    static PublishQueuePosix &instance(const char *name);
+
+    /**
+     * @brief Gets the name of this instance, an empty string for instance()
+     */
+    const char *getName() const { return name.c_str(); };
+
     /**
      * @brief Sets the RAM based queue size (default is 2)
      * 
@@ -89,6 +188,80 @@ public:
      */
     size_t getFileQueueSize() const { return fileQueueSize; };
 
+    /**
+     * @brief Sets the maximum size of the RAM queue in bytes (default is 0, no limit)
+     * 
+     * @param bytes The maximum size of the events in the RAM queue, or 0 for no limit
+     * 
+     * Events vary in size from a few bytes to over 1K, so a limit on the number of events set
+     * using withRamQueueSize() has to allow for the largest. When the events in the RAM queue
+     * exceed either limit, they are moved to files. Priority lanes only use the count.
+     */
+    PublishQueuePosix &withRamQueueMaxBytes(size_t bytes);
+
+    /**
+     * @brief Gets the maximum size of the RAM queue in bytes, 0 if there is no limit
+     */
+    size_t getRamQueueMaxBytes() const { return ramQueueMaxBytes; };
+
+    /**
+     * @brief Sets the maximum size of the file queue on the flash file system in bytes (default is 0, no limit)
+     * 
+     * @param bytes The maximum size of the event files and segment files, or 0 for no limit
+     * 
+     * When writing an event would exceed this, the oldest events are discarded first. The limit
+     * set using withFileQueueSize() also still applies. Files in priority lanes count toward the
+     * limit, but only events in the default queue are discarded for it; priority lanes only discard
+     * events to stay within their count.
+     * 
+     * The size is tracked as files are written and removed. The first time a limit is set, the
+     * size of each file already queued is checked once, which takes a while if many events are
+     * queued at boot.
+     */
+    PublishQueuePosix &withFileQueueMaxBytes(size_t bytes);
+
+    /**
+     * @brief Gets the maximum size of the file queue in bytes, 0 if there is no limit
+     */
+    size_t getFileQueueMaxBytes() const { return fileQueueMaxBytes; };
+
+    /**
+     * @brief Keep space free on the flash file system, discarding the oldest events if necessary
+     * 
+     * @param bytes The minimum free space to leave, in bytes, or 0 to not check
+     * 
+     * @param freeSpaceFunction Function that returns the free space on the file system in bytes
+     * 
+     * The flash file system is shared with the application, and running out of space can cause
+     * other writes to fail. Before writing an event to the default queue, if it would leave less
+     * than this much free space, the oldest events are discarded first. If there are none to
+     * discard, the event is written anyway, which may fail.
+     * 
+     * The free space function is called before each event is written, so it should be fast.
+     */
+    PublishQueuePosix &withMinFreeSpace(size_t bytes, std::function<size_t()> freeSpaceFunction);
+
+    /**
+     * @brief Gets the minimum free space set using withMinFreeSpace(), 0 if not checked
+     */
+    size_t getMinFreeSpace() const { return minFreeSpace; };
+
+    /**
+     * @brief Gets the size of the events in the default RAM queue in bytes
+     * 
+     * This is tracked as events are added and removed, so it's fast.
+     */
+    size_t getRamQueueBytes();
+
+    /**
+     * @brief Gets the size of the default file queue, event files and segment files, in bytes
+     * 
+     * This includes files being sent that have not been deleted yet. Event files already queued
+     * at boot are only counted once a limit is set using withFileQueueMaxBytes() or withMinFreeSpace(),
+     * or getStats() has been called.
+     */
+    size_t getFileQueueBytes();
+
     /**
      * @brief Sets the directory to use as the queue directory. This is required!
      * 
@@ -112,6 +285,476 @@ public:
      */
     const char *getDirPath() const { return fileQueue.getDirPath(); };
 
+    /**
+     * @brief Enable or disable the queue index file (default: enabled)
+     * 
+     * @param enable true to use the index, false to scan the queue directory at every boot
+     * 
+     * The index stores the range of file numbers in the queue, so setup() does not need to list
+     * and sort every file in the queue directory, which can take a noticeable amount of time when
+     * many events are queued. It's saved after each pass that writes events to files and when the
+     * queue becomes idle; files added or removed since then are found by checking the files just
+     * past each end of the saved range. If the index is missing, empty, or does not match the
+     * files, the directory is scanned as before.
+     * 
+     * Call this before setup(). When disabled, any existing index file is deleted.
+     */
+    PublishQueuePosix &withQueueIndex(bool enable = true) { useQueueIndex = enable; return *this; };
+
+    /**
+     * @brief Returns true if the queue index file is enabled
+     */
+    bool getQueueIndex() const { return useQueueIndex; };
+
+    /**
+     * @brief Store events in append-only segment files instead of one file per event
+     * 
+     * @param size The maximum size of each segment file in bytes (default: 16384). 0 stores
+     * one event per file, which is the default if you do not call this method.
+     * 
+     * Events are appended to the current segment file as length-prefixed, checksummed
+     * records. When a segment is full, a new one is started, and a segment is deleted once
+     * all of the events in it have been sent. This greatly reduces the number of files
+     * created and flash sectors written when many events are queued, especially small ones.
+     * 
+     * The file queue size set using withFileQueueSize() is still the maximum number of events.
+     * 
+     * Call this before setup(). Events already queued in the other format are still sent,
+     * so it's safe to switch between the two modes.
+     */
+    PublishQueuePosix &withSegmentSize(size_t size = PublishQueueSegmentLog::DEFAULT_SEGMENT_SIZE) { segmentLog.withSegmentSize(size); return *this; };
+
+    /**
+     * @brief Gets the segment size set using withSegmentSize(), or 0 if storing one event per file
+     */
+    size_t getSegmentSize() const { return segmentLog.getSegmentSize(); };
+
+    /**
+     * @brief Sets the size of the buffer used to read segment files (default: 2048)
+     * 
+     * @param size The buffer size in bytes. The minimum is about 1100 bytes, enough for one
+     * maximum size event.
+     * 
+     * When sending events from segment files, this many bytes are read at a time, so a run of
+     * small events is read with one open and read instead of one per event. The buffer is only
+     * allocated if there are events in segment files. Call this before setup().
+     */
+    PublishQueuePosix &withReadAheadSize(size_t size) { segmentLog.withReadAheadSize(size); return *this; };
+
+    /**
+     * @brief Gets the segment read buffer size set using withReadAheadSize()
+     */
+    size_t getReadAheadSize() const { return segmentLog.getReadAheadSize(); };
+
+    /**
+     * @brief Preallocate the events in the RAM queue so publishing does not use the heap
+     * 
+     * @param maxDataSize The largest event data size, in bytes (default: 1024). Events with
+     * larger data are still allocated from the heap.
+     * 
+     * When setup() is called, buffers for the RAM queue size set using withRamQueueSize() plus
+     * a few more for events being published and read from files are allocated in one block.
+     * After that, publishing and sending events does not allocate memory from the heap, which
+     * avoids heap fragmentation on devices that run for a long time.
+     * 
+     * If all of the buffers are in use, publish() first moves the RAM queue to files, and returns
+     * false if the event still cannot be queued, instead of running out of heap.
+     * 
+     * This uses (ramQueueSize + 3) * (maxDataSize + 72) bytes of RAM, plus two more events when
+     * using withBatchPublish(). Call this, withRamQueueSize() and withBatchPublish() before setup().
+     */
+    PublishQueuePosix &withEventPool(size_t maxDataSize = particle::protocol::MAX_EVENT_DATA_LENGTH);
+
+    /**
+     * @brief Gets the number of preallocated events from withEventPool() that are not in use
+     */
+    size_t getEventPoolNumFree() const { return eventPool.getNumFree(); };
+
+    /**
+     * @brief Publish without waiting for the queue mutex, using a lock-free queue
+     * 
+     * @param size Maximum number of events waiting to be moved into the RAM queue (default: 16,
+     * rounded up to a power of 2). 0 disables the lock-free queue, which is the default if you
+     * do not call this.
+     * 
+     * Normally publish() locks the queue mutex, which is held by the publishing state machine and
+     * while writing events to files. With a lock-free queue, publish() adds the event to the
+     * lock-free queue and returns, and loop() moves it into the RAM queue and writes files
+     * if necessary. This is useful if a thread publishes at a high rate and must not be stalled
+     * by flash writes.
+     * 
+     * Only one thread may publish at a time when using the lock-free queue. If it is full,
+     * publish() falls back to locking the mutex and moving the events itself. 
+     * 
+     * Call this before setup(). When combined with withEventPool(), the pool is made larger
+     * so the events in the lock-free queue are preallocated too.
+     */
+    PublishQueuePosix &withLockFreeQueue(size_t size = 16);
+
+    /**
+     * @brief Gets the capacity of the lock-free queue, or 0 if not used
+     */
+    size_t getLockFreeQueueSize() const { return lockFreeQueue.getCapacity(); };
+
+    /**
+     * @brief Write events to the flash file system from a separate thread, in groups
+     * 
+     * @param maxDelayMs Maximum time in milliseconds an event waits to be written once it has been
+     * moved out of the RAM queue (default: 100)
+     * 
+     * @param maxGroupSize Write without waiting for maxDelayMs once this many events are waiting
+     * (default: 16)
+     * 
+     * Normally, when the RAM queue is full or the cloud is not connected, publish() writes the RAM
+     * queue to files before returning. With the async writer, the events are instead handed to a
+     * writer thread, which waits up to maxDelayMs for more events and then writes all of them.
+     * With withSegmentSize(), each group is appended to the segment with one open and close.
+     * 
+     * publish() can still wait for the queue mutex while the writer is appending a group to the
+     * segment log; use withLockFreeQueue() as well if that is a problem. Events waiting to be
+     * written are lost on a sudden reset, so the loss window is maxDelayMs plus the write time.
+     * Use flush() or waitForPersisted() when an event must be on the file system. A graceful
+     * reset or cloud disconnect still writes everything immediately.
+     * 
+     * Call this before setup().
+     */
+    PublishQueuePosix &withAsyncWriter(unsigned long maxDelayMs = 100, size_t maxGroupSize = 16);
+
+    /**
+     * @brief Returns true if withAsyncWriter() was used and the writer thread is running
+     */
+    bool getAsyncWriterRunning() const { return writerThread != 0; };
+
+    /**
+     * @brief Write all queued events to the flash file system and wait for them to be written
+     * 
+     * @param timeoutMs Maximum time to wait in milliseconds (default: wait forever)
+     * 
+     * @return true if all of the events published before the call have been written, false if
+     * the timeout expired first
+     * 
+     * This moves the RAM queue to files, even if connected. Without withAsyncWriter(), it is the
+     * same as writeQueueToFiles(). Do not call this with the queue mutex locked.
+     */
+    bool flush(system_tick_t timeoutMs = CONCURRENT_WAIT_FOREVER);
+
+    /**
+     * @brief Wait until events already handed to the async writer have been written
+     * 
+     * @param timeoutMs Maximum time to wait in milliseconds (default: wait forever)
+     * 
+     * @return true if the events have been written, false if the timeout expired first
+     * 
+     * Unlike flush(), events that are still in the RAM queue are left there. The writer thread
+     * is asked to write without waiting for its maxDelayMs. Returns true immediately if not
+     * using withAsyncWriter(). Do not call this with the queue mutex locked.
+     */
+    bool waitForPersisted(system_tick_t timeoutMs = CONCURRENT_WAIT_FOREVER);
+
+    /**
+     * @brief Send several queued events in one cloud event
+     * 
+     * @param eventName The event name to use for batches (default: "pqBatch"). Pass NULL or
+     * an empty string to send one event at a time, which is the default if you do not call this.
+     * 
+     * @param maxEvents Maximum number of events in a batch (default: 10)
+     * 
+     * @param maxDataSize Maximum size of the batch event data in bytes (default: 1024). Set this
+     * to 622 if you are using Device OS older than 3.0.
+     * 
+     * When more than one event is queued, consecutive events with the same flags are packed
+     * into the data of a single event, in the format described in PublishQueueBatch. If the
+     * publish succeeds, all of the events in the batch are removed from the queue; if it fails,
+     * they are all retried. When only one event can be sent, it's sent unchanged, with its
+     * own name.
+     * 
+     * This greatly reduces the time it takes to send a large number of queued events after being
+     * offline, as well as the data used, but the receiving server must unpack the batches. There is
+     * a decoder for node.js in tools/batch-decoder, and PublishQueueBatch::decode() in C++.
+     */
+    PublishQueuePosix &withBatchPublish(const char *eventName = "pqBatch", size_t maxEvents = 10, size_t maxDataSize = particle::protocol::MAX_EVENT_DATA_LENGTH);
+
+    /**
+     * @brief Gets the batch event name set using withBatchPublish(), or an empty string if not batching
+     */
+    const char *getBatchEventName() const { return batchEventName.c_str(); };
+
+    /**
+     * @brief Add a queue for higher priority events
+     * 
+     * @param priority 1 to MAX_PRIORITY. Higher numbers are sent first. 0 is the default queue set
+     * up by the other methods.
+     * 
+     * @param ramQueueSize Maximum number of events of this priority kept in RAM (default: 2)
+     * 
+     * @param fileQueueSize Maximum number of events of this priority stored on the flash file system
+     * (default: 20). When exceeded, the oldest event of this priority is discarded.
+     * 
+     * Events published using publishWithPriority() are kept in their own RAM and file queues, with
+     * their own limits, so they're never discarded to make room for lower priority events. Whenever
+     * an event is about to be sent, the highest priority queue with an event is used, so after
+     * reconnecting, priority events are sent before the events that were queued in the default
+     * queue while offline.
+     * 
+     * Priority events are stored one per file in the "p1" to "p3" subdirectories of the queue
+     * directory, and are always sent individually, not in batches. Call this before setup().
+     */
+    PublishQueuePosix &withPriorityLane(uint8_t priority, size_t ramQueueSize = 2, size_t fileQueueSize = 20);
+
+    /**
+     * @brief Gets the number of events queued with a priority from withPriorityLane()
+     * 
+     * @param priority 1 to MAX_PRIORITY
+     */
+    size_t getNumPriorityEvents(uint8_t priority);
+
+    /**
+     * @brief Highest priority that can be used with withPriorityLane()
+     */
+    static const uint8_t MAX_PRIORITY = 3;
+
+    /**
+     * @brief Time-to-live in seconds used by the publish overloads that don't take one, the same as Particle.publish()
+     *
+     * It's only enforced if withEventExpiry() is used.
+     */
+    static const int DEFAULT_TTL = 60;
+
+    /**
+     * @brief Publish several events at the same time instead of waiting for each one to complete
+     *
+     * @param maxInFlight Maximum number of publishes in progress at the same time (default: 4).
+     * 0 or 1 sends one event at a time, which is the default if you do not call this.
+     *
+     * Normally the next event is not sent until the cloud has acknowledged the previous one, so
+     * the queue is sent at no more than one event per round trip. On a high-latency connection
+     * that's slower than the publish rate limit allows. With pipelining, events are sent as soon
+     * as withPublishRate() allows, up to maxInFlight at a time, using Particle.publish() instead
+     * of BackgroundPublishRK. Each is given a sequence id so the correct file or RAM event is
+     * removed when its publish completes, even if they complete out of order.
+     *
+     * If a publish fails, no new events are sent until it has been sent successfully, but events
+     * sent after it and before the failure was known may already have been delivered, so events
+     * can arrive out of order. As with one publish at a time, an event that was delivered can be
+     * sent again after a reset, before it was removed from the queue.
+     *
+     * Unlike BackgroundPublishRK, which publishes from its own worker thread, Particle.publish() is
+     * called from loop(). It returns without waiting for the acknowledgement, but it can still
+     * block loop() briefly while the cloud connection is busy. The withPublishCompleteUserCallback()
+     * callback is also called from loop(), instead of from the worker thread.
+     *
+     * Call this before setup(). Pipelining is not used with withBatchPublish().
+     */
+    PublishQueuePosix &withPipelining(size_t maxInFlight = 4);
+
+    /**
+     * @brief Gets the maximum number of publishes in progress set using withPipelining(), 0 if not used
+     */
+    size_t getPipelineSize() const { return pipeline.getCapacity(); };
+
+    /**
+     * @brief Gets the number of events sent using pipelining that have not been removed from the queue yet
+     */
+    size_t getNumInFlight() const { return pipeline.size(); };
+
+    /**
+     * @brief Compress events stored on the flash file system, and optionally the data sent to the cloud
+     *
+     * @param dictionary Optional preset dictionary (default: NULL), up to
+     * PublishQueueCompress::MAX_DICTIONARY_SIZE characters. Text that's common in your events,
+     * such as JSON keys, lets even short events compress. Events written with a dictionary can
+     * only be read with the same one, so don't change it while there are events in the queue.
+     *
+     * @param cloud Also compress the event data sent to the cloud (default: false). Data that
+     * would be shorter is sent as "~Z" followed by the compressed data encoded using Z85, which
+     * the server needs to decode. See tools/compression-decoder.
+     *
+     * Events are compressed when they are written to files or the segment log, using a small
+     * LZSS codec. The file header and segment records record the encoding, and events are only
+     * stored compressed if that makes them smaller. Files and segments
+     * written with or without compression can always be read, so it can be enabled with events
+     * already in the queue.
+     *
+     * Call this before setup().
+     */
+    PublishQueuePosix &withCompression(const char *dictionary = NULL, bool cloud = false);
+
+    /**
+     * @brief Returns true if withCompression() is used
+     */
+    bool getCompression() const { return compressor.isEnabled(); };
+
+    /**
+     * @brief Returns true if withCompression() is used with cloud set
+     */
+    bool getCompressCloud() const { return compressCloud; };
+
+    /**
+     * @brief Store events on the flash file system using a compact binary encoding
+     *
+     * @param enable true to enable (default), false to disable
+     *
+     * Instead of the fixed size PublishQueueEvent, which always has 65 bytes for the event name,
+     * events written to files or the segment log are stored as a flags byte, the timestamp and
+     * expiry when set, the event name, and the event data without a null terminator. Event names
+     * are kept in a name table in the queue directory, so an event name that has been used before
+     * takes 1 or 2 bytes. An event with a 20 byte name and 30 bytes of data takes 36 bytes instead
+     * of 105. See PublishQueueCompact for the format.
+     *
+     * The name table has room for PublishQueueCompact::MAX_NAMES names and starts over when the
+     * queue is empty at startup. Once it's full, new names are stored in each event, so events
+     * with many different names still work but take more space.
+     *
+     * If withCompression() is also used, each event is stored using whichever is smaller. Events
+     * stored with and without the compact encoding can always be read, so it can be enabled with
+     * events already in the queue, but earlier versions of this library can't read them.
+     *
+     * Call this before setup().
+     */
+    PublishQueuePosix &withCompactEncoding(bool enable = true);
+
+    /**
+     * @brief Returns true if withCompactEncoding() is used
+     */
+    bool getCompactEncoding() const { return compact.isEnabled(); };
+
+    /**
+     * @brief Set the function that formats the event data of events published using publishDeferred()
+     *
+     * @param formatId The format, 1 to 255, passed to publishDeferred()
+     *
+     * @param formatter Function called with the record passed to publishDeferred() that writes the
+     * event data to buf, which is bufSize bytes, and returns its length. If the length is bufSize or
+     * more, the data is truncated. It does not need to null terminate the data.
+     *
+     * The formatter is called from loop() just before the event is sent, not when it's published,
+     * and may be called again if the publish is retried. It must only use the record, as the event
+     * may have been stored on the flash file system for a long time, including across a reset.
+     * An event whose format has no formatter is sent with empty data.
+     *
+     * Call this before setup().
+     */
+    PublishQueuePosix &withFormatter(uint8_t formatId, std::function<size_t(const void *record, size_t recordLen, char *buf, size_t bufSize)> formatter);
+
+    /**
+     * @brief Discard events whose time-to-live has passed instead of sending them
+     *
+     * @param sweepIntervalMs How often loop() checks the queues for expired events in milliseconds
+     * (default: 60000), or 0 to only check each event when it's about to be sent
+     *
+     * When used, the ttl passed to publish() is the number of seconds after publishing that the
+     * event expires, DEFAULT_TTL (60) for the overloads without a ttl. The expiry time is stored with the event, in RAM and on the flash file system,
+     * so it still applies after a reset. Events published using publishWithDeadline() expire even
+     * if this is not used, but are only checked when they are about to be sent.
+     *
+     * Expiry uses Time.now(), so events published when the time is not valid, such as before
+     * the first cloud connection after a cold boot, do not expire.
+     */
+    PublishQueuePosix &withEventExpiry(unsigned long sweepIntervalMs = 60000) { enforceTtl = true; expirySweepInterval = sweepIntervalMs; return *this; };
+
+    /**
+     * @brief Returns true if withEventExpiry() is used
+     */
+    bool getEventExpiry() const { return enforceTtl; };
+
+    /**
+     * @brief Gets the sweep interval set using withEventExpiry() in milliseconds
+     */
+    unsigned long getExpirySweepInterval() const { return expirySweepInterval; };
+
+    /**
+     * @brief Sets how long to wait after connecting to the cloud before publishing
+     *
+     * @param ms Time in milliseconds (default: 2000)
+     */
+    PublishQueuePosix &withWaitAfterConnect(unsigned long ms) { waitAfterConnect = ms; return *this; };
+
+    /**
+     * @brief Gets the time set using withWaitAfterConnect() in milliseconds
+     */
+    unsigned long getWaitAfterConnect() const { return waitAfterConnect; };
+
+    /**
+     * @brief Sets the publish rate limit
+     *
+     * @param msPerEvent Average time between publishes in milliseconds (default: 1000)
+     *
+     * @param burst Number of events that can be published back-to-back after not publishing for
+     * a while (default: 1)
+     *
+     * This is a token bucket: it holds up to burst tokens, one is added every msPerEvent
+     * milliseconds, and each publish uses one. An event is published as soon as the previous one
+     * completes if there is a token. The default of one token is the same as waiting msPerEvent
+     * between publishes. The Particle cloud allows an average of one event per second with a
+     * burst of up to 4, so withPublishRate(1000, 4) sends the queue faster without going over.
+     *
+     * The bucket is filled when the cloud connects.
+     */
+    PublishQueuePosix &withPublishRate(unsigned long msPerEvent = 1000, size_t burst = 1);
+
+    /**
+     * @brief Gets the average time between publishes set using withPublishRate() in milliseconds
+     */
+    unsigned long getWaitBetweenPublish() const { return publishRate.getMsPerToken(); };
+
+    /**
+     * @brief Gets the burst size set using withPublishRate()
+     */
+    size_t getPublishBurst() const { return publishRate.getBurst(); };
+
+    /**
+     * @brief Share the publish rate with other instances using PublishQueueScheduler
+     * 
+     * @param weight Share of the publish rate relative to the other instances using the scheduler
+     * (default: 1), or 0 to stop using it
+     * 
+     * While more than one instance has events to send, each gets publishes in proportion to its
+     * weight, so a busy queue can't keep the others from sending. The rate set using
+     * PublishQueueScheduler::instance().withPublishRate() is used instead of withPublishRate().
+     * Instances not using withPipelining() also take turns sending, as only one publish using
+     * BackgroundPublishRK can be in progress at a time, so all instances that do not use
+     * withPipelining() should use the scheduler. Without it, an instance that finds
+     * BackgroundPublishRK busy tries again PUBLISH_BUSY_RETRY_MS later.
+     */
+    PublishQueuePosix &withScheduler(unsigned weight = 1);
+
+    /**
+     * @brief Gets the weight set using withScheduler(), 0 if not using the scheduler
+     */
+    unsigned getSchedulerWeight() const { return schedulerWeight; };
+
+    /**
+     * @brief Sets how long to wait before trying again after a publish fails
+     *
+     * @param minMs Time to wait after the first failure in milliseconds (default: 30000)
+     *
+     * @param maxMs Maximum time to wait in milliseconds (default: 30000). The wait doubles after
+     * each consecutive failure, up to maxMs.
+     *
+     * @param jitterPercent Randomly make each wait up to this percentage longer or shorter
+     * (default: 0), so many devices that failed at the same time do not all retry together.
+     *
+     * The default is to always wait 30 seconds. After a successful publish or reconnecting to
+     * the cloud, the next failure waits minMs again. For example, withFailureBackoff(2000, 60000, 25)
+     * retries quickly after a transient failure but backs off when the cloud is unreachable.
+     */
+    PublishQueuePosix &withFailureBackoff(unsigned long minMs = 30000, unsigned long maxMs = 30000, unsigned jitterPercent = 0);
+
+    /**
+     * @brief Gets the minimum wait after a failure set using withFailureBackoff() in milliseconds
+     */
+    unsigned long getWaitAfterFailure() const { return waitAfterFailure; };
+
+    /**
+     * @brief Gets the maximum wait after a failure set using withFailureBackoff() in milliseconds
+     */
+    unsigned long getMaxWaitAfterFailure() const { return maxWaitAfterFailure; };
+
+    /**
+     * @brief Gets the number of publishes that have failed since the last success
+     */
+    unsigned getConsecutiveFailures() const { return consecutiveFailures; };
+
     /**
      * @brief Adds a callback function to call with publish is complete
      * 
@@ -127,6 +770,8 @@ public:
      * - eventName: The original event name that was published (a copy of it, not the original pointer)
      * - eventData: The original event data
      * 
+     * When using withBatchPublish(), the callback is called once for each event in the batch.
+     * 
      * Note that this callback will be called from the background thread used for publishing. You should not
      * perform any lengthy operations and you should avoid using large amounts of stack space during this
      * callback. 
@@ -159,7 +804,7 @@ public:
 	 * oldest (sometimes second oldest) is discarded.
 	 */
 	inline bool publish(const char *eventName, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
-		return publishCommon(eventName, "", 60, flags1, flags2);
+		return publishCommon(eventName, "", DEFAULT_TTL, flags1, flags2);
 	}
 
 	/**
@@ -179,7 +824,7 @@ public:
 	 * oldest (sometimes second oldest) is discarded.
 	 */
 	inline bool publish(const char *eventName, const char *data, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
-		return publishCommon(eventName, data, 60, flags1, flags2);
+		return publishCommon(eventName, data, DEFAULT_TTL, flags1, flags2);
 	}
 
 	/**
@@ -189,9 +834,10 @@ public:
 	 *
 	 * @param data The event data (255 bytes maximum, 622 bytes in system firmware 0.8.0-rc.4 and later).
 	 *
-	 * @param ttl The time-to-live value. If not specified in one of the other overloads, the value 60 is
-	 * used. However, the ttl is ignored by the cloud, so it doesn't matter what you set it to. Essentially
-	 * all events are discarded immediately if not subscribed to so they essentially have a ttl of 0.
+	 * @param ttl The time-to-live in seconds. It's ignored by the cloud, which discards events
+	 * immediately if not subscribed to. If withEventExpiry() is used, an event that has not been sent
+	 * within ttl seconds of publishing is discarded. The other overloads use DEFAULT_TTL (60).
+	 * 0 does not expire.
 	 *
 	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
 	 *
@@ -213,9 +859,10 @@ public:
 	 *
 	 * @param data The event data (255 bytes maximum, 622 bytes in system firmware 0.8.0-rc.4 and later).
 	 *
-	 * @param ttl The time-to-live value. If not specified in one of the other overloads, the value 60 is
-	 * used. However, the ttl is ignored by the cloud, so it doesn't matter what you set it to. Essentially
-	 * all events are discarded immediately if not subscribed to so they essentially have a ttl of 0.
+	 * @param ttl The time-to-live in seconds. It's ignored by the cloud, which discards events
+	 * immediately if not subscribed to. If withEventExpiry() is used, an event that has not been sent
+	 * within ttl seconds of publishing is discarded. The other overloads use DEFAULT_TTL (60).
+	 * 0 does not expire.
 	 *
 	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
 	 *
@@ -228,14 +875,242 @@ public:
 	 */
 	virtual bool publishCommon(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2 = PublishFlags());
 
-    /**
-     * @brief If there are events in the RAM queue, write them to files in the flash file system
-     */
-    void writeQueueToFiles();
+	/**
+	 * @brief Publish an event using a queue set up using withPriorityLane()
+	 *
+	 * @param priority 1 to MAX_PRIORITY, higher numbers are sent first. 0, or a priority with no
+	 * lane, uses the default queue, the same as publish().
+	 *
+	 * @param eventName The name of the event (63 character maximum).
+	 *
+	 * @param data The event data.
+	 *
+	 * @param ttl The time-to-live in seconds, the same as publish(). 0 does not expire.
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @return true if the event was queued or false if it was not.
+	 *
+	 * The lock-free queue and async writer are not used for priority events.
+	 */
+	bool publishWithPriority(uint8_t priority, const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2 = PublishFlags());
 
-    /**
-     * @brief Empty both the RAM and file based queues. Any queued events are discarded. 
-     */
+	/**
+	 * @brief Overload for publishing an event using a queue set up using withPriorityLane(), with a ttl of DEFAULT_TTL
+	 */
+	inline bool publishWithPriority(uint8_t priority, const char *eventName, const char *data, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
+		return publishWithPriority(priority, eventName, data, DEFAULT_TTL, flags1, flags2);
+	}
+
+	/**
+	 * @brief Publish an event that replaces any queued event with the same key
+	 *
+	 * @param key The coalescing key (31 character maximum). NULL or an empty string is the same as publish().
+	 *
+	 * @param eventName The name of the event (63 character maximum).
+	 *
+	 * @param data The event data.
+	 *
+	 * @param ttl The time-to-live in seconds, the same as publish(). 0 does not expire.
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @return true if the event was queued or replaced a queued event, false if it was not.
+	 *
+	 * Use this for events where only the latest value matters, such as status. If an event with
+	 * the same key is still in the RAM queue or in a file, it's replaced by this event, which takes
+	 * its place in the queue, instead of adding another event. An event that is already being sent
+	 * is not replaced. Events in segment files are not replaced, and events written before a reset
+	 * are not replaced after it. The lock-free queue is not used for these events.
+	 */
+	bool publishCoalesced(const char *key, const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2 = PublishFlags());
+
+	/**
+	 * @brief Overload for publishing an event that replaces any queued event with the same key, with a ttl of DEFAULT_TTL
+	 */
+	inline bool publishCoalesced(const char *key, const char *eventName, const char *data, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
+		return publishCoalesced(key, eventName, data, DEFAULT_TTL, flags1, flags2);
+	}
+
+	/**
+	 * @brief Publish an event that is discarded instead of sent if it's still queued at a deadline
+	 *
+	 * @param deadline The Time.now() value at which the event expires, or 0 to not expire.
+	 *
+	 * @param eventName The name of the event (63 character maximum).
+	 *
+	 * @param data The event data.
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @return true if the event was queued or false if it was not.
+	 *
+	 * The deadline is checked when the event is about to be sent, and by the sweep if
+	 * withEventExpiry() is used. It's not checked when the time is not valid.
+	 */
+	bool publishWithDeadline(time_t deadline, const char *eventName, const char *data, PublishFlags flags1, PublishFlags flags2 = PublishFlags());
+
+	/**
+	 * @brief Publish an event whose data length is already known
+	 *
+	 * @param eventName The name of the event (63 character maximum).
+	 *
+	 * @param data The event data. It does not need to be null terminated, but must not contain a null byte.
+	 *
+	 * @param dataLen The length of data in bytes
+	 *
+	 * @param ttl The time-to-live in seconds, the same as publish(). 0 does not expire.
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @return true if the event was queued or false if it was not.
+	 *
+	 * This is the same as publish(), but the data is not scanned for its length, so it can be used
+	 * with a String (c_str() and length()) or a buffer filled by JSONBufferWriter (buffer() and
+	 * dataSize()) without adding a null terminator.
+	 */
+	bool publishWithLength(const char *eventName, const char *data, size_t dataLen, int ttl, PublishFlags flags1, PublishFlags flags2 = PublishFlags());
+
+	/**
+	 * @brief Allocate an event for the caller to fill in, then publish using publishEvent()
+	 *
+	 * @param eventName The name of the event (63 character maximum).
+	 *
+	 * @param maxDataLen The largest event data that will be written, not including the null terminator.
+	 *
+	 * @return The event, or NULL if maxDataLen is too large or out of memory. Its eventData is an
+	 * empty string, with room for maxDataLen bytes plus a null terminator.
+	 *
+	 * Building the event data directly in the event, such as using
+	 * JSONBufferWriter(event->eventData, maxDataLen), avoids copying it. Make sure eventData is null
+	 * terminated, then pass the event to publishEvent(), or freeEvent() if it won't be published.
+	 * When using withEventPool(), this is one of the preallocated events.
+	 */
+	PublishQueueEvent *allocEvent(const char *eventName, size_t maxDataLen);
+
+	/**
+	 * @brief Publish an event from allocEvent()
+	 *
+	 * @param event The event. The queue takes ownership of it, whether or not it's queued.
+	 *
+	 * @param ttl The time-to-live in seconds, the same as publish(). 0 does not expire.
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @return true if the event was queued or false if it was not (event is NULL).
+	 */
+	bool publishEvent(PublishQueueEvent *event, int ttl, PublishFlags flags1, PublishFlags flags2 = PublishFlags());
+
+	/**
+	 * @brief Free an event from allocEvent() that won't be published. NULL is ignored.
+	 */
+	void freeEvent(PublishQueueEvent *event) { deleteEvent(event); };
+
+	/**
+	 * @brief Publish an event whose data is formatted from a record when it's sent
+	 *
+	 * @param formatId The format set using withFormatter(), 1 to 255
+	 *
+	 * @param eventName The name of the event (63 character maximum).
+	 *
+	 * @param record The values to format, such as a struct. It's copied, so it only needs to be
+	 * valid during this call. It must not contain pointers. Can only be NULL if recordLen is 0.
+	 *
+	 * @param recordLen The size of the record in bytes, up to MAX_RECORD_SIZE
+	 *
+	 * @param ttl The time-to-live in seconds, the same as publish(). 0 does not expire.
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @return true if the event was queued or false if it was not.
+	 *
+	 * The record is stored as is, after a length byte, in place of the event data, which is
+	 * usually much smaller than the formatted data, so it uses less RAM and flash. The format is
+	 * stored in the event's formatId, separately from the data, so the data of other events is
+	 * always sent as is. The formatter is only called if the event is sent, so no time is spent
+	 * formatting events that expire or are discarded because the queue is full.
+	 */
+	bool publishDeferred(uint8_t formatId, const char *eventName, const void *record, size_t recordLen, int ttl, PublishFlags flags1, PublishFlags flags2 = PublishFlags());
+
+	/**
+	 * @brief Overload for publishing an event whose data is formatted when it's sent, with a ttl of DEFAULT_TTL
+	 */
+	inline bool publishDeferred(uint8_t formatId, const char *eventName, const void *record, size_t recordLen, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
+		return publishDeferred(formatId, eventName, record, recordLen, DEFAULT_TTL, flags1, flags2);
+	}
+
+	/**
+	 * @brief Publish several events at once
+	 *
+	 * @param events The events, in the order they are to be sent. The queued member of each is set
+	 * to true if the event was queued, or false if it was not, such as if the name or data is too long.
+	 *
+	 * @param numEvents The number of events
+	 *
+	 * @return The number of events queued
+	 *
+	 * This is the same as calling publish() for each event, but the queue mutex is locked once and
+	 * Particle.connected() and the queue limits are checked once, instead of for each event. If the
+	 * events need to be written to the flash file system, they're written together, so with
+	 * withSegmentSize() they're appended to the segment log with a single commit. The lock-free
+	 * queue is not used for these events.
+	 */
+	size_t publishBulk(PublishQueueBulkEvent *events, size_t numEvents);
+
+    /**
+     * @brief Discard expired events from the queues
+     * 
+     * @return The number of events discarded
+     * 
+     * This is called from loop() every sweep interval set using withEventExpiry(). Events in
+     * the RAM queues are all checked. Files and the segment log can only be removed from the
+     * oldest end, so they are checked from the oldest event until one has not expired; later
+     * expired events are discarded when they are about to be sent. Events waiting for the
+     * writer thread set using withAsyncWriter() are checked once they are written.
+     */
+    size_t discardExpiredEvents();
+
+    /**
+     * @brief Gets the number of expired events discarded since setup
+     */
+    uint32_t getExpiredCount() const { return stats.get(PublishQueueStatsCollector::DISCARDED_EXPIRED); };
+
+    /**
+     * @brief Gets statistics about the events queued and sent
+     * 
+     * The counters and histograms are updated as events pass through the queue, using atomic
+     * increments, so keeping them costs little. flashBytes is also tracked as files are written
+     * and removed. The first call checks the size of each file queued at boot, unless a byte
+     * limit already has, which takes a while when many events are queued. After that, this does
+     * not access the file system.
+     */
+    PublishQueueStats getStats();
+
+    /**
+     * @brief Set the counters and histograms from getStats() to 0
+     */
+    void resetStats() { stats.reset(); };
+
+    /**
+     * @brief If there are events in the RAM queue, write them to files in the flash file system
+     */
+    void writeQueueToFiles();
+
+    /**
+     * @brief Empty both the RAM and file based queues. Any queued events are discarded. 
+     */
     void clearQueues();
 
     /**
@@ -266,6 +1141,63 @@ public:
      */
     bool getCanSleep() const { return canSleep; };
 
+    /**
+     * @brief Send as many events as fit in a time budget, then write the rest to flash so the device can sleep
+     * 
+     * @param budgetMs How long until the device goes to sleep, in milliseconds
+     * 
+     * @return The estimated time to send all queued events in milliseconds, from getEstimatedDrainMs()
+     * 
+     * Until budgetMs has passed, a publish is only started if it's expected to complete in the time
+     * left, using the average publish time from getPublishLatencyMs(). Once no more will fit, or if not
+     * cloud connected, the events still in RAM are written to the flash file system with a single
+     * writeQueueToFiles(), no more publishes are started, and getCanSleep() returns true once the
+     * publishes in progress have completed. Events published after that are also written to flash.
+     * 
+     * After budgetMs, or cancelSleepDrain(), the queue is sent normally again. Call this from loop()
+     * when you decide to sleep, then keep calling loop() until getCanSleep() returns true.
+     * 
+     * With withPipelining(), events that failed to send and are waiting to be sent again stay in RAM
+     * if they were not stored in files.
+     */
+    unsigned long drainForSleep(unsigned long budgetMs);
+
+    /**
+     * @brief Stop a drain started using drainForSleep() before its budget has passed
+     * 
+     * This is not necessary if millis() advances during sleep, as the drain ends when the budget
+     * has passed.
+     */
+    void cancelSleepDrain() { sleepDrainActive = false; };
+
+    /**
+     * @brief Returns true if drainForSleep() has been called and its budget has not passed
+     */
+    bool getSleepDrainActive() const { return sleepDrainActive; };
+
+    /**
+     * @brief Estimate how long it will take to send all queued events, in milliseconds
+     * 
+     * This uses the number of publishes needed, including batching, the average publish time from
+     * getPublishLatencyMs(), the number of publishes that can be in progress at a time with
+     * withPipelining(), the publish rate, and the remaining wait after a failure. It assumes the
+     * cloud is connected and publishes do not fail.
+     */
+    unsigned long getEstimatedDrainMs();
+
+    /**
+     * @brief Gets the average time for a publish to complete, in milliseconds
+     * 
+     * This is a moving average of recent publishes, successful or not. Before the first publish
+     * completes, it's DEFAULT_PUBLISH_LATENCY_MS.
+     */
+    unsigned long getPublishLatencyMs() const { return publishLatencyMs ? publishLatencyMs : DEFAULT_PUBLISH_LATENCY_MS; };
+
+    /**
+     * @brief Publish time used by getPublishLatencyMs() until a publish has completed
+     */
+    static const unsigned long DEFAULT_PUBLISH_LATENCY_MS = 1000;
+
     /**
      * @brief Gets the total number of events queued
      * 
@@ -277,12 +1209,56 @@ public:
      */
     size_t getNumEvents();
 
+    /**
+     * @brief Gets the number of events stored on the flash file system
+     * 
+     * This includes both events stored one per file and events in segment files, including
+     * events in a batch that is being sent.
+     */
+    size_t getFileQueueLen() const { return fileQueue.getQueueLen() + segmentLog.getQueueLen() + batchFileNums.size() + pipeline.getNumFiles(0); };
+
     /**
      * @brief Check the queue limit, discarding events as necessary
      * 
      * When the RAM queue exceeds the limit, all events are moved into files. 
      */
     void checkQueueLimits();
+
+    /**
+     * @brief Returns true if writing extraBytes more would exceed the file queue byte limit or the
+     * minimum free space
+     * 
+     * Must be called with the queue mutex locked.
+     */
+    bool isFlashFull(size_t extraBytes);
+
+    /**
+     * @brief Returns true if the RAM queue exceeds the limit on the number of events or bytes
+     */
+    bool isRamQueueFull() const { return ramQueue.size() > ramQueueSize || (ramQueueMaxBytes != 0 && ramQueue.getBytes() > ramQueueMaxBytes); };
+
+    /**
+     * @brief Gets the size of the files and segments of the default queue and the priority lanes in bytes
+     *
+     * Must be called with the queue mutex locked.
+     */
+    size_t getFlashBytes() const;
+
+    /**
+     * @brief Check the size of each file queued at boot, once, so getQueueBytes() includes them
+     *
+     * Must be called with the queue mutex locked.
+     */
+    void loadFileSizes();
+
+    /**
+     * @brief Discard the oldest event in the default file queue or segment log
+     * 
+     * Must be called with the queue mutex locked.
+     * 
+     * @return true if an event was discarded, false if there are none that can be
+     */
+    bool discardOldestFileEvent();
     
     /**
      * @brief Lock the queue protection mutex
@@ -310,21 +1286,58 @@ public:
     /**
      * @brief Version of the file header for events
      */
-    static const uint8_t FILE_VERSION = 1;
+    static const uint8_t FILE_VERSION = 3;
+
+    /**
+     * @brief Version of the file header whose payload does not have the expires, timestamp and formatId fields
+     */
+    static const uint8_t FILE_VERSION_2 = 2;
+
+    /**
+     * @brief Version of the file header written by earlier versions of the library, without a CRC
+     */
+    static const uint8_t FILE_VERSION_1 = 1;
+
+    /**
+     * @brief Size of the version 1 file header, the fields up to nameLen
+     */
+    static const uint8_t FILE_V1_HEADER_SIZE = 8;
+
+    /**
+     * @brief Time to wait before trying again when BackgroundPublishRK is busy with another queue's publish
+     */
+    static const unsigned long PUBLISH_BUSY_RETRY_MS = 100;
+
+    /**
+     * @brief Stack size of the writer thread used by withAsyncWriter()
+     */
+    static const size_t ASYNC_WRITER_STACK_SIZE = 3072;
+
+    /**
+     * @brief Largest record for publishDeferred() in bytes
+     */
+    static const size_t MAX_RECORD_SIZE = 128;
 
 protected:
     /**
      * @brief Constructor 
      * 
-     * This class is a singleton; you never create one of these directly. Use 
-     * PublishQueuePosix::instance() to get the singleton instance.
+     * You never create one of these directly. Use PublishQueuePosix::instance()
+     * to get the default instance, or instance(name) to get a named instance.
      */
     PublishQueuePosix();
 
+    /**
+     * @brief Constructor for a named instance
+     * 
+     * Use PublishQueuePosix::instance(name) to get a named instance.
+     */
+    PublishQueuePosix(const char *name);
+
     /**
      * @brief Destructor
      * 
-     * This class is never deleted; once the singleton is created it cannot
+     * Instances are never deleted; once an instance is created it cannot
      * be destroyed.
      */
     virtual ~PublishQueuePosix();
@@ -346,9 +1359,205 @@ protected:
      * 
      * May return NULL if eventName or eventData are invalid (too long) or out of memory.
      * 
-     * You must delete the result from this method when you are done using it. 
+     * When using withEventPool(), the event is one of the preallocated events, and NULL is also
+     * returned if they are all in use.
+     * 
+     * You must free the result from this method using deleteEvent() when you are done using it. 
+     * 
+     * dataLen is the number of bytes of eventData to copy. If eventData is NULL, the event data is
+     * an empty string with room for dataLen bytes. expires is the Time.now() value at which the
+     * event expires, or 0 if it does not.
+     */
+    PublishQueueEvent *newRamEvent(const char *eventName, const char *eventData, size_t dataLen, PublishFlags flags, uint32_t expires = 0);
+
+    /**
+     * @brief Same as newRamEvent(), but if all preallocated events are in use, moves the RAM queue to files and tries again
+     */
+    PublishQueueEvent *allocRamEvent(const char *eventName, const char *eventData, size_t dataLen, PublishFlags flags, uint32_t expires = 0);
+
+    /**
+     * @brief Same as allocRamEvent(), for a null terminated eventData, which can be NULL for no data
+     */
+    PublishQueueEvent *allocRamEvent(const char *eventName, const char *eventData, PublishFlags flags, uint32_t expires = 0) {
+        return allocRamEvent(eventName, eventData, eventData ? strlen(eventData) : 0, flags, expires);
+    };
+
+    /**
+     * @brief Gets the expiry time for an event published now with a ttl, 0 if it does not expire
+     *
+     * Only used with withEventExpiry(), and if the time is valid.
+     */
+    uint32_t getTtlExpires(int ttl) const;
+
+    /**
+     * @brief Add an event from allocRamEvent() to the default queue, using the lock-free queue if possible
+     */
+    void queueRamEvent(PublishQueueEvent *event);
+
+    /**
+     * @brief Returns true if the event has an expiry time that has passed
+     * 
+     * Always false if the time is not valid.
+     */
+    bool isExpired(const PublishQueueEvent *event) const;
+
+    /**
+     * @brief Discard the expired events in a RAM queue. Must be called with the mutex locked.
+     * 
+     * @return The number of events discarded
+     */
+    size_t discardExpired(PublishQueueEventRing &queue);
+
+    /**
+     * @brief Discard expired files from the head of a file queue. Must be called with the mutex locked.
+     * 
+     * @param queue The file queue
+     * 
+     * @param priority The priority lane of the queue, 0 for the default queue
+     * 
+     * @return The number of files discarded. Stops at the first file that has not expired, could not
+     * be read, or is being sent.
+     */
+    size_t discardExpiredFiles(PublishQueueFileQueue &queue, uint8_t priority);
+
+    /**
+     * @brief Replace the queued event with a coalescing key. Must be called with the mutex locked.
+     * 
+     * @return true if event replaced a queued event and was freed or is now in ramQueue or writeQueue,
+     * false if there is no queued event with this key
+     */
+    bool replaceCoalesced(const char *key, PublishQueueEvent *event);
+
+    /**
+     * @brief Update the coalescing entry for an event that is leaving the RAM queue
+     * 
+     * @param event The event, which is not freed
+     * 
+     * @param fileNum The file the event was written to, or 0 if it is being sent or was written to the
+     * segment log, which removes the entry
+     */
+    void updateCoalesceEntry(const PublishQueueEvent *event, int fileNum);
+
+    /**
+     * @brief Returns true if a file is still in fileQueue and is not being sent
+     */
+    bool isFileQueued(int fileNum);
+
+    /**
+     * @brief Decide whether the RAM queue can stay in RAM or must be written to files
+     * 
+     * @param connected The result of Particle.connected(), checked before locking the mutex 
+     * 
+     * Called after adding events to the RAM queue. Locks the queue mutex.
+     */
+    void checkRamQueue(bool connected);
+
+    /**
+     * @brief Move any events in the lock-free queue to the end of the RAM queue
+     * 
+     * Locks the queue mutex, which also makes sure only one thread removes events from the
+     * lock-free queue at a time.
+     */
+    void drainLockFreeQueue();
+
+    /**
+     * @brief Save the queue index file if enabled and the file queue has changed
+     * 
+     * Must be called with the queue mutex locked.
+     */
+    void saveQueueIndex();
+
+    /**
+     * @brief Move the RAM queue to the flash file system
+     * 
+     * With withAsyncWriter(), the events are moved to writeQueue for the writer thread. Otherwise
+     * this is the same as writeQueueToFiles(). Locks the queue mutex.
+     */
+    void spillRamQueue();
+
+    /**
+     * @brief Put an event from the RAM queue that failed to send back at the beginning of the queue
+     * 
+     * If events have been moved to writeQueue since, it goes at the beginning of writeQueue, as it
+     * is older than them. Must be called with the queue mutex locked.
+     */
+    void requeueRamEvent(PublishQueueEvent *event, uint8_t priority = 0);
+
+    /**
+     * @brief Write one event to a file, or append it to the segment log
+     * 
+     * Does not free the event. When appending to the segment log, call segmentLog.flush() after
+     * the last event. Must be called with the queue mutex locked.
+     */
+    void writeEvent(const PublishQueueEvent *event);
+
+    /**
+     * @brief Write an event to a file in a file queue
+     * 
+     * @param queue The file queue
+     * 
+     * @param event The event to write
+     * 
+     * @param fileNum 0 to write to a new file at the end of the queue, or a file already in the queue to replace
+     * 
+     * The event is written to a temporary file that's renamed to the file number once it has been
+     * written completely, so the queue never contains a partial file.
+     * 
+     * @return The file number written, or 0 if the write failed. A new file is only added to the
+     * queue if it was written, and a file that could not be replaced still has the old event.
+     */
+    int writeEventToFile(PublishQueueFileQueue &queue, const PublishQueueEvent *event, int fileNum = 0);
+
+    /**
+     * @brief Move the RAM queue of a priority lane to files. Must be called with the mutex locked.
+     */
+    void writeLaneToFiles(uint8_t priority);
+
+    /**
+     * @brief Gets the lane for a priority, or NULL if withPriorityLane() was not called for it
+     */
+    PublishQueueLane *getLane(uint8_t priority) const { return (priority >= 1 && priority <= MAX_PRIORITY) ? lanes[priority - 1] : NULL; };
+
+    /**
+     * @brief Gets the file queue for a priority, fileQueue for 0
+     */
+    PublishQueueFileQueue &getFileQueue(uint8_t priority);
+
+    /**
+     * @brief Gets the highest priority that has events queued in a priority lane, or 0 if none
+     */
+    uint8_t getHighestQueuedPriority();
+
+    /**
+     * @brief Read the oldest event from the highest priority lane that has events
+     * 
+     * @param priority Filled in with the priority, or 0 if there are no events in priority lanes
+     * 
+     * @param fileNum Filled in with the file the event was read from, or 0 if from RAM
+     * 
+     * @param removeFile Remove the file from the lane's file queue, without deleting it
+     * 
+     * @return The event, or NULL if none
      */
-    PublishQueueEvent *newRamEvent(const char *eventName, const char *eventData, PublishFlags flags);
+    PublishQueueEvent *readPriorityEvent(uint8_t &priority, int &fileNum, bool removeFile);
+
+    /**
+     * @brief Write the events in writeQueue, used by the writer thread
+     * 
+     * With the segment log, up to maxGroupSize events are appended at a time with the mutex locked
+     * and committed with one close. With one file per event, the mutex is released after each file.
+     */
+    void writePendingEvents();
+
+    /**
+     * @brief Thread function for withAsyncWriter()
+     */
+    void asyncWriterThreadFunction();
+
+    /**
+     * @brief Static thread function for withAsyncWriter(), param is the PublishQueuePosix object
+     */
+    static void asyncWriterThreadFunctionStatic(void *param);
 
     /**
      * @brief Read an event from a sequentially numbered file 
@@ -357,15 +1566,96 @@ protected:
      * 
      * May return NULL if file does not exist, or out of memory.
      * 
-     * You must delete the result from this method when you are done using it. 
+     * You must free the result from this method using deleteEvent() when you are done using it. 
+     */
+    PublishQueueEvent *readQueueFile(int fileNum) { return readQueueFile(fileQueue, fileNum); };
+
+    /**
+     * @brief Reads an event from a file in a file queue, such as a priority lane
+     */
+    PublishQueueEvent *readQueueFile(PublishQueueFileQueue &queue, int fileNum);
+
+    /**
+     * @brief Count a file that readQueueFile() could not read as corrupted, unless it no longer exists
+     *
+     * @param queue The file queue the file is in
+     * @param fileNum The file number
+     * @param priority The priority lane, or 0 for the default file queue
+     *
+     * A file that is missing was already sent, and is skipped without logging or counting it.
+     * The caller removes the file from the queue either way.
+     */
+    void countCorruptFile(PublishQueueFileQueue &queue, int fileNum, uint8_t priority = 0);
+
+    /**
+     * @brief Read and check the header of an event file
+     *
+     * @param fd The file, positioned at the beginning
+     *
+     * @param fileSize Size of the file in bytes
+     *
+     * @param hdr Filled in with the header. For version 1 files, encoding is ENCODING_NONE and
+     * payloadLen is set from the file size.
+     *
+     * @return true if the header is valid and, for version 2 and later, the file size matches payloadLen
+     */
+    bool readFileHeader(int fd, off_t fileSize, PublishQueueFileHeader &hdr);
+
+    /**
+     * @brief Gets the CRC of a version 2 or later file header and its payload of hdr.payloadLen bytes
+     */
+    static uint32_t getFileCrc(const PublishQueueFileHeader &hdr, const void *payload);
+
+    /**
+     * @brief Continue the sequence numbers after the newest file in a queue, so they keep increasing after a reset
+     */
+    void loadSequence(PublishQueueFileQueue &queue);
+
+    /**
+     * @brief Free an event from newRamEvent(), readQueueFile(), or the segment log
+     */
+    void deleteEvent(PublishQueueEvent *event);
+
+    /**
+     * @brief Read the next events to send as a batch, used from stateWait when batching is enabled
+     * 
+     * Events are taken from the file queue, the segment log, or the RAM queue, in that order
+     * of preference, but a batch only contains events from one of them.
+     * 
+     * @return The event to publish, or NULL if there are no events. If only one event is available
+     * it's returned as-is, otherwise the result is a new event containing the batch.
      */
-    PublishQueueEvent *readQueueFile(int fileNum);
+    PublishQueueEvent *readBatch();
 
     /**
      * @brief Callback for BackgroundPublishRK library
      */
     void publishCompleteCallback(bool succeeded, const char *eventName, const char *eventData);
 
+    /**
+     * @brief Add the tokens earned since they were last added to the publish rate token bucket
+     *
+     * @return true if there is a token, so an event can be published now
+     */
+    bool refillPublishTokens();
+
+    /**
+     * @brief Use a token from the bucket, or from the scheduler if using withScheduler(), to start a publish
+     */
+    void usePublishToken();
+
+    /**
+     * @brief Returns true if there's an event that can be sent now, used with withScheduler()
+     * 
+     * Events waiting for the writer thread are not counted, as they're sent once written.
+     */
+    bool hasEventsToSend();
+
+    /**
+     * @brief Gets the time to wait after a failure, based on consecutiveFailures and withFailureBackoff()
+     */
+    unsigned long getFailureWait() const;
+
     /**
      * @brief State handler for waiting to connect to the Particle cloud
      * 
@@ -390,30 +1680,179 @@ protected:
      */
     void statePublishWait();
 
+    /**
+     * @brief Remove curEvent from its queue and free it, after it has been sent or has expired
+     */
+    void removeCurEvent();
+
+    /**
+     * @brief State handler when using withPipelining(), instead of stateWait and statePublishWait
+     * 
+     * Handles completed publishes, removes them from the queue, and sends more events.
+     * 
+     * Next state: stateConnectWait
+     */
+    void statePipeline();
+
+    /**
+     * @brief Read the next event to send using pipelining, from the oldest queue that has one
+     * 
+     * @param source Filled in with PublishQueuePipeline::SOURCE_RAM, etc.
+     * 
+     * @param priority Filled in with the priority lane the event was read from, or 0
+     * 
+     * @param fileNum Filled in with the file the event was read from, which is removed from its file queue, or 0
+     * 
+     * @param segmentSeq Filled in with the sequence number in the segment log, or 0
+     * 
+     * @return The event, or NULL if there are no more events that can be sent now
+     */
+    PublishQueueEvent *readPipelineEvent(uint8_t &source, uint8_t &priority, int &fileNum, uint32_t &segmentSeq);
+
+    /**
+     * @brief Gets the event data of an event, formatted if it was published using publishDeferred()
+     *
+     * @return The event data, or the formatted data in a buffer that's valid until the next call.
+     * Only call this from loop(), as it calls the formatter.
+     */
+    const char *getEventData(const PublishQueueEvent *event);
+
+    /**
+     * @brief Gets the data to publish, compressed if withCompression() is used with cloud set
+     *
+     * @param eventData The event data from getEventData()
+     *
+     * @return eventData, or the compressed data in a buffer that's valid until the next call
+     */
+    const char *getCloudData(const char *eventData);
+
+    /**
+     * @brief Start publishing an entry in the pipeline
+     */
+    void sendPipelineEvent(PublishQueueInFlight *entry);
+
+    /**
+     * @brief Discard an expired entry in the pipeline instead of sending it
+     */
+    void discardPipelineEvent(PublishQueueInFlight *entry);
+
+    /**
+     * @brief Update the statistics when a publish completes
+     * 
+     * @param succeeded true if the publish succeeded
+     * 
+     * @param event The event that was sent, used for the queue latency
+     * 
+     * @param numEvents Number of events sent, more than 1 for a batch
+     * 
+     * @param sendTime millis() value when the publish was started
+     */
+    void recordPublishComplete(bool succeeded, const PublishQueueEvent *event, size_t numEvents, unsigned long sendTime);
+
+    /**
+     * @brief Check the drain set up using drainForSleep(), called from the state handlers
+     * 
+     * @param connected true if the state handler can publish
+     * 
+     * When another publish will not fit in the budget, writes the events in RAM to the flash file
+     * system.
+     * 
+     * @return true if no more publishes should be started
+     */
+    bool checkSleepDrain(bool connected);
+
+    /**
+     * @brief Gets the oldest file that has been removed from fileQueue to send but not deleted, or 0
+     */
+    int getOldestSendingFileNum() const;
+
+    /**
+     * @brief Rebuild a file queue from its index, or by scanning its directory, at setup()
+     */
+    void loadFileQueue(PublishQueueFileQueue &queue);
+
     /**
      * @brief SequentialFileRK library object for maintaining the queue of files on the POSIX file system
      */
-    SequentialFile fileQueue;
+    PublishQueueFileQueue fileQueue;
 
+    /**
+     * @brief Append-only segment log used instead of one file per event when withSegmentSize() is set
+     */
+    PublishQueueSegmentLog segmentLog;
 
     size_t ramQueueSize = 2; //!< size of the queue in RAM
     size_t fileQueueSize = 100; //!< size of the queue on the flash file system
+    size_t ramQueueMaxBytes = 0; //!< maximum bytes in the RAM queue, 0 = no limit
+    size_t fileQueueMaxBytes = 0; //!< maximum bytes in the file queue, 0 = no limit
+    size_t minFreeSpace = 0; //!< minimum free space on the flash file system, 0 = not checked
+    std::function<size_t()> freeSpaceFunction = 0; //!< returns the free space, set using withMinFreeSpace()
+    bool fileSizesLoaded = false; //!< the size of each file queued at boot has been checked
+    bool useQueueIndex = true; //!< Use the queue index file instead of scanning the directory at boot
+
+    String batchEventName; //!< Event name for batches, empty if not batching
+    size_t batchMaxEvents = 10; //!< Maximum number of events in a batch
+    size_t batchMaxDataSize = particle::protocol::MAX_EVENT_DATA_LENGTH; //!< Maximum size of the batch event data
 
     os_mutex_recursive_t mutex; //!< mutex for protecting the queue
-    std::deque<PublishQueueEvent*> ramQueue; //!< Queue in RAM
+    PublishQueueEventPool eventPool; //!< Preallocated events, if withEventPool() is used
+    size_t eventPoolMaxDataSize = 0; //!< Data size for withEventPool(), 0 = use the heap
+    PublishQueueEventRing ramQueue; //!< Queue in RAM
+    PublishQueueSpscRing lockFreeQueue; //!< Events published but not yet moved to ramQueue, if withLockFreeQueue() is used
+    size_t lockFreeQueueSize = 0; //!< Size for withLockFreeQueue(), 0 = not used
+
+    bool asyncWriter = false; //!< withAsyncWriter() was called
+    unsigned long asyncWriterMaxDelay = 100; //!< Maximum time events wait in writeQueue in milliseconds
+    size_t asyncWriterMaxGroupSize = 16; //!< Number of events in writeQueue to write without waiting
+    PublishQueueEventRing writeQueue; //!< Events moved out of ramQueue, waiting for the writer thread. Older than ramQueue.
+    os_thread_t writerThread = 0; //!< Writer thread, if withAsyncWriter() is used
+    os_semaphore_t writerSemaphore = 0; //!< Given to wake the writer thread
+    os_semaphore_t persistedSemaphore = 0; //!< Given by the writer thread after writing events
+    uint32_t spilledCount = 0; //!< Number of events added to writeQueue
+    uint32_t persistedCount = 0; //!< Number of events removed from writeQueue and written (or cleared)
+    std::atomic<bool> writerFlush; //!< Write without waiting for asyncWriterMaxDelay
+    std::atomic<bool> writerStop; //!< Set to make the writer thread exit
 
     PublishQueueEvent *curEvent = 0; //!< Current event being published
+    const char *curEventData = 0; //!< Data of curEvent from getEventData() when it was sent, for publishCompleteCallback() with compressCloud
     int curFileNum = 0; //!< Current file number being published (0 if from RAM queue)
+    uint8_t curPriority = 0; //!< Priority lane of the current event (0 if from the default queue)
+    uint32_t curSegmentSeq = 0; //!< Sequence number of the current event in the segment log (0 if not from the segment log)
+    size_t curBatchCount = 0; //!< Number of events in the batch being published (0 if not a batch)
+    std::vector<int> batchFileNums; //!< Files in the batch being published, already removed from fileQueue
+    PublishQueuePipeline pipeline; //!< Events being published, if withPipelining() is used
+    size_t pipelineSize = 0; //!< Size for withPipelining(), 0 = not used
+    PublishQueueLane *lanes[MAX_PRIORITY] = {}; //!< Priority lanes from withPriorityLane(), indexed by priority - 1
+    std::vector<PublishQueueCoalesceEntry> coalesceEntries; //!< Keys of events queued using publishCoalesced()
+    PublishQueueCompress compressor; //!< Compresses events, if withCompression() is used
+    PublishQueueCompact compact; //!< Compact encoding of stored events, if withCompactEncoding() is used
+    uint32_t nextSequence = 1; //!< PublishQueueFileHeader::sequence of the next event written to a file
+    bool compressCloud = false; //!< Compress data sent to the cloud, set using withCompression()
+    std::vector<std::pair<uint8_t, std::function<size_t(const void *record, size_t recordLen, char *buf, size_t bufSize)>>> formatters; //!< Formatters set using withFormatter(), by format
+    char *formatBuf = 0; //!< Data formatted by getEventData(), allocated when first used
+    bool enforceTtl = false; //!< Events expire using the publish() ttl, set using withEventExpiry()
+    unsigned long expirySweepInterval = 0; //!< How often loop() calls discardExpiredEvents(), 0 = never
+    unsigned long lastExpirySweep = 0; //!< millis() value when discardExpiredEvents() was last called from loop()
+    PublishQueueStatsCollector stats; //!< Counters and histograms for getStats()
+    PublishQueueEventRing batchRamEvents; //!< RAM queue events in the batch being published
     unsigned long stateTime = 0; //!< millis() value when entering the state, used for stateWait
     unsigned long durationMs = 0; //!< how long to wait before publishing in milliseconds, used in stateWait
     bool publishComplete = false; //!< true if the publish has completed (successfully or not)
     bool publishSuccess = false; //!< true if the publish succeeded
     bool pausePublishing = false; //!< flag to pause publishing (used from automated test)
     bool canSleep = false; //!< returns true if this is a good time to go to sleep
+    bool sleepDrainActive = false; //!< drainForSleep() was called and sleepDrainEnd has not passed
+    bool sleepDrainFlushed = false; //!< the drain has stopped publishing and written the RAM queue to flash
+    unsigned long sleepDrainStart = 0; //!< millis() value when drainForSleep() was called
+    unsigned long sleepDrainBudget = 0; //!< budgetMs passed to drainForSleep()
+    unsigned long publishLatencyMs = 0; //!< moving average of the publish round trip time, 0 until a publish completes
 
     unsigned long waitAfterConnect = 2000; //!< time to wait after Particle.connected() before publishing
-    unsigned long waitBetweenPublish = 1000; //!< how long to wait in milliseconds between publishes
     unsigned long waitAfterFailure = 30000; //!< how long to wait after failing to publish before trying again
+    unsigned long maxWaitAfterFailure = 30000; //!< maximum wait after consecutive failures
+    unsigned failureJitterPercent = 0; //!< randomly vary the wait after failure by up to this percentage
+    unsigned consecutiveFailures = 0; //!< number of failed publishes since the last success
+    PublishQueueTokenBucket publishRate; //!< publish rate token bucket, set using withPublishRate()
 
     std::function<void(bool succeeded, const char *eventName, const char *eventData)> publishCompleteUserCallback = 0; //!< User callback for publish complete
 
@@ -421,7 +1860,11 @@ protected:
 
     static void systemEventHandler(system_event_t event, int param); //!< system event handler, used to detect reset events
 
-    static PublishQueuePosix *_instance; //!< singleton instance of this class
+    static PublishQueuePosix *_instance; //!< default instance of this class
+    static std::vector<PublishQueuePosix *> _instances; //!< all instances, including _instance and named instances
+
+    String name; //!< name of this instance, empty for _instance
+    unsigned schedulerWeight = 0; //!< weight set using withScheduler(), 0 = not using the scheduler
 };
 
 #endif /* __PUBLISHQUEUEPOSIXRK_H */
@@ -0,0 +1,132 @@
+#include "PublishQueueScheduler.h"
+
+PublishQueueScheduler *PublishQueueScheduler::_instance;
+
+static Logger _log("app.pubq");
+
+PublishQueueScheduler &PublishQueueScheduler::instance() {
+    if (!_instance) {
+        _instance = new PublishQueueScheduler();
+    }
+    return *_instance;
+}
+
+PublishQueueScheduler::PublishQueueScheduler() {
+}
+
+PublishQueueScheduler::~PublishQueueScheduler() {
+}
+
+PublishQueueScheduler &PublishQueueScheduler::withPublishRate(unsigned long msPerEvent, size_t burst) {
+    publishRate.setRate(msPerEvent, burst);
+    return *this;
+}
+
+void PublishQueueScheduler::add(PublishQueuePosix *queue, unsigned weight) {
+    if (weight == 0) {
+        weight = 1;
+    }
+    Member *member = find(queue);
+    if (!member) {
+        Member newMember;
+        newMember.queue = queue;
+        newMember.pass = globalPass;
+        newMember.numPublished = 0;
+        newMember.waitTime = 0;
+        newMember.waiting = false;
+        newMember.exclusive = false;
+        members.push_back(newMember);
+        member = &members.back();
+    }
+    member->stride = STRIDE_BASE / weight;
+    _log.trace("scheduler added queue weight=%u numQueues=%u", weight, (unsigned) members.size());
+}
+
+void PublishQueueScheduler::remove(PublishQueuePosix *queue) {
+    for(auto it = members.begin(); it != members.end(); ++it) {
+        if (it->queue == queue) {
+            members.erase(it);
+            break;
+        }
+    }
+    if (exclusiveOwner == queue) {
+        exclusiveOwner = NULL;
+    }
+}
+
+bool PublishQueueScheduler::canPublish(PublishQueuePosix *queue, bool exclusive) {
+    Member *member = find(queue);
+    if (!member) {
+        return true;
+    }
+
+    unsigned long now = millis();
+    if (!member->waiting || now - member->waitTime > WAITING_TIMEOUT_MS) {
+        // Was not waiting, so it does not get credit for the publishes it did not need
+        if ((int32_t)(member->pass - globalPass) < 0) {
+            member->pass = globalPass;
+        }
+    }
+    member->waiting = true;
+    member->waitTime = now;
+    member->exclusive = exclusive;
+
+    if (!isReady(*member, now) || !publishRate.refill()) {
+        return false;
+    }
+
+    // The ready queue with the lowest pass goes first. Ties go to the caller, as it's ready now.
+    for(const Member &other : members) {
+        if (&other != member && isReady(other, now) && (int32_t)(other.pass - member->pass) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void PublishQueueScheduler::published(PublishQueuePosix *queue, bool exclusive) {
+    Member *member = find(queue);
+    if (!member) {
+        return;
+    }
+    publishRate.use();
+    globalPass = member->pass;
+    member->pass += member->stride;
+    member->numPublished++;
+    member->waiting = false;
+    if (exclusive) {
+        exclusiveOwner = queue;
+    }
+}
+
+void PublishQueueScheduler::publishComplete(PublishQueuePosix *queue) {
+    if (exclusiveOwner == queue) {
+        exclusiveOwner = NULL;
+    }
+}
+
+uint32_t PublishQueueScheduler::getNumPublished(const PublishQueuePosix *queue) const {
+    for(const Member &member : members) {
+        if (member.queue == queue) {
+            return member.numPublished;
+        }
+    }
+    return 0;
+}
+
+PublishQueueScheduler::Member *PublishQueueScheduler::find(const PublishQueuePosix *queue) {
+    for(Member &member : members) {
+        if (member.queue == queue) {
+            return &member;
+        }
+    }
+    return NULL;
+}
+
+bool PublishQueueScheduler::isReady(const Member &member, unsigned long now) const {
+    if (!member.waiting || now - member.waitTime > WAITING_TIMEOUT_MS) {
+        return false;
+    }
+    // A queue waiting for another queue's BackgroundPublishRK publish can't go yet, so it does not hold up the others
+    return !(member.exclusive && exclusiveOwner != NULL);
+}
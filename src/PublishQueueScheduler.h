@@ -0,0 +1,162 @@
+#ifndef __PUBLISHQUEUESCHEDULER_H
+#define __PUBLISHQUEUESCHEDULER_H
+
+// Github: https://github.com/rickkas7/PublishQueuePosixRK
+// License: MIT
+
+#include "Particle.h"
+#include "PublishQueueTokenBucket.h"
+
+#include <vector>
+
+class PublishQueuePosix;
+
+/**
+ * @brief Shares the cloud publish rate between multiple PublishQueuePosix instances
+ *
+ * Each queue added using PublishQueuePosix::withScheduler() gets a share of the publishes in
+ * proportion to its weight while more than one queue has events to send. A queue that has
+ * nothing to send does not use its share, so the others can use all of the rate, and it does not
+ * build up credit while idle, so it can't starve the others when it has events again. This is
+ * stride scheduling: each publish advances the queue's pass by a stride inversely proportional to
+ * its weight, and the waiting queue with the lowest pass goes next.
+ *
+ * Only one publish using BackgroundPublishRK can be in progress at a time, so queues that are
+ * not using withPipelining() also take turns with that.
+ *
+ * This class is a singleton, and is only called from PublishQueuePosix::loop().
+ */
+class PublishQueueScheduler {
+public:
+    /**
+     * @brief Gets the singleton instance of this class
+     */
+    static PublishQueueScheduler &instance();
+
+    /**
+     * @brief Sets the publish rate shared by all of the queues (default is 1 per second)
+     *
+     * @param msPerEvent Milliseconds between publishes on average, 0 for no limit
+     *
+     * @param burst Number of publishes that can be sent without waiting, after not publishing
+     *
+     * This takes the place of PublishQueuePosix::withPublishRate() for the queues using the scheduler.
+     */
+    PublishQueueScheduler &withPublishRate(unsigned long msPerEvent, size_t burst = 1);
+
+    /**
+     * @brief Gets the milliseconds between publishes set using withPublishRate()
+     */
+    unsigned long getWaitBetweenPublish() const { return publishRate.getMsPerToken(); };
+
+    /**
+     * @brief Gets the burst size set using withPublishRate()
+     */
+    size_t getPublishBurst() const { return publishRate.getBurst(); };
+
+    /**
+     * @brief Add a queue, or change its weight
+     *
+     * @param queue The queue
+     *
+     * @param weight Share of the publish rate relative to the other queues, 1 or more
+     */
+    void add(PublishQueuePosix *queue, unsigned weight);
+
+    /**
+     * @brief Remove a queue
+     */
+    void remove(PublishQueuePosix *queue);
+
+    /**
+     * @brief Called when a queue has an event ready to send
+     *
+     * @param queue The queue
+     *
+     * @param exclusive true if the publish uses BackgroundPublishRK, which can only send one at a time
+     *
+     * @return true if the queue can start a publish now. Call published() when it does.
+     */
+    bool canPublish(PublishQueuePosix *queue, bool exclusive);
+
+    /**
+     * @brief Called when a queue starts a publish that canPublish() allowed
+     */
+    void published(PublishQueuePosix *queue, bool exclusive);
+
+    /**
+     * @brief Called when an exclusive publish completes, successfully or not
+     */
+    void publishComplete(PublishQueuePosix *queue);
+
+    /**
+     * @brief Gets the number of publishes a queue has started using the scheduler
+     */
+    uint32_t getNumPublished(const PublishQueuePosix *queue) const;
+
+    /**
+     * @brief Stride for a weight of 1. The stride for weight w is STRIDE_BASE / w.
+     */
+    static const uint32_t STRIDE_BASE = 1UL << 20;
+
+    /**
+     * @brief A queue that has not called canPublish() for this many milliseconds is not waiting
+     */
+    static const unsigned long WAITING_TIMEOUT_MS = 100;
+
+protected:
+    /**
+     * @brief A queue using the scheduler
+     */
+    struct Member {
+        PublishQueuePosix *queue;   //!< The queue
+        uint32_t stride;            //!< Added to pass for each publish, STRIDE_BASE / weight
+        uint32_t pass;              //!< The waiting queue with the lowest pass publishes next
+        uint32_t numPublished;      //!< Publishes started
+        unsigned long waitTime;     //!< millis() value when canPublish() was last called
+        bool waiting;               //!< canPublish() has been called since the last publish
+        bool exclusive;             //!< The event waiting to be sent uses BackgroundPublishRK
+    };
+
+    /**
+     * @brief Constructor
+     *
+     * This class is a singleton; use PublishQueueScheduler::instance().
+     */
+    PublishQueueScheduler();
+
+    /**
+     * @brief Destructor. This class is never deleted.
+     */
+    virtual ~PublishQueueScheduler();
+
+    /**
+     * @brief This class is not copyable
+     */
+    PublishQueueScheduler(const PublishQueueScheduler&) = delete;
+
+    /**
+     * @brief This class is not copyable
+     */
+    PublishQueueScheduler& operator=(const PublishQueueScheduler&) = delete;
+
+    /**
+     * @brief Find the member for a queue, or NULL
+     */
+    Member *find(const PublishQueuePosix *queue);
+
+    /**
+     * @brief Returns true if the member is waiting to publish and could publish if it were its turn
+     */
+    bool isReady(const Member &member, unsigned long now) const;
+
+    std::vector<Member> members; //!< Queues using the scheduler
+    PublishQueuePosix *exclusiveOwner = NULL; //!< Queue with a BackgroundPublishRK publish in progress, or NULL
+    uint32_t globalPass = 0; //!< Pass of the last queue to publish. A queue that starts waiting starts from here.
+
+    PublishQueueTokenBucket publishRate{1}; //!< Publish rate shared by the queues, set using withPublishRate()
+
+    static PublishQueueScheduler *_instance; //!< singleton instance of this class
+};
+
+#endif /* __PUBLISHQUEUESCHEDULER_H */
@@ -0,0 +1,743 @@
+#include "PublishQueueSegmentLog.h"
+#include "PublishQueueCompact.h"
+#include "PublishQueueCompress.h"
+#include "PublishQueuePosixRK.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <vector>
+
+static Logger _log("app.pubq");
+
+static const char * const SEGMENT_PREFIX = "seg";
+static const char * const CURSOR_NAME = "segcursor";
+
+// Largest valid record body: a PublishQueueEvent with maximum size eventData
+static const size_t MAX_RECORD_SIZE = PublishQueueEvent::getSize(particle::protocol::MAX_EVENT_DATA_LENGTH);
+
+static_assert(sizeof(PublishQueueRecordHeader) + MAX_RECORD_SIZE <= PublishQueueSegmentLog::MIN_READ_AHEAD_SIZE, "MIN_READ_AHEAD_SIZE too small");
+
+// CRC-32 (IEEE 802.3, reflected polynomial 0xEDB88320) of each byte value
+static const uint32_t CRC32_TABLE[256] = {
+    0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f, 0xe963a535, 0x9e6495a3,
+    0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988, 0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91,
+    0x1db71064, 0x6ab020f2, 0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+    0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9, 0xfa0f3d63, 0x8d080df5,
+    0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172, 0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b,
+    0x35b5a8fa, 0x42b2986c, 0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+    0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423, 0xcfba9599, 0xb8bda50f,
+    0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924, 0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d,
+    0x76dc4190, 0x01db7106, 0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+    0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d, 0x91646c97, 0xe6635c01,
+    0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e, 0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457,
+    0x65b0d9c6, 0x12b7e950, 0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+    0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7, 0xa4d1c46d, 0xd3d6f4fb,
+    0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0, 0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9,
+    0x5005713c, 0x270241aa, 0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+    0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81, 0xb7bd5c3b, 0xc0ba6cad,
+    0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a, 0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683,
+    0xe3630b12, 0x94643b84, 0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+    0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb, 0x196c3671, 0x6e6b06e7,
+    0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc, 0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5,
+    0xd6d6a3e8, 0xa1d1937e, 0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+    0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55, 0x316e8eef, 0x4669be79,
+    0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236, 0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f,
+    0xc5ba3bbe, 0xb2bd0b28, 0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+    0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f, 0x72076785, 0x05005713,
+    0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38, 0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21,
+    0x86d3d2d4, 0xf1d4e242, 0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+    0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69, 0x616bffd3, 0x166ccf45,
+    0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2, 0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db,
+    0xaed16a4a, 0xd9d65adc, 0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+    0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693, 0x54de5729, 0x23d967bf,
+    0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94, 0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d,
+};
+
+PublishQueueSegmentLog::PublishQueueSegmentLog() {
+}
+
+PublishQueueSegmentLog::~PublishQueueSegmentLog() {
+    flush();
+    delete[] readCache;
+}
+
+PublishQueueSegmentLog &PublishQueueSegmentLog::withSegmentSize(size_t size) {
+    if (size != 0 && size < MIN_SEGMENT_SIZE) {
+        size = MIN_SEGMENT_SIZE;
+    }
+    segmentSize = size;
+    return *this;
+}
+
+PublishQueueSegmentLog &PublishQueueSegmentLog::withReadAheadSize(size_t size) {
+    if (size < MIN_READ_AHEAD_SIZE) {
+        size = MIN_READ_AHEAD_SIZE;
+    }
+    if (size != readAheadSize) {
+        delete[] readCache;
+        readCache = 0;
+        readCacheLen = 0;
+        readAheadSize = size;
+    }
+    return *this;
+}
+
+bool PublishQueueSegmentLog::scan(bool always) {
+    struct stat sb;
+
+    if (!always && segmentSize == 0 && stat(getCursorPath(), &sb) != 0) {
+        // Segment log has never been used in this directory
+        return true;
+    }
+
+    flush();
+    segments.clear();
+    queueLen = 0;
+    fileBytes = 0;
+    headNextOffset = 0;
+    readEndOffsets.clear();
+    unsavedRemoves = 0;
+    invalidateReadCache();
+
+    std::vector<uint32_t> segmentNums;
+
+    DIR *dir = opendir(dirPath);
+    if (!dir) {
+        _log.error("segment log cannot open %s", dirPath.c_str());
+        return false;
+    }
+    size_t prefixLen = strlen(SEGMENT_PREFIX);
+    while(struct dirent *ent = readdir(dir)) {
+        if (strncmp(ent->d_name, SEGMENT_PREFIX, prefixLen) == 0 && strlen(ent->d_name) == prefixLen + 8) {
+            uint32_t segmentNum = strtoul(&ent->d_name[prefixLen], NULL, 10);
+            if (segmentNum) {
+                segmentNums.push_back(segmentNum);
+            }
+        }
+    }
+    closedir(dir);
+
+    std::sort(segmentNums.begin(), segmentNums.end());
+
+    // Read the cursor. If it's missing or invalid, start at the beginning of the first segment.
+    PublishQueueSegmentCursor cursor = {};
+    int fd = open(getCursorPath(), O_RDONLY);
+    if (fd >= 0) {
+        if (read(fd, &cursor, sizeof(cursor)) != sizeof(cursor) ||
+            cursor.magic != CURSOR_MAGIC ||
+            cursor.crc != crc32(&cursor, offsetof(PublishQueueSegmentCursor, crc))) {
+            _log.info("segment log cursor invalid, starting from first segment");
+            cursor.segmentNum = 0;
+        }
+        close(fd);
+    }
+
+    lastSegmentNum = 0;
+    if (cursor.segmentNum > 0) {
+        lastSegmentNum = cursor.segmentNum - 1;
+    }
+    if (!segmentNums.empty() && segmentNums.back() > lastSegmentNum) {
+        lastSegmentNum = segmentNums.back();
+    }
+
+    headOffset = sizeof(PublishQueueSegmentHeader);
+
+    for(uint32_t segmentNum : segmentNums) {
+        uint32_t startOffset = sizeof(PublishQueueSegmentHeader);
+
+        if (segmentNum < cursor.segmentNum) {
+            // Already consumed; the device was reset before the segment could be deleted
+            unlink(getPathForSegment(segmentNum));
+            continue;
+        }
+        if (segmentNum == cursor.segmentNum && segments.empty()) {
+            startOffset = headOffset = cursor.offset;
+        }
+
+        uint32_t endOffset;
+        int numEvents = scanSegment(segmentNum, startOffset, endOffset);
+        if (numEvents < 0) {
+            _log.info("discarding corrupted segment %lu", (unsigned long) segmentNum);
+            unlink(getPathForSegment(segmentNum));
+            continue;
+        }
+        if (numEvents == 0 && segmentNum != segmentNums.back()) {
+            unlink(getPathForSegment(segmentNum));
+            continue;
+        }
+
+        if (segments.empty()) {
+            headOffset = startOffset;
+        }
+        segments.push_back(Segment{segmentNum, (uint32_t)numEvents, endOffset});
+        queueLen += numEvents;
+        fileBytes += endOffset;
+        tailOffset = endOffset;
+    }
+
+    if (!segments.empty()) {
+        // Remove any partially written record at the end of the tail segment so
+        // the next append starts at a record boundary
+        fd = open(getPathForSegment(segments.back().segmentNum), O_RDWR);
+        if (fd >= 0) {
+            if (fstat(fd, &sb) == 0 && sb.st_size > (off_t)tailOffset) {
+                _log.info("truncating segment %lu from %ld to %lu", (unsigned long) segments.back().segmentNum, (long) sb.st_size, (unsigned long) tailOffset);
+                ftruncate(fd, tailOffset);
+            }
+            close(fd);
+        }
+    }
+
+    _log.trace("segment log scan segments=%u events=%u headOffset=%lu tailOffset=%lu", segments.size(), queueLen, (unsigned long) headOffset, (unsigned long) tailOffset);
+
+    return true;
+}
+
+int PublishQueueSegmentLog::scanSegment(uint32_t segmentNum, uint32_t offset, uint32_t &endOffset) {
+    int numEvents = -1;
+
+    endOffset = offset;
+
+    int fd = open(getPathForSegment(segmentNum), O_RDONLY);
+    if (fd >= 0) {
+        struct stat sb;
+        PublishQueueSegmentHeader hdr;
+
+        if (fstat(fd, &sb) == 0 &&
+            read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+            hdr.magic == SEGMENT_MAGIC &&
+            hdr.version == SEGMENT_VERSION &&
+            hdr.headerSize == sizeof(PublishQueueSegmentHeader) &&
+            hdr.nameLen == sizeof(PublishQueueEvent::eventName)) {
+
+            if (offset < sizeof(PublishQueueSegmentHeader)) {
+                offset = sizeof(PublishQueueSegmentHeader);
+            }
+
+            numEvents = 0;
+            while(offset + sizeof(PublishQueueRecordHeader) <= (uint32_t)sb.st_size) {
+                PublishQueueRecordHeader rh;
+
+                lseek(fd, offset, SEEK_SET);
+                if (read(fd, &rh, sizeof(rh)) != sizeof(rh) ||
+                    !isValidRecordSize(rh) ||
+                    offset + sizeof(rh) + rh.size > (uint32_t)sb.st_size) {
+                    break;
+                }
+                offset += sizeof(rh) + rh.size;
+                numEvents++;
+            }
+            endOffset = offset;
+        }
+        close(fd);
+    }
+    return numEvents;
+}
+
+bool PublishQueueSegmentLog::append(const PublishQueueEvent *event) {
+    PublishQueueRecordHeader rh;
+    rh.flags = 0;
+
+    const void *stored = event;
+    size_t size = PublishQueueEvent::getSize(event->getDataLen());
+    if (compressor) {
+        if (const uint8_t *compressed = compressor->compressEvent(event, size)) {
+            rh.flags |= RECORD_FLAG_COMPRESSED;
+            stored = compressed;
+        }
+    }
+    if (compact) {
+        size_t compactSize;
+        if (const uint8_t *encoded = compact->encodeEvent(event, compactSize)) {
+            if (compactSize < size) {
+                rh.flags = RECORD_FLAG_COMPACT;
+                stored = encoded;
+                size = compactSize;
+            }
+        }
+    }
+    size_t recordSize = sizeof(PublishQueueRecordHeader) + size;
+    size_t maxSize = segmentSize ? segmentSize : DEFAULT_SEGMENT_SIZE;
+
+    if (segments.empty() || tailOffset + recordSize > maxSize) {
+        if (!startSegment()) {
+            return false;
+        }
+    }
+
+    if (tailFd < 0) {
+        // scan() removes any partial record from the end of the tail segment, so appending
+        // always starts at tailOffset
+        tailFd = open(getPathForSegment(segments.back().segmentNum), O_WRONLY | O_APPEND);
+        if (tailFd < 0) {
+            _log.error("segment log cannot open segment %lu errno=%d", (unsigned long) segments.back().segmentNum, errno);
+            return false;
+        }
+    }
+
+    rh.size = (uint16_t) size;
+    rh.crc = recordCrc(rh, stored);
+
+    if (write(tailFd, &rh, sizeof(rh)) != sizeof(rh) || write(tailFd, stored, size) != (ssize_t)size) {
+        _log.error("segment log write failed errno=%d", errno);
+
+        // Remove the partial record, which may have been read into the read-ahead buffer
+        ftruncate(tailFd, tailOffset);
+        invalidateReadCache();
+        return false;
+    }
+
+    tailOffset += recordSize;
+    segments.back().numEvents++;
+    segments.back().size = tailOffset;
+    fileBytes += recordSize;
+    queueLen++;
+
+    _log.trace("writeQueueToFiles segment=%lu offset=%lu", (unsigned long) segments.back().segmentNum, (unsigned long)(tailOffset - recordSize));
+
+    return true;
+}
+
+void PublishQueueSegmentLog::flush() {
+    if (tailFd >= 0) {
+        close(tailFd);
+        tailFd = -1;
+    }
+}
+
+bool PublishQueueSegmentLog::startSegment() {
+    flush();
+
+    uint32_t segmentNum = ++lastSegmentNum;
+
+    segments.push_back(Segment{segmentNum, 0, 0});
+    if (segments.size() == 1) {
+        // First segment after being empty. Update the cursor before creating the
+        // file so a cursor left over from a previous segment is never applied to it.
+        headOffset = sizeof(PublishQueueSegmentHeader);
+        headNextOffset = 0;
+        writeCursor();
+    }
+
+    tailFd = open(getPathForSegment(segmentNum), O_WRONLY | O_CREAT | O_TRUNC);
+    if (tailFd < 0) {
+        _log.error("segment log cannot create segment %lu errno=%d", (unsigned long) segmentNum, errno);
+        segments.pop_back();
+        return false;
+    }
+
+    PublishQueueSegmentHeader hdr;
+    hdr.magic = SEGMENT_MAGIC;
+    hdr.version = SEGMENT_VERSION;
+    hdr.headerSize = sizeof(PublishQueueSegmentHeader);
+    hdr.nameLen = sizeof(PublishQueueEvent::eventName);
+    if (write(tailFd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        _log.error("segment log cannot write segment %lu errno=%d", (unsigned long) segmentNum, errno);
+        flush();
+        segments.pop_back();
+        unlink(getPathForSegment(segmentNum));
+        return false;
+    }
+    tailOffset = sizeof(hdr);
+    segments.back().size = tailOffset;
+    fileBytes += tailOffset;
+
+    _log.trace("segment log started segment %lu", (unsigned long) segmentNum);
+    return true;
+}
+
+PublishQueueEvent *PublishQueueSegmentLog::readHead(uint32_t &seq) {
+    while(!segments.empty()) {
+        Segment &head = segments.front();
+
+        if (head.numEvents == 0) {
+            discardHeadSegment();
+            continue;
+        }
+
+        bool corrupted;
+        PublishQueueEvent *result = readRecord(head.segmentNum, headOffset, headNextOffset, corrupted);
+
+        if (!corrupted) {
+            if (result) {
+                _log.trace("readHead segment=%lu offset=%lu event=%s data=%s", (unsigned long) head.segmentNum, (unsigned long) headOffset, result->eventName, result->eventData);
+                seq = headSeq;
+                readEndOffsets.clear();
+            }
+            return result;
+        }
+
+        _log.info("discarding %lu events in corrupted segment %lu at offset %lu", (unsigned long) head.numEvents, (unsigned long) head.segmentNum, (unsigned long) headOffset);
+        if (stats) {
+            stats->increment(PublishQueueStatsCollector::DISCARDED_CORRUPT, head.numEvents);
+        }
+        discardHeadSegment();
+    }
+    return NULL;
+}
+
+PublishQueueEvent *PublishQueueSegmentLog::readNext(uint32_t &seq) {
+    if (segments.empty() || headNextOffset == 0) {
+        // readHead() has not been called
+        return NULL;
+    }
+    Segment &head = segments.front();
+
+    if (1 + readEndOffsets.size() >= head.numEvents) {
+        // Only events in the head segment are returned
+        return NULL;
+    }
+
+    uint32_t offset = readEndOffsets.empty() ? headNextOffset : readEndOffsets.back();
+    uint32_t nextOffset;
+    bool corrupted;
+    PublishQueueEvent *result = readRecord(head.segmentNum, offset, nextOffset, corrupted);
+    if (result) {
+        readEndOffsets.push_back(nextOffset);
+        seq = headSeq + readEndOffsets.size();
+        _log.trace("readNext segment=%lu offset=%lu event=%s data=%s", (unsigned long) head.segmentNum, (unsigned long) offset, result->eventName, result->eventData);
+    }
+    // A corrupted record is not discarded here; that happens when it becomes the head
+    return result;
+}
+
+PublishQueueEvent *PublishQueueSegmentLog::readRecord(uint32_t segmentNum, uint32_t offset, uint32_t &nextOffset, bool &corrupted) {
+    PublishQueueEvent *result = NULL;
+    corrupted = true;
+
+    PublishQueueRecordHeader rh;
+    if (readBytes(segmentNum, offset, &rh, sizeof(rh)) && isValidRecordSize(rh)) {
+        if (rh.flags & RECORD_FLAG_COMPRESSED) {
+            uint8_t *stored = compressor ? compressor->getBuffer() : NULL;
+            if (!stored) {
+                // Can't decode without a compressor
+                return NULL;
+            }
+            if (readBytes(segmentNum, offset + sizeof(rh), stored, rh.size) && recordCrc(rh, stored) == rh.crc) {
+                size_t eventSize = PublishQueueCompress::getDecodedSize(stored, rh.size);
+                if (eventSize >= PublishQueueEvent::getSize(0) && eventSize <= MAX_RECORD_SIZE) {
+                    result = allocEvent(eventSize);
+                    if (!result) {
+                        // Out of memory, try again later
+                        corrupted = false;
+                        return NULL;
+                    }
+                    if (compressor->decompressEvent(stored, rh.size, result, eventSize) &&
+                        strlen(result->eventName) < sizeof(PublishQueueEvent::eventName)) {
+                        corrupted = false;
+                        nextOffset = offset + sizeof(rh) + rh.size;
+                    }
+                    else {
+                        freeEvent(result);
+                        result = NULL;
+                    }
+                }
+            }
+            return result;
+        }
+
+        if (rh.flags & RECORD_FLAG_COMPACT) {
+            uint8_t *stored = compact ? compact->getBuffer() : NULL;
+            if (!stored) {
+                // Can't decode without the name table
+                return NULL;
+            }
+            if (readBytes(segmentNum, offset + sizeof(rh), stored, rh.size) && recordCrc(rh, stored) == rh.crc) {
+                size_t eventSize = compact->getDecodedSize(stored, rh.size);
+                if (eventSize) {
+                    result = allocEvent(eventSize);
+                    if (!result) {
+                        // Out of memory, try again later
+                        corrupted = false;
+                        return NULL;
+                    }
+                    if (compact->decodeEvent(stored, rh.size, result, eventSize)) {
+                        corrupted = false;
+                        nextOffset = offset + sizeof(rh) + rh.size;
+                    }
+                    else {
+                        freeEvent(result);
+                        result = NULL;
+                    }
+                }
+            }
+            return result;
+        }
+
+        result = allocEvent(rh.size);
+        if (result) {
+            if (readBytes(segmentNum, offset + sizeof(rh), result, rh.size) &&
+                recordCrc(rh, result) == rh.crc &&
+                ((char *)result)[rh.size - 1] == 0 &&
+                strlen(result->eventName) < sizeof(PublishQueueEvent::eventName)) {
+                corrupted = false;
+                nextOffset = offset + sizeof(rh) + rh.size;
+            }
+            else {
+                freeEvent(result);
+                result = NULL;
+            }
+        }
+        else {
+            // Out of memory, try again later
+            corrupted = false;
+        }
+    }
+    return result;
+}
+
+// static
+uint32_t PublishQueueSegmentLog::recordCrc(const PublishQueueRecordHeader &rh, const void *data) {
+    // Include the size and flags so a corrupted header is not used to decode the record
+    uint32_t crc = crc32(&rh, offsetof(PublishQueueRecordHeader, crc));
+    return crc32(data, rh.size, crc);
+}
+
+PublishQueueEvent *PublishQueueSegmentLog::allocEvent(size_t eventSize) {
+    if (eventPool) {
+        // A record larger than a pool buffer, or read while the pool is empty, comes from the heap
+        // so reading does not wait for a pool buffer to be freed
+        return eventPool->alloc(eventSize, true);
+    }
+    return (PublishQueueEvent *) new char[eventSize];
+}
+
+// static
+bool PublishQueueSegmentLog::isValidRecordSize(const PublishQueueRecordHeader &rh) {
+    size_t minSize = PublishQueueEvent::getSize(0);
+    if (rh.flags & RECORD_FLAG_COMPRESSED) {
+        minSize = PublishQueueCompress::STREAM_HEADER_SIZE + 1;
+    }
+    else
+    if (rh.flags & RECORD_FLAG_COMPACT) {
+        minSize = PublishQueueCompact::MIN_STORED_SIZE;
+    }
+    return rh.size >= minSize && rh.size <= MAX_RECORD_SIZE;
+}
+
+bool PublishQueueSegmentLog::readBytes(uint32_t segmentNum, uint32_t offset, void *buf, size_t len) {
+    if (readCacheLen == 0 || segmentNum != readCacheSegmentNum || offset < readCacheOffset || offset + len > readCacheOffset + readCacheLen) {
+        // Not in the buffer. Records are never modified once written, so the buffer only
+        // needs to be refilled when reading past its end.
+        if (!readCache) {
+            readCache = new char[readAheadSize];
+            if (!readCache) {
+                return false;
+            }
+        }
+        readCacheLen = 0;
+
+        int fd = open(getPathForSegment(segmentNum), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        lseek(fd, offset, SEEK_SET);
+        ssize_t count = read(fd, readCache, readAheadSize);
+        close(fd);
+
+        if (count <= 0) {
+            return false;
+        }
+        readCacheSegmentNum = segmentNum;
+        readCacheOffset = offset;
+        readCacheLen = count;
+
+        if (len > readCacheLen) {
+            return false;
+        }
+    }
+    memcpy(buf, &readCache[offset - readCacheOffset], len);
+    return true;
+}
+
+bool PublishQueueSegmentLog::removeHead(uint32_t seq) {
+    if (segments.empty() || (seq != 0 && seq != headSeq)) {
+        return false;
+    }
+
+    Segment &head = segments.front();
+
+    if (headNextOffset == 0 && head.numEvents > 0) {
+        // Not read by readHead(), so the record size is not known yet
+        PublishQueueRecordHeader rh;
+        if (readBytes(head.segmentNum, headOffset, &rh, sizeof(rh)) && isValidRecordSize(rh)) {
+            headNextOffset = headOffset + sizeof(rh) + rh.size;
+        }
+        if (headNextOffset == 0) {
+            // Can't find the end of this record, so the rest of the segment can't be used either
+            discardHeadSegment();
+            return true;
+        }
+    }
+
+    if (head.numEvents > 0) {
+        head.numEvents--;
+        queueLen--;
+        headSeq++;
+    }
+    headOffset = headNextOffset;
+    if (!readEndOffsets.empty()) {
+        // The next event was already read by readNext()
+        headNextOffset = readEndOffsets.front();
+        readEndOffsets.erase(readEndOffsets.begin());
+    }
+    else {
+        headNextOffset = 0;
+    }
+
+    if (head.numEvents == 0) {
+        discardHeadSegment();
+    }
+    else
+    if (++unsavedRemoves >= cursorInterval) {
+        writeCursor();
+    }
+    return true;
+}
+
+bool PublishQueueSegmentLog::removeThrough(uint32_t seq) {
+    if (segments.empty() || seq < headSeq || seq - headSeq > readEndOffsets.size()) {
+        // Not an event returned by readHead() or readNext()
+        return false;
+    }
+    uint32_t count = seq - headSeq + 1;
+    if (count == 1) {
+        return removeHead(seq);
+    }
+
+    Segment &head = segments.front();
+    head.numEvents -= count;
+    queueLen -= count;
+    headSeq += count;
+
+    headOffset = readEndOffsets[count - 2];
+    readEndOffsets.erase(readEndOffsets.begin(), readEndOffsets.begin() + (count - 1));
+    if (!readEndOffsets.empty()) {
+        headNextOffset = readEndOffsets.front();
+        readEndOffsets.erase(readEndOffsets.begin());
+    }
+    else {
+        headNextOffset = 0;
+    }
+
+    if (head.numEvents == 0) {
+        discardHeadSegment();
+    }
+    else
+    if ((unsavedRemoves += count) >= cursorInterval) {
+        writeCursor();
+    }
+    return true;
+}
+
+void PublishQueueSegmentLog::discardHeadSegment() {
+    if (segments.empty()) {
+        return;
+    }
+    uint32_t segmentNum = segments.front().segmentNum;
+
+    queueLen -= segments.front().numEvents;
+    headSeq += segments.front().numEvents;
+    fileBytes -= segments.front().size;
+    segments.pop_front();
+
+    if (segments.empty()) {
+        flush();
+        tailOffset = 0;
+    }
+    headOffset = sizeof(PublishQueueSegmentHeader);
+    headNextOffset = 0;
+    readEndOffsets.clear();
+    if (readCacheSegmentNum == segmentNum) {
+        invalidateReadCache();
+    }
+
+    // Move the cursor before deleting, so a reset in between leaves a segment that
+    // is recognized as consumed, not a cursor pointing into a deleted segment
+    writeCursor();
+    unlink(getPathForSegment(segmentNum));
+
+    _log.trace("segment log removed segment %lu", (unsigned long) segmentNum);
+}
+
+void PublishQueueSegmentLog::saveCursor() {
+    if (unsavedRemoves) {
+        writeCursor();
+    }
+}
+
+void PublishQueueSegmentLog::writeCursor() {
+    unsavedRemoves = 0;
+
+    PublishQueueSegmentCursor cursor;
+    cursor.magic = CURSOR_MAGIC;
+    cursor.segmentNum = segments.empty() ? (lastSegmentNum + 1) : segments.front().segmentNum;
+    cursor.offset = headOffset;
+    cursor.crc = crc32(&cursor, offsetof(PublishQueueSegmentCursor, crc));
+
+    int fd = open(getCursorPath(), O_WRONLY | O_CREAT | O_TRUNC);
+    if (fd >= 0) {
+        if (write(fd, &cursor, sizeof(cursor)) != sizeof(cursor)) {
+            _log.error("segment log cursor write failed errno=%d", errno);
+        }
+        close(fd);
+    }
+    else {
+        _log.error("segment log cannot open cursor errno=%d", errno);
+    }
+}
+
+void PublishQueueSegmentLog::removeAll() {
+    flush();
+
+    for(const Segment &segment : segments) {
+        unlink(getPathForSegment(segment.segmentNum));
+    }
+    segments.clear();
+    unlink(getCursorPath());
+    unsavedRemoves = 0;
+    invalidateReadCache();
+
+    // Sequence numbers are not reused, so an event read before this is not mistaken for a new one
+    headSeq += queueLen;
+    queueLen = 0;
+    fileBytes = 0;
+    headOffset = sizeof(PublishQueueSegmentHeader);
+    headNextOffset = 0;
+    readEndOffsets.clear();
+    tailOffset = 0;
+}
+
+void PublishQueueSegmentLog::freeEvent(PublishQueueEvent *event) {
+    if (eventPool) {
+        eventPool->free(event);
+    }
+    else {
+        delete[] (char *)event;
+    }
+}
+
+String PublishQueueSegmentLog::getPathForSegment(uint32_t segmentNum) const {
+    return String::format("%s/%s%08lu", dirPath.c_str(), SEGMENT_PREFIX, (unsigned long) segmentNum);
+}
+
+String PublishQueueSegmentLog::getCursorPath() const {
+    return String::format("%s/%s", dirPath.c_str(), CURSOR_NAME);
+}
+
+// static
+uint32_t PublishQueueSegmentLog::crc32(const void *data, size_t len, uint32_t crc) {
+    const uint8_t *p = (const uint8_t *)data;
+
+    // One table lookup per byte instead of 8 shifts
+    crc = ~crc;
+    while(len-- > 0) {
+        crc = CRC32_TABLE[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
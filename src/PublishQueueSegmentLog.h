@@ -0,0 +1,453 @@
+#ifndef __PUBLISHQUEUESEGMENTLOG_H
+#define __PUBLISHQUEUESEGMENTLOG_H
+
+// Github: https://github.com/rickkas7/PublishQueuePosixRK
+// License: MIT
+
+#include "Particle.h"
+#include "PublishQueueEventPool.h"
+#include "PublishQueueStats.h"
+
+#include <deque>
+#include <vector>
+
+struct PublishQueueEvent;
+class PublishQueueCompact;
+class PublishQueueCompress;
+
+/**
+ * @brief Structure stored at the beginning of each segment file
+ *
+ * A segment file is this header (8 bytes) followed by any number of records, each
+ * consisting of a PublishQueueRecordHeader followed by a PublishQueueEvent.
+ */
+struct PublishQueueSegmentHeader {
+    uint32_t magic;         //!< PublishQueueSegmentLog::SEGMENT_MAGIC = 0x5e9a3c17
+    uint8_t version;        //!< PublishQueueSegmentLog::SEGMENT_VERSION = 2
+    uint8_t headerSize;     //!< sizeof(PublishQueueSegmentHeader) = 8
+    uint16_t nameLen;       //!< sizeof(PublishQueueEvent::eventName)
+};
+
+/**
+ * @brief Structure stored before each event in a segment file
+ */
+struct PublishQueueRecordHeader {
+    uint16_t size;          //!< Size of the PublishQueueEvent that follows, including the eventData null terminator, or its compressed or compact size
+    uint16_t flags;         //!< PublishQueueSegmentLog::RECORD_FLAG_COMPRESSED or RECORD_FLAG_COMPACT, otherwise 0
+    uint32_t crc;           //!< CRC-32 of size and flags followed by the PublishQueueEvent that follows, as stored
+};
+
+/**
+ * @brief Structure stored in the cursor file to record how far the log has been consumed
+ */
+struct PublishQueueSegmentCursor {
+    uint32_t magic;         //!< PublishQueueSegmentLog::CURSOR_MAGIC = 0x5e9a3c18
+    uint32_t segmentNum;    //!< Segment number containing the oldest unsent event
+    uint32_t offset;        //!< Offset of the oldest unsent event in that segment
+    uint32_t crc;           //!< CRC-32 of the previous fields
+};
+
+/**
+ * @brief Append-only log of events stored in fixed-size segment files
+ *
+ * Instead of one file per event, events are appended as length-prefixed, checksummed
+ * records into segment files. When a segment reaches the segment size, a new
+ * segment is started. A small cursor file records the position of the oldest event
+ * that has not been sent yet, and a segment is deleted once all of its events have
+ * been sent or discarded.
+ *
+ * Writing a burst of events opens and closes the tail segment once, instead of
+ * creating a file (directory entry, inode and at least one sector) per event.
+ *
+ * This class is used by PublishQueuePosix when withSegmentSize() is set. It is not
+ * thread-safe; PublishQueuePosix calls it with its mutex locked.
+ */
+class PublishQueueSegmentLog {
+public:
+    /**
+     * @brief Constructor
+     */
+    PublishQueueSegmentLog();
+
+    /**
+     * @brief Destructor
+     */
+    virtual ~PublishQueueSegmentLog();
+
+    /**
+     * @brief Sets the directory the segment files are stored in
+     *
+     * @param dirPath the pathname, Unix-style with / as the directory separator, not ending with a slash.
+     *
+     * The directory must already exist; PublishQueuePosix uses the same directory as the file queue.
+     */
+    PublishQueueSegmentLog &withDirPath(const char *dirPath) { this->dirPath = dirPath; return *this; };
+
+    /**
+     * @brief Sets the pool to allocate events returned by readHead() and readNext() from
+     *
+     * @param eventPool The pool, or NULL to use the heap (the default)
+     */
+    PublishQueueSegmentLog &withEventPool(PublishQueueEventPool *eventPool) { this->eventPool = eventPool; return *this; };
+
+    /**
+     * @brief Sets where to count events discarded because their segment is corrupted
+     *
+     * @param stats The statistics, or NULL to not count them (the default)
+     */
+    PublishQueueSegmentLog &withStats(PublishQueueStatsCollector *stats) { this->stats = stats; return *this; };
+
+    /**
+     * @brief Sets the compressor used to compress events in append() and decompress them when reading
+     *
+     * @param compressor The compressor, or NULL. Events are only compressed if it's enabled, but
+     * compressed events can be read as long as it's set.
+     */
+    PublishQueueSegmentLog &withCompressor(PublishQueueCompress *compressor) { this->compressor = compressor; return *this; };
+
+    /**
+     * @brief Sets the compact encoding used to encode events in append() and decode them when reading
+     *
+     * @param compact The encoding, or NULL. Events are only encoded if it's enabled, but encoded
+     * events can be read as long as it's set. If the compressor is also enabled, the smaller is used.
+     */
+    PublishQueueSegmentLog &withCompact(PublishQueueCompact *compact) { this->compact = compact; return *this; };
+
+    /**
+     * @brief Sets the segment size in bytes (default: 0, segment log disabled)
+     *
+     * @param size The segment size. Values smaller than MIN_SEGMENT_SIZE are increased
+     * to MIN_SEGMENT_SIZE so a maximum size event always fits in a segment.
+     */
+    PublishQueueSegmentLog &withSegmentSize(size_t size);
+
+    /**
+     * @brief Gets the segment size in bytes, or 0 if the segment log is disabled
+     */
+    size_t getSegmentSize() const { return segmentSize; };
+
+    /**
+     * @brief Sets the size of the buffer used to read segments (default: 2048)
+     * 
+     * @param size The buffer size in bytes. Values smaller than MIN_READ_AHEAD_SIZE are
+     * increased to MIN_READ_AHEAD_SIZE so a maximum size record always fits.
+     * 
+     * Segments are read this many bytes at a time, and the following records are returned from
+     * the buffer without reading the file again. The buffer is allocated the first time a
+     * segment is read. Call this before reading.
+     */
+    PublishQueueSegmentLog &withReadAheadSize(size_t size);
+
+    /**
+     * @brief Sets how many events are removed between cursor file writes (default: 16)
+     *
+     * @param interval Number of events. 0 or 1 writes the cursor every time an event is removed.
+     *
+     * The head position is kept in RAM and only written to the cursor file after this many
+     * events, when a segment is deleted, or when saveCursor() is called. If the device resets
+     * in between, the events removed since the last write are sent again.
+     */
+    PublishQueueSegmentLog &withCursorInterval(size_t interval) { cursorInterval = interval; return *this; };
+
+    /**
+     * @brief Gets the read buffer size set using withReadAheadSize()
+     */
+    size_t getReadAheadSize() const { return readAheadSize; };
+
+    /**
+     * @brief Find the segments and the cursor on the file system
+     *
+     * @param always If false, only scan if the segment log is enabled or a cursor file exists,
+     * so a device that has never used the segment log does not scan its queue directory again.
+     *
+     * Any existing segments are read even if the segment log is not currently enabled, so
+     * events are not lost when switching back to one file per event.
+     */
+    bool scan(bool always = false);
+
+    /**
+     * @brief Append an event to the tail segment
+     *
+     * The tail segment is left open so a burst of events can be appended with one
+     * open and close. Call flush() when done appending.
+     *
+     * @return true if the event was written
+     */
+    bool append(const PublishQueueEvent *event);
+
+    /**
+     * @brief Close the tail segment, committing any appended events to the file system
+     */
+    void flush();
+
+    /**
+     * @brief Read the oldest event in the log
+     *
+     * @param seq Filled in with a sequence number identifying this event. Pass this to
+     * removeHead() so the correct event is removed even if the log changed in between.
+     *
+     * Returns NULL if the log is empty, or out of memory. If the record is corrupted,
+     * the rest of its segment is discarded and the next segment is tried.
+     *
+     * You must free the result from this method when you are done using it, using the event
+     * pool set with withEventPool(), or delete if none.
+     */
+    PublishQueueEvent *readHead(uint32_t &seq);
+
+    /**
+     * @brief Read the event after the one last returned by readHead() or readNext()
+     *
+     * @param seq Filled in with a sequence number identifying this event, for removeThrough()
+     *
+     * Used to read several events to publish as a batch without consuming them. Only events
+     * in the same segment as the head are returned. Returns NULL when there are no more events
+     * in that segment, if readHead() has not been called, or if the record cannot be read.
+     *
+     * The result must be freed the same way as readHead().
+     */
+    PublishQueueEvent *readNext(uint32_t &seq);
+
+    /**
+     * @brief Remove the oldest event from the log
+     *
+     * @param seq If non-zero, only remove the head event if it has this sequence number
+     * (from readHead()).
+     *
+     * @return true if an event was removed
+     */
+    bool removeHead(uint32_t seq = 0);
+
+    /**
+     * @brief Remove the oldest events from the log, up to and including seq
+     *
+     * @param seq Sequence number from readHead() or readNext().
+     *
+     * All of the events removed count toward withCursorInterval(), but the cursor file is
+     * written at most once.
+     *
+     * @return true if the events were removed, false if seq is not an event returned
+     * by readHead() or readNext() since the head last changed
+     */
+    bool removeThrough(uint32_t seq);
+
+    /**
+     * @brief Write the cursor file if events were removed since it was last written
+     *
+     * Call this when the queue is idle and before the device sleeps or resets.
+     */
+    void saveCursor();
+
+    /**
+     * @brief Gets the number of events in the log
+     */
+    size_t getQueueLen() const { return queueLen; };
+
+    /**
+     * @brief Gets the sequence number of the oldest event, as returned by readHead()
+     * 
+     * Sequence numbers are not reused, even after removeAll(), so this can be used to tell
+     * if an event read earlier is still the oldest event.
+     */
+    uint32_t getHeadSeq() const { return headSeq; };
+
+    /**
+     * @brief Gets the total size of the segment files in bytes
+     *
+     * This is updated as events are appended and segments are deleted, so it does not access
+     * the file system. Events already removed from the head segment are included, as they use
+     * space until the segment is deleted.
+     */
+    size_t getFileBytes() const { return fileBytes; };
+
+    /**
+     * @brief Delete all segments and the cursor file
+     */
+    void removeAll();
+
+    /**
+     * @brief Calculate a CRC-32 (IEEE 802.3, as used by zlib)
+     *
+     * @param data Data to checksum
+     * @param len Length of data in bytes
+     * @param crc Previous CRC value to continue a calculation, or 0 to start
+     */
+    static uint32_t crc32(const void *data, size_t len, uint32_t crc = 0);
+
+    /**
+     * @brief Magic bytes at the beginning of segment files
+     */
+    static const uint32_t SEGMENT_MAGIC = 0x5e9a3c17;
+
+    /**
+     * @brief Magic bytes at the beginning of the cursor file
+     */
+    static const uint32_t CURSOR_MAGIC = 0x5e9a3c18;
+
+    /**
+     * @brief Version of the segment file format
+     *
+     * Version 1 segments did not have the expires, timestamp and formatId fields, and their record
+     * CRC did not cover the record header. They're discarded.
+     */
+    static const uint8_t SEGMENT_VERSION = 2;
+
+    /**
+     * @brief Default number of removed events between cursor writes, see withCursorInterval()
+     */
+    static const size_t DEFAULT_CURSOR_INTERVAL = 16;
+
+    /**
+     * @brief Default segment size used by PublishQueuePosix::withSegmentSize()
+     */
+    static const size_t DEFAULT_SEGMENT_SIZE = 16384;
+
+    /**
+     * @brief Smallest segment size, enough for one maximum size event
+     */
+    static const size_t MIN_SEGMENT_SIZE = 2048;
+
+    /**
+     * @brief Default read buffer size used by withReadAheadSize()
+     */
+    static const size_t DEFAULT_READ_AHEAD_SIZE = 2048;
+
+    /**
+     * @brief Smallest read buffer size, enough for one maximum size record
+     */
+    static const size_t MIN_READ_AHEAD_SIZE = 1112;
+
+    /**
+     * @brief Set in PublishQueueRecordHeader::flags if the record was compressed using PublishQueueCompress::compressEvent()
+     */
+    static const uint16_t RECORD_FLAG_COMPRESSED = 0x0001;
+
+    /**
+     * @brief Set in PublishQueueRecordHeader::flags if the record was encoded using PublishQueueCompact::encodeEvent()
+     */
+    static const uint16_t RECORD_FLAG_COMPACT = 0x0002;
+
+protected:
+    /**
+     * @brief Information about a segment file kept in RAM
+     */
+    struct Segment {
+        uint32_t segmentNum;    //!< Segment number, used to build the filename
+        uint32_t numEvents;     //!< Number of events not yet consumed in this segment
+        uint32_t size;          //!< Size of the segment file in bytes, including consumed events
+    };
+
+    /**
+     * @brief Get the pathname for a segment number
+     */
+    String getPathForSegment(uint32_t segmentNum) const;
+
+    /**
+     * @brief Get the pathname of the cursor file
+     */
+    String getCursorPath() const;
+
+    /**
+     * @brief Count the valid records in a segment, starting at offset
+     *
+     * @param segmentNum Segment to scan
+     * @param offset Offset of the first record to count
+     * @param endOffset Filled in with the offset after the last valid record
+     *
+     * @return the number of records found, or -1 if the segment header is not valid
+     */
+    int scanSegment(uint32_t segmentNum, uint32_t offset, uint32_t &endOffset);
+
+    /**
+     * @brief Read and validate the record at offset in a segment
+     *
+     * @param segmentNum Segment to read
+     * @param offset Offset of the record header
+     * @param nextOffset Filled in with the offset after the record, if valid
+     * @param corrupted Set to true if the record is not valid, false if valid or out of memory
+     *
+     * @return The event, or NULL if corrupted or out of memory
+     */
+    PublishQueueEvent *readRecord(uint32_t segmentNum, uint32_t offset, uint32_t &nextOffset, bool &corrupted);
+
+    /**
+     * @brief Calculate the CRC stored in a record header, which covers the size and flags too
+     */
+    static uint32_t recordCrc(const PublishQueueRecordHeader &rh, const void *data);
+
+    /**
+     * @brief Allocate an event for readRecord() from the pool, or from the heap if no pool buffer fits
+     *
+     * @return The event, or NULL if the heap is out of memory too
+     */
+    PublishQueueEvent *allocEvent(size_t eventSize);
+
+    /**
+     * @brief Returns true if the size in a record header is possible for its flags
+     */
+    static bool isValidRecordSize(const PublishQueueRecordHeader &rh);
+
+    /**
+     * @brief Read bytes from a segment, using the read-ahead buffer
+     * 
+     * If the bytes are not in the buffer, it's filled starting at offset.
+     * 
+     * @return true if len bytes were read, false if the segment is too short or can't be read
+     */
+    bool readBytes(uint32_t segmentNum, uint32_t offset, void *buf, size_t len);
+
+    /**
+     * @brief Discard the contents of the read-ahead buffer
+     */
+    void invalidateReadCache() { readCacheLen = 0; };
+
+    /**
+     * @brief Free an event allocated by readRecord()
+     */
+    void freeEvent(PublishQueueEvent *event);
+
+    /**
+     * @brief Start a new tail segment and leave it open for appending
+     */
+    bool startSegment();
+
+    /**
+     * @brief Discard the head segment and move the cursor to the next one
+     */
+    void discardHeadSegment();
+
+    /**
+     * @brief Save the head position to the cursor file
+     */
+    void writeCursor();
+
+    String dirPath; //!< Directory containing the segments
+    PublishQueueEventPool *eventPool = 0; //!< Pool to allocate events from, or NULL to use the heap
+    PublishQueueCompress *compressor = 0; //!< Compressor from withCompressor(), or NULL
+    PublishQueueCompact *compact = 0; //!< Compact encoding from withCompact(), or NULL
+    PublishQueueStatsCollector *stats = 0; //!< Statistics from withStats(), or NULL
+    size_t segmentSize = 0; //!< Maximum segment size in bytes, 0 = disabled
+
+    std::deque<Segment> segments; //!< Segments, oldest first. The last is the tail.
+    size_t queueLen = 0; //!< Number of events in all segments
+    size_t fileBytes = 0; //!< Total size of all segments, from getFileBytes()
+
+    uint32_t headOffset = 0; //!< Offset of the oldest event in the first segment
+    uint32_t headSeq = 1; //!< Sequence number of the oldest event
+    uint32_t headNextOffset = 0; //!< Offset after the oldest event, if known (0 if not)
+    std::vector<uint32_t> readEndOffsets; //!< Offsets after each event read by readNext(), following the head
+
+    size_t cursorInterval = DEFAULT_CURSOR_INTERVAL; //!< Events removed between cursor writes, from withCursorInterval()
+    size_t unsavedRemoves = 0; //!< Events removed since the cursor file was last written
+
+    uint32_t tailOffset = 0; //!< Offset where the next event will be appended in the tail segment
+    uint32_t lastSegmentNum = 0; //!< Highest segment number used so far
+    int tailFd = -1; //!< File descriptor of the tail segment while appending, or -1
+
+    size_t readAheadSize = DEFAULT_READ_AHEAD_SIZE; //!< Size of readCache
+    char *readCache = 0; //!< Bytes read ahead from a segment, allocated on first use
+    uint32_t readCacheSegmentNum = 0; //!< Segment the readCache bytes are from
+    uint32_t readCacheOffset = 0; //!< Offset in the segment of the first byte in readCache
+    size_t readCacheLen = 0; //!< Number of valid bytes in readCache, 0 if empty
+};
+
+#endif /* __PUBLISHQUEUESEGMENTLOG_H */
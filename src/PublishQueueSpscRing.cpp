@@ -0,0 +1,60 @@
+#include "PublishQueueSpscRing.h"
+
+PublishQueueSpscRing::PublishQueueSpscRing() : head(0), tail(0) {
+}
+
+PublishQueueSpscRing::~PublishQueueSpscRing() {
+    delete[] events;
+}
+
+bool PublishQueueSpscRing::init(size_t capacity) {
+    if (events || capacity == 0) {
+        return false;
+    }
+
+    // A power of 2 so the indexes stay correct when the counters wrap
+    size_t size = 1;
+    while(size < capacity) {
+        size <<= 1;
+    }
+
+    events = new PublishQueueEvent*[size];
+    if (!events) {
+        return false;
+    }
+    this->capacity = size;
+    return true;
+}
+
+bool PublishQueueSpscRing::push(PublishQueueEvent *event) {
+    if (!events) {
+        return false;
+    }
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) >= capacity) {
+        return false;
+    }
+    events[t & (capacity - 1)] = event;
+
+    // Release so the consumer sees the event pointer before the new tail
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+}
+
+PublishQueueEvent *PublishQueueSpscRing::pop() {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) {
+        return NULL;
+    }
+    PublishQueueEvent *event = events[h & (capacity - 1)];
+
+    // Release so the producer does not reuse the slot until it has been read
+    head.store(h + 1, std::memory_order_release);
+    return event;
+}
+
+size_t PublishQueueSpscRing::size() const {
+    // Read head first; tail can only be the same or larger after that
+    uint32_t h = head.load(std::memory_order_acquire);
+    return tail.load(std::memory_order_acquire) - h;
+}
@@ -0,0 +1,90 @@
+#ifndef __PUBLISHQUEUESPSCRING_H
+#define __PUBLISHQUEUESPSCRING_H
+
+// Github: https://github.com/rickkas7/PublishQueuePosixRK
+// License: MIT
+
+#include "Particle.h"
+
+#include <atomic>
+
+struct PublishQueueEvent;
+
+/**
+ * @brief Bounded lock-free queue of events for one producer thread and one consumer thread
+ *
+ * Used by PublishQueuePosix when withLockFreeQueue() is set, so the thread calling publish()
+ * does not need to wait for the queue mutex, which is held while writing files.
+ *
+ * push() may only be called from one thread at a time (the producer). pop() may only be
+ * called from one thread at a time (the consumer); PublishQueuePosix only calls it with its
+ * mutex locked. Neither blocks.
+ */
+class PublishQueueSpscRing {
+public:
+    /**
+     * @brief Constructor
+     */
+    PublishQueueSpscRing();
+
+    /**
+     * @brief Destructor. Does not free the events in the queue.
+     */
+    virtual ~PublishQueueSpscRing();
+
+    /**
+     * @brief Allocate the queue. Can only be called once.
+     *
+     * @param capacity Maximum number of events, rounded up to a power of 2
+     *
+     * @return false if out of memory, or already initialized
+     */
+    bool init(size_t capacity);
+
+    /**
+     * @brief Add an event to the end of the queue (producer thread only)
+     *
+     * @return false if the queue is full or not initialized
+     */
+    bool push(PublishQueueEvent *event);
+
+    /**
+     * @brief Remove the event at the beginning of the queue (consumer thread only)
+     *
+     * @return The event, or NULL if the queue is empty
+     */
+    PublishQueueEvent *pop();
+
+    /**
+     * @brief Gets the number of events in the queue. May be out of date by the time it returns.
+     */
+    size_t size() const;
+
+    /**
+     * @brief Returns true if init() has been called
+     */
+    bool isEnabled() const { return capacity != 0; };
+
+    /**
+     * @brief Gets the maximum number of events
+     */
+    size_t getCapacity() const { return capacity; };
+
+protected:
+    /**
+     * @brief This class is not copyable
+     */
+    PublishQueueSpscRing(const PublishQueueSpscRing&) = delete;
+
+    /**
+     * @brief This class is not copyable
+     */
+    PublishQueueSpscRing& operator=(const PublishQueueSpscRing&) = delete;
+
+    PublishQueueEvent **events = 0; //!< Array of capacity events
+    size_t capacity = 0; //!< Size of events, a power of 2
+    std::atomic<uint32_t> head; //!< Count of events removed, only modified by the consumer
+    std::atomic<uint32_t> tail; //!< Count of events added, only modified by the producer
+};
+
+#endif /* __PUBLISHQUEUESPSCRING_H */
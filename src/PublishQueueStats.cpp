@@ -0,0 +1,106 @@
+#include "PublishQueueStats.h"
+
+uint32_t PublishQueueHistogram::getCount() const {
+    uint32_t result = 0;
+    for(size_t ii = 0; ii < NUM_BUCKETS; ii++) {
+        result += buckets[ii];
+    }
+    return result;
+}
+
+uint32_t PublishQueueHistogram::getPercentile(unsigned percent) const {
+    uint32_t count = getCount();
+    if (count == 0) {
+        return 0;
+    }
+    if (percent > 100) {
+        percent = 100;
+    }
+
+    // Number of values at or below the percentile, at least 1
+    uint32_t target = (uint32_t)(((uint64_t)count * percent + 99) / 100);
+    if (target == 0) {
+        target = 1;
+    }
+
+    uint32_t sum = 0;
+    for(size_t ii = 0; ii < NUM_BUCKETS; ii++) {
+        sum += buckets[ii];
+        if (sum >= target) {
+            uint32_t result = getBucketMax(ii);
+            return (result < max) ? result : max;
+        }
+    }
+    return max;
+}
+
+// static
+size_t PublishQueueHistogram::getBucket(uint32_t value) {
+    size_t bucket = 0;
+    while(value != 0 && bucket < NUM_BUCKETS - 1) {
+        value >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+// static
+uint32_t PublishQueueHistogram::getBucketMax(size_t bucket) {
+    if (bucket >= NUM_BUCKETS - 1) {
+        return 0xffffffff;
+    }
+    return (1UL << bucket) - 1;
+}
+
+
+PublishQueueStatsCollector::PublishQueueStatsCollector() {
+    reset();
+}
+
+PublishQueueStatsCollector::~PublishQueueStatsCollector() {
+}
+
+void PublishQueueStatsCollector::record(Histogram histogram, uint32_t value) {
+    buckets[histogram][PublishQueueHistogram::getBucket(value)].fetch_add(1, std::memory_order_relaxed);
+
+    uint32_t prev = maxValues[histogram].load(std::memory_order_relaxed);
+    while(value > prev && !maxValues[histogram].compare_exchange_weak(prev, value, std::memory_order_relaxed)) {
+        // prev was updated with the current value, try again
+    }
+}
+
+void PublishQueueStatsCollector::snapshot(PublishQueueStats &stats) const {
+    stats.enqueued = get(ENQUEUED);
+    stats.rejected = get(REJECTED);
+    stats.coalesced = get(COALESCED);
+    stats.published = get(PUBLISHED);
+    stats.failed = get(FAILED);
+    stats.discardedLimit = get(DISCARDED_LIMIT);
+    stats.discardedCorrupt = get(DISCARDED_CORRUPT);
+    stats.discardedExpired = get(DISCARDED_EXPIRED);
+    stats.spilled = get(SPILLED);
+    stats.writeFailures = get(WRITE_FAILURES);
+
+    snapshotHistogram(QUEUE_LATENCY, stats.queueLatency);
+    snapshotHistogram(PUBLISH_ROUND_TRIP, stats.publishRoundTrip);
+    snapshotHistogram(WRITE_DURATION, stats.writeDuration);
+}
+
+void PublishQueueStatsCollector::snapshotHistogram(Histogram histogram, PublishQueueHistogram &result) const {
+    for(size_t ii = 0; ii < PublishQueueHistogram::NUM_BUCKETS; ii++) {
+        result.buckets[ii] = buckets[histogram][ii].load(std::memory_order_relaxed);
+    }
+    result.max = maxValues[histogram].load(std::memory_order_relaxed);
+}
+
+void PublishQueueStatsCollector::reset() {
+    for(size_t ii = 0; ii < NUM_COUNTERS; ii++) {
+        counters[ii].store(0, std::memory_order_relaxed);
+    }
+    for(size_t ii = 0; ii < NUM_HISTOGRAMS; ii++) {
+        for(size_t jj = 0; jj < PublishQueueHistogram::NUM_BUCKETS; jj++) {
+            buckets[ii][jj].store(0, std::memory_order_relaxed);
+        }
+        maxValues[ii].store(0, std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,171 @@
+#ifndef __PUBLISHQUEUESTATS_H
+#define __PUBLISHQUEUESTATS_H
+
+// Github: https://github.com/rickkas7/PublishQueuePosixRK
+// License: MIT
+
+#include "Particle.h"
+
+#include <atomic>
+
+/**
+ * @brief Histogram of values, such as durations, with buckets that are powers of 2
+ *
+ * Bucket 0 counts the value 0. Bucket n (1 to NUM_BUCKETS - 2) counts the values from
+ * 2^(n-1) to 2^n - 1. The last bucket counts all larger values.
+ */
+struct PublishQueueHistogram {
+    /**
+     * @brief Number of buckets
+     */
+    static const size_t NUM_BUCKETS = 20;
+
+    uint32_t buckets[NUM_BUCKETS]; //!< Number of values in each bucket
+    uint32_t max; //!< Largest value, 0 if there are none
+
+    /**
+     * @brief Gets the number of values in all buckets
+     */
+    uint32_t getCount() const;
+
+    /**
+     * @brief Gets an upper bound of a percentile
+     *
+     * @param percent The percentile, 0 to 100. 50 is the median.
+     *
+     * @return The largest value in the bucket containing the percentile, but no more than max,
+     * or 0 if there are no values
+     */
+    uint32_t getPercentile(unsigned percent) const;
+
+    /**
+     * @brief Gets the bucket a value is counted in
+     */
+    static size_t getBucket(uint32_t value);
+
+    /**
+     * @brief Gets the largest value counted in a bucket. For the last bucket, this is 0xffffffff.
+     */
+    static uint32_t getBucketMax(size_t bucket);
+};
+
+/**
+ * @brief Statistics from PublishQueuePosix::getStats()
+ *
+ * Counters are the number of events since startup or PublishQueuePosix::resetStats(), and wrap
+ * around at 2^32. The lengths and flashBytes are the values when getStats() was called.
+ */
+struct PublishQueueStats {
+    uint32_t enqueued; //!< Events accepted by a publish function
+    uint32_t rejected; //!< Events not accepted, because out of memory or too large
+    uint32_t coalesced; //!< Events that replaced a queued event using publishCoalesced()
+    uint32_t published; //!< Events sent successfully. Each event in a batch is counted.
+    uint32_t failed; //!< Publish attempts that failed and will be retried
+    uint32_t discardedLimit; //!< Events discarded because a queue was full
+    uint32_t discardedCorrupt; //!< Events discarded because their file or segment was corrupted
+    uint32_t discardedExpired; //!< Events discarded because they expired
+    uint32_t spilled; //!< Events moved from RAM to the flash file system
+    uint32_t writeFailures; //!< Events that could not be written to the flash file system
+
+    size_t ramQueueLen; //!< Events in RAM, including priority lanes and events waiting for the writer thread
+    size_t fileQueueLen; //!< Events on the flash file system, including priority lanes and the segment log
+    size_t flashBytes; //!< Size of the queued files and segments in bytes
+
+    PublishQueueHistogram queueLatency; //!< Seconds from publish until sent successfully, once per batch using its oldest event. Only events published with a valid time are counted.
+    PublishQueueHistogram publishRoundTrip; //!< Milliseconds from starting a publish until it completes, successfully or not
+    PublishQueueHistogram writeDuration; //!< Milliseconds to write the RAM queue to the flash file system, each time it's written
+};
+
+/**
+ * @brief Counters and histograms updated by PublishQueuePosix
+ *
+ * Each update is a relaxed atomic increment, so it can be done from any thread without the
+ * queue mutex, and costs little enough to leave enabled. snapshot() is not atomic as a whole,
+ * so counters updated at the same time may be off by one relative to each other.
+ */
+class PublishQueueStatsCollector {
+public:
+    /**
+     * @brief Counters, in the same order as in PublishQueueStats
+     */
+    enum Counter {
+        ENQUEUED = 0,
+        REJECTED,
+        COALESCED,
+        PUBLISHED,
+        FAILED,
+        DISCARDED_LIMIT,
+        DISCARDED_CORRUPT,
+        DISCARDED_EXPIRED,
+        SPILLED,
+        WRITE_FAILURES,
+        NUM_COUNTERS
+    };
+
+    /**
+     * @brief Histograms
+     */
+    enum Histogram {
+        QUEUE_LATENCY = 0,
+        PUBLISH_ROUND_TRIP,
+        WRITE_DURATION,
+        NUM_HISTOGRAMS
+    };
+
+    /**
+     * @brief Constructor. All counters and histograms start at 0.
+     */
+    PublishQueueStatsCollector();
+
+    /**
+     * @brief Destructor
+     */
+    virtual ~PublishQueueStatsCollector();
+
+    /**
+     * @brief Add to a counter
+     */
+    void increment(Counter counter, uint32_t count = 1) { counters[counter].fetch_add(count, std::memory_order_relaxed); };
+
+    /**
+     * @brief Gets the value of a counter
+     */
+    uint32_t get(Counter counter) const { return counters[counter].load(std::memory_order_relaxed); };
+
+    /**
+     * @brief Add a value to a histogram
+     */
+    void record(Histogram histogram, uint32_t value);
+
+    /**
+     * @brief Copy the counters and histograms into stats. The lengths and flashBytes are not set.
+     */
+    void snapshot(PublishQueueStats &stats) const;
+
+    /**
+     * @brief Set all counters and histograms to 0
+     */
+    void reset();
+
+protected:
+    /**
+     * @brief This class is not copyable
+     */
+    PublishQueueStatsCollector(const PublishQueueStatsCollector&) = delete;
+
+    /**
+     * @brief This class is not copyable
+     */
+    PublishQueueStatsCollector& operator=(const PublishQueueStatsCollector&) = delete;
+
+    /**
+     * @brief Copy a histogram into a snapshot
+     */
+    void snapshotHistogram(Histogram histogram, PublishQueueHistogram &result) const;
+
+    std::atomic<uint32_t> counters[NUM_COUNTERS]; //!< Value of each Counter
+    std::atomic<uint32_t> buckets[NUM_HISTOGRAMS][PublishQueueHistogram::NUM_BUCKETS]; //!< Buckets of each Histogram
+    std::atomic<uint32_t> maxValues[NUM_HISTOGRAMS]; //!< Largest value of each Histogram
+};
+
+#endif /* __PUBLISHQUEUESTATS_H */
@@ -0,0 +1,31 @@
+#include "PublishQueueTokenBucket.h"
+
+void PublishQueueTokenBucket::setRate(unsigned long msPerToken, size_t burst) {
+    this->msPerToken = msPerToken;
+    this->burst = (burst != 0) ? burst : 1;
+    if (tokens > this->burst) {
+        tokens = this->burst;
+    }
+}
+
+bool PublishQueueTokenBucket::refill() {
+    unsigned long now = millis();
+
+    if (tokens < burst && msPerToken != 0) {
+        unsigned long earned = (now - tokenTime) / msPerToken;
+        if (earned < burst - tokens) {
+            tokens += earned;
+            tokenTime += earned * msPerToken;
+            return tokens != 0;
+        }
+    }
+
+    // Full. Tokens don't accumulate past the burst size, so start counting from now.
+    fill();
+    return true;
+}
+
+void PublishQueueTokenBucket::fill() {
+    tokens = burst;
+    tokenTime = millis();
+}
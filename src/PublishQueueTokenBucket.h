@@ -0,0 +1,75 @@
+#ifndef __PUBLISHQUEUETOKENBUCKET_H
+#define __PUBLISHQUEUETOKENBUCKET_H
+
+// Github: https://github.com/rickkas7/PublishQueuePosixRK
+// License: MIT
+
+#include "Particle.h"
+
+/**
+ * @brief Token bucket used to limit the publish rate
+ *
+ * A token is added every msPerToken milliseconds, up to burst tokens, and one is used for each
+ * publish. Tokens are added when refill() is called, based on the time since they were last
+ * added, so nothing needs to run periodically.
+ *
+ * Used by PublishQueuePosix for withPublishRate(), and by PublishQueueScheduler for the rate
+ * shared by the queues using it. This class is not thread-safe; both only call it from loop().
+ */
+class PublishQueueTokenBucket {
+public:
+    /**
+     * @brief Constructor
+     *
+     * @param tokens Number of tokens in the bucket to start with
+     */
+    PublishQueueTokenBucket(size_t tokens = 0) : tokens(tokens) {};
+
+    /**
+     * @brief Sets the rate tokens are added
+     *
+     * @param msPerToken Milliseconds between tokens, 0 for no limit
+     *
+     * @param burst Maximum number of tokens in the bucket. 0 is the same as 1.
+     */
+    void setRate(unsigned long msPerToken, size_t burst);
+
+    /**
+     * @brief Gets the milliseconds between tokens set using setRate()
+     */
+    unsigned long getMsPerToken() const { return msPerToken; };
+
+    /**
+     * @brief Gets the maximum number of tokens set using setRate()
+     */
+    size_t getBurst() const { return burst; };
+
+    /**
+     * @brief Add the tokens earned since they were last added
+     *
+     * @return true if there is a token, so a publish can start now
+     */
+    bool refill();
+
+    /**
+     * @brief Use a token to start a publish, if there is one
+     */
+    void use() {
+        if (tokens) {
+            tokens--;
+        }
+    };
+
+    /**
+     * @brief Fill the bucket, and start counting the time for the next token from now
+     */
+    void fill();
+
+protected:
+    unsigned long msPerToken = 1000; //!< Milliseconds per token, 0 = no limit
+    size_t burst = 1; //!< Maximum number of tokens in the bucket
+    size_t tokens; //!< Tokens currently in the bucket, one is used for each publish
+    unsigned long tokenTime = 0; //!< millis() value when tokens were last added
+};
+
+#endif /* __PUBLISHQUEUETOKENBUCKET_H */
@@ -0,0 +1,91 @@
+// Decoder for batches sent by PublishQueuePosixRK withBatchPublish()
+//
+// Use as a module:
+//
+//   const batchDecoder = require('./batch-decoder.js');
+//   const events = batchDecoder.decode(req.body.data); // [{name, data}, ...]
+//
+// Or from the command line, with the batch event data as an argument or on stdin:
+//
+//   node batch-decoder.js '1;4:temp4:21.50:4:21.6'
+//
+// The format is described in src/PublishQueueBatch.h. Lengths are in bytes of UTF-8,
+// not characters, so the data is decoded as a Buffer.
+
+(function(batchDecoder) {
+
+    // Returns an array of {name, data} objects. Throws an Error if the batch is not valid.
+    batchDecoder.decode = function(batchData) {
+        const buf = Buffer.isBuffer(batchData) ? batchData : Buffer.from(batchData, 'utf8');
+
+        if (buf.length < 2 || buf[0] != 0x31 || buf[1] != 0x3b) { // '1;'
+            throw new Error('not a version 1 batch');
+        }
+
+        let offset = 2;
+
+        const parseLength = function() {
+            const colon = buf.indexOf(0x3a, offset); // ':'
+            if (colon <= offset) {
+                throw new Error('missing length at offset ' + offset);
+            }
+            const str = buf.toString('latin1', offset, colon);
+            if (!/^[0-9]+$/.test(str)) {
+                throw new Error('invalid length at offset ' + offset);
+            }
+            offset = colon + 1;
+            return parseInt(str, 10);
+        };
+
+        const parseString = function(len) {
+            if (offset + len > buf.length) {
+                throw new Error('truncated batch at offset ' + offset);
+            }
+            const str = buf.toString('utf8', offset, offset + len);
+            offset += len;
+            return str;
+        };
+
+        let events = [];
+        let name;
+
+        while(offset < buf.length) {
+            const nameLen = parseLength();
+            if (nameLen == 0) {
+                // Same name as the previous event
+                if (name === undefined) {
+                    throw new Error('first event has no name');
+                }
+            }
+            else {
+                name = parseString(nameLen);
+            }
+            const data = parseString(parseLength());
+            events.push({name, data});
+        }
+        return events;
+    };
+
+    if (require.main === module) {
+        const decodeAndPrint = function(batchData) {
+            try {
+                console.log(JSON.stringify(batchDecoder.decode(batchData.replace(/\r?\n$/, '')), null, 2));
+            }
+            catch(e) {
+                console.error(e.message);
+                process.exit(1);
+            }
+        };
+
+        if (process.argv.length > 2) {
+            decodeAndPrint(process.argv[2]);
+        }
+        else {
+            let input = '';
+            process.stdin.setEncoding('utf8');
+            process.stdin.on('data', (chunk) => input += chunk);
+            process.stdin.on('end', () => decodeAndPrint(input));
+        }
+    }
+
+}(module.exports));
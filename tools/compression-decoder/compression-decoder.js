@@ -0,0 +1,154 @@
+// Decoder for event data sent by PublishQueuePosixRK withCompression() with cloud set
+//
+// Use as a module:
+//
+//   const compressionDecoder = require('./compression-decoder.js');
+//   const data = compressionDecoder.decode(req.body.data); // original event data
+//
+// If the device uses a dictionary, pass the same string:
+//
+//   const data = compressionDecoder.decode(req.body.data, '{"temp":');
+//
+// Or from the command line, with the event data as an argument or on stdin:
+//
+//   node compression-decoder.js [--dictionary STRING] '~Z...'
+//
+// The format is described in src/PublishQueueCompress.h. Data that does not start with ~Z
+// was not compressed and is returned unchanged.
+
+(function(compressionDecoder) {
+
+    const CLOUD_PREFIX = '~Z';
+    const Z85_CHARS = '0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ.-:+=^!/*?&<>()[]{}@%$#';
+    const STREAM_HEADER_SIZE = 4;
+    const MIN_MATCH = 3;
+
+    const crc32 = function(buf) {
+        let crc = 0xffffffff;
+        for(const b of buf) {
+            crc ^= b;
+            for(let bit = 0; bit < 8; bit++) {
+                crc = (crc >>> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+            }
+        }
+        return (~crc) >>> 0;
+    };
+
+    // Returns the dictionary id stored in the stream, 0 if none
+    const getDictionaryId = function(dictBuf) {
+        if (dictBuf.length == 0) {
+            return 0;
+        }
+        const id = crc32(dictBuf) & 0xffff;
+        return (id == 0) ? 1 : id;
+    };
+
+    // Returns a Buffer. Throws an Error if not valid Z85.
+    compressionDecoder.z85Decode = function(str) {
+        if ((str.length % 5) != 0) {
+            throw new Error('Z85 length is not a multiple of 5');
+        }
+        let buf = Buffer.alloc(str.length / 5 * 4);
+        for(let ii = 0; ii < str.length; ii += 5) {
+            let value = 0;
+            for(let jj = 0; jj < 5; jj++) {
+                const index = Z85_CHARS.indexOf(str.charAt(ii + jj));
+                if (index < 0) {
+                    throw new Error('invalid Z85 character at offset ' + (ii + jj));
+                }
+                value = value * 85 + index;
+            }
+            if (value > 0xffffffff) {
+                throw new Error('invalid Z85 value at offset ' + ii);
+            }
+            buf.writeUInt32BE(value, ii / 5 * 4);
+        }
+        return buf;
+    };
+
+    // Decompress a stream into a Buffer. Throws an Error if not valid or the dictionary is different.
+    compressionDecoder.decompress = function(src, dictionary) {
+        const dictBuf = Buffer.from(dictionary || '', 'utf8');
+
+        if (src.length < STREAM_HEADER_SIZE) {
+            throw new Error('stream too short');
+        }
+        const decodedSize = src.readUInt16LE(0);
+        if (src.readUInt16LE(2) != getDictionaryId(dictBuf)) {
+            throw new Error('stream uses a different dictionary');
+        }
+
+        let dst = Buffer.alloc(decodedSize);
+        let inOffset = STREAM_HEADER_SIZE;
+        let outOffset = 0;
+        while(outOffset < decodedSize) {
+            if (inOffset >= src.length) {
+                throw new Error('truncated stream');
+            }
+            const flags = src[inOffset++];
+            for(let item = 0; item < 8 && outOffset < decodedSize; item++) {
+                if (flags & (1 << item)) {
+                    if (inOffset + 2 > src.length) {
+                        throw new Error('truncated stream');
+                    }
+                    const offset = ((src[inOffset] << 4) | (src[inOffset + 1] >> 4)) + 1;
+                    const len = (src[inOffset + 1] & 0x0f) + MIN_MATCH;
+                    inOffset += 2;
+                    if (offset > dictBuf.length + outOffset || outOffset + len > decodedSize) {
+                        throw new Error('invalid match at offset ' + (inOffset - 2));
+                    }
+                    let from = dictBuf.length + outOffset - offset;
+                    for(let ii = 0; ii < len; ii++, from++) {
+                        dst[outOffset++] = (from < dictBuf.length) ? dictBuf[from] : dst[from - dictBuf.length];
+                    }
+                }
+                else {
+                    if (inOffset >= src.length) {
+                        throw new Error('truncated stream');
+                    }
+                    dst[outOffset++] = src[inOffset++];
+                }
+            }
+        }
+        return dst;
+    };
+
+    // Returns the original event data as a string. Throws an Error if the data is not valid.
+    compressionDecoder.decode = function(eventData, dictionary) {
+        if (!eventData.startsWith(CLOUD_PREFIX)) {
+            return eventData;
+        }
+        const stream = compressionDecoder.z85Decode(eventData.substring(CLOUD_PREFIX.length));
+        return compressionDecoder.decompress(stream, dictionary).toString('utf8');
+    };
+
+    if (require.main === module) {
+        let args = process.argv.slice(2);
+        let dictionary;
+        if (args.length >= 2 && args[0] == '--dictionary') {
+            dictionary = args[1];
+            args = args.slice(2);
+        }
+
+        const decodeAndPrint = function(eventData) {
+            try {
+                console.log(compressionDecoder.decode(eventData.replace(/\r?\n$/, ''), dictionary));
+            }
+            catch(e) {
+                console.error(e.message);
+                process.exit(1);
+            }
+        };
+
+        if (args.length > 0) {
+            decodeAndPrint(args[0]);
+        }
+        else {
+            let input = '';
+            process.stdin.setEncoding('utf8');
+            process.stdin.on('data', (chunk) => input += chunk);
+            process.stdin.on('end', () => decodeAndPrint(input));
+        }
+    }
+
+}(module.exports));